@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs the load generator with the same number of requests in flight over HTTP/1.1, one per connection, and over
+# HTTP/2, multiplexed as streams on fewer connections.
+# Run from the repository root (the server resolves its paths relative to the working directory).
+#
+# Usage: bench/compare_http2.sh [connections] [streams] [seconds] [uri]
+# HTTP/1.1 gets connections * streams connections. TRACE=FILE replays a trace instead of requesting the uri.
+set -e
+
+CONNECTIONS=${1:-8}
+STREAMS=${2:-16}
+SECONDS_PER_RUN=${3:-10}
+URI=${4:-/}
+BUILD_DIR=${BUILD_DIR:-/tmp/simple_webserver_bench}
+
+mkdir -p "$BUILD_DIR"
+g++ -std=c++17 -O2 -pthread -o "$BUILD_DIR/server" *.cpp -lz -lbrotlienc -lssl -lcrypto
+g++ -std=c++17 -O2 -pthread -I. -o "$BUILD_DIR/load_generator" bench/load_generator.cpp hpack.cpp -lssl -lcrypto
+
+if [ -n "$TRACE" ]; then
+	REQUESTS="--trace=$TRACE"
+else
+	REQUESTS="--uri=$URI"
+fi
+
+# Neither protocol should spend the run reconnecting
+"$BUILD_DIR/server" --max-keep-alive-requests=1000000 > /dev/null &
+SERVER_PID=$!
+sleep 0.5
+
+echo "== HTTP/1.1 =="
+"$BUILD_DIR/load_generator" --connections=$((CONNECTIONS * STREAMS)) --duration="$SECONDS_PER_RUN" "$REQUESTS"
+echo "== HTTP/2 =="
+"$BUILD_DIR/load_generator" --connections="$CONNECTIONS" --h2 --streams="$STREAMS" --duration="$SECONDS_PER_RUN" "$REQUESTS"
+
+kill $SERVER_PID
+wait $SERVER_PID 2>/dev/null || true
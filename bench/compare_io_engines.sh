@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs the load client against the epoll and io_uring engines with the same settings.
+# Run from the repository root (the server resolves its paths relative to the working directory).
+#
+# Usage: bench/compare_io_engines.sh [connections] [seconds] [uri]
+set -e
+
+CONNECTIONS=${1:-64}
+SECONDS_PER_RUN=${2:-10}
+URI=${3:-/}
+BUILD_DIR=${BUILD_DIR:-/tmp/simple_webserver_bench}
+
+mkdir -p "$BUILD_DIR"
+g++ -std=c++17 -O2 -pthread -o "$BUILD_DIR/server" *.cpp -lz -lbrotlienc -lssl -lcrypto
+g++ -std=c++17 -O2 -o "$BUILD_DIR/io_engine_bench" bench/io_engine_bench.cpp
+
+for ENGINE in epoll uring; do
+	"$BUILD_DIR/server" --io-engine=$ENGINE > /dev/null &
+	SERVER_PID=$!
+	sleep 0.5
+
+	echo "== $ENGINE =="
+	# `strace -c -f -p $SERVER_PID` next to this run shows the syscalls per request
+	"$BUILD_DIR/io_engine_bench" 127.0.0.1 8080 "$CONNECTIONS" "$SECONDS_PER_RUN" "$URI"
+
+	kill $SERVER_PID
+	wait $SERVER_PID 2>/dev/null || true
+done
\ No newline at end of file
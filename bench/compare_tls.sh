@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs the load generator over plain TCP, over TLS with and without kTLS, and over TLS with a new connection for
+# every request, resuming the session or not, to show what the handshakes cost.
+# Run from the repository root (the server resolves its paths relative to the working directory).
+#
+# Usage: bench/compare_tls.sh [connections] [seconds] [uri]
+# Pass a large file as uri to compare the kernel and user space encryption of bodies. kTLS needs the `tls` kernel
+# module (`modprobe tls`), the server's metrics show whether connections got it.
+set -e
+
+CONNECTIONS=${1:-64}
+SECONDS_PER_RUN=${2:-10}
+URI=${3:-/}
+BUILD_DIR=${BUILD_DIR:-/tmp/simple_webserver_bench}
+
+mkdir -p "$BUILD_DIR"
+g++ -std=c++17 -O2 -pthread -o "$BUILD_DIR/server" *.cpp -lz -lbrotlienc -lssl -lcrypto
+g++ -std=c++17 -O2 -pthread -I. -o "$BUILD_DIR/load_generator" bench/load_generator.cpp hpack.cpp -lssl -lcrypto
+if [ ! -f "$BUILD_DIR/cert.pem" ]; then
+	openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 30 -subj /CN=localhost \
+		-keyout "$BUILD_DIR/key.pem" -out "$BUILD_DIR/cert.pem" 2> /dev/null
+fi
+TLS="--tls-cert=$BUILD_DIR/cert.pem --tls-key=$BUILD_DIR/key.pem"
+
+# Runs the server with the options in $1 and the load generator with the ones in $2
+run() {
+	"$BUILD_DIR/server" $1 > /dev/null &
+	SERVER_PID=$!
+	sleep 0.5
+	"$BUILD_DIR/load_generator" --connections="$CONNECTIONS" --duration="$SECONDS_PER_RUN" --uri="$URI" $2
+	if command -v curl > /dev/null; then
+		curl -sk "https://127.0.0.1:8080/_stats" | grep '^webserver_tls' || true
+	fi
+	kill $SERVER_PID
+	wait $SERVER_PID 2>/dev/null || true
+}
+
+echo "== plain TCP =="
+run "--max-keep-alive-requests=1000000" ""
+echo "== TLS =="
+run "$TLS --max-keep-alive-requests=1000000" "--tls"
+echo "== TLS without kTLS =="
+run "$TLS --ktls=off --max-keep-alive-requests=1000000" "--tls"
+echo "== TLS, a connection per request, resumed =="
+run "$TLS --max-keep-alive-requests=1" "--tls"
+echo "== TLS, a connection per request, full handshakes =="
+run "$TLS --max-keep-alive-requests=1" "--tls --tls-resume=off"
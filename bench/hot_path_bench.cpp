@@ -0,0 +1,326 @@
+// Microbenchmarks of the functions every request passes through: parsing, URI decoding, the extension and content
+// type lookups, header comparisons, reason phrases and building the response. Reports ns/op and allocations/op,
+// writes them as JSON and compares them against a stored baseline, so a regression shows up before it is deployed.
+//
+// Build from the repository root (the response builder pulls in the rest of the server):
+//   g++ -std=c++17 -O2 -I. -pthread -o hot_path_bench bench/hot_path_bench.cpp $(ls *.cpp | grep -v main.cpp) -lz -lbrotlienc -lssl -lcrypto
+// Usage: hot_path_bench [--seconds=1] [--filter=SUBSTRING] [--json=FILE] [--baseline=FILE] [--tolerance=20]
+// With `--baseline`, the exit status is 1 if a case got more than `--tolerance` percent slower or allocates more
+// than before. Timings only compare on the same machine and compiler, so the baseline in
+// `bench/hot_path_baseline.json` should be regenerated with `--json` where the comparison runs.
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "http_parser.h"
+#include "http_server.h"
+#include "mime_types.h"
+#include "path_resolver.h"
+#include "server_config.h"
+#include "status_code.h"
+#include "string_utils.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Every allocation of the process is counted. The benchmark is single threaded, so a plain counter does.
+static unsigned long long allocations = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	if (void* memory = malloc(size ? size : 1))
+		return memory;
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+
+// Keeps the compiler from dropping the work
+static volatile size_t sink;
+
+struct BenchCase {
+	std::string name;
+	// Performs one operation and returns something derived from its result
+	std::function<size_t()> run;
+};
+
+struct BenchResult {
+	double ns_per_op;
+	double allocations_per_op;
+};
+
+// The fastest of several rounds, which is the least disturbed by other work on the machine
+static BenchResult measure(const BenchCase& bench_case, double seconds) {
+	const int rounds = 20;
+	const int batch = 1000;
+	double best = 1e300;
+	unsigned long long operations = 0;
+	unsigned long long allocated = 0;
+	size_t checksum = 0;
+	for (int round = 0; round < rounds; round++) {
+		unsigned long long round_operations = 0;
+		unsigned long long allocations_before = allocations;
+		Clock::time_point start = Clock::now();
+		Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds / rounds));
+		while (Clock::now() < deadline) {
+			for (int i = 0; i < batch; i++) {
+				checksum += bench_case.run();
+			}
+			round_operations += batch;
+		}
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		best = std::min(best, elapsed * 1e9 / round_operations);
+		operations += round_operations;
+		allocated += allocations - allocations_before;
+	}
+	sink = checksum;
+	return BenchResult{ best, (double)allocated / operations };
+}
+
+static std::vector<BenchCase> benchCases() {
+	std::vector<BenchCase> cases;
+
+	// The request parser replaced the `StringParser` tokenizer, so it is measured on whole requests
+	static const std::string curl_request = "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+	static const std::string browser_request =
+		"GET /static/js/app.3f9c2b1e.js?v=20240101 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Windows\"\r\n"
+		"Accept: */*\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: script\r\n"
+		"Referer: https://www.example.com/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.1234567890.1700000000\r\n"
+		"If-None-Match: \"1a2b3c-4d5e-6f7a8b9c0d1e2f3a\"\r\n"
+		"If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+		"\r\n";
+	for (const auto& request : { std::make_pair("parse/curl", &curl_request), std::make_pair("parse/browser", &browser_request) }) {
+		const std::string* data = request.second;
+		cases.push_back({ request.first, [data]() {
+			static HttpRequestParser parser;
+			static HttpRequest parsed;
+			parser.reset();
+			if (parser.parse(data->data(), data->length(), parsed) != HttpRequestParser::Result::Complete) {
+				fprintf(stderr, "Failed to parse: %s\n", parser.error());
+				exit(1);
+			}
+			return parsed.header_count;
+		} });
+	}
+
+	static const std::string plain_path = "static/js/app.3f9c2b1e.js";
+	static const std::string escaped_path = "docs/Release%20Notes%20%282024%29/read%20me.html";
+	cases.push_back({ "decode/plain", []() { return decodeEscapeSequences(plain_path).length(); } });
+	cases.push_back({ "decode/escaped", []() { return decodeEscapeSequences(escaped_path).length(); } });
+
+	static const std::string_view paths[] = { "server_root/index.html", "server_root/static/js/app.3f9c2b1e.js",
+		"server_root/img/logo.png", "server_root/LICENSE" };
+	cases.push_back({ "extension/4 paths", []() {
+		size_t length = 0;
+		for (std::string_view path : paths) {
+			length += getFileExtension(path).length();
+		}
+		return length;
+	} });
+
+	static const std::string_view extensions[] = { ".html", ".css", ".js", ".png", ".jpg", ".svg", ".woff2", ".json", ".map", "" };
+	cases.push_back({ "mime/10 extensions", []() {
+		size_t length = 0;
+		for (std::string_view extension : extensions) {
+			length += getMimeType(extension).length();
+		}
+		return length;
+	} });
+
+	// The comparisons made for `Connection` and `Accept-Encoding` values, half of which match
+	static const std::pair<std::string_view, std::string_view> comparisons[] = { { "keep-alive", "keep-alive" },
+		{ "Keep-Alive", "keep-alive" }, { "close", "keep-alive" }, { "gzip", "gzip" }, { "deflate", "br" }, { "BR", "br" } };
+	cases.push_back({ "case_insensitive_equals/6 values", []() {
+		size_t matches = 0;
+		for (const auto& comparison : comparisons) {
+			matches += caseInsensitiveEquals(comparison.first, comparison.second);
+		}
+		return matches;
+	} });
+
+	static const StatusCode codes[] = { StatusCode::OK, StatusCode::NotModified, StatusCode::PartialContent, StatusCode::NotFound };
+	cases.push_back({ "reason/4 codes", []() {
+		size_t length = 0;
+		for (StatusCode code : codes) {
+			length += strlen(httpReasonForCode(code));
+		}
+		return length;
+	} });
+
+	// The headers of a file response as `serveFile` adds them
+	static const std::shared_ptr<const std::string> body = std::make_shared<const std::string>(std::string(2048, 'x'));
+	cases.push_back({ "response_build/file", []() {
+		ResponseBuilder response = ResponseBuilder().setStatusCode(StatusCode::OK).setKeepAlive(true);
+		response.addHeader("Vary", "Accept-Encoding")
+			.addHeader("ETag", "\"1a2b3c-800-65920080\"")
+			.addHeader("Last-Modified", "Mon, 01 Jan 2024 00:00:00 GMT")
+			.addHeader("Cache-Control", "max-age=3600")
+			.addHeader("Content-Type", "text/html")
+			.addHeader("Accept-Ranges", "bytes")
+			.addBody(body);
+		return response.build().length();
+	} });
+	cases.push_back({ "response_build/not_modified", []() {
+		ResponseBuilder response = ResponseBuilder().setStatusCode(StatusCode::OK).setKeepAlive(true);
+		response.addHeader("ETag", "\"1a2b3c-800-65920080\"").addHeader("Last-Modified", "Mon, 01 Jan 2024 00:00:00 GMT");
+		return response.notModified().build().length();
+	} });
+
+	// Whole requests on a persistent connection, from the received bytes to the sent response. The files come
+	// from `server_root`, so run the benchmark from the repository root.
+	static const std::string cached_request = "GET /index.html HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: identity\r\n\r\n";
+	static const std::string range_request = "GET /test_dir/avatar.png HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-1023\r\n\r\n";
+	static const std::string missing_request = "GET /test_dir/missing.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	for (const auto& request : { std::make_pair("connection/cached", &cached_request), std::make_pair("connection/range", &range_request),
+		std::make_pair("connection/not_found", &missing_request) }) {
+		const std::string* data = request.second;
+		cases.push_back({ request.first, [data]() {
+			static HttpConnection connection;
+			connection.onReceive(data->data(), data->length());
+			size_t sent = 0;
+			while (connection.hasPendingOutput()) {
+				size_t length = 0;
+				if (connection.pendingOutputIsFile()) {
+					length = connection.pendingFileLength();
+				} else {
+					SendBuffer buffers[16];
+					size_t count = connection.pendingBuffers(buffers, 16);
+					for (size_t i = 0; i < count; i++) {
+						length += buffers[i].length;
+					}
+				}
+				connection.consumeOutput(length);
+				sent += length;
+			}
+			if (connection.isFinished()) {
+				fprintf(stderr, "%s: the connection was closed\n", data->c_str());
+				exit(1);
+			}
+			return sent;
+		} });
+	}
+	return cases;
+}
+
+static std::string toJson(const std::vector<std::pair<std::string, BenchResult>>& results) {
+	std::ostringstream json;
+	json << "{\n\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		char line[256];
+		snprintf(line, sizeof(line), "\t\t{\"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}%s\n",
+			results[i].first.c_str(), results[i].second.ns_per_op, results[i].second.allocations_per_op, i + 1 < results.size() ? "," : "");
+		json << line;
+	}
+	json << "\t]\n}\n";
+	return json.str();
+}
+
+// Reads the results written by `toJson`, one per line
+static std::map<std::string, BenchResult> readBaseline(const std::string& path) {
+	std::ifstream file(path);
+	if (!file) {
+		fprintf(stderr, "Can't open the baseline %s\n", path.c_str());
+		exit(2);
+	}
+	std::map<std::string, BenchResult> baseline;
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t name = line.find("\"name\": \"");
+		const char* ns = strstr(line.c_str(), "\"ns_per_op\":");
+		const char* allocs = strstr(line.c_str(), "\"allocs_per_op\":");
+		if (name == std::string::npos || !ns || !allocs)
+			continue;
+		name += 9;
+		baseline[line.substr(name, line.find('"', name) - name)] = BenchResult{ atof(ns + 12), atof(allocs + 16) };
+	}
+	return baseline;
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = 1;
+	double tolerance = 20;
+	std::string filter, json_path, baseline_path;
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		std::string value = option.substr(option.find('=') + 1);
+		if (option.rfind("--seconds=", 0) == 0) seconds = atof(value.c_str());
+		else if (option.rfind("--filter=", 0) == 0) filter = value;
+		else if (option.rfind("--json=", 0) == 0) json_path = value;
+		else if (option.rfind("--baseline=", 0) == 0) baseline_path = value;
+		else if (option.rfind("--tolerance=", 0) == 0) tolerance = atof(value.c_str());
+		else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	server_config.max_keep_alive_requests = INT_MAX;
+	file_cache.start(16 * 1024 * 1024, FILE_CACHE_MAX_FILE_SIZE, SERVE_ROOT);
+	path_resolver.start(SERVE_ROOT, RESOLVE_CACHE_ENTRIES);
+
+	std::map<std::string, BenchResult> baseline;
+	if (!baseline_path.empty()) {
+		baseline = readBaseline(baseline_path);
+	}
+
+	std::vector<std::pair<std::string, BenchResult>> results;
+	bool regressed = false;
+	printf("%-36s %10s %10s %s\n", "", "ns/op", "allocs/op", baseline.empty() ? "" : "  vs. baseline");
+	for (const BenchCase& bench_case : benchCases()) {
+		if (bench_case.name.find(filter) == std::string::npos)
+			continue;
+		BenchResult result = measure(bench_case, seconds);
+		results.push_back(std::make_pair(bench_case.name, result));
+		printf("%-36s %10.1f %10.2f", bench_case.name.c_str(), result.ns_per_op, result.allocations_per_op);
+
+		auto previous = baseline.find(bench_case.name);
+		if (previous != baseline.end()) {
+			double change = (result.ns_per_op / previous->second.ns_per_op - 1) * 100;
+			// Allocation counts are exact, rounding aside, so any increase is a regression
+			bool slower = change > tolerance;
+			bool allocates_more = result.allocations_per_op > previous->second.allocations_per_op + 0.01;
+			printf("  %+6.1f%%%s%s", change, slower ? "  SLOWER" : "", allocates_more ? "  MORE ALLOCATIONS" : "");
+			regressed |= slower || allocates_more;
+		} else if (!baseline.empty()) {
+			printf("  (not in baseline)");
+		}
+		printf("\n");
+	}
+
+	if (!json_path.empty()) {
+		std::ofstream file(json_path);
+		file << toJson(results);
+		if (!file) {
+			fprintf(stderr, "Can't write %s\n", json_path.c_str());
+			return 2;
+		}
+	}
+	if (regressed) {
+		printf("Regression against %s (tolerance %.0f%%)\n", baseline_path.c_str(), tolerance);
+		return 1;
+	}
+	return 0;
+}
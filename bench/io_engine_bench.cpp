@@ -0,0 +1,137 @@
+// Closed-loop HTTP/1.0 load client used to compare the server's I/O engines.
+// Every connection sends one request, reads the response until the server closes it and reconnects.
+//
+// Usage: io_engine_bench [host] [port] [connections] [seconds] [uri]
+// See bench/compare_io_engines.sh for running it against both engines.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Client {
+	int socket;
+	size_t sent;
+	Clock::time_point started;
+};
+
+static int connectClient(const sockaddr_in& address) {
+	int client_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (client_socket == -1)
+		return -1;
+	int one = 1;
+	setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(client_socket, (const sockaddr*)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+		close(client_socket);
+		return -1;
+	}
+	return client_socket;
+}
+
+int main(int argc, char* argv[]) {
+	const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+	int port = argc > 2 ? atoi(argv[2]) : 8080;
+	int connection_count = argc > 3 ? atoi(argv[3]) : 64;
+	int seconds = argc > 4 ? atoi(argv[4]) : 10;
+	std::string uri = argc > 5 ? argv[5] : "/";
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+		fprintf(stderr, "Invalid host: %s\n", host);
+		return 1;
+	}
+
+	std::string request = "GET " + uri + " HTTP/1.0\r\nHost: " + host + "\r\n\r\n";
+	int epoll_fd = epoll_create1(0);
+	std::vector<Client> clients(connection_count);
+
+	auto start = [&](int index) {
+		Client& client = clients[index];
+		client.socket = connectClient(address);
+		client.sent = 0;
+		client.started = Clock::now();
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.u32 = index;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.socket, &event);
+	};
+	for (int i = 0; i < connection_count; i++) {
+		start(i);
+	}
+
+	unsigned long long completed = 0, failed = 0, bytes = 0;
+	double total_latency_us = 0;
+	char buffer[64 * 1024];
+	epoll_event events[256];
+	Clock::time_point begin = Clock::now();
+	Clock::time_point end = begin + std::chrono::seconds(seconds);
+
+	while (Clock::now() < end) {
+		int count = epoll_wait(epoll_fd, events, 256, 100);
+		for (int i = 0; i < count; i++) {
+			int index = events[i].data.u32;
+			Client& client = clients[index];
+			bool finished = false, error = false;
+
+			if (client.sent < request.length() && (events[i].events & EPOLLOUT)) {
+				ssize_t sent = send(client.socket, request.data() + client.sent, request.length() - client.sent, MSG_NOSIGNAL);
+				if (sent > 0) {
+					client.sent += sent;
+				} else if (errno != EAGAIN) {
+					error = true;
+				}
+				if (client.sent == request.length()) {
+					epoll_event event = {};
+					event.events = EPOLLIN;
+					event.data.u32 = index;
+					epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.socket, &event);
+				}
+			}
+
+			if (!error && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				while (true) {
+					ssize_t received = recv(client.socket, buffer, sizeof(buffer), 0);
+					if (received > 0) {
+						bytes += received;
+					} else if (received == 0) {
+						finished = true;
+						break;
+					} else {
+						error = errno != EAGAIN;
+						break;
+					}
+				}
+			}
+
+			if (finished || error) {
+				if (finished && !error) {
+					completed++;
+					total_latency_us += std::chrono::duration<double, std::micro>(Clock::now() - client.started).count();
+				} else {
+					failed++;
+				}
+				close(client.socket);
+				start(index);
+			}
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+	printf("requests: %llu, failed: %llu, elapsed: %.2fs\n", completed, failed, elapsed);
+	printf("throughput: %.0f req/s, %.2f MB/s\n", completed / elapsed, bytes / elapsed / (1024 * 1024));
+	printf("mean latency: %.1f us\n", completed ? total_latency_us / completed : 0.0);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,1362 @@
+// HTTP/1.1 and HTTP/2 load generator replaying a request trace over persistent connections, and a generator for
+// synthetic server roots with traces to match.
+//
+// Closed loop (default): every connection sends its next request once the previous response arrived and the
+// request's think time passed. Open loop (`--rate`): requests are sent on a fixed schedule whether or not the server
+// keeps up, and latency is measured from the scheduled time, so a stalled server is charged for every request it
+// delayed instead of the load generator quietly sending fewer (coordinated omission). For a closed loop,
+// `--expected-interval-us` applies the HdrHistogram correction instead.
+//
+// A trace is a JSONL file with one request per line, which connections replay in turns:
+//   {"method":"GET","uri":"/index.html","headers":{"Accept-Encoding":"gzip"},"think_ms":0}
+// Only `uri` is required.
+//
+// `--h2` speaks HTTP/2 with prior knowledge instead, with `--streams` requests in flight on every connection. Each
+// stream replays the trace like a connection does over HTTP/1.1. The streams should stay within the server's
+// SETTINGS_MAX_CONCURRENT_STREAMS, or the ones above it are refused and count as errors.
+//
+// `--tls` connects with TLS, HTTP/2 is then negotiated with ALPN. A new connection resumes the session of the last
+// one of its thread, unless `--tls-resume=off`. The certificate is not verified.
+//
+// Build: g++ -std=c++17 -O2 -pthread -I. -o load_generator bench/load_generator.cpp hpack.cpp -lssl -lcrypto
+// Usage: load_generator [--host=127.0.0.1] [--port=8080] [--connections=64] [--threads=1] [--duration=10]
+//                       [--trace=FILE | --uri=/] [--rate=REQUESTS_PER_SECOND] [--expected-interval-us=N]
+//                       [--h2 [--streams=1]] [--tls [--tls-resume=on]]
+//        load_generator --generate-root=DIR [--files=1000] [--sizes=lognormal:8k:1.5] [--seed=1]
+//                       [--trace-out=FILE] [--trace-requests=100000] [--zipf=1.0] [--uri-prefix=/]
+// `--sizes` is `fixed:SIZE`, `uniform:MIN:MAX` or `lognormal:MEDIAN:SIGMA`, sizes may end in k or m.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "hpack.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+	std::string host = "127.0.0.1";
+	int port = 8080;
+	int connections = 64;
+	int threads = 1;
+	double duration = 10;
+	std::string trace;
+	std::string uri = "/";
+	double rate = 0; // Requests per second in total, 0 for a closed loop
+	long long expected_interval_us = 0;
+	bool h2 = false;
+	int streams = 1; // Requests in flight on an HTTP/2 connection
+	bool tls = false;
+	bool tls_resume = true;
+
+	std::string generate_root;
+	int files = 1000;
+	std::string sizes = "lognormal:8k:1.5";
+	unsigned seed = 1;
+	std::string trace_out;
+	int trace_requests = 100000;
+	double zipf = 1.0;
+	std::string uri_prefix = "/";
+};
+
+[[noreturn]] static void fail(const std::string& message) {
+	fprintf(stderr, "%s\n", message.c_str());
+	exit(1);
+}
+
+// The TLS client of a worker thread, which remembers the last session the server issued to resume it
+class ClientTls {
+	SSL_CTX* context = nullptr;
+	SSL_SESSION* session = nullptr;
+	bool resume = false;
+
+	static int storeSession(SSL* ssl, SSL_SESSION* session) {
+		ClientTls* tls = (ClientTls*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+		if (tls->session) {
+			SSL_SESSION_free(tls->session);
+		}
+		tls->session = session;
+		return 1; // We keep the reference
+	}
+public:
+	ClientTls(const Options& options, bool http2) {
+		if (!options.tls)
+			return;
+		context = SSL_CTX_new(TLS_client_method());
+		if (context == nullptr)
+			fail("SSL_CTX_new() failed");
+		resume = options.tls_resume;
+		SSL_CTX_set_app_data(context, this);
+		// Sends are retried with what is left of the same buffer
+		SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+		SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(context, storeSession);
+		static const unsigned char http2_protocols[] = "\x02h2";
+		static const unsigned char http1_protocols[] = "\x08http/1.1";
+		if (http2) {
+			SSL_CTX_set_alpn_protos(context, http2_protocols, sizeof(http2_protocols) - 1);
+		} else {
+			SSL_CTX_set_alpn_protos(context, http1_protocols, sizeof(http1_protocols) - 1);
+		}
+	}
+
+	~ClientTls() {
+		if (session) {
+			SSL_SESSION_free(session);
+		}
+		SSL_CTX_free(context);
+	}
+
+	ClientTls(const ClientTls&) = delete;
+	ClientTls& operator=(const ClientTls&) = delete;
+
+	// Returns null without `--tls`. The handshake runs as the connection is first read or written.
+	SSL* open(int socket) {
+		if (!context)
+			return nullptr;
+		SSL* ssl = SSL_new(context);
+		SSL_set_fd(ssl, socket);
+		SSL_set_connect_state(ssl);
+		if (resume && session) {
+			SSL_set_session(ssl, session);
+		}
+		return ssl;
+	}
+
+	// Shuts the connection down first, as OpenSSL only lets sessions which were shut down be resumed
+	static void close(SSL* ssl) {
+		if (!ssl)
+			return;
+		SSL_shutdown(ssl);
+		ERR_clear_error();
+		SSL_free(ssl);
+	}
+};
+
+// `send()` and `recv()`, through TLS if `ssl` is set. Waiting for the socket fails with EAGAIN, as does writing to a
+// socket which is still connecting.
+static ssize_t sendSome(int socket, SSL* ssl, const char* data, size_t length) {
+	if (!ssl)
+		return send(socket, data, length, MSG_NOSIGNAL);
+	int result = SSL_write(ssl, data, (int)std::min(length, (size_t)(1 << 30)));
+	if (result > 0)
+		return result;
+	int error = SSL_get_error(ssl, result);
+	errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : ECONNRESET;
+	ERR_clear_error();
+	return -1;
+}
+
+static ssize_t receiveSome(int socket, SSL* ssl, char* buffer, size_t length) {
+	if (!ssl)
+		return recv(socket, buffer, length, 0);
+	int result = SSL_read(ssl, buffer, (int)std::min(length, (size_t)(1 << 30)));
+	if (result > 0)
+		return result;
+	int error = SSL_get_error(ssl, result);
+	ERR_clear_error();
+	if (error == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : ECONNRESET;
+	return -1;
+}
+
+// Latencies in nanoseconds in log-linear buckets, 32 per power of two, so values are known within about 3%
+class Histogram {
+	static const int SUB_BUCKET_BITS = 5;
+	static const int MAX_EXPONENT = 40;
+	std::vector<unsigned long long> buckets;
+	unsigned long long count = 0;
+	unsigned long long max = 0;
+
+	static size_t index(unsigned long long value) {
+		if (value < (2ull << SUB_BUCKET_BITS))
+			return (size_t)value;
+		int exponent = 63 - __builtin_clzll(value);
+		if (exponent > MAX_EXPONENT)
+			return ((size_t)(MAX_EXPONENT - SUB_BUCKET_BITS + 2) << SUB_BUCKET_BITS) - 1;
+		size_t sub_bucket = (size_t)(value >> (exponent - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+		return ((size_t)(exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub_bucket;
+	}
+
+	// The largest value in the bucket
+	static unsigned long long highest(size_t index) {
+		if (index < (2u << SUB_BUCKET_BITS))
+			return index;
+		int exponent = (int)(index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+		unsigned long long sub_bucket = index & ((1 << SUB_BUCKET_BITS) - 1);
+		return (((1ull << SUB_BUCKET_BITS) + sub_bucket + 1) << (exponent - SUB_BUCKET_BITS)) - 1;
+	}
+public:
+	Histogram() : buckets((size_t)(MAX_EXPONENT - SUB_BUCKET_BITS + 2) << SUB_BUCKET_BITS, 0) {}
+
+	void record(unsigned long long value) {
+		buckets[index(value)]++;
+		count++;
+		max = std::max(max, value);
+	}
+
+	// Records `value`, and if it took longer than the `expected_interval` between requests, also the requests
+	// which a client sending at that interval would have waited for meanwhile (as HdrHistogram does)
+	void recordCorrected(unsigned long long value, unsigned long long expected_interval) {
+		record(value);
+		if (expected_interval == 0)
+			return;
+		for (unsigned long long missed = value - std::min(value, expected_interval); missed >= expected_interval; missed -= expected_interval) {
+			record(missed);
+		}
+	}
+
+	void merge(const Histogram& other) {
+		for (size_t i = 0; i < buckets.size(); i++) {
+			buckets[i] += other.buckets[i];
+		}
+		count += other.count;
+		max = std::max(max, other.max);
+	}
+
+	unsigned long long total() const { return count; }
+
+	unsigned long long percentile(double percent) const {
+		unsigned long long rank = (unsigned long long)std::ceil(percent / 100 * (double)count);
+		unsigned long long seen = 0;
+		for (size_t i = 0; i < buckets.size(); i++) {
+			seen += buckets[i];
+			if (seen >= std::max(rank, 1ull))
+				return std::min(highest(i), max);
+		}
+		return max;
+	}
+};
+
+struct TraceEntry {
+	std::string request; // The serialized HTTP/1.1 request
+	bool is_head;
+	double think_ms;
+	// The request for HTTP/2, which encodes it anew for every connection's header compression
+	std::string method;
+	std::string uri;
+	std::string authority;
+	std::vector<std::pair<std::string, std::string>> headers; // Names in lower case, without `host`
+};
+
+// A minimal JSON reader for trace lines: objects, strings, numbers and the literals
+class JsonReader {
+	const std::string& text;
+	size_t position = 0;
+	int line;
+
+	[[noreturn]] void error(const char* message) {
+		fail("Trace line " + std::to_string(line) + ": " + message);
+	}
+	void skipSpace() {
+		while (position < text.length() && isspace((unsigned char)text[position])) {
+			position++;
+		}
+	}
+	bool consume(char c) {
+		skipSpace();
+		if (position < text.length() && text[position] == c) {
+			position++;
+			return true;
+		}
+		return false;
+	}
+public:
+	JsonReader(const std::string& text, int line) : text(text), line(line) {}
+
+	std::string readString() {
+		if (!consume('"'))
+			error("expected a string");
+		std::string value;
+		while (position < text.length() && text[position] != '"') {
+			char c = text[position++];
+			if (c != '\\') {
+				value += c;
+				continue;
+			}
+			if (position >= text.length())
+				break;
+			char escaped = text[position++];
+			switch (escaped) {
+			case 'n': value += '\n'; break;
+			case 't': value += '\t'; break;
+			case 'r': value += '\r'; break;
+			case 'b': value += '\b'; break;
+			case 'f': value += '\f'; break;
+			case 'u': {
+				if (position + 4 > text.length())
+					error("truncated \\u escape");
+				unsigned code = (unsigned)strtoul(text.substr(position, 4).c_str(), nullptr, 16);
+				position += 4;
+				if (code >= 0x80)
+					error("only ASCII \\u escapes are supported");
+				value += (char)code;
+				break;
+			}
+			default: value += escaped; break;
+			}
+		}
+		if (!consume('"'))
+			error("unterminated string");
+		return value;
+	}
+
+	double readNumber() {
+		skipSpace();
+		char* end;
+		double value = strtod(text.c_str() + position, &end);
+		if (end == text.c_str() + position)
+			error("expected a number");
+		position = end - text.c_str();
+		return value;
+	}
+
+	// Calls `member(key)` for every member of an object, which has to read the value
+	template <typename Member>
+	void readObject(Member member) {
+		if (!consume('{'))
+			error("expected an object");
+		if (consume('}'))
+			return;
+		do {
+			std::string key = readString();
+			if (!consume(':'))
+				error("expected ':'");
+			member(key);
+		} while (consume(','));
+		if (!consume('}'))
+			error("expected '}'");
+	}
+
+	void expectEnd() {
+		skipSpace();
+		if (position != text.length())
+			error("unexpected characters after the object");
+	}
+};
+
+static std::vector<TraceEntry> loadTrace(const Options& options) {
+	std::vector<TraceEntry> entries;
+	auto add = [&](const std::string& method, const std::string& uri, const std::vector<std::pair<std::string, std::string>>& headers, double think_ms) {
+		TraceEntry entry{ method + " " + uri + " HTTP/1.1\r\n", method == "HEAD", think_ms, method, uri, options.host, {} };
+		bool has_host = false;
+		for (const auto& header : headers) {
+			entry.request += header.first + ": " + header.second + "\r\n";
+			std::string name = header.first;
+			for (char& c : name) {
+				c = (char)tolower((unsigned char)c);
+			}
+			if (name == "host") {
+				has_host = true;
+				entry.authority = header.second;
+			} else {
+				entry.headers.push_back(std::make_pair(name, header.second));
+			}
+		}
+		if (!has_host) {
+			entry.request += "Host: " + options.host + "\r\n";
+		}
+		entry.request += "\r\n";
+		entries.push_back(entry);
+	};
+
+	if (options.trace.empty()) {
+		add("GET", options.uri, {}, 0);
+		return entries;
+	}
+
+	std::ifstream file(options.trace);
+	if (!file)
+		fail("Can't open the trace " + options.trace);
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line)) {
+		line_number++;
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		JsonReader reader(line, line_number);
+		std::string method = "GET";
+		std::string uri;
+		std::vector<std::pair<std::string, std::string>> headers;
+		double think_ms = 0;
+		reader.readObject([&](const std::string& key) {
+			if (key == "method") {
+				method = reader.readString();
+			} else if (key == "uri") {
+				uri = reader.readString();
+			} else if (key == "think_ms") {
+				think_ms = reader.readNumber();
+			} else if (key == "headers") {
+				reader.readObject([&](const std::string& name) {
+					headers.push_back(std::make_pair(name, reader.readString()));
+				});
+			} else {
+				fail("Trace line " + std::to_string(line_number) + ": unknown key '" + key + "'");
+			}
+		});
+		reader.expectEnd();
+		if (uri.empty() || uri[0] != '/')
+			fail("Trace line " + std::to_string(line_number) + ": the uri has to start with /");
+		add(method, uri, headers, think_ms);
+	}
+	if (entries.empty())
+		fail("The trace " + options.trace + " has no requests");
+	return entries;
+}
+
+struct Connection {
+	int socket = -1;
+	SSL* ssl = nullptr;
+	size_t next_entry; // Index into the trace of the next request
+	const TraceEntry* entry = nullptr; // The request in flight, null while idle
+	size_t sent = 0;
+	std::string response;
+	size_t header_length = 0; // 0 until the end of the response headers was received
+	long long body_length = -1; // -1 if the response ends when the connection closes
+	bool close_after = false;
+	Clock::time_point due; // When the next request is (or was) meant to be sent
+	Clock::time_point intended; // When the request in flight was meant to be sent
+};
+
+struct WorkerResult {
+	Histogram latency;
+	unsigned long long completed = 0;
+	unsigned long long errors = 0;
+	unsigned long long bytes = 0;
+	std::map<int, unsigned long long> statuses;
+};
+
+class Worker {
+	const Options& options;
+	const std::vector<TraceEntry>& trace;
+	sockaddr_in address;
+	std::vector<Connection> connections;
+	int epoll_fd;
+	Clock::duration open_loop_interval; // Between two requests of a connection, zero for a closed loop
+	Clock::time_point end;
+	WorkerResult& result;
+	ClientTls tls;
+	char buffer[64 * 1024];
+
+	void connect(size_t index) {
+		Connection& connection = connections[index];
+		connection.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (connection.socket == -1)
+			fail("socket() failed: " + std::to_string(errno));
+		int one = 1;
+		setsockopt(connection.socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (::connect(connection.socket, (const sockaddr*)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+			close(connection.socket);
+			connection.socket = -1;
+			return;
+		}
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.u64 = index;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection.socket, &event);
+		connection.ssl = tls.open(connection.socket);
+	}
+
+	void disconnect(Connection& connection) {
+		if (connection.socket != -1) {
+			ClientTls::close(connection.ssl);
+			connection.ssl = nullptr;
+			close(connection.socket);
+			connection.socket = -1;
+		}
+		connection.response.clear();
+		connection.header_length = 0;
+	}
+
+	// Gives up on the request in flight. It is not retried, the connection moves on to its next request.
+	void failRequest(size_t index) {
+		Connection& connection = connections[index];
+		if (Clock::now() < end) {
+			result.errors++;
+		}
+		disconnect(connection);
+		connection.entry = nullptr;
+		scheduleNext(connection, 0);
+	}
+
+	void scheduleNext(Connection& connection, double think_ms) {
+		if (open_loop_interval != Clock::duration::zero()) {
+			// The schedule does not care how long the last request took
+			connection.due += open_loop_interval;
+		} else {
+			connection.due = Clock::now() + std::chrono::microseconds((long long)(think_ms * 1000));
+		}
+	}
+
+	void startRequest(size_t index) {
+		Connection& connection = connections[index];
+		if (connection.socket == -1) {
+			connect(index);
+			if (connection.socket == -1) {
+				result.errors++;
+				scheduleNext(connection, 0);
+				return;
+			}
+		}
+		connection.entry = &trace[connection.next_entry];
+		connection.next_entry = (connection.next_entry + 1) % trace.size();
+		connection.sent = 0;
+		connection.intended = connection.due;
+		connection.response.clear();
+		connection.header_length = 0;
+		sendRequest(index);
+	}
+
+	void sendRequest(size_t index) {
+		Connection& connection = connections[index];
+		const std::string& request = connection.entry->request;
+		while (connection.sent < request.length()) {
+			ssize_t sent = sendSome(connection.socket, connection.ssl, request.data() + connection.sent, request.length() - connection.sent);
+			if (sent > 0) {
+				connection.sent += sent;
+			} else if (errno == EAGAIN || errno == ENOTCONN) {
+				return; // Still connecting or the buffer is full, EPOLLOUT tells us when to go on
+			} else if (errno != EINTR) {
+				failRequest(index);
+				return;
+			}
+		}
+	}
+
+	// Parses the status line and headers once they are complete. Returns false if the response is invalid.
+	bool parseHead(Connection& connection, int& status) {
+		size_t end_of_headers = connection.response.find("\r\n\r\n");
+		if (end_of_headers == std::string::npos)
+			return true;
+		connection.header_length = end_of_headers + 4;
+		std::string head = connection.response.substr(0, end_of_headers);
+		for (char& c : head) {
+			c = (char)tolower((unsigned char)c);
+		}
+		if (head.compare(0, 9, "http/1.1 ") != 0 && head.compare(0, 9, "http/1.0 ") != 0)
+			return false;
+		status = atoi(head.c_str() + 9);
+		connection.close_after = head.compare(0, 8, "http/1.0") == 0 ? head.find("\r\nconnection: keep-alive") == std::string::npos
+			: head.find("\r\nconnection: close") != std::string::npos;
+		size_t length_header = head.find("\r\ncontent-length:");
+		connection.body_length = length_header == std::string::npos ? -1 : atoll(head.c_str() + length_header + 17);
+		if (connection.entry->is_head || status == 204 || status == 304 || (status >= 100 && status < 200)) {
+			connection.body_length = 0;
+		}
+		return true;
+	}
+
+	void completeRequest(size_t index, int status) {
+		Connection& connection = connections[index];
+		Clock::time_point now = Clock::now();
+		if (now < end) {
+			unsigned long long latency = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(now - connection.intended).count();
+			result.latency.recordCorrected(latency, (unsigned long long)options.expected_interval_us * 1000);
+			result.completed++;
+			result.statuses[status]++;
+		}
+		double think_ms = connection.entry->think_ms;
+		connection.entry = nullptr;
+		if (connection.close_after) {
+			disconnect(connection);
+		} else {
+			connection.response.clear();
+			connection.header_length = 0;
+		}
+		scheduleNext(connection, think_ms);
+	}
+
+	void receive(size_t index) {
+		Connection& connection = connections[index];
+		while (connection.socket != -1) {
+			ssize_t received = receiveSome(connection.socket, connection.ssl, buffer, sizeof(buffer));
+			bool closed = received == 0;
+			if (received > 0) {
+				result.bytes += received;
+				if (!connection.entry)
+					continue; // Nothing was asked for
+				connection.response.append(buffer, received);
+			} else if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+				if (errno == EAGAIN)
+					return;
+				continue;
+			} else if (!closed) {
+				if (connection.entry) {
+					failRequest(index);
+				} else {
+					disconnect(connection);
+				}
+				return;
+			}
+			if (!connection.entry) {
+				disconnect(connection);
+				return;
+			}
+
+			int status = 0;
+			if (connection.header_length == 0 && !parseHead(connection, status)) {
+				failRequest(index);
+				return;
+			}
+			if (connection.header_length == 0) {
+				if (closed) {
+					failRequest(index);
+				}
+				if (closed)
+					return;
+				continue;
+			}
+			if (status == 0) {
+				status = atoi(connection.response.c_str() + 9);
+			}
+			size_t received_body = connection.response.length() - connection.header_length;
+			bool complete = connection.body_length >= 0 ? received_body >= (size_t)connection.body_length : closed;
+			if (complete) {
+				if (closed) {
+					connection.close_after = true;
+				}
+				completeRequest(index, status);
+				return;
+			}
+			if (closed) {
+				failRequest(index);
+				return;
+			}
+		}
+	}
+public:
+	Worker(const Options& options, const std::vector<TraceEntry>& trace, const sockaddr_in& address, int first_connection,
+		int connection_count, Clock::time_point begin, WorkerResult& result)
+		: options(options), trace(trace), address(address), connections(connection_count), result(result), tls(options, false) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		end = begin + std::chrono::microseconds((long long)(options.duration * 1e6));
+		open_loop_interval = Clock::duration::zero();
+		if (options.rate > 0) {
+			open_loop_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.connections / options.rate));
+		}
+		for (int i = 0; i < connection_count; i++) {
+			Connection& connection = connections[i];
+			int global_index = first_connection + i;
+			// Connections start at different points of the trace and, in an open loop, of the schedule
+			connection.next_entry = (size_t)global_index * trace.size() / options.connections;
+			connection.due = begin + open_loop_interval * global_index / options.connections;
+		}
+	}
+
+	~Worker() {
+		for (Connection& connection : connections) {
+			disconnect(connection);
+		}
+		close(epoll_fd);
+	}
+
+	void run() {
+		epoll_event events[256];
+		while (true) {
+			Clock::time_point now = Clock::now();
+			if (now >= end)
+				return;
+
+			// Send what is due, and find out how long we may wait for responses until the next one is
+			Clock::time_point next_due = end;
+			for (size_t i = 0; i < connections.size(); i++) {
+				if (connections[i].entry)
+					continue;
+				if (connections[i].due <= now) {
+					startRequest(i);
+				}
+				if (!connections[i].entry) {
+					next_due = std::min(next_due, connections[i].due);
+				}
+			}
+			long long wait_us = std::chrono::duration_cast<std::chrono::microseconds>(next_due - Clock::now()).count();
+			// Rounded down, so requests are not sent late: a late send counts as latency in an open loop
+			int timeout = (int)std::max(0ll, wait_us / 1000);
+
+			int count = epoll_wait(epoll_fd, events, 256, timeout);
+			for (int i = 0; i < count; i++) {
+				size_t index = (size_t)events[i].data.u64;
+				Connection& connection = connections[index];
+				if (connection.socket == -1)
+					continue;
+				// The handshake may need the server's response before the request can go out
+				if (connection.entry && ((events[i].events & EPOLLOUT) || connection.ssl)) {
+					sendRequest(index);
+				}
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					receive(index);
+				}
+			}
+		}
+	}
+};
+
+// A request slot of an HTTP/2 connection, which sends its next request once the previous response arrived, like
+// an HTTP/1.1 connection
+struct Http2Slot {
+	size_t next_entry;
+	const TraceEntry* entry = nullptr; // The request in flight or waiting to be sent, null while idle
+	uint32_t stream_id = 0; // 0 while the request waits for a connection
+	int status = 0;
+	Clock::time_point due;
+	Clock::time_point intended;
+};
+
+struct Http2Connection {
+	int socket = -1;
+	SSL* ssl = nullptr;
+	HpackEncoder encoder;
+	HpackDecoder decoder;
+	std::string output;
+	size_t output_offset = 0;
+	std::string input;
+	uint32_t next_stream_id = 1;
+	std::map<uint32_t, size_t> streams; // Streams in flight, to their slot
+	bool going_away = false; // The server sent a GOAWAY, the streams it did not take wait for a new connection
+	long long unacknowledged_data = 0; // Received DATA which was not granted again with a WINDOW_UPDATE
+	uint32_t continued_stream = 0; // The stream whose header block continues in CONTINUATION frames
+	bool continued_ends_stream = false;
+	std::string header_block;
+	std::string field_storage;
+	std::vector<HpackField> fields;
+};
+
+class Http2Worker {
+	// The receive windows we grant, large enough that the server never waits for a WINDOW_UPDATE
+	static const uint32_t WINDOW = 1u << 30;
+	static const uint32_t DEFAULT_WINDOW = 65535;
+	static const uint8_t DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, SETTINGS = 0x4, PING = 0x6, GOAWAY = 0x7,
+		WINDOW_UPDATE = 0x8, CONTINUATION = 0x9;
+	static const uint8_t END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY = 0x20;
+
+	const Options& options;
+	const std::vector<TraceEntry>& trace;
+	sockaddr_in address;
+	std::vector<Http2Connection> connections;
+	std::vector<Http2Slot> slots; // `options.streams` per connection
+	int epoll_fd;
+	Clock::duration open_loop_interval; // Between two requests of a slot, zero for a closed loop
+	Clock::time_point end;
+	WorkerResult& result;
+	ClientTls tls;
+	char buffer[64 * 1024];
+
+	static void appendFrameHeader(std::string& out, size_t length, uint8_t type, uint8_t flags, uint32_t stream_id) {
+		const char header[9] = { (char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags,
+			(char)(stream_id >> 24), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id };
+		out.append(header, sizeof(header));
+	}
+
+	static void appendWindowUpdate(std::string& out, uint32_t increment) {
+		appendFrameHeader(out, 4, WINDOW_UPDATE, 0, 0);
+		const char payload[4] = { (char)(increment >> 24), (char)(increment >> 16), (char)(increment >> 8), (char)increment };
+		out.append(payload, sizeof(payload));
+	}
+
+	static uint32_t readUint32(const char* data) {
+		return (uint32_t)(uint8_t)data[0] << 24 | (uint32_t)(uint8_t)data[1] << 16 | (uint32_t)(uint8_t)data[2] << 8 | (uint8_t)data[3];
+	}
+
+	bool connect(size_t index) {
+		Http2Connection& connection = connections[index];
+		connection.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (connection.socket == -1)
+			fail("socket() failed: " + std::to_string(errno));
+		int one = 1;
+		setsockopt(connection.socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (::connect(connection.socket, (const sockaddr*)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+			close(connection.socket);
+			connection.socket = -1;
+			return false;
+		}
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.u64 = index;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection.socket, &event);
+		connection.ssl = tls.open(connection.socket);
+
+		// The preface, SETTINGS without server push and with a large stream window, and a large connection window
+		connection.output = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+		appendFrameHeader(connection.output, 12, SETTINGS, 0, 0);
+		const char settings[12] = { 0, 2, 0, 0, 0, 0, 0, 4, (char)(WINDOW >> 24), (char)(WINDOW >> 16), (char)(WINDOW >> 8), (char)WINDOW };
+		connection.output.append(settings, sizeof(settings));
+		appendWindowUpdate(connection.output, WINDOW - DEFAULT_WINDOW);
+		return true;
+	}
+
+	// Closes the connection. Requests still in flight failed, the ones waiting are sent on the next connection.
+	void disconnect(size_t index) {
+		Http2Connection& connection = connections[index];
+		if (connection.socket != -1) {
+			ClientTls::close(connection.ssl);
+			close(connection.socket);
+		}
+		for (const auto& stream : connection.streams) {
+			failRequest(stream.second);
+		}
+		connection = Http2Connection();
+	}
+
+	void failRequest(size_t slot_index) {
+		Http2Slot& slot = slots[slot_index];
+		if (Clock::now() < end) {
+			result.errors++;
+		}
+		slot.entry = nullptr;
+		slot.stream_id = 0;
+		scheduleNext(slot, 0);
+	}
+
+	void scheduleNext(Http2Slot& slot, double think_ms) {
+		if (open_loop_interval != Clock::duration::zero()) {
+			slot.due += open_loop_interval;
+		} else {
+			slot.due = Clock::now() + std::chrono::microseconds((long long)(think_ms * 1000));
+		}
+	}
+
+	void startRequest(size_t slot_index) {
+		Http2Slot& slot = slots[slot_index];
+		slot.entry = &trace[slot.next_entry];
+		slot.next_entry = (slot.next_entry + 1) % trace.size();
+		slot.intended = slot.due;
+		sendRequest(slot_index);
+	}
+
+	// Opens a stream for the slot's request, unless its connection is going away
+	void sendRequest(size_t slot_index) {
+		Http2Slot& slot = slots[slot_index];
+		size_t index = slot_index / options.streams;
+		Http2Connection& connection = connections[index];
+		if (connection.going_away)
+			return;
+		if (connection.socket == -1 && !connect(index)) {
+			failRequest(slot_index);
+			return;
+		}
+
+		const TraceEntry& entry = *slot.entry;
+		std::string block;
+		connection.encoder.beginBlock(block);
+		connection.encoder.encodeField(":method", entry.method, true, block);
+		connection.encoder.encodeField(":scheme", options.tls ? "https" : "http", true, block);
+		connection.encoder.encodeField(":authority", entry.authority, true, block);
+		connection.encoder.encodeField(":path", entry.uri, true, block);
+		for (const auto& header : entry.headers) {
+			connection.encoder.encodeField(header.first, header.second, true, block);
+		}
+		// Frames may carry 16384 bytes until the server's SETTINGS allow more
+		const size_t max_frame_size = 16384;
+		slot.stream_id = connection.next_stream_id;
+		connection.next_stream_id += 2;
+		slot.status = 0;
+		connection.streams[slot.stream_id] = slot_index;
+		for (size_t offset = 0; offset == 0 || offset < block.length(); offset += max_frame_size) {
+			size_t length = std::min(max_frame_size, block.length() - offset);
+			uint8_t flags = offset + length == block.length() ? END_HEADERS : 0;
+			if (offset == 0) {
+				appendFrameHeader(connection.output, length, HEADERS, flags | END_STREAM, slot.stream_id);
+			} else {
+				appendFrameHeader(connection.output, length, CONTINUATION, flags, slot.stream_id);
+			}
+			connection.output.append(block, offset, length);
+		}
+		flush(index);
+	}
+
+	void flush(size_t index) {
+		Http2Connection& connection = connections[index];
+		while (connection.output_offset < connection.output.length()) {
+			ssize_t sent = sendSome(connection.socket, connection.ssl, connection.output.data() + connection.output_offset,
+				connection.output.length() - connection.output_offset);
+			if (sent > 0) {
+				connection.output_offset += sent;
+			} else if (errno == EAGAIN || errno == ENOTCONN) {
+				return; // Still connecting or the buffer is full, EPOLLOUT tells us when to go on
+			} else if (errno != EINTR) {
+				disconnect(index);
+				return;
+			}
+		}
+		connection.output.clear();
+		connection.output_offset = 0;
+	}
+
+	void completeRequest(size_t index, uint32_t stream_id) {
+		Http2Connection& connection = connections[index];
+		auto stream = connection.streams.find(stream_id);
+		if (stream == connection.streams.end())
+			return;
+		Http2Slot& slot = slots[stream->second];
+		connection.streams.erase(stream);
+		Clock::time_point now = Clock::now();
+		if (now < end) {
+			unsigned long long latency = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(now - slot.intended).count();
+			result.latency.recordCorrected(latency, (unsigned long long)options.expected_interval_us * 1000);
+			result.completed++;
+			result.statuses[slot.status]++;
+		}
+		double think_ms = slot.entry->think_ms;
+		slot.entry = nullptr;
+		slot.stream_id = 0;
+		scheduleNext(slot, think_ms);
+	}
+
+	// Returns false if the header block is malformed
+	bool handleHeaderBlock(size_t index, uint32_t stream_id, bool end_stream) {
+		Http2Connection& connection = connections[index];
+		// Every block has to be decoded to keep the dynamic table in step with the server's
+		connection.field_storage.clear();
+		connection.fields.clear();
+		if (!connection.decoder.decode(connection.header_block, 64 * 1024, connection.field_storage, connection.fields))
+			return false;
+		auto stream = connection.streams.find(stream_id);
+		if (stream != connection.streams.end()) {
+			for (const HpackField& field : connection.fields) {
+				if (field.name == ":status") {
+					slots[stream->second].status = atoi(std::string(field.value).c_str());
+				}
+			}
+		}
+		if (end_stream) {
+			completeRequest(index, stream_id);
+		}
+		return true;
+	}
+
+	// Returns false if the connection has to be closed
+	bool handleFrame(size_t index, uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload) {
+		Http2Connection& connection = connections[index];
+		if (connection.continued_stream != 0 && type != CONTINUATION)
+			return false;
+		switch (type) {
+		case DATA:
+			connection.unacknowledged_data += payload.length();
+			if (connection.unacknowledged_data >= WINDOW / 2) {
+				appendWindowUpdate(connection.output, (uint32_t)connection.unacknowledged_data);
+				connection.unacknowledged_data = 0;
+			}
+			if (flags & END_STREAM) {
+				completeRequest(index, stream_id);
+			}
+			return true;
+		case HEADERS:
+			if (flags & PADDED) {
+				if (payload.empty() || (uint8_t)payload[0] >= payload.length())
+					return false;
+				payload = payload.substr(1, payload.length() - 1 - (uint8_t)payload[0]);
+			}
+			if (flags & PRIORITY) {
+				if (payload.length() < 5)
+					return false;
+				payload.remove_prefix(5);
+			}
+			connection.header_block.assign(payload.data(), payload.length());
+			if (flags & END_HEADERS)
+				return handleHeaderBlock(index, stream_id, flags & END_STREAM);
+			connection.continued_stream = stream_id;
+			connection.continued_ends_stream = flags & END_STREAM;
+			return true;
+		case CONTINUATION:
+			if (stream_id != connection.continued_stream)
+				return false;
+			connection.header_block.append(payload.data(), payload.length());
+			if (!(flags & END_HEADERS))
+				return true;
+			connection.continued_stream = 0;
+			return handleHeaderBlock(index, stream_id, connection.continued_ends_stream);
+		case RST_STREAM: {
+			auto stream = connection.streams.find(stream_id);
+			if (stream != connection.streams.end()) {
+				size_t slot_index = stream->second;
+				connection.streams.erase(stream);
+				failRequest(slot_index);
+			}
+			return true;
+		}
+		case SETTINGS:
+			if (flags & ACK)
+				return true;
+			for (size_t offset = 0; offset + 6 <= payload.length(); offset += 6) {
+				if (payload[offset] == 0 && payload[offset + 1] == 1) {
+					connection.encoder.setPeerTableSize(readUint32(payload.data() + offset + 2));
+				}
+			}
+			appendFrameHeader(connection.output, 0, SETTINGS, ACK, 0);
+			return true;
+		case PING:
+			if (!(flags & ACK)) {
+				appendFrameHeader(connection.output, payload.length(), PING, ACK, 0);
+				connection.output.append(payload.data(), payload.length());
+			}
+			return true;
+		case GOAWAY: {
+			if (payload.length() < 8)
+				return false;
+			// The streams after the last one the server took were not processed, they are sent again on a new
+			// connection once this one finished the others
+			uint32_t last_stream_id = readUint32(payload.data()) & 0x7fffffff;
+			connection.going_away = true;
+			for (auto stream = connection.streams.upper_bound(last_stream_id); stream != connection.streams.end();) {
+				slots[stream->second].stream_id = 0;
+				stream = connection.streams.erase(stream);
+			}
+			return true;
+		}
+		default:
+			return true;
+		}
+	}
+
+	void receive(size_t index) {
+		Http2Connection& connection = connections[index];
+		while (connection.socket != -1) {
+			ssize_t received = receiveSome(connection.socket, connection.ssl, buffer, sizeof(buffer));
+			if (received == -1 && errno == EINTR)
+				continue;
+			if (received == -1 && errno == EAGAIN)
+				break;
+			if (received <= 0) {
+				disconnect(index);
+				return;
+			}
+			result.bytes += received;
+			connection.input.append(buffer, received);
+
+			size_t offset = 0;
+			while (connection.input.length() - offset >= 9) {
+				const char* header = connection.input.data() + offset;
+				size_t length = (size_t)(uint8_t)header[0] << 16 | (size_t)(uint8_t)header[1] << 8 | (uint8_t)header[2];
+				if (connection.input.length() - offset - 9 < length)
+					break;
+				std::string_view payload(header + 9, length);
+				if (!handleFrame(index, (uint8_t)header[3], (uint8_t)header[4], readUint32(header + 5) & 0x7fffffff, payload)) {
+					disconnect(index);
+					return;
+				}
+				offset += 9 + length;
+			}
+			connection.input.erase(0, offset);
+		}
+		if (connection.going_away && connection.streams.empty()) {
+			disconnect(index);
+			return;
+		}
+		// Acknowledgements and window updates
+		if (!connection.output.empty()) {
+			flush(index);
+		}
+	}
+public:
+	Http2Worker(const Options& options, const std::vector<TraceEntry>& trace, const sockaddr_in& address, int first_connection,
+		int connection_count, Clock::time_point begin, WorkerResult& result)
+		: options(options), trace(trace), address(address), connections(connection_count),
+		slots((size_t)connection_count * options.streams), result(result), tls(options, true) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		end = begin + std::chrono::microseconds((long long)(options.duration * 1e6));
+		size_t total_slots = (size_t)options.connections * options.streams;
+		open_loop_interval = Clock::duration::zero();
+		if (options.rate > 0) {
+			open_loop_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(total_slots / options.rate));
+		}
+		for (size_t i = 0; i < slots.size(); i++) {
+			size_t global_index = (size_t)first_connection * options.streams + i;
+			slots[i].next_entry = global_index * trace.size() / total_slots;
+			slots[i].due = begin + open_loop_interval * global_index / total_slots;
+		}
+	}
+
+	~Http2Worker() {
+		for (Http2Connection& connection : connections) {
+			if (connection.socket != -1) {
+				ClientTls::close(connection.ssl);
+				close(connection.socket);
+			}
+		}
+		close(epoll_fd);
+	}
+
+	void run() {
+		epoll_event events[256];
+		while (true) {
+			Clock::time_point now = Clock::now();
+			if (now >= end)
+				return;
+
+			Clock::time_point next_due = end;
+			for (size_t i = 0; i < slots.size(); i++) {
+				Http2Slot& slot = slots[i];
+				if (slot.entry) {
+					// A request the server did not take before going away is sent again once it can be
+					if (slot.stream_id == 0) {
+						sendRequest(i);
+					}
+					continue;
+				}
+				if (slot.due <= now) {
+					startRequest(i);
+				}
+				if (!slot.entry) {
+					next_due = std::min(next_due, slot.due);
+				}
+			}
+			long long wait_us = std::chrono::duration_cast<std::chrono::microseconds>(next_due - Clock::now()).count();
+			int timeout = (int)std::max(0ll, wait_us / 1000);
+
+			int count = epoll_wait(epoll_fd, events, 256, timeout);
+			for (int i = 0; i < count; i++) {
+				size_t index = (size_t)events[i].data.u64;
+				if (connections[index].socket == -1)
+					continue;
+				if ((events[i].events & EPOLLOUT) && !connections[index].output.empty()) {
+					flush(index);
+				}
+				if (connections[index].socket != -1 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+					receive(index);
+				}
+			}
+		}
+	}
+};
+
+static void runLoad(const Options& options) {
+	std::vector<TraceEntry> trace = loadTrace(options);
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons((uint16_t)options.port);
+	if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1)
+		fail("Invalid host: " + options.host);
+
+	int thread_count = std::min(options.threads, options.connections);
+	std::vector<WorkerResult> results(thread_count);
+	std::vector<std::thread> threads;
+	Clock::time_point begin = Clock::now() + std::chrono::milliseconds(10);
+	for (int i = 0; i < thread_count; i++) {
+		int first = options.connections * i / thread_count;
+		int count = options.connections * (i + 1) / thread_count - first;
+		threads.emplace_back([&, i, first, count]() {
+			if (options.h2) {
+				Http2Worker worker(options, trace, address, first, count, begin, results[i]);
+				worker.run();
+			} else {
+				Worker worker(options, trace, address, first, count, begin, results[i]);
+				worker.run();
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	WorkerResult total;
+	for (const WorkerResult& result : results) {
+		total.latency.merge(result.latency);
+		total.completed += result.completed;
+		total.errors += result.errors;
+		total.bytes += result.bytes;
+		for (const auto& status : result.statuses) {
+			total.statuses[status.first] += status.second;
+		}
+	}
+
+	std::string protocol = options.h2 ? " (HTTP/2, " + std::to_string(options.streams) + " streams each)" : "";
+	if (options.tls) {
+		protocol += options.tls_resume ? " over TLS" : " over TLS without resumption";
+	}
+	printf("%s loop, %d connections%s on %d threads, %zu trace entries, %.1fs\n", options.rate > 0 ? "open" : "closed",
+		options.connections, protocol.c_str(), thread_count, trace.size(), options.duration);
+	printf("requests: %llu, errors: %llu\n", total.completed, total.errors);
+	printf("throughput: %.0f req/s, %.2f MB/s\n", total.completed / options.duration, total.bytes / options.duration / (1024 * 1024));
+	if (options.rate > 0 && total.completed < options.rate * options.duration * 0.95) {
+		printf("warning: only %.0f%% of the requested rate was achieved\n", 100 * total.completed / (options.rate * options.duration));
+	}
+	printf("latency%s:", options.rate > 0 || options.expected_interval_us > 0 ? " (corrected for coordinated omission)" : "");
+	const double percentiles[] = { 50, 90, 99, 99.9 };
+	for (double percentile : percentiles) {
+		printf(" p%g %.1fus", percentile, total.latency.percentile(percentile) / 1000.0);
+	}
+	printf(" max %.1fus\n", total.latency.percentile(100) / 1000.0);
+	printf("status codes:");
+	for (const auto& status : total.statuses) {
+		printf(" %d: %llu", status.first, status.second);
+	}
+	printf("\n");
+}
+
+// Parses `4096`, `8k` or `1m`
+static double parseSize(const std::string& text) {
+	char* end;
+	double size = strtod(text.c_str(), &end);
+	if (end == text.c_str() || size < 0)
+		fail("Invalid size: " + text);
+	if (*end == 'k' || *end == 'K') {
+		size *= 1024;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size *= 1024 * 1024;
+		end++;
+	}
+	if (*end != '\0')
+		fail("Invalid size: " + text);
+	return size;
+}
+
+static void generateRoot(const Options& options) {
+	std::vector<std::string> parameters;
+	size_t start = 0;
+	while (true) {
+		size_t colon = options.sizes.find(':', start);
+		parameters.push_back(options.sizes.substr(start, colon - start));
+		if (colon == std::string::npos)
+			break;
+		start = colon + 1;
+	}
+	std::mt19937_64 random(options.seed);
+	std::function<size_t()> nextSize;
+	if (parameters[0] == "fixed" && parameters.size() == 2) {
+		size_t size = (size_t)parseSize(parameters[1]);
+		nextSize = [size]() { return size; };
+	} else if (parameters[0] == "uniform" && parameters.size() == 3) {
+		std::uniform_int_distribution<size_t> distribution((size_t)parseSize(parameters[1]), (size_t)parseSize(parameters[2]));
+		nextSize = [&random, distribution]() mutable { return distribution(random); };
+	} else if (parameters[0] == "lognormal" && parameters.size() == 3) {
+		std::lognormal_distribution<double> distribution(std::log(parseSize(parameters[1])), atof(parameters[2].c_str()));
+		nextSize = [&random, distribution]() mutable { return (size_t)std::min(distribution(random), 1024.0 * 1024 * 1024); };
+	} else {
+		fail("Invalid --sizes: " + options.sizes);
+	}
+
+	if (mkdir(options.generate_root.c_str(), 0755) != 0 && errno != EEXIST)
+		fail("Can't create " + options.generate_root);
+
+	// Text files compress like text, the others are random
+	static const char* const extensions[] = { ".html", ".css", ".js", ".json", ".png", ".jpg", ".bin" };
+	static const char* const words[] = { "the", "server", "request", "response", "static", "file", "cache", "header",
+		"<div>", "</div>", "class=", "function", "return", "{", "}", "\n" };
+	std::vector<std::string> names;
+	unsigned long long total_size = 0;
+	for (int i = 0; i < options.files; i++) {
+		char name[32];
+		const char* extension = extensions[i % (sizeof(extensions) / sizeof(extensions[0]))];
+		snprintf(name, sizeof(name), "f%06d%s", i, extension);
+		names.push_back(name);
+
+		size_t size = nextSize();
+		std::string contents;
+		contents.reserve(size + 16);
+		bool text = i % 7 < 4;
+		while (contents.length() < size) {
+			if (text) {
+				contents += words[random() % (sizeof(words) / sizeof(words[0]))];
+				contents += ' ';
+			} else {
+				unsigned long long bits = random();
+				contents.append((const char*)&bits, sizeof(bits));
+			}
+		}
+		contents.resize(size);
+		std::ofstream file(options.generate_root + "/" + name, std::ios::binary);
+		file.write(contents.data(), contents.size());
+		if (!file)
+			fail("Can't write " + options.generate_root + "/" + name);
+		total_size += size;
+	}
+	printf("Generated %d files with %.1f MB in %s\n", options.files, total_size / (1024.0 * 1024), options.generate_root.c_str());
+
+	if (options.trace_out.empty())
+		return;
+	// Popularity follows Zipf's law: the file of rank r is requested in proportion to 1 / r^s
+	std::vector<double> weights;
+	for (int i = 0; i < options.files; i++) {
+		weights.push_back(1.0 / std::pow(i + 1, options.zipf));
+	}
+	std::discrete_distribution<int> popularity(weights.begin(), weights.end());
+	std::vector<int> ranks(options.files);
+	for (int i = 0; i < options.files; i++) {
+		ranks[i] = i;
+	}
+	// Popularity should not follow the file types
+	std::shuffle(ranks.begin(), ranks.end(), random);
+
+	std::string prefix = options.uri_prefix;
+	if (prefix.empty() || prefix.back() != '/') {
+		prefix += '/';
+	}
+	std::ofstream trace(options.trace_out);
+	for (int i = 0; i < options.trace_requests; i++) {
+		trace << "{\"method\":\"GET\",\"uri\":\"" << prefix << names[ranks[popularity(random)]]
+			<< "\",\"headers\":{\"Accept-Encoding\":\"gzip, br\"},\"think_ms\":0}\n";
+	}
+	if (!trace)
+		fail("Can't write " + options.trace_out);
+	printf("Wrote %d requests to %s\n", options.trace_requests, options.trace_out.c_str());
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		size_t equals = option.find('=');
+		std::string name = option.substr(0, equals);
+		std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+		if (name == "--host") options.host = value;
+		else if (name == "--port") options.port = atoi(value.c_str());
+		else if (name == "--connections") options.connections = atoi(value.c_str());
+		else if (name == "--threads") options.threads = atoi(value.c_str());
+		else if (name == "--duration") options.duration = atof(value.c_str());
+		else if (name == "--trace") options.trace = value;
+		else if (name == "--uri") options.uri = value;
+		else if (name == "--rate") options.rate = atof(value.c_str());
+		else if (name == "--expected-interval-us") options.expected_interval_us = atoll(value.c_str());
+		else if (name == "--h2") options.h2 = true;
+		else if (name == "--streams") options.streams = atoi(value.c_str());
+		else if (name == "--tls") options.tls = true;
+		else if (name == "--tls-resume") options.tls_resume = value != "off";
+		else if (name == "--generate-root") options.generate_root = value;
+		else if (name == "--files") options.files = atoi(value.c_str());
+		else if (name == "--sizes") options.sizes = value;
+		else if (name == "--seed") options.seed = (unsigned)atoi(value.c_str());
+		else if (name == "--trace-out") options.trace_out = value;
+		else if (name == "--trace-requests") options.trace_requests = atoi(value.c_str());
+		else if (name == "--zipf") options.zipf = atof(value.c_str());
+		else if (name == "--uri-prefix") options.uri_prefix = value;
+		else fail("Unknown option: " + option + " (see the top of bench/load_generator.cpp for the usage)");
+	}
+	if (options.connections < 1 || options.threads < 1 || options.streams < 1 || options.duration <= 0 || options.files < 1 || options.trace_requests < 0)
+		fail("Invalid option values");
+
+	// OpenSSL writes without MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!options.generate_root.empty()) {
+		generateRoot(options);
+	} else {
+		runLoad(options);
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+// Microbenchmark of the MIME type lookup: the hash table in mime_types.cpp against the linear `strcmp` scan
+// it replaced, for the extensions of a typical page load and for misses.
+//
+// Build from the repository root:
+//   g++ -std=c++17 -O2 -I. -o mime_bench bench/mime_bench.cpp mime_types.cpp
+// Usage: mime_bench [seconds per case]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "mime_types.h"
+
+using Clock = std::chrono::steady_clock;
+
+// The lookup as it was before, with its loop bound fixed so misses don't read past the table
+static const char* linear_mime_types[] = {
+	".aac", "audio/aac",
+	".abw", "application/x-abiword",
+	".arc", "application/x-freearc",
+	".avi", "video/x-msvideo",
+	".azw", "application/vnd.amazon.ebook",
+	".bin", "application/octet-stream",
+	".bmp", "image/bmp",
+	".bz", "application/x-bzip",
+	".bz2", "application/x-bzip2",
+	".csh", "application/x-csh",
+	".css", "text/css",
+	".csv", "text/csv",
+	".doc", "application/msword",
+	".docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+	".eot", "application/vnd.ms-fontobject",
+	".epub", "application/epub+zip",
+	".gz", "application/gzip",
+	".gif", "image/gif",
+	".htm", "text/html",
+	".html", "text/html",
+	".ico", "image/vnd.microsoft.icon",
+	".ics", "text/calendar",
+	".jar", "application/java-archive",
+	".jpeg", "image/jpeg",
+	".jpg", "image/jpeg",
+	".js", "text/javascript",
+	".json", "application/json",
+	".jsonld", "application/ld+json",
+	".mid", "audio/midi audio/x-midi",
+	".midi", "audio/midi audio/x-midi",
+	".mjs", "text/javascript",
+	".mp3", "audio/mpeg",
+	".mp4", "video/mp4",
+	".mpeg", "video/mpeg",
+	".mpkg", "application/vnd.apple.installer+xml",
+	".odp", "application/vnd.oasis.opendocument.presentation",
+	".ods", "application/vnd.oasis.opendocument.spreadsheet",
+	".odt", "application/vnd.oasis.opendocument.text",
+	".oga", "audio/ogg",
+	".ogv", "video/ogg",
+	".ogx", "application/ogg",
+	".opus", "audio/opus",
+	".otf", "font/otf",
+	".png", "image/png",
+	".pdf", "application/pdf",
+	".php", "application/x-httpd-php",
+	".ppt", "application/vnd.ms-powerpoint",
+	".pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation",
+	".rar", "application/vnd.rar",
+	".rtf", "application/rtf",
+	".sh", "application/x-sh",
+	".svg", "image/svg+xml",
+	".swf", "application/x-shockwave-flash",
+	".tar", "application/x-tar",
+	".tif", "image/tiff",
+	".tiff", "image/tiff",
+	".ts", "video/mp2t",
+	".ttf", "font/ttf",
+	".txt", "text/plain",
+	".vsd", "application/vnd.visio",
+	".wav", "audio/wav",
+	".weba", "audio/webm",
+	".webm", "video/webm",
+	".webp", "image/webp",
+	".woff", "font/woff",
+	".woff2", "font/woff2",
+	".xhtml", "application/xhtml+xml",
+	".xls", "application/vnd.ms-excel",
+	".xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
+	".xml", "text/xml",
+	".xul", "application/vnd.mozilla.xul+xml",
+	".zip", "application/zip",
+	".3gp", "video/3gpp",
+	".3g2", "video/3gpp2",
+	".7z", "application/x-7z-compressed"
+};
+
+static const char* linearMimeType(const char* extension) {
+	for (size_t i = 0; i < sizeof(linear_mime_types) / sizeof(linear_mime_types[0]) / 2; i++) {
+		if (!strcmp(extension, linear_mime_types[2 * i])) {
+			return linear_mime_types[2 * i + 1];
+		}
+	}
+	return "application/octet-stream";
+}
+
+struct BenchCase {
+	const char* name;
+	std::vector<std::string> extensions;
+};
+
+template <typename Lookup>
+static double measure(const BenchCase& bench_case, double seconds, Lookup lookup) {
+	unsigned long long lookups = 0;
+	size_t checksum = 0; // Keeps the compiler from dropping the work
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	while (Clock::now() < deadline) {
+		for (int i = 0; i < 1000; i++) {
+			for (const std::string& extension : bench_case.extensions) {
+				checksum += lookup(extension);
+			}
+		}
+		lookups += 1000 * bench_case.extensions.size();
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	if (checksum == 1) {
+		printf("\n");
+	}
+	return elapsed * 1e9 / lookups;
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+
+	std::vector<BenchCase> cases = {
+		{ "page load", { ".html", ".css", ".js", ".png", ".jpg", ".svg", ".woff2", ".json", ".ico", ".webp" } },
+		{ "late in the table", { ".xml", ".zip", ".7z", ".3gp", ".xlsx", ".woff2" } },
+		{ "misses", { ".map", ".md", ".wasm", ".yaml", "", ".c" } },
+	};
+
+	printf("%-20s %14s %14s\n", "", "linear ns/op", "hash ns/op");
+	for (const BenchCase& bench_case : cases) {
+		double linear = measure(bench_case, seconds, [](const std::string& extension) {
+			return strlen(linearMimeType(extension.c_str()));
+		});
+		double hashed = measure(bench_case, seconds, [](const std::string& extension) {
+			return getMimeType(extension).length();
+		});
+		printf("%-20s %14.1f %14.1f\n", bench_case.name, linear, hashed);
+	}
+	return 0;
+}
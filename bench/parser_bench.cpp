@@ -0,0 +1,100 @@
+// Microbenchmark of the request parser: how many requests one core parses per second.
+// Every request is parsed whole, and again delivered in small pieces like a slow client would send it, which
+// shows that resuming does not rescan what was already parsed.
+//
+// Build from the repository root (add -mavx2 to use the AVX2 scanner instead of SSE2):
+//   g++ -std=c++17 -O2 -I. -o parser_bench bench/parser_bench.cpp http_parser.cpp
+// Usage: parser_bench [seconds per case]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "http_parser.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchCase {
+	const char* name;
+	std::string request;
+	size_t piece_size; // Bytes delivered per parse call, 0 for the whole request at once
+};
+
+static void runCase(const BenchCase& bench_case, double seconds) {
+	HttpRequestParser parser;
+	HttpRequest request;
+	const std::string& data = bench_case.request;
+	size_t piece_size = bench_case.piece_size == 0 ? data.length() : bench_case.piece_size;
+
+	unsigned long long parsed = 0;
+	size_t checksum = 0; // Keeps the compiler from dropping the work
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	while (Clock::now() < deadline) {
+		for (int i = 0; i < 1000; i++) {
+			HttpRequestParser::Result result = HttpRequestParser::Result::Incomplete;
+			for (size_t length = piece_size; result == HttpRequestParser::Result::Incomplete; length += piece_size) {
+				result = parser.parse(data.data(), std::min(length, data.length()), request);
+			}
+			if (result != HttpRequestParser::Result::Complete) {
+				fprintf(stderr, "%s: failed to parse: %s\n", bench_case.name, parser.error());
+				exit(1);
+			}
+			checksum += request.header_count + request.uri.length();
+			parser.reset();
+		}
+		parsed += 1000;
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	printf("%-28s %5zu bytes  %12.0f req/s  %7.1f ns/req  %8.1f MB/s  (%zu)\n", bench_case.name, data.length(),
+		parsed / elapsed, elapsed * 1e9 / parsed, parsed * data.length() / elapsed / (1024 * 1024), checksum % 10);
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+
+	std::string minimal = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	std::string curl = "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+	std::string browser =
+		"GET /static/js/app.3f9c2b1e.js?v=20240101 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Windows\"\r\n"
+		"Accept: */*\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: script\r\n"
+		"Referer: https://www.example.com/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.1234567890.1700000000\r\n"
+		"If-None-Match: \"1a2b3c-4d5e-6f7a8b9c0d1e2f3a\"\r\n"
+		"If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+		"\r\n";
+
+	std::vector<BenchCase> cases = {
+		{ "minimal", minimal, 0 },
+		{ "curl", curl, 0 },
+		{ "browser", browser, 0 },
+		{ "browser, 64 byte reads", browser, 64 },
+		{ "browser, 8 byte reads", browser, 8 },
+	};
+
+#if defined(__AVX2__)
+	const char* scanner = "AVX2";
+#elif defined(__SSE2__) || defined(_M_X64)
+	const char* scanner = "SSE2";
+#else
+	const char* scanner = "scalar";
+#endif
+	printf("Scanner: %s, one thread\n", scanner);
+	for (const BenchCase& bench_case : cases) {
+		runCase(bench_case, seconds);
+	}
+	return 0;
+}
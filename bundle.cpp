@@ -0,0 +1,220 @@
+#include "bundle.h"
+#include <string.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "http_server.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+BundleStore bundle_store;
+
+uint64_t bundleHash(std::string_view data) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (char c : data) {
+		hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+Bundle::Bundle(const std::string& path) : data(nullptr), size(0), header(nullptr), entries(nullptr), slots(nullptr) {
+#ifdef __linux__
+	bundle_file = std::make_shared<OpenFile>(path.c_str());
+	if (!bundle_file->isOpen())
+		throw std::runtime_error("Failed to open the bundle");
+	if ((size_t)bundle_file->size() < sizeof(BundleHeader))
+		throw std::runtime_error("The bundle is truncated");
+
+	size = (size_t)bundle_file->size();
+	void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, bundle_file->descriptor(), 0);
+	if (mapping == MAP_FAILED)
+		throw std::runtime_error("mmap() failed: " + std::to_string(errno));
+	data = (const char*)mapping;
+
+	// Only the tables are read now, the responses are paged in as they are requested
+	try {
+		header = (const BundleHeader*)data;
+		if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0)
+			throw std::runtime_error("Not a bundle");
+		if (header->byte_order != BUNDLE_BYTE_ORDER || header->version != BUNDLE_VERSION)
+			throw std::runtime_error("The bundle was packed for another version or byte order");
+		if (header->file_size != size)
+			throw std::runtime_error("The bundle is truncated");
+
+		uint32_t slot_count = header->slot_count;
+		if (slot_count <= header->entry_count || (slot_count & (slot_count - 1)) != 0)
+			throw std::runtime_error("Invalid hash table size");
+		checkRange(header->entries_offset, (uint64_t)header->entry_count * sizeof(BundleEntry));
+		checkRange(header->slots_offset, (uint64_t)slot_count * sizeof(uint32_t));
+		if (header->entries_offset % alignof(BundleEntry) != 0 || header->slots_offset % alignof(uint32_t) != 0)
+			throw std::runtime_error("Misaligned tables");
+		entries = (const BundleEntry*)(data + header->entries_offset);
+		slots = (const uint32_t*)(data + header->slots_offset);
+
+		for (uint32_t i = 0; i < header->entry_count; i++) {
+			const BundleEntry& entry = entries[i];
+			checkRange(entry.path_offset, entry.path_length);
+			checkRange(entry.content_type_offset, entry.content_type_length);
+			if (entry.variants[0].response.length == 0)
+				throw std::runtime_error("Entry without an identity response");
+			for (const BundleVariant& variant : entry.variants) {
+				if (variant.response.length == 0)
+					continue;
+				checkResponse(variant.response, true);
+				checkResponse(variant.not_modified, false);
+				if ((uint64_t)variant.fields_offset + variant.fields_length > variant.response.head_length
+					|| (uint64_t)variant.etag_offset + variant.etag_length > variant.response.head_length)
+					throw std::runtime_error("Header fields outside of the head");
+			}
+		}
+
+		// Lookups stop at the first empty slot, so there has to be one
+		uint32_t used = 0;
+		for (uint32_t i = 0; i < slot_count; i++) {
+			if (slots[i] > header->entry_count)
+				throw std::runtime_error("Invalid hash table slot");
+			used += slots[i] != 0;
+		}
+		if (used >= slot_count)
+			throw std::runtime_error("The hash table is full");
+	}
+	catch (...) {
+		munmap(mapping, size);
+		throw;
+	}
+#else
+	(void)path;
+	throw std::runtime_error("Bundles are only supported on Linux");
+#endif
+}
+
+Bundle::~Bundle() {
+#ifdef __linux__
+	munmap((void*)data, size);
+#endif
+}
+
+void Bundle::checkRange(uint64_t offset, uint64_t length) const {
+	if (offset > size || length > size - offset)
+		throw std::runtime_error("Offset outside of the bundle");
+}
+
+void Bundle::checkResponse(const BundleResponse& response, bool needs_body) const {
+	static const size_t connection_length = strlen("Connection: keep-alive\r\n");
+	checkRange(response.offset, response.length);
+	if (response.head_length > response.length || (!needs_body && response.head_length != response.length)
+		|| (uint64_t)response.connection_offset + connection_length > response.head_length)
+		throw std::runtime_error("Invalid response");
+}
+
+const BundleEntry* Bundle::find(std::string_view path) const {
+	uint64_t hash = bundleHash(path);
+	uint32_t mask = header->slot_count - 1;
+	for (uint32_t slot = (uint32_t)hash & mask;; slot = (slot + 1) & mask) {
+		uint32_t index = slots[slot];
+		if (index == 0)
+			return nullptr;
+		const BundleEntry& entry = entries[index - 1];
+		if (entry.path_hash == hash && bytes(entry.path_offset, entry.path_length) == path)
+			return &entry;
+	}
+}
+
+BundleStore::~BundleStore() {
+	// The watcher blocks in read() for the lifetime of the process
+	if (watcher.joinable()) {
+		watcher.detach();
+	}
+}
+
+void BundleStore::start(const std::string& path) {
+	try {
+		latest = std::make_shared<const Bundle>(path);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Failed to load the bundle " << path << ": " << e.what() << std::endl;
+		exit(1);
+	}
+	this->path = path;
+	LOG(Info) << "Serving " << latest->entryCount() << " paths from the bundle " << path << ".";
+
+#ifdef __linux__
+	// New bundles are renamed over the old one, so we watch the directory for files moved to its name
+	char resolved[PATH_MAX];
+	if (realpath(path.c_str(), resolved) == NULL) {
+		std::cerr << "Failed to resolve the bundle path, new bundles are not picked up: " << errno << std::endl;
+		return;
+	}
+	std::string resolved_path = resolved;
+	size_t separator = resolved_path.find_last_of('/');
+	std::string directory = separator == 0 ? "/" : resolved_path.substr(0, separator);
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd == -1 || inotify_add_watch(watch_fd, directory.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR) == -1) {
+		std::cerr << "Failed to watch " << directory << ", new bundles are not picked up: " << errno << std::endl;
+		return;
+	}
+	watcher = std::thread(&BundleStore::watchChanges, this, directory + "/", resolved_path.substr(separator + 1));
+#endif
+}
+
+const std::shared_ptr<const Bundle>& BundleStore::current() {
+	// Swaps are rare, so threads only take the lock to pick up a new bundle
+	static thread_local std::shared_ptr<const Bundle> bundle;
+	static thread_local unsigned long long bundle_generation = ~0ULL;
+	unsigned long long current_generation = generation.load(std::memory_order_acquire);
+	if (current_generation != bundle_generation) {
+		std::lock_guard<std::mutex> lock(mutex);
+		bundle = latest;
+		bundle_generation = current_generation;
+	}
+	return bundle;
+}
+
+void BundleStore::watchChanges(std::string directory, std::string name) {
+#ifdef __linux__
+	alignas(struct inotify_event) char buffer[1024 * 4];
+	while (true) {
+		ssize_t length = read(watch_fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			if (length == -1 && errno == EINTR)
+				continue;
+			LOG(Warning) << "Reading inotify events failed, new bundles are not picked up: " << errno;
+			return;
+		}
+
+		bool changed = false;
+		for (char* position = buffer; position < buffer + length;) {
+			struct inotify_event* event = (struct inotify_event*)position;
+			position += sizeof(struct inotify_event) + event->len;
+			changed |= (event->mask & IN_Q_OVERFLOW) != 0 || (event->len > 0 && name == event->name);
+		}
+		if (!changed)
+			continue;
+
+		// A broken bundle is not swapped in, we keep serving the last good one
+		std::shared_ptr<const Bundle> bundle;
+		try {
+			bundle = std::make_shared<const Bundle>(directory + name);
+		}
+		catch (const std::exception& e) {
+			LOG(Error) << "Failed to load the new bundle " << directory << name << ": " << e.what();
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			latest = bundle;
+			generation.fetch_add(1, std::memory_order_release);
+		}
+		LOG(Info) << "Serving " << bundle->entryCount() << " paths from the new bundle " << directory << name << ".";
+	}
+#else
+	(void)directory;
+	(void)name;
+#endif
+}
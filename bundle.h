@@ -0,0 +1,125 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+class OpenFile;
+
+// Static content bundles: `tools/pack_bundle.cpp` packs a directory into a single file holding a hash table of the
+// request paths and the complete responses for every file (headers, body and compressed variants). The server maps
+// the bundle and answers requests straight from the mapping, so it needs no file system calls per request and no
+// cache to warm up.
+//
+// Layout, in the byte order of the machine which packed it, all offsets counted from the start of the file:
+// `BundleHeader`, `BundleEntry[entry_count]`, `uint32_t slots[slot_count]`, then the paths and responses.
+
+#define BUNDLE_MAGIC "SWBUNDLE"
+#define BUNDLE_VERSION 1
+#define BUNDLE_BYTE_ORDER 0x01020304 // Reads differently on a machine of the other byte order, which refuses the bundle
+
+struct BundleHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t entry_count;
+	uint32_t slot_count; // A power of two larger than `entry_count`
+	uint64_t entries_offset;
+	// Open addressing with linear probing by `bundleHash()`. A slot holds an entry's index + 1, or 0 if it is empty.
+	uint64_t slots_offset;
+	uint64_t file_size; // A truncated bundle is refused
+};
+
+// A response serialized for a persistent connection, like a `CachedFile`
+struct BundleResponse {
+	uint64_t offset; // Status line, headers and body
+	uint64_t length;
+	uint32_t head_length; // Length of the status line and headers, which is all a HEAD request gets
+	uint32_t connection_offset; // Where the `Connection: keep-alive` header starts, from `offset`
+};
+
+// One content encoding of a file. Offsets are counted from `response.offset`.
+struct BundleVariant {
+	BundleResponse response; // The `200 OK`, with a length of 0 if the file has no such variant
+	BundleResponse not_modified;
+	// The header lines describing the representation (validators, caching, encoding), which range responses repeat
+	uint32_t fields_offset;
+	uint32_t fields_length;
+	uint32_t etag_offset;
+	uint32_t etag_length;
+};
+
+struct BundleEntry {
+	uint64_t path_hash;
+	uint64_t path_offset;
+	uint32_t path_length; // The request path, e.g. `/css/site.css`, or `/docs/` and `/docs` for `/docs/index.html`
+	uint32_t content_type_length;
+	uint64_t content_type_offset;
+	int64_t modified; // Unix time of the last modification, for `If-Modified-Since`
+	BundleVariant variants[3]; // Indexed by `ContentEncoding`, the identity is always there
+};
+
+static_assert(sizeof(BundleHeader) == 48 && sizeof(BundleEntry) == 232, "The bundle layout must not depend on the compiler");
+
+// FNV-1a, which the hash table of a bundle is built with and the packer derives entity tags from
+uint64_t bundleHash(std::string_view data);
+
+// A mapped bundle. It is unmapped when the last response sending from it is done.
+class Bundle {
+	std::shared_ptr<OpenFile> bundle_file;
+	const char* data;
+	size_t size;
+	const BundleHeader* header;
+	const BundleEntry* entries;
+	const uint32_t* slots;
+
+	// Throws if `length` bytes at `offset` are not within the file
+	void checkRange(uint64_t offset, uint64_t length) const;
+	void checkResponse(const BundleResponse& response, bool needs_body) const;
+public:
+	// Maps the bundle at `path` and checks its tables, so a corrupt bundle can't make us read outside of it.
+	// Throws std::runtime_error if it can't be opened or is invalid.
+	explicit Bundle(const std::string& path);
+	~Bundle();
+	Bundle(const Bundle&) = delete;
+	Bundle& operator=(const Bundle&) = delete;
+
+	// The entry for a decoded request path, or null
+	const BundleEntry* find(std::string_view path) const;
+
+	std::string_view bytes(uint64_t offset, uint64_t length) const { return std::string_view(data + offset, (size_t)length); }
+	// The bundle as an open file, large bodies and ranges are sent from it with `sendfile`
+	const std::shared_ptr<OpenFile>& file() const { return bundle_file; }
+	size_t entryCount() const { return header->entry_count; }
+};
+
+// The bundle being served. A new bundle renamed over the file is mapped and replaces the current one atomically,
+// requests already being answered finish with the old one (Linux).
+class BundleStore {
+	std::string path;
+	std::mutex mutex;
+	std::shared_ptr<const Bundle> latest; // Guarded by `mutex`
+	std::atomic<unsigned long long> generation; // Incremented by every swap
+	int watch_fd;
+	std::thread watcher;
+
+	void watchChanges(std::string directory, std::string name);
+public:
+	BundleStore() : generation(0), watch_fd(-1) {}
+	~BundleStore();
+
+	// Maps the bundle at `path` and watches for a new one. Exits if it can't be loaded.
+	void start(const std::string& path);
+	// True if requests are served from a bundle instead of the serve root
+	bool enabled() const { return !path.empty(); }
+
+	// The current bundle. Every thread keeps the one it got until the next swap, so this takes no lock.
+	const std::shared_ptr<const Bundle>& current();
+
+	unsigned long long reloadCount() const { return generation.load(std::memory_order_relaxed); }
+};
+
+extern BundleStore bundle_store;
@@ -0,0 +1,257 @@
+#include "compression.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <memory_resource>
+
+#include "http_server.h"
+#include "logger.h"
+#include "path_resolver.h"
+#include "string_utils.h"
+
+#if ENABLE_GZIP
+#include <zlib.h>
+#ifdef _WIN32
+#pragma comment(lib, "zlib.lib")
+#endif
+#endif
+#if ENABLE_BROTLI
+#include <brotli/encode.h>
+#ifdef _WIN32
+#pragma comment(lib, "brotlienc.lib")
+#endif
+#endif
+
+CompressionCache compression_cache;
+
+// True for a `q=0` weight, which refuses the coding. Weights have at most three decimals, e.g. `q=0.000`.
+static bool isZeroWeight(std::string_view parameters) {
+	size_t weight = parameters.find("q=");
+	if (weight == std::string_view::npos)
+		return false;
+	std::string_view value = trimWhitespace(parameters.substr(weight + 2, parameters.find(';', weight) - weight - 2));
+	return !value.empty() && value[0] == '0' && value.find_first_not_of("0.") == std::string_view::npos;
+}
+
+unsigned parseAcceptEncoding(std::string_view header_value) {
+	unsigned accepted = 0;
+	forEachListElement(header_value, [&accepted](std::string_view entry) {
+		// Each entry looks like `gzip` or `br;q=0.8`
+		size_t parameters = entry.find(';');
+		std::string_view coding = trimWhitespace(entry.substr(0, parameters));
+		if (parameters != std::string_view::npos && isZeroWeight(entry.substr(parameters + 1)))
+			return false;
+
+#if ENABLE_GZIP
+		if (caseInsensitiveEquals(coding, "gzip") || caseInsensitiveEquals(coding, "x-gzip")) {
+			accepted |= 1u << (int)ContentEncoding::Gzip;
+		}
+#endif
+#if ENABLE_BROTLI
+		if (caseInsensitiveEquals(coding, "br")) {
+			accepted |= 1u << (int)ContentEncoding::Brotli;
+		}
+#endif
+		return false;
+	});
+	return accepted;
+}
+
+size_t preferredEncodings(unsigned accepted, ContentEncoding (&encodings)[COMPRESSED_ENCODINGS]) {
+	size_t count = 0;
+	for (ContentEncoding encoding : { ContentEncoding::Brotli, ContentEncoding::Gzip }) {
+		if (accepted & (1u << (int)encoding)) {
+			encodings[count++] = encoding;
+		}
+	}
+	return count;
+}
+
+const char* encodingName(ContentEncoding encoding) {
+	switch (encoding) {
+	case ContentEncoding::Gzip:
+		return "gzip";
+	case ContentEncoding::Brotli:
+		return "br";
+	default:
+		return "identity";
+	}
+}
+
+const char* encodingFileSuffix(ContentEncoding encoding) {
+	switch (encoding) {
+	case ContentEncoding::Gzip:
+		return ".gz";
+	case ContentEncoding::Brotli:
+		return ".br";
+	default:
+		return "";
+	}
+}
+
+bool isCompressible(std::string_view mime_type) {
+	static const char* compressible_types[] = {
+		"application/json",
+		"application/ld+json",
+		"application/xml",
+		"application/xhtml+xml",
+		"application/rtf",
+		"application/x-sh",
+		"application/x-csh",
+		"application/vnd.ms-fontobject",
+		"image/svg+xml",
+		"image/bmp",
+		"font/otf",
+		"font/ttf",
+	};
+
+	if (mime_type.compare(0, 5, "text/") == 0)
+		return true;
+	for (const char* type : compressible_types) {
+		if (mime_type == type)
+			return true;
+	}
+	return false;
+}
+
+std::string compress(const std::string& data, ContentEncoding encoding) {
+	std::string compressed;
+	switch (encoding) {
+#if ENABLE_GZIP
+	case ContentEncoding::Gzip: {
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		// 15 window bits plus 16 selects the gzip format instead of a raw zlib stream
+		if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("deflateInit2() failed");
+		compressed.resize(deflateBound(&stream, (uLong)data.size()));
+		stream.next_in = (Bytef*)data.data();
+		stream.avail_in = (uInt)data.size();
+		stream.next_out = (Bytef*)&compressed[0];
+		stream.avail_out = (uInt)compressed.size();
+		int result = deflate(&stream, Z_FINISH);
+		compressed.resize(stream.total_out);
+		deflateEnd(&stream);
+		if (result != Z_STREAM_END)
+			throw std::runtime_error("deflate() failed");
+		return compressed;
+	}
+#endif
+#if ENABLE_BROTLI
+	case ContentEncoding::Brotli: {
+		size_t compressed_size = BrotliEncoderMaxCompressedSize(data.size());
+		compressed.resize(compressed_size);
+		// Quality 11 is several times slower for a few percent, 9 is a good trade-off for a one-time cost
+		if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(), (const uint8_t*)data.data(),
+			&compressed_size, (uint8_t*)&compressed[0]))
+			throw std::runtime_error("BrotliEncoderCompress() failed");
+		compressed.resize(compressed_size);
+		return compressed;
+	}
+#endif
+	default:
+		throw std::runtime_error("Unsupported content encoding");
+	}
+}
+
+void CompressionCache::start(size_t budget, int threads) {
+	if (budget == 0)
+		return;
+	this->budget = budget;
+	// Files waiting for longer than this are simply sent uncompressed for a little longer, nothing expires
+	pool.reset(new ThreadPool(threads, 256, std::chrono::milliseconds(0)));
+}
+
+CompressionCache::State CompressionCache::find(const std::string& path, const struct stat& status, ContentEncoding encoding,
+	std::shared_ptr<const std::string>& body) {
+	if (!pool || status.st_size < COMPRESSION_MIN_FILE_SIZE || status.st_size > COMPRESSION_MAX_FILE_SIZE)
+		return State::Unavailable;
+
+#ifdef __linux__
+	long long modified = (long long)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#else
+	long long modified = (long long)status.st_mtime;
+#endif
+	// The key is built on the stack, a cached file is found without allocating
+	char identity[128];
+	int identity_length = snprintf(identity, sizeof(identity), "\n%llu:%llu:%lld:%lld:%s", (unsigned long long)status.st_dev,
+		(unsigned long long)status.st_ino, (long long)status.st_size, modified, encodingName(encoding));
+	char key_buffer[1024];
+	std::pmr::monotonic_buffer_resource key_memory(key_buffer, sizeof(key_buffer));
+	std::pmr::string key(&key_memory);
+	key.reserve(path.length() + identity_length);
+	key.append(path).append(identity, (size_t)identity_length);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto entry = entries.find(key);
+		if (entry != entries.end()) {
+			lru.splice(lru.begin(), lru, entry->second);
+			body = entry->second->second.body;
+			return body ? State::Ready : State::Unavailable;
+		}
+		if (!pending.insert(std::string(key)).second)
+			return State::Pending;
+	}
+
+	struct stat status_copy = status;
+	std::string owned_key(key);
+	bool queued = pool->submit([this, owned_key, path, status_copy, encoding]() {
+		compressFile(owned_key, path, status_copy, encoding);
+	});
+	if (!queued) {
+		// Too many files are waiting to be compressed, a later request will try again
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.erase(owned_key);
+	}
+	return State::Pending;
+}
+
+void CompressionCache::compressFile(const std::string& key, const std::string& path, const struct stat& status, ContentEncoding encoding) {
+	std::shared_ptr<const std::string> body;
+	try {
+		// Opened below the serve root like a file sent from disk
+		OpenFile file(path_resolver.openFile(path.c_str()));
+		std::string contents;
+		// A file which changed in the meantime is keyed differently now, so we just drop the work
+		if (file.size() == (long long)status.st_size && file.read(contents)) {
+			std::string compressed = compress(contents, encoding);
+			if (compressed.size() < contents.size()) {
+				body = std::make_shared<const std::string>(std::move(compressed));
+			}
+			insert(key, body);
+		}
+	}
+	catch (const std::exception& e) {
+		LOG(Warning) << "Failed to compress " << path << ": " << e.what();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.erase(key);
+}
+
+void CompressionCache::insert(const std::string& key, std::shared_ptr<const std::string> body) {
+	size_t entry_size = key.size() + (body ? body->size() : 0);
+	if (entry_size > budget)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	// The map's key views the list node, so a replaced entry goes first
+	auto existing = entries.find(key);
+	if (existing != entries.end()) {
+		LruList::iterator node = existing->second;
+		size -= node->first.size() + (node->second.body ? node->second.body->size() : 0);
+		entries.erase(existing);
+		lru.erase(node);
+	}
+	lru.emplace_front(key, Entry{ body });
+	entries[lru.front().first] = lru.begin();
+	size += entry_size;
+
+	while (size > budget) {
+		auto& last = lru.back();
+		size -= last.first.size() + (last.second.body ? last.second.body->size() : 0);
+		entries.erase(last.first);
+		lru.pop_back();
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/stat.h>
+
+#include "server_settings.h"
+#include "thread_pool.h"
+
+// Content codings we can send. Sets of them are passed around as bit masks of `1 << encoding`.
+enum class ContentEncoding {
+	Identity = 0,
+	Gzip = 1,
+	Brotli = 2
+};
+
+// Parses an `Accept-Encoding` header value into the mask of encodings the client accepts and this server
+// was built with. Encodings with `q=0` are refused.
+unsigned parseAcceptEncoding(std::string_view header_value);
+
+#define COMPRESSED_ENCODINGS 2 // Encodings other than identity
+
+// Fills `encodings` with the encodings from `accepted` to try, in order of preference (best compression first),
+// and returns how many there are
+size_t preferredEncodings(unsigned accepted, ContentEncoding (&encodings)[COMPRESSED_ENCODINGS]);
+
+// The `Content-Encoding` token, e.g. `gzip`
+const char* encodingName(ContentEncoding encoding);
+// The suffix of precompressed sibling files, e.g. `.gz`
+const char* encodingFileSuffix(ContentEncoding encoding);
+
+// True for mime types which compress well (text, JSON, SVG, ...), as opposed to already compressed images etc.
+bool isCompressible(std::string_view mime_type);
+
+// Compresses `data`. Throws std::runtime_error on failure.
+std::string compress(const std::string& data, ContentEncoding encoding);
+
+// Bounded LRU cache of compressed file contents, keyed by file identity (device, inode, size and
+// modification time) so a changed file never matches a stale entry.
+// Files are compressed on a background thread pool, so the first request for a file does not wait for it.
+class CompressionCache {
+public:
+	enum class State {
+		Ready, // The compressed contents are available
+		Pending, // The file is being compressed, it should be sent uncompressed for now
+		Unavailable // The file is not worth compressing (too small, too large, or it did not get smaller)
+	};
+private:
+	struct Entry {
+		std::shared_ptr<const std::string> body; // Null if compressing did not make the file smaller
+	};
+	typedef std::list<std::pair<std::string, Entry>> LruList;
+
+	std::mutex mutex;
+	LruList lru; // Most recently used first
+	std::unordered_map<std::string_view, LruList::iterator> entries; // Keyed by views of the keys in `lru`
+	std::unordered_set<std::string> pending; // Keys of the files which are being compressed
+	size_t size; // Bytes used by the compressed contents
+	size_t budget;
+	std::unique_ptr<ThreadPool> pool;
+
+	void compressFile(const std::string& key, const std::string& path, const struct stat& status, ContentEncoding encoding);
+	void insert(const std::string& key, std::shared_ptr<const std::string> body);
+public:
+	CompressionCache() : size(0), budget(0) {}
+
+	// Enables the cache with a budget of `budget` bytes (0 keeps it disabled), compressing on `threads` threads
+	void start(size_t budget, int threads);
+
+	// Looks up the compressed contents of the file at `path`, described by `status`.
+	// If they are not cached, compressing the file is started in the background and `Pending` is returned.
+	State find(const std::string& path, const struct stat& status, ContentEncoding encoding, std::shared_ptr<const std::string>& body);
+};
+
+extern CompressionCache compression_cache;
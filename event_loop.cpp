@@ -0,0 +1,676 @@
+#ifdef __linux__
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "server_settings.h"
+#include "http_server.h"
+#include "server_config.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "proxy.h"
+
+// What an epoll event's pointer points to: a client connection or an upstream connection
+struct Watched {
+	bool is_upstream;
+};
+
+struct Connection;
+
+// A connection to an upstream, which carries the proxied requests of one client connection at a time. Between them
+// it waits in the loop's pool of idle connections.
+struct UpstreamConnection : Watched {
+	SOCKET socket; // INVALID_SOCKET once closed, while events for it may still be pending
+	Upstream* target;
+	Connection* client; // Null while idle
+	bool readable;
+	bool writable;
+	bool connected; // The non-blocking connect completed
+	bool reused; // Taken from the pool, the upstream may have closed it in the meantime
+};
+
+// The timer runs at the connection's `http.deadline()`
+struct Connection : TimerWheel::Timer, Watched {
+	SOCKET socket;
+	HttpConnection http;
+	bool readable; // Edge-triggered: set when epoll reports input, cleared once recv() runs dry
+	bool sent_output; // `flush()` sent something, which may let the connection go on
+#if ENABLE_TLS
+	std::unique_ptr<TlsConnection> tls; // Set if the server speaks HTTPS
+#endif
+	std::unique_ptr<UpstreamConnection> upstream; // The upstream connection of the proxied request
+	// Response bodies move from the upstream socket through the pipe to the client socket without passing through
+	// our memory (splice). It is created for the first one.
+	int pipe[2];
+	size_t piped; // Bytes in the pipe
+	bool can_splice; // False if the pipe could not be created
+};
+
+// `recv()`, or the decrypted input of a TLS connection
+static ssize_t receiveFrom(Connection& connection, char* buffer, size_t length) {
+#if ENABLE_TLS
+	if (connection.tls)
+		return connection.tls->receive(buffer, length);
+#endif
+	return recv(connection.socket, buffer, length, 0);
+}
+
+static ssize_t sendBuffersTo(Connection& connection, const SendBuffer* buffers, size_t count, bool more) {
+#if ENABLE_TLS
+	if (connection.tls)
+		return connection.tls->sendBuffers(buffers, count, more);
+#endif
+	return sendBuffers(connection.socket, buffers, count, more);
+}
+
+static ssize_t sendFileTo(Connection& connection, int file, long long offset, size_t length) {
+#if ENABLE_TLS
+	if (connection.tls)
+		return connection.tls->sendFile(file, offset, length);
+#endif
+	return sendFile(connection.socket, file, offset, length);
+}
+
+class EventLoop {
+	Shard& shard;
+	int epoll_fd;
+	std::unordered_map<SOCKET, std::unique_ptr<Connection>> connections;
+	TimerWheel deadlines;
+	bool draining; // The listening socket was handed over, the loop ends once the connections are closed
+	// Idle upstream connections by upstream, the most recently used last. They stay registered with epoll, and are
+	// closed when the upstream closes them.
+	std::unordered_map<Upstream*, std::vector<std::unique_ptr<UpstreamConnection>>> idle_upstreams;
+	// Closed upstream connections, deleted after the events of the current round were handled
+	std::vector<std::unique_ptr<UpstreamConnection>> closed_upstreams;
+	// Closed client connections, deleted after the events of the current round were handled, since servicing an
+	// upstream connection may close its client while the client has an event of its own in the same round
+	std::vector<std::unique_ptr<Connection>> closed_connections;
+
+	void acceptClients();
+	// Completes the TLS handshake and transfers what it can
+	void service(Connection& connection);
+	// Reads and writes on the client socket and its upstream connection until they block or the connection is closed.
+	// Returns false if it was closed.
+	bool transfer(Connection& connection);
+	// Sends the proxied request to the upstream and receives its response, as far as the sockets and the
+	// connection's buffers allow. Attaches and releases upstream connections as requests start and end.
+	// Returns true if anything changed.
+	bool pumpUpstream(Connection& connection);
+	// Takes an idle connection to the wanted upstream from the pool or starts a new one. Returns false if
+	// connecting failed right away.
+	bool attachUpstream(Connection& connection);
+	// Puts the connection's upstream connection back into the pool if it can be reused, otherwise closes it
+	void releaseUpstream(Connection& connection);
+	// The upstream connection ended (`failed` if with an error). A reused connection is replaced by a new one if the
+	// request can still be sent again, as the upstream may have closed it while it was idle.
+	void endUpstream(Connection& connection, bool failed);
+	void closeUpstream(std::unique_ptr<UpstreamConnection> upstream);
+	// An event for an idle upstream connection, which is only ever the upstream closing it
+	void onIdleUpstreamEvent(UpstreamConnection& upstream);
+	// Whether response bodies can be spliced to the client, which needs a pipe and no encryption in user space
+	bool canSplice(Connection& connection);
+	// Sends as much pending output as the socket accepts. Returns false if the connection was closed.
+	bool flush(Connection& connection);
+	void closeConnection(Connection& connection);
+	// Called when the connection's deadline timer ran
+	void expire(Connection& connection);
+	// The connection's deadline, which is brought forward to the end of the drain
+	long long deadlineOf(Connection& connection) const;
+	// Stops accepting and lets every connection finish its request
+	void startDraining();
+public:
+	explicit EventLoop(Shard& shard);
+	void run();
+};
+
+EventLoop::EventLoop(Shard& shard) : shard(shard), deadlines(monotonicMilliseconds()), draining(false) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		std::cerr << "epoll_create1() failed: " << errno << std::endl;
+		exit(1);
+	}
+
+	if (!setNonBlocking(shard.server_socket)) {
+		std::cerr << "Failed to make the server socket non-blocking: " << errno << std::endl;
+		exit(1);
+	}
+
+	// Every shard has its own listening socket, so there is no thundering herd to avoid
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr; // A null pointer marks the listening socket
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard.server_socket, &event) == -1) {
+		std::cerr << "epoll_ctl() failed: " << errno << std::endl;
+		exit(1);
+	}
+	event.data.ptr = &shard; // The shard marks its wake-up eventfd
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard.wake_fd, &event) == -1) {
+		std::cerr << "epoll_ctl() failed: " << errno << std::endl;
+		exit(1);
+	}
+}
+
+void EventLoop::run() {
+	struct epoll_event events[256];
+
+	while (!draining || !connections.empty()) {
+		closed_upstreams.clear();
+		closed_connections.clear();
+		// We only wake up for deadlines when one is due, however many connections are open
+		long long timeout = deadlines.timeUntilNext(monotonicMilliseconds());
+		int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), (int)std::min(timeout, 60000LL));
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "epoll_wait() failed: " << errno << std::endl;
+			return;
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr == nullptr) {
+				if (!draining) {
+					acceptClients();
+				}
+				continue;
+			}
+			if (events[i].data.ptr == &shard) {
+				startDraining();
+				continue;
+			}
+
+			Watched* watched = (Watched*)events[i].data.ptr;
+			bool input = (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+			if (watched->is_upstream) {
+				UpstreamConnection* upstream = static_cast<UpstreamConnection*>(watched);
+				if (upstream->socket == INVALID_SOCKET)
+					continue;
+				upstream->readable |= input;
+				upstream->writable |= (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+				if (upstream->client == nullptr) {
+					onIdleUpstreamEvent(*upstream);
+				} else {
+					service(*upstream->client);
+				}
+				continue;
+			}
+
+			Connection* connection = static_cast<Connection*>(watched);
+			if (connection->socket == INVALID_SOCKET)
+				continue;
+			if (input) {
+				connection->readable = true;
+			}
+			service(*connection);
+		}
+
+		deadlines.advance(monotonicMilliseconds(), [this](TimerWheel::Timer* timer) {
+			expire(*static_cast<Connection*>(timer));
+		});
+	}
+	for (auto& entry : idle_upstreams) {
+		for (auto& upstream : entry.second) {
+			close(upstream->socket);
+		}
+	}
+	close(epoll_fd);
+}
+
+void EventLoop::acceptClients() {
+	// The listening socket is non-blocking, so we accept until the backlog is drained
+	while (true) {
+		SOCKET client_socket = acceptClientNonBlocking(shard.server_socket);
+		if (client_socket == INVALID_SOCKET)
+			return;
+
+		std::unique_ptr<Connection> connection(new Connection);
+		connection->is_upstream = false;
+		connection->socket = client_socket;
+		connection->readable = false;
+		connection->sent_output = false;
+		connection->pipe[0] = connection->pipe[1] = -1;
+		connection->piped = 0;
+		connection->can_splice = true;
+#if ENABLE_TLS
+		if (tls_context.enabled()) {
+			connection->tls.reset(new TlsConnection(client_socket));
+			connection->http.setSecure();
+		}
+#endif
+
+		// Edge-triggered: we are only notified about state changes, so every notification
+		// must be handled until the socket reports EAGAIN.
+		struct epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = static_cast<Watched*>(connection.get());
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+			LOG(Error) << "epoll_ctl() failed: " << errno;
+			endClient(client_socket);
+			continue;
+		}
+		// Proxied requests tell the upstream who the client is
+		if (logger.accessLogEnabled() || proxy_routes.enabled()) {
+			connection->http.setClientAddress(peerAddress(client_socket));
+		}
+
+		deadlines.schedule(*connection, deadlineOf(*connection));
+		connections[client_socket] = std::move(connection);
+		shard.accepted.fetch_add(1, std::memory_order_relaxed);
+		shard.active.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void EventLoop::service(Connection& connection) {
+#if ENABLE_TLS
+	// The handshake has to complete before there is any input, it is bounded by the deadline of the first request
+	if (connection.tls && !connection.tls->isEstablished()) {
+		int result = connection.tls->handshake();
+		if (result < 0) {
+			closeConnection(connection);
+			return;
+		}
+		if (result == 0) {
+			deadlines.schedule(connection, deadlineOf(connection));
+			return;
+		}
+		// The first request may have arrived together with the end of the handshake
+		connection.readable = true;
+	}
+#endif
+
+	if (transfer(connection)) {
+		// Moving the timer is cheap, so it simply follows every change of the deadline
+		deadlines.schedule(connection, deadlineOf(connection));
+	}
+}
+
+bool EventLoop::transfer(Connection& connection) {
+	char recv_buffer[1024 * 16];
+	while (true) {
+		while (connection.readable && connection.http.wantsInput()) {
+			long long receive_start = metrics.stageStart();
+			ssize_t bytes = receiveFrom(connection, recv_buffer, sizeof(recv_buffer));
+			if (bytes > 0) {
+				metrics.recordStage(Stage::Receive, receive_start);
+				connection.http.onReceive(recv_buffer, bytes);
+			} else if (bytes == 0) {
+				connection.readable = false;
+				connection.http.onReceiveEnd(false);
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				connection.readable = false;
+			} else if (errno != EINTR) {
+				closeConnection(connection);
+				return false;
+			}
+		}
+
+		bool upstream_progress = pumpUpstream(connection);
+		connection.sent_output = false;
+		if (!flush(connection))
+			return false;
+
+		// We stopped reading because the client had to read its responses first, or the upstream had to take more
+		// of the request body. With edge-triggered notifications nobody will tell us again about the pending input,
+		// so we continue now. The same goes for the upstream, which may have waited for the client.
+		if (!upstream_progress && !connection.sent_output && (!connection.readable || !connection.http.wantsInput()))
+			return true;
+	}
+}
+
+bool EventLoop::pumpUpstream(Connection& connection) {
+	HttpConnection& http = connection.http;
+	char buffer[1024 * 16];
+	bool progress = false;
+	while (true) {
+		if (http.upstreamFinished()) {
+			// Releasing it may start a pipelined request, which wants an upstream again
+			releaseUpstream(connection);
+			progress = true;
+			continue;
+		}
+		if (!connection.upstream) {
+			if (http.wantedUpstream() == nullptr)
+				return progress;
+			if (!attachUpstream(connection)) {
+				http.onUpstreamEnd(true);
+			}
+			progress = true;
+			continue;
+		}
+
+		UpstreamConnection& upstream = *connection.upstream;
+		if (!upstream.connected) {
+			if (!upstream.readable && !upstream.writable)
+				return progress;
+			int error = 0;
+			socklen_t length = sizeof(error);
+			if (getsockopt(upstream.socket, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+				error = errno;
+			}
+			progress = true;
+			if (error != 0) {
+				LOG(Warning) << "Failed to connect to upstream " << upstream.target->name() << ": " << strerror(error);
+				endUpstream(connection, true);
+				continue;
+			}
+			upstream.connected = true;
+			http.onUpstreamConnected();
+		}
+
+		bool moved = false;
+		bool ended = false;
+		bool failed = false;
+		while (upstream.writable) {
+			std::string_view pending = http.pendingUpstreamOutput();
+			if (pending.empty())
+				break;
+			ssize_t sent = send(upstream.socket, pending.data(), pending.length(), MSG_NOSIGNAL);
+			if (sent > 0) {
+				http.consumeUpstreamOutput((size_t)sent);
+				moved = true;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				upstream.writable = false;
+			} else if (errno != EINTR) {
+				LOG(Info) << "Failed to send to upstream " << upstream.target->name() << ": " << strerror(errno);
+				ended = failed = true;
+				break;
+			}
+		}
+
+		while (!ended && upstream.readable && http.wantsUpstreamInput()) {
+			long long splice_length = http.upstreamSpliceLength();
+			ssize_t received;
+			if (splice_length > 0 && canSplice(connection)) {
+				// A body of known length goes from socket to socket, as much as the pipe holds at a time
+				size_t room = PROXY_BUFFER_SIZE - connection.piped;
+				if (room == 0)
+					break;
+				received = splice(upstream.socket, nullptr, connection.pipe[1], nullptr, (size_t)std::min<long long>(splice_length, room),
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (received > 0) {
+					connection.piped += (size_t)received;
+					http.onUpstreamSpliced((size_t)received);
+					moved = true;
+					continue;
+				}
+				// A pipe holding data may be out of slots rather than the socket out of data, so the socket is
+				// tried again once the client took some
+				if (received == -1 && errno == EAGAIN && connection.piped > 0)
+					break;
+			} else {
+				received = recv(upstream.socket, buffer, sizeof(buffer), 0);
+				if (received > 0) {
+					http.onUpstreamReceive(buffer, (size_t)received);
+					moved = true;
+					continue;
+				}
+			}
+			if (received == 0) {
+				ended = true;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				upstream.readable = false;
+			} else if (errno != EINTR) {
+				LOG(Info) << "Failed to receive from upstream " << upstream.target->name() << ": " << strerror(errno);
+				ended = failed = true;
+			}
+		}
+
+		if (ended) {
+			endUpstream(connection, failed);
+			progress = true;
+			continue;
+		}
+		if (!moved)
+			return progress;
+		progress = true;
+	}
+}
+
+bool EventLoop::attachUpstream(Connection& connection) {
+	Upstream* target = connection.http.wantedUpstream();
+	std::vector<std::unique_ptr<UpstreamConnection>>& idle = idle_upstreams[target];
+	std::unique_ptr<UpstreamConnection> upstream;
+	if (!idle.empty()) {
+		upstream = std::move(idle.back());
+		idle.pop_back();
+		upstream->reused = true;
+		// An idle socket has room to send, if not, EPOLLOUT follows
+		upstream->writable = true;
+	} else {
+		SOCKET socket = connectNonBlocking(target->address(), target->addressLength());
+		if (socket == INVALID_SOCKET) {
+			LOG(Warning) << "Failed to connect to upstream " << target->name() << ": " << strerror(errno);
+			return false;
+		}
+		upstream.reset(new UpstreamConnection);
+		upstream->is_upstream = true;
+		upstream->socket = socket;
+		upstream->target = target;
+		upstream->readable = false;
+		upstream->writable = false;
+		upstream->connected = false;
+		upstream->reused = false;
+
+		struct epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = static_cast<Watched*>(upstream.get());
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1) {
+			LOG(Error) << "epoll_ctl() failed: " << errno;
+			close(socket);
+			return false;
+		}
+	}
+
+	metrics.countUpstreamConnection(upstream->reused);
+	upstream->client = &connection;
+	connection.upstream = std::move(upstream);
+	if (connection.upstream->connected) {
+		connection.http.onUpstreamConnected();
+	}
+	return true;
+}
+
+void EventLoop::releaseUpstream(Connection& connection) {
+	std::unique_ptr<UpstreamConnection> upstream = std::move(connection.upstream);
+	if (upstream) {
+		std::vector<std::unique_ptr<UpstreamConnection>>& idle = idle_upstreams[upstream->target];
+		bool reusable = connection.http.upstreamReusable() && idle.size() < PROXY_MAX_IDLE_CONNECTIONS;
+		if (reusable && upstream->readable) {
+			// Anything arriving now, even the end of the connection, means it can't take another request
+			char byte;
+			ssize_t peeked = recv(upstream->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+			reusable = peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+			upstream->readable = false;
+		}
+		if (reusable) {
+			upstream->client = nullptr;
+			idle.push_back(std::move(upstream));
+		} else {
+			closeUpstream(std::move(upstream));
+		}
+	}
+	connection.http.onUpstreamReleased();
+}
+
+void EventLoop::endUpstream(Connection& connection, bool failed) {
+	bool retry = connection.upstream->reused && connection.http.retryUpstream();
+	closeUpstream(std::move(connection.upstream));
+	if (retry) {
+		LOG(Debug) << "Idle upstream connection was closed, sending the request on another one.";
+	} else {
+		connection.http.onUpstreamEnd(failed);
+	}
+}
+
+void EventLoop::closeUpstream(std::unique_ptr<UpstreamConnection> upstream) {
+	// Closing the socket also removes it from the epoll interest list
+	close(upstream->socket);
+	upstream->socket = INVALID_SOCKET;
+	upstream->client = nullptr;
+	closed_upstreams.push_back(std::move(upstream));
+}
+
+void EventLoop::onIdleUpstreamEvent(UpstreamConnection& upstream) {
+	// Writability is of no interest while idle, input is the upstream closing the connection
+	if (!upstream.readable)
+		return;
+	std::vector<std::unique_ptr<UpstreamConnection>>& idle = idle_upstreams[upstream.target];
+	for (auto it = idle.begin(); it != idle.end(); ++it) {
+		if (it->get() == &upstream) {
+			std::unique_ptr<UpstreamConnection> closed = std::move(*it);
+			idle.erase(it);
+			closeUpstream(std::move(closed));
+			return;
+		}
+	}
+}
+
+bool EventLoop::canSplice(Connection& connection) {
+#if ENABLE_TLS
+	if (connection.tls && !connection.tls->kernelSends())
+		return false;
+#endif
+	if (connection.pipe[0] == -1 && connection.can_splice) {
+		if (pipe2(connection.pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+			LOG(Warning) << "pipe2() failed: " << errno;
+			connection.can_splice = false;
+			connection.pipe[0] = connection.pipe[1] = -1;
+		} else {
+			fcntl(connection.pipe[1], F_SETPIPE_SZ, PROXY_BUFFER_SIZE);
+		}
+	}
+	return connection.can_splice;
+}
+
+bool EventLoop::flush(Connection& connection) {
+	while (connection.http.hasPendingOutput()) {
+		long long send_start = metrics.stageStart();
+		ssize_t sent;
+		if (connection.http.pendingOutputIsFile()) {
+			// File bodies go from the page cache to the socket without passing through our memory
+			sent = sendFileTo(connection, connection.http.pendingFile(), connection.http.pendingFileOffset(),
+				connection.http.pendingFileLength());
+			if (sent == 0) {
+				// The file was truncated while we sent it, we can't deliver the announced length anymore
+				closeConnection(connection);
+				return false;
+			}
+		} else if (connection.http.pendingOutputIsPipe()) {
+			sent = splice(connection.pipe[0], nullptr, connection.socket, nullptr, connection.http.pendingFileLength(),
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (connection.http.pendingOutputContinues() ? SPLICE_F_MORE : 0));
+			if (sent > 0) {
+				connection.piped -= (size_t)sent;
+			}
+		} else {
+			// Everything in memory up to the next file goes out with one call, headers followed by a file body
+			// should share a packet with the start of the body
+			SendBuffer buffers[MAX_SEND_BUFFERS];
+			size_t count = connection.http.pendingBuffers(buffers, MAX_SEND_BUFFERS);
+			sent = sendBuffersTo(connection, buffers, count, connection.http.pendingOutputContinues());
+		}
+		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// The socket buffer is full, we will get an EPOLLOUT once it drains
+				return true;
+			}
+			if (errno == EINTR)
+				continue;
+
+			closeConnection(connection);
+			return false;
+		}
+		metrics.recordStage(Stage::Send, send_start);
+		connection.sent_output = true;
+		connection.http.consumeOutput(sent);
+	}
+
+	if (connection.http.isFinished()) {
+		closeConnection(connection);
+		return false;
+	}
+	return true;
+}
+
+void EventLoop::closeConnection(Connection& connection) {
+	SOCKET socket = connection.socket;
+	deadlines.cancel(connection);
+#if ENABLE_TLS
+	if (connection.tls) {
+		connection.tls->shutdown();
+	}
+#endif
+	if (connection.upstream) {
+		closeUpstream(std::move(connection.upstream));
+	}
+	if (connection.pipe[0] != -1) {
+		close(connection.pipe[0]);
+		close(connection.pipe[1]);
+	}
+	// Closing the socket also removes it from the epoll interest list
+	endClient(socket);
+	LOG(Debug) << "Client disconnected.";
+	connection.socket = INVALID_SOCKET;
+	auto entry = connections.find(socket);
+	closed_connections.push_back(std::move(entry->second));
+	connections.erase(entry);
+	shard.active.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventLoop::expire(Connection& connection) {
+	if (draining && monotonicMilliseconds() >= shard.drain_deadline) {
+		LOG(Debug) << "Connection closed at the end of the drain.";
+		closeConnection(connection);
+		return;
+	}
+	if (connection.http.hasPendingOutput()) {
+		// The client stopped reading, sending it the rest is hopeless
+		LOG(Debug) << "Client did not read its response in time.";
+		closeConnection(connection);
+		return;
+	}
+
+	// A started request is answered with a 400, an idle connection is just closed, and a proxied request whose
+	// upstream does not answer gets a 504
+	connection.http.onReceiveEnd(true);
+	if (transfer(connection)) {
+		deadlines.schedule(connection, deadlineOf(connection));
+	}
+}
+
+long long EventLoop::deadlineOf(Connection& connection) const {
+	long long deadline = connection.http.deadline();
+	return draining ? std::min(deadline, shard.drain_deadline) : deadline;
+}
+
+void EventLoop::startDraining() {
+	uint64_t signals;
+	if (read(shard.wake_fd, &signals, sizeof(signals)) != sizeof(signals) || draining
+		|| !shard.draining.load(std::memory_order_acquire))
+		return;
+	draining = true;
+
+	// The successor accepts from the same listening socket now
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, shard.server_socket, nullptr);
+
+	std::vector<Connection*> open;
+	for (auto& entry : connections) {
+		open.push_back(entry.second.get());
+	}
+	for (Connection* connection : open) {
+		connection->http.drain();
+		if (transfer(*connection)) {
+			deadlines.schedule(*connection, deadlineOf(*connection));
+		}
+	}
+}
+
+void runEventLoop(Shard& shard) {
+	EventLoop loop(shard);
+	loop.run();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,11 @@
+#pragma once
+#ifdef __linux__
+
+#include "shards.h"
+
+// Runs the edge-triggered epoll reactor of a shard on the calling thread and never returns.
+// Every shard owns its own epoll instance, listening socket and the connections it accepted, so
+// connection state is never shared between threads and a single thread can hold many idle connections.
+void runEventLoop(Shard& shard);
+
+#endif
\ No newline at end of file
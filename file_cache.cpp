@@ -0,0 +1,289 @@
+#include "file_cache.h"
+#include <sys/stat.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+
+#include "http_server.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+FileCache file_cache;
+
+FileCache::FileCache() : shard_budget(0), max_file_size(0), enabled(false), watch_fd(-1), hits(0), misses(0), evictions(0), invalidations(0) {
+	for (Shard& shard : shards) {
+		shard.size = 0;
+	}
+}
+
+FileCache::~FileCache() {
+	// The watcher blocks in read() for the lifetime of the process
+	if (watcher.joinable()) {
+		watcher.detach();
+	}
+}
+
+bool FileCache::start(size_t budget, size_t max_file_size, const std::string& root) {
+	if (budget == 0)
+		return false;
+
+#ifdef __linux__
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd == -1) {
+		std::cerr << "inotify_init1() failed, the file cache is disabled: " << errno << std::endl;
+		return false;
+	}
+
+	char resolved_root[PATH_MAX];
+	if (realpath(root.c_str(), resolved_root) == NULL) {
+		std::cerr << "Failed to resolve the serve root, the file cache is disabled: " << errno << std::endl;
+		close(watch_fd);
+		watch_fd = -1;
+		return false;
+	}
+
+	this->shard_budget = budget / FILE_CACHE_SHARDS;
+	this->max_file_size = max_file_size;
+	enabled = true;
+	watcher = std::thread(&FileCache::watchChanges, this, std::string(resolved_root));
+	return true;
+#else
+	// Without change notifications we could serve stale files forever
+	(void)max_file_size;
+	(void)root;
+	return false;
+#endif
+}
+
+size_t FileCache::entrySize(std::string_view key, const CachedFile& cached) {
+	return key.length() + cached.response.length() + cached.not_modified->response.length();
+}
+
+FileCache::Shard& FileCache::shardFor(std::string_view key) {
+	return shards[std::hash<std::string_view>()(key) % FILE_CACHE_SHARDS];
+}
+
+std::shared_ptr<const CachedFile> FileCache::find(std::string_view key) {
+	if (!enabled)
+		return nullptr;
+
+	Shard& shard = shardFor(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto entry = shard.entries.find(key);
+	if (entry == shard.entries.end()) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	hits.fetch_add(1, std::memory_order_relaxed);
+	shard.lru.splice(shard.lru.begin(), shard.lru, entry->second);
+	return entry->second->second;
+}
+
+std::shared_ptr<const CachedFile> FileCache::load(std::string_view key, std::string_view path, const OpenFile& file,
+	ResponseBuilder response, unsigned long long read_generation) {
+	if (!enabled || !file.isOpen() || (size_t)file.size() > max_file_size)
+		return nullptr;
+
+	std::shared_ptr<string> contents = std::make_shared<string>();
+	if (!file.read(*contents)) {
+		// The file changed size while we read it, the next request will try again
+		return nullptr;
+	}
+
+	return insert(key, path, response, contents, read_generation);
+}
+
+std::shared_ptr<const CachedFile> FileCache::store(std::string_view key, std::string_view path, ResponseBuilder response,
+	std::shared_ptr<const std::string> body, unsigned long long read_generation) {
+	if (!enabled)
+		return nullptr;
+	return insert(key, path, response, body, read_generation);
+}
+
+// Serializes `response` for a persistent connection
+static std::shared_ptr<CachedFile> serialize(std::string_view path, ResponseBuilder& response, size_t body_length) {
+	std::shared_ptr<CachedFile> cached = std::make_shared<CachedFile>();
+	cached->path = path;
+	cached->response = response.setKeepAlive(true).build();
+	cached->header_length = cached->response.length() - body_length;
+	cached->connection_offset = cached->response.find("Connection: keep-alive\r\n");
+	cached->etag = response.getHeader("ETag");
+	cached->modified = parseHttpDate(response.getHeader("Last-Modified"));
+	return cached;
+}
+
+std::shared_ptr<const CachedFile> FileCache::insert(std::string_view key, std::string_view path, ResponseBuilder& response,
+	std::shared_ptr<const std::string> body, unsigned long long read_generation) {
+	ResponseBuilder not_modified = response.notModified();
+	size_t body_length = body->length();
+	std::shared_ptr<CachedFile> cached = serialize(path, response.addBody(std::move(body)), body_length);
+	cached->not_modified = serialize(path, not_modified, 0);
+
+	size_t entry_size = entrySize(key, *cached);
+	if (entry_size > shard_budget)
+		return cached;
+
+	Shard& shard = shardFor(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	// The file may have changed since we read it
+	if (generation() != read_generation)
+		return cached;
+
+	auto existing = shard.entries.find(key);
+	if (existing != shard.entries.end()) {
+		// Another thread loaded the same file concurrently
+		shard.size -= entrySize(key, *existing->second->second);
+		LruList::iterator node = existing->second;
+		shard.entries.erase(existing);
+		shard.lru.erase(node);
+	}
+	shard.lru.emplace_front(std::string(key), cached);
+	shard.entries[shard.lru.front().first] = shard.lru.begin();
+	shard.size += entry_size;
+
+	while (shard.size > shard_budget) {
+		auto& last = shard.lru.back();
+		shard.size -= entrySize(last.first, *last.second);
+		shard.entries.erase(last.first);
+		shard.lru.pop_back();
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+	return cached;
+}
+
+void FileCache::invalidate(const std::string& path) {
+	invalidations.fetch_add(1, std::memory_order_acq_rel);
+
+	std::string directory_prefix = path + "/";
+	for (Shard& shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (auto entry = shard.lru.begin(); entry != shard.lru.end();) {
+			const std::string& cached_path = entry->second->path;
+			if (cached_path == path || cached_path.compare(0, directory_prefix.length(), directory_prefix) == 0) {
+				shard.size -= entrySize(entry->first, *entry->second);
+				shard.entries.erase(entry->first);
+				entry = shard.lru.erase(entry);
+			} else {
+				++entry;
+			}
+		}
+	}
+}
+
+void FileCache::clear() {
+	invalidations.fetch_add(1, std::memory_order_acq_rel);
+
+	for (Shard& shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.lru.clear();
+		shard.entries.clear();
+		shard.size = 0;
+	}
+}
+
+size_t FileCache::entryCount() {
+	size_t count = 0;
+	for (Shard& shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		count += shard.entries.size();
+	}
+	return count;
+}
+
+size_t FileCache::bytesUsed() {
+	size_t size = 0;
+	for (Shard& shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		size += shard.size;
+	}
+	return size;
+}
+
+#ifdef __linux__
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+	| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// inotify watches are not recursive, so every directory below the root gets its own watch
+static void watchTree(int watch_fd, const std::string& directory, std::unordered_map<int, std::string>& watched) {
+	int wd = inotify_add_watch(watch_fd, directory.c_str(), WATCH_MASK);
+	if (wd == -1) {
+		LOG(Warning) << "inotify_add_watch() failed for " << directory << ": " << errno;
+		return;
+	}
+	watched[wd] = directory;
+
+	DIR* dir = opendir(directory.c_str());
+	if (dir == NULL)
+		return;
+	std::vector<std::string> children;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			children.push_back(directory + "/" + entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	for (const std::string& child : children) {
+		watchTree(watch_fd, child, watched);
+	}
+}
+
+void FileCache::watchChanges(const std::string& root) {
+	std::unordered_map<int, std::string> watched;
+	watchTree(watch_fd, root, watched);
+
+	alignas(struct inotify_event) char buffer[1024 * 16];
+	while (true) {
+		ssize_t length = read(watch_fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			if (length == -1 && errno == EINTR)
+				continue;
+			LOG(Warning) << "Reading inotify events failed, the file cache is disabled: " << errno;
+			enabled = false;
+			clear();
+			return;
+		}
+
+		for (char* position = buffer; position < buffer + length;) {
+			struct inotify_event* event = (struct inotify_event*)position;
+			position += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// We missed events, so we can't tell which entries are stale
+				clear();
+				continue;
+			}
+
+			auto directory = watched.find(event->wd);
+			if (directory == watched.end())
+				continue;
+			if (event->mask & IN_IGNORED) {
+				watched.erase(directory);
+				continue;
+			}
+
+			std::string path = event->len > 0 ? directory->second + "/" + event->name : directory->second;
+			if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+				watchTree(watch_fd, path, watched);
+			}
+			invalidate(path);
+
+			// A precompressed sibling (`app.js.gz`) which appears or changes replaces responses made from the original
+			size_t suffix = path.rfind('.');
+			if (suffix != std::string::npos && (path.compare(suffix, std::string::npos, ".gz") == 0 || path.compare(suffix, std::string::npos, ".br") == 0)) {
+				invalidate(path.substr(0, suffix));
+			}
+		}
+	}
+}
+#else
+void FileCache::watchChanges(const std::string& root) {
+	(void)root;
+}
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <time.h>
+
+class OpenFile;
+class ResponseBuilder;
+
+#define FILE_CACHE_SHARDS 16 // Entries are spread over independently locked shards to reduce contention
+
+// A complete `200 OK` response for a small file, kept in memory so a cache hit is answered with a single send.
+// The response is serialized for a persistent connection, `connection_offset` allows swapping the header.
+struct CachedFile {
+	std::string path; // Resolved local path of the file
+	std::string response; // Status line, headers and body
+	size_t header_length; // Length of the status line and headers, which is all a HEAD request gets
+	size_t connection_offset; // Where the `Connection: keep-alive` header starts in `response`
+	std::string etag; // Validators to answer conditional requests with `not_modified`
+	time_t modified;
+	std::shared_ptr<const CachedFile> not_modified; // The `304 Not Modified` response, serialized the same way
+};
+
+// Concurrent LRU cache of small static files keyed by request path, with a memory budget.
+// Entries are invalidated when their file changes, which is watched with inotify (Linux).
+// Without a way to watch for changes the cache stays disabled.
+class FileCache {
+	typedef std::list<std::pair<std::string, std::shared_ptr<const CachedFile>>> LruList;
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		LruList lru; // Most recently used first
+		// Keyed by views of the keys in `lru`, so lookups need no copy of the key
+		std::unordered_map<std::string_view, LruList::iterator> entries;
+		size_t size; // Bytes used by the entries
+	};
+
+	Shard shards[FILE_CACHE_SHARDS];
+	size_t shard_budget;
+	size_t max_file_size;
+	std::atomic<bool> enabled;
+	int watch_fd;
+	std::thread watcher;
+
+	std::atomic<unsigned long long> hits;
+	std::atomic<unsigned long long> misses;
+	std::atomic<unsigned long long> evictions;
+	// Incremented by every invalidation, so a file read before its change is not inserted after it
+	std::atomic<unsigned long long> invalidations;
+
+	Shard& shardFor(std::string_view key);
+	static size_t entrySize(std::string_view key, const CachedFile& cached);
+	std::shared_ptr<const CachedFile> insert(std::string_view key, std::string_view path, ResponseBuilder& response,
+		std::shared_ptr<const std::string> body, unsigned long long read_generation);
+	// Drops the entries of `path`, and of all files below it if it is a directory
+	void invalidate(const std::string& path);
+	void clear();
+	void watchChanges(const std::string& root);
+public:
+	FileCache();
+	~FileCache();
+
+	// Enables the cache with a budget of `budget` bytes (0 keeps it disabled) and starts watching `root`
+	// for changes. Files larger than `max_file_size` are not cached. Returns false if the cache stays disabled.
+	bool start(size_t budget, size_t max_file_size, const std::string& root);
+
+	// Returns the cached response for the request path, or null
+	std::shared_ptr<const CachedFile> find(std::string_view key);
+
+	// Reads `file`, which was opened from `path`, and caches `response` (status and headers set by the caller) with
+	// the file as its body under the request key. Returns null if the cache is disabled or the file is too large or
+	// can't be read, in which case the caller should serve it from disk. `read_generation` is the `generation()` from
+	// before the caller looked at the file to make the headers.
+	std::shared_ptr<const CachedFile> load(std::string_view key, std::string_view path, const OpenFile& file,
+		ResponseBuilder response, unsigned long long read_generation);
+
+	// Caches `response` with `body`, which was made from the file at `path`, under the request key.
+	// `read_generation` is the `generation()` from before the file was read, to detect changes since then.
+	// Returns null if the cache is disabled.
+	std::shared_ptr<const CachedFile> store(std::string_view key, std::string_view path, ResponseBuilder response,
+		std::shared_ptr<const std::string> body, unsigned long long read_generation);
+
+	unsigned long long generation() const { return invalidations.load(std::memory_order_acquire); }
+	// True while changes are watched, so other data derived from the files can be cached until `generation()` changes
+	bool watching() const { return enabled.load(std::memory_order_acquire); }
+
+	unsigned long long hitCount() const { return hits.load(std::memory_order_relaxed); }
+	unsigned long long missCount() const { return misses.load(std::memory_order_relaxed); }
+	unsigned long long evictionCount() const { return evictions.load(std::memory_order_relaxed); }
+	// Number of entries and bytes used by them
+	size_t entryCount();
+	size_t bytesUsed();
+};
+
+extern FileCache file_cache;
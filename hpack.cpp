@@ -0,0 +1,505 @@
+#include "hpack.h"
+#include <algorithm>
+#include <unordered_map>
+
+struct StaticEntry {
+	std::string_view name;
+	std::string_view value;
+};
+
+// RFC 7541 appendix A
+static const StaticEntry static_table[HPACK_STATIC_ENTRIES] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+struct HuffmanCode {
+	uint32_t code;
+	uint8_t length;
+};
+
+// RFC 7541 appendix B, the last one is the end of string, which must not occur
+static const HuffmanCode huffman_codes[257] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+	{ 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+	{ 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+	{ 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+	{ 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 },
+	{ 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 },
+	{ 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 },
+	{ 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 },
+	{ 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 },
+	{ 0x25, 6 }, { 0x26, 6 }, { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 },
+	{ 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 },
+	{ 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 },
+	{ 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 },
+	{ 0x7fffe2, 23 }, { 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 },
+	{ 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 },
+	{ 0x7fffeb, 23 }, { 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 },
+	{ 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 },
+	{ 0x3fffe8, 22 }, { 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 },
+	{ 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 },
+	{ 0x7ffffe4, 27 }, { 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 },
+	{ 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 },
+	{ 0x7ffffe9, 27 }, { 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 }, { 0x3fffffff, 30 },
+};
+
+// Huffman codes are decoded four bits at a time by a state machine whose states are the inner nodes of the code tree.
+// No code is shorter than five bits, so a step emits at most one symbol.
+#define HUFFMAN_EMITS 1
+#define HUFFMAN_FAILS 2 // The end of string code was found
+#define HUFFMAN_ACCEPTS 4 // The bits since the last symbol are valid padding: fewer than eight ones
+
+struct HuffmanTransition {
+	uint8_t state;
+	uint8_t flags;
+	uint8_t symbol;
+};
+
+struct HuffmanDecoder {
+	// 257 symbols make a tree of 256 inner nodes
+	HuffmanTransition transitions[256][16];
+
+	HuffmanDecoder() {
+		// Inner nodes by index, the root is 0. A child is an inner node's index, or -1 - symbol for a leaf.
+		std::vector<int> children(2, 0);
+		for (int symbol = 0; symbol < 257; symbol++) {
+			const HuffmanCode& code = huffman_codes[symbol];
+			int node = 0;
+			for (int bit = code.length - 1; bit >= 0; bit--) {
+				size_t child = node * 2 + ((code.code >> bit) & 1);
+				if (bit == 0) {
+					children[child] = -1 - symbol;
+				} else {
+					if (children[child] == 0) {
+						// Resizing moves the children, so the slot is looked up again afterwards
+						int next = (int)children.size() / 2;
+						children.resize(children.size() + 2, 0);
+						children[child] = next;
+					}
+					node = children[child];
+				}
+			}
+		}
+
+		// Padding is a prefix of the end of string code, which is all ones
+		bool accepting[256] = {};
+		for (int node = 0, depth = 0; depth < 8; node = children[node * 2 + 1], depth++) {
+			accepting[node] = true;
+		}
+
+		for (int state = 0; state < 256; state++) {
+			for (int nibble = 0; nibble < 16; nibble++) {
+				HuffmanTransition transition = { 0, 0, 0 };
+				int node = state;
+				for (int bit = 3; bit >= 0; bit--) {
+					int child = children[node * 2 + ((nibble >> bit) & 1)];
+					if (child >= 0) {
+						node = child;
+						continue;
+					}
+					int symbol = -1 - child;
+					if (symbol == 256) {
+						transition.flags |= HUFFMAN_FAILS;
+						break;
+					}
+					transition.flags |= HUFFMAN_EMITS;
+					transition.symbol = (uint8_t)symbol;
+					node = 0;
+				}
+				transition.state = (uint8_t)node;
+				if (accepting[node]) {
+					transition.flags |= HUFFMAN_ACCEPTS;
+				}
+				transitions[state][nibble] = transition;
+			}
+		}
+	}
+};
+
+static const HuffmanDecoder huffman_decoder;
+
+bool hpackHuffmanDecode(const uint8_t* data, size_t length, std::string& out) {
+	uint8_t state = 0;
+	bool accepts = true;
+	for (size_t i = 0; i < length; i++) {
+		for (int nibble : { data[i] >> 4, data[i] & 0xf }) {
+			const HuffmanTransition& transition = huffman_decoder.transitions[state][nibble];
+			if (transition.flags & HUFFMAN_FAILS)
+				return false;
+			if (transition.flags & HUFFMAN_EMITS) {
+				out.push_back((char)transition.symbol);
+			}
+			state = transition.state;
+			accepts = (transition.flags & HUFFMAN_ACCEPTS) != 0;
+		}
+	}
+	return accepts;
+}
+
+static size_t huffmanLength(std::string_view value) {
+	size_t bits = 0;
+	for (char c : value) {
+		bits += huffman_codes[(unsigned char)c].length;
+	}
+	return (bits + 7) / 8;
+}
+
+void hpackHuffmanEncode(std::string_view value, std::string& out) {
+	// Only the lowest `bit_count` bits are pending, the ones above are shifted out eventually
+	uint64_t bits = 0;
+	int bit_count = 0;
+	for (char c : value) {
+		const HuffmanCode& code = huffman_codes[(unsigned char)c];
+		bits = (bits << code.length) | code.code;
+		bit_count += code.length;
+		while (bit_count >= 8) {
+			bit_count -= 8;
+			out.push_back((char)(bits >> bit_count));
+		}
+	}
+	if (bit_count > 0) {
+		// Padded with the start of the end of string code
+		out.push_back((char)((bits << (8 - bit_count)) | (0xff >> bit_count)));
+	}
+}
+
+void hpackEncodeInteger(uint64_t value, int prefix_bits, uint8_t first, std::string& out) {
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	if (value < max_prefix) {
+		out.push_back((char)(first | value));
+		return;
+	}
+	out.push_back((char)(first | max_prefix));
+	value -= max_prefix;
+	while (value >= 128) {
+		out.push_back((char)(value % 128 + 128));
+		value /= 128;
+	}
+	out.push_back((char)value);
+}
+
+// Reads an integer with a `prefix_bits` bit prefix, `data` must not be at the end. Returns false if it is truncated or
+// larger than anything we accept.
+static bool decodeInteger(const uint8_t*& data, const uint8_t* end, int prefix_bits, uint64_t& value) {
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	value = *data++ & max_prefix;
+	if (value < max_prefix)
+		return true;
+	for (int shift = 0; data < end && shift <= 28; shift += 7) {
+		uint8_t byte = *data++;
+		value += (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+void HpackDynamicTable::evict(size_t limit) {
+	while (size > limit) {
+		const Entry& oldest = entries.back();
+		size -= oldest.name.length() + oldest.value.length() + 32;
+		entries.pop_back();
+	}
+}
+
+void HpackDynamicTable::resize(size_t new_max_size) {
+	max_size = new_max_size;
+	evict(max_size);
+}
+
+void HpackDynamicTable::add(std::string_view name, std::string_view value, uint8_t static_index) {
+	size_t entry_size = name.length() + value.length() + 32;
+	if (entry_size > max_size) {
+		evict(0);
+		return;
+	}
+	// The field may be a copy of an entry which is evicted to make room
+	Entry entry{ std::string(name), std::string(value), static_index };
+	evict(max_size - entry_size);
+	entries.push_front(std::move(entry));
+	size += entry_size;
+}
+
+bool HpackDecoder::decodeString(const uint8_t*& data, const uint8_t* end, std::string& storage, Piece& piece) {
+	if (data == end)
+		return false;
+	bool huffman = (*data & 0x80) != 0;
+	uint64_t length;
+	if (!decodeInteger(data, end, 7, length) || length > (uint64_t)(end - data))
+		return false;
+	piece = Piece{ nullptr, storage.length(), 0 };
+	if (huffman) {
+		if (!hpackHuffmanDecode(data, (size_t)length, storage))
+			return false;
+	} else {
+		storage.append((const char*)data, (size_t)length);
+	}
+	data += length;
+	piece.length = storage.length() - piece.offset;
+	return true;
+}
+
+bool HpackDecoder::decode(std::string_view block, size_t max_length, std::string& storage, std::vector<HpackField>& fields) {
+	const uint8_t* data = (const uint8_t*)block.data();
+	const uint8_t* end = data + block.length();
+	pending.clear();
+
+	// Entries of the dynamic table are copied, adding a field may evict them before the block is decoded
+	auto lookup = [&](uint64_t index, Piece& name, Piece* value, uint8_t& static_index) {
+		if (index == 0 || index > HPACK_STATIC_ENTRIES + table.count())
+			return false;
+		if (index <= HPACK_STATIC_ENTRIES) {
+			const StaticEntry& entry = static_table[index - 1];
+			name = Piece{ entry.name.data(), 0, entry.name.length() };
+			if (value) {
+				*value = Piece{ entry.value.data(), 0, entry.value.length() };
+			}
+			static_index = (uint8_t)index;
+			return true;
+		}
+		size_t dynamic_index = (size_t)index - HPACK_STATIC_ENTRIES - 1;
+		name = Piece{ nullptr, storage.length(), table.name(dynamic_index).length() };
+		storage.append(table.name(dynamic_index));
+		if (value) {
+			*value = Piece{ nullptr, storage.length(), table.value(dynamic_index).length() };
+			storage.append(table.value(dynamic_index));
+		}
+		static_index = table.staticIndex(dynamic_index);
+		return true;
+	};
+	auto text = [&](const Piece& piece) {
+		return piece.data ? std::string_view(piece.data, piece.length) : std::string_view(storage).substr(piece.offset, piece.length);
+	};
+
+	while (data < end) {
+		if (storage.length() > max_length)
+			return false;
+		uint8_t first = *data;
+		PendingField field = {};
+		uint64_t index;
+		if (first & 0x80) {
+			// An indexed field
+			if (!decodeInteger(data, end, 7, index) || !lookup(index, field.name, &field.value, field.static_index))
+				return false;
+			pending.push_back(field);
+			continue;
+		}
+		if ((first & 0xe0) == 0x20) {
+			// A dynamic table size update, which may only start a block
+			if (!pending.empty() || !decodeInteger(data, end, 5, index) || index > max_table_size)
+				return false;
+			table.resize((size_t)index);
+			continue;
+		}
+
+		// A literal field with incremental indexing, without indexing or never indexed
+		bool indexing = (first & 0xc0) == 0x40;
+		if (!decodeInteger(data, end, indexing ? 6 : 4, index))
+			return false;
+		if (index == 0) {
+			if (!decodeString(data, end, storage, field.name))
+				return false;
+		} else if (!lookup(index, field.name, nullptr, field.static_index)) {
+			return false;
+		}
+		if (!decodeString(data, end, storage, field.value))
+			return false;
+		if (indexing) {
+			table.add(text(field.name), text(field.value), field.static_index);
+		}
+		pending.push_back(field);
+	}
+	if (storage.length() > max_length)
+		return false;
+
+	for (const PendingField& field : pending) {
+		fields.push_back(HpackField{ text(field.name), text(field.value), field.static_index });
+	}
+	return true;
+}
+
+void HpackEncoder::setPeerTableSize(size_t size) {
+	size_t new_size = std::min(size, (size_t)HPACK_DEFAULT_TABLE_SIZE);
+	if (new_size == table.maxSize())
+		return;
+	// The decoder has to see the smallest size we used, even if it grew again before the next block
+	smallest_size = size_changed ? std::min(smallest_size, new_size) : std::min(table.maxSize(), new_size);
+	table.resize(new_size);
+	size_changed = true;
+}
+
+void HpackEncoder::beginBlock(std::string& out) {
+	if (!size_changed)
+		return;
+	if (smallest_size < table.maxSize()) {
+		hpackEncodeInteger(smallest_size, 5, 0x20, out);
+	}
+	hpackEncodeInteger(table.maxSize(), 5, 0x20, out);
+	size_changed = false;
+}
+
+void HpackEncoder::encodeStatus(int status, std::string& out) {
+	size_t index;
+	switch (status) {
+	case 200: index = 8; break;
+	case 204: index = 9; break;
+	case 206: index = 10; break;
+	case 304: index = 11; break;
+	case 400: index = 12; break;
+	case 404: index = 13; break;
+	case 500: index = 14; break;
+	default: {
+		char digits[3] = { (char)('0' + status / 100 % 10), (char)('0' + status / 10 % 10), (char)('0' + status % 10) };
+		encodeField(":status", std::string_view(digits, 3), false, out);
+		return;
+	}
+	}
+	out.push_back((char)(0x80 | index));
+}
+
+void HpackEncoder::encodeString(std::string_view value, std::string& out) {
+	size_t huffman_length = huffmanLength(value);
+	if (huffman_length < value.length()) {
+		hpackEncodeInteger(huffman_length, 7, 0x80, out);
+		hpackHuffmanEncode(value, out);
+	} else {
+		hpackEncodeInteger(value.length(), 7, 0, out);
+		out.append(value);
+	}
+}
+
+size_t HpackEncoder::find(std::string_view name, std::string_view value, bool& value_matches) const {
+	// Entries with the same name are next to each other in the static table
+	static const std::unordered_map<std::string_view, size_t> static_names = []() {
+		std::unordered_map<std::string_view, size_t> names;
+		for (size_t i = HPACK_STATIC_ENTRIES; i > 0; i--) {
+			names[static_table[i - 1].name] = i;
+		}
+		return names;
+	}();
+
+	value_matches = false;
+	size_t name_index = 0;
+	auto found = static_names.find(name);
+	if (found != static_names.end()) {
+		name_index = found->second;
+		for (size_t i = name_index; i <= HPACK_STATIC_ENTRIES && static_table[i - 1].name == name; i++) {
+			if (static_table[i - 1].value == value) {
+				value_matches = true;
+				return i;
+			}
+		}
+	}
+	for (size_t i = 0; i < table.count(); i++) {
+		if (table.name(i) != name)
+			continue;
+		if (table.value(i) == value) {
+			value_matches = true;
+			return HPACK_STATIC_ENTRIES + 1 + i;
+		}
+		if (name_index == 0) {
+			name_index = HPACK_STATIC_ENTRIES + 1 + i;
+		}
+	}
+	return name_index;
+}
+
+void HpackEncoder::encodeField(std::string_view name, std::string_view value, bool indexed, std::string& out) {
+	bool value_matches;
+	size_t index = find(name, value, value_matches);
+	if (value_matches) {
+		hpackEncodeInteger(index, 7, 0x80, out);
+		return;
+	}
+
+	indexed = indexed && name.length() + value.length() + 32 <= table.maxSize();
+	hpackEncodeInteger(index, indexed ? 6 : 4, indexed ? 0x40 : 0, out);
+	if (index == 0) {
+		encodeString(name, out);
+	}
+	encodeString(value, out);
+	if (indexed) {
+		table.add(name, value, 0);
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// HPACK (RFC 7541), the header compression of HTTP/2. It only depends on the standard library, so the load
+// generator uses it too.
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096 // Size of the dynamic tables until SETTINGS_HEADER_TABLE_SIZE says otherwise
+#define HPACK_STATIC_ENTRIES 61
+
+// A decoded header field. The views point into the static table or into the storage given to `HpackDecoder::decode`.
+struct HpackField {
+	std::string_view name;
+	std::string_view value;
+	// The name's index in the static table, 0 if it was sent literally. Lets the server recognize the headers it acts
+	// on without looking at the name.
+	uint8_t static_index;
+};
+
+// The fields added to a header block's context, newest first. An entry costs its name and value and 32 bytes.
+class HpackDynamicTable {
+	struct Entry {
+		std::string name;
+		std::string value;
+		uint8_t static_index; // The static entry whose name the field was sent with, 0 if none
+	};
+	std::deque<Entry> entries;
+	size_t size;
+	size_t max_size;
+
+	void evict(size_t limit);
+public:
+	HpackDynamicTable() : size(0), max_size(HPACK_DEFAULT_TABLE_SIZE) {}
+
+	// Evicts the oldest entries until the table fits `new_max_size`
+	void resize(size_t new_max_size);
+	size_t maxSize() const { return max_size; }
+	// Evicts as much as needed to fit the field. A field larger than the table just empties it.
+	void add(std::string_view name, std::string_view value, uint8_t static_index);
+
+	size_t count() const { return entries.size(); }
+	// `index` counts from 0 for the newest entry
+	std::string_view name(size_t index) const { return entries[index].name; }
+	std::string_view value(size_t index) const { return entries[index].value; }
+	uint8_t staticIndex(size_t index) const { return entries[index].static_index; }
+};
+
+// Decodes the header blocks of one direction of a connection, which share the dynamic table
+class HpackDecoder {
+	// A decoded string: a view into the tables, or bytes in the storage, which may move while a block is decoded
+	struct Piece {
+		const char* data; // Null for bytes in the storage
+		size_t offset;
+		size_t length;
+	};
+	struct PendingField {
+		Piece name;
+		Piece value;
+		uint8_t static_index;
+	};
+
+	HpackDynamicTable table;
+	size_t max_table_size; // The largest table the encoder may ask for, the SETTINGS_HEADER_TABLE_SIZE we sent
+	std::vector<PendingField> pending;
+
+	// Appends `length` bytes at `data`, Huffman coded or not, to `storage`. Returns false if they are malformed.
+	static bool decodeString(const uint8_t*& data, const uint8_t* end, std::string& storage, Piece& piece);
+public:
+	HpackDecoder() : max_table_size(HPACK_DEFAULT_TABLE_SIZE) {}
+
+	// Decodes a complete header block and appends its fields to `fields`. Strings which are not in the static table
+	// are copied to `storage`, so the fields stay valid until it is changed. Returns false if the block is malformed
+	// or `storage` would grow beyond `max_length` (a few bytes can reference a large table entry many times), which
+	// is a connection error: the dynamic table can't be trusted anymore.
+	bool decode(std::string_view block, size_t max_length, std::string& storage, std::vector<HpackField>& fields);
+};
+
+// Encodes the header blocks of one direction of a connection. Fields which are likely to repeat are added to the
+// dynamic table, so every further response or request sends them as a single byte.
+class HpackEncoder {
+	HpackDynamicTable table;
+	bool size_changed; // The next block has to announce the new size
+	size_t smallest_size; // The smallest size since the last block, which has to be announced as well
+
+	void encodeString(std::string_view value, std::string& out);
+	// Index of the entry matching `name` and `value` or, if there is none, of one matching only the name (0 if none)
+	size_t find(std::string_view name, std::string_view value, bool& value_matches) const;
+public:
+	HpackEncoder() : size_changed(false), smallest_size(HPACK_DEFAULT_TABLE_SIZE) {}
+
+	// Called for the decoder's SETTINGS_HEADER_TABLE_SIZE. We never use more than the default.
+	void setPeerTableSize(size_t size);
+
+	// Starts a header block in `out`
+	void beginBlock(std::string& out);
+	// `:status`, the common ones are in the static table
+	void encodeStatus(int status, std::string& out);
+	// `name` has to be in lower case. `indexed` adds the field to the dynamic table, which is not worth it for values
+	// which change with every message (`content-length`, `etag`).
+	void encodeField(std::string_view name, std::string_view value, bool indexed, std::string& out);
+};
+
+// Appends the Huffman coded `value` (RFC 7541 appendix B), padded to a whole byte
+void hpackHuffmanEncode(std::string_view value, std::string& out);
+// Appends the decoded `data` to `out`. Returns false if it is not a valid Huffman string.
+bool hpackHuffmanDecode(const uint8_t* data, size_t length, std::string& out);
+
+// Appends the integer `value` with a `prefix_bits` bit prefix, the bits above it in `first` (RFC 7541 section 5.1)
+void hpackEncodeInteger(uint64_t value, int prefix_bits, uint8_t first, std::string& out);
@@ -0,0 +1,652 @@
+#include "http2.h"
+#include <string.h>
+#include <algorithm>
+
+#include "http_server.h"
+#include "server_config.h"
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define DEFAULT_WINDOW_SIZE 65535
+#define MAX_WINDOW_SIZE 0x7fffffffLL
+#define DEFAULT_MAX_FRAME_SIZE 16384 // Also the largest frame we accept, we don't raise it
+#define FRAME_HEADER_SIZE 9
+
+static uint32_t readUint32(const char* data) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static void writeUint32(char* data, uint32_t value) {
+	data[0] = (char)(value >> 24);
+	data[1] = (char)(value >> 16);
+	data[2] = (char)(value >> 8);
+	data[3] = (char)value;
+}
+
+// The headers we act on by their index in the HPACK static table, so a name sent as an index is not looked at
+static HeaderId staticHeaderId(uint8_t index) {
+	switch (index) {
+	case 16: return HeaderId::AcceptEncoding;
+	case 28: return HeaderId::ContentLength;
+	case 38: return HeaderId::Host;
+	case 40: return HeaderId::IfModifiedSince;
+	case 41: return HeaderId::IfNoneMatch;
+	case 42: return HeaderId::IfRange;
+	case 50: return HeaderId::Range;
+	case 51: return HeaderId::Referer;
+	case 57: return HeaderId::TransferEncoding;
+	case 58: return HeaderId::UserAgent;
+	default: return HeaderId::Other;
+	}
+}
+
+Http2Session::Http2Session(HttpConnection& connection, std::pmr::memory_resource* memory) : connection(connection), streams(memory),
+	last_stream_id(0), last_scheduled(0), send_window(DEFAULT_WINDOW_SIZE), initial_window(DEFAULT_WINDOW_SIZE),
+	max_frame_size(DEFAULT_MAX_FRAME_SIZE), unacknowledged_data(0), going_away(false), peer_going_away(false),
+	idle_since(monotonicMilliseconds()), continuation_stream(0), continuation_ends_stream(false), continuation_start(0),
+	current_stream(0), current_remote_open(false), http1_required(false), response_body(memory) {
+	char settings[12];
+	settings[0] = 0;
+	settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+	writeUint32(settings + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+	settings[6] = 0;
+	settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+	writeUint32(settings + 8, MAX_REQUEST_HEADERS_SIZE);
+	queueFrameHeader(sizeof(settings), Http2FrameType::Settings, 0, 0);
+	connection.queueOutput(std::string_view(settings, sizeof(settings)));
+}
+
+void Http2Session::processInput() {
+	string& input = connection.input;
+	// Like pipelined requests, frames wait while the client does not read its responses
+	while (!connection.closing && connection.output_length < MAX_PENDING_OUTPUT) {
+		size_t available = input.length() - connection.input_offset;
+		if (available < FRAME_HEADER_SIZE)
+			break;
+		const char* header = input.data() + connection.input_offset;
+		size_t length = (size_t)(uint8_t)header[0] << 16 | (size_t)(uint8_t)header[1] << 8 | (uint8_t)header[2];
+		if (length > DEFAULT_MAX_FRAME_SIZE) {
+			fail(Http2Error::FrameSizeError, "Frame larger than SETTINGS_MAX_FRAME_SIZE.");
+			break;
+		}
+		if (available < FRAME_HEADER_SIZE + length)
+			break;
+
+		// Requests point into the input, so the frame is only consumed once it was handled
+		handleFrame((Http2FrameType)header[3], (uint8_t)header[4], readUint32(header + 5) & 0x7fffffff,
+			std::string_view(header + FRAME_HEADER_SIZE, length));
+		connection.input_offset += FRAME_HEADER_SIZE + length;
+		connection.request_start = std::max(connection.last_receive, connection.last_send);
+	}
+	connection.dropProcessedInput();
+
+	if (connection.input_ended && !connection.closing && connection.input_offset < input.length()
+		&& connection.output_length < MAX_PENDING_OUTPUT) {
+		LOG(Info) << "HTTP/2 connection closed in the middle of a frame.";
+		connection.closing = true;
+	}
+	schedule();
+}
+
+void Http2Session::onReceiveEnd(bool timed_out) {
+	if (timed_out) {
+		if (!going_away) {
+			queueGoAway(Http2Error::NoError);
+		}
+		connection.closing = true;
+		return;
+	}
+	// The streams the client opened are still answered
+	connection.input_ended = true;
+	processInput();
+}
+
+void Http2Session::handleFrame(Http2FrameType type, uint8_t flags, uint32_t stream_id, std::string_view payload) {
+	if (continuation_stream != 0 && (type != Http2FrameType::Continuation || stream_id != continuation_stream)) {
+		fail(Http2Error::ProtocolError, "Header block interrupted by another frame.");
+		return;
+	}
+
+	switch (type) {
+	case Http2FrameType::Data: {
+		if (stream_id == 0 || stream_id > last_stream_id) {
+			fail(Http2Error::ProtocolError, "DATA on a stream which is not open.");
+			return;
+		}
+		// We serve nothing that needs a request body, it is dropped. The client may send more once we granted it again.
+		unacknowledged_data += (long long)payload.length();
+		if (unacknowledged_data >= DEFAULT_WINDOW_SIZE / 2) {
+			char increment[4];
+			writeUint32(increment, (uint32_t)unacknowledged_data);
+			queueFrameHeader(sizeof(increment), Http2FrameType::WindowUpdate, 0, 0);
+			connection.queueOutput(std::string_view(increment, sizeof(increment)));
+			unacknowledged_data = 0;
+		}
+		auto stream = streams.find(stream_id);
+		if ((flags & FLAG_END_STREAM) && stream != streams.end()) {
+			stream->second.remote_open = false;
+		}
+		return;
+	}
+	case Http2FrameType::Headers: {
+		if (stream_id == 0) {
+			fail(Http2Error::ProtocolError, "HEADERS on stream 0.");
+			return;
+		}
+		size_t padding = 0;
+		if (flags & FLAG_PADDED) {
+			if (payload.empty()) {
+				fail(Http2Error::FrameSizeError, "HEADERS too short for its padding.");
+				return;
+			}
+			padding = (uint8_t)payload[0];
+			payload.remove_prefix(1);
+		}
+		if (flags & FLAG_PRIORITY) {
+			// Priorities are deprecated (RFC 9113 section 5.3.2), streams simply take turns
+			if (payload.length() < 5) {
+				fail(Http2Error::FrameSizeError, "HEADERS too short for its priority.");
+				return;
+			}
+			payload.remove_prefix(5);
+		}
+		if (padding > payload.length()) {
+			fail(Http2Error::ProtocolError, "HEADERS padding exceeds the frame.");
+			return;
+		}
+		payload.remove_suffix(padding);
+
+		if (flags & FLAG_END_HEADERS) {
+			handleHeaderBlock(stream_id, payload, (flags & FLAG_END_STREAM) != 0);
+		} else {
+			continuation_stream = stream_id;
+			continuation_ends_stream = (flags & FLAG_END_STREAM) != 0;
+			continuation_start = connection.last_receive;
+			header_block.assign(payload);
+		}
+		return;
+	}
+	case Http2FrameType::Continuation:
+		if (continuation_stream == 0) {
+			fail(Http2Error::ProtocolError, "CONTINUATION without a header block.");
+			return;
+		}
+		if (header_block.length() + payload.length() > MAX_REQUEST_HEADERS_SIZE) {
+			fail(Http2Error::EnhanceYourCalm, "Header block too large.");
+			return;
+		}
+		header_block.append(payload);
+		if (flags & FLAG_END_HEADERS) {
+			continuation_stream = 0;
+			handleHeaderBlock(stream_id, header_block, continuation_ends_stream);
+		}
+		return;
+	case Http2FrameType::Priority:
+		return;
+	case Http2FrameType::RstStream:
+		if (stream_id == 0 || payload.length() != 4) {
+			fail(Http2Error::ProtocolError, "Invalid RST_STREAM.");
+			return;
+		}
+		// Frames of the stream which are queued already are sent anyway, the client ignores them
+		streams.erase(stream_id);
+		return;
+	case Http2FrameType::Settings:
+		handleSettings(flags, stream_id, payload);
+		return;
+	case Http2FrameType::PushPromise:
+		fail(Http2Error::ProtocolError, "Clients can't push.");
+		return;
+	case Http2FrameType::Ping:
+		if (stream_id != 0 || payload.length() != 8) {
+			fail(Http2Error::ProtocolError, "Invalid PING.");
+			return;
+		}
+		if (!(flags & FLAG_ACK)) {
+			queueFrameHeader(payload.length(), Http2FrameType::Ping, FLAG_ACK, 0);
+			connection.queueOutput(payload);
+		}
+		return;
+	case Http2FrameType::GoAway:
+		if (stream_id != 0 || payload.length() < 8) {
+			fail(Http2Error::ProtocolError, "Invalid GOAWAY.");
+			return;
+		}
+		peer_going_away = true;
+		return;
+	case Http2FrameType::WindowUpdate:
+		handleWindowUpdate(stream_id, payload);
+		return;
+	default:
+		// Unknown frame types are ignored (RFC 9113 section 4.1)
+		return;
+	}
+}
+
+void Http2Session::handleSettings(uint8_t flags, uint32_t stream_id, std::string_view payload) {
+	if (stream_id != 0) {
+		fail(Http2Error::ProtocolError, "SETTINGS on a stream.");
+		return;
+	}
+	if (flags & FLAG_ACK) {
+		if (!payload.empty()) {
+			fail(Http2Error::FrameSizeError, "SETTINGS acknowledgement with a payload.");
+		}
+		return;
+	}
+	if (payload.length() % 6 != 0) {
+		fail(Http2Error::FrameSizeError, "SETTINGS of invalid length.");
+		return;
+	}
+
+	for (size_t offset = 0; offset < payload.length(); offset += 6) {
+		unsigned identifier = (uint8_t)payload[offset] << 8 | (uint8_t)payload[offset + 1];
+		uint32_t value = readUint32(payload.data() + offset + 2);
+		switch (identifier) {
+		case SETTINGS_HEADER_TABLE_SIZE:
+			encoder.setPeerTableSize(value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1) {
+				fail(Http2Error::ProtocolError, "Invalid SETTINGS_ENABLE_PUSH.");
+				return;
+			}
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE: {
+			if (value > MAX_WINDOW_SIZE) {
+				fail(Http2Error::FlowControlError, "Invalid SETTINGS_INITIAL_WINDOW_SIZE.");
+				return;
+			}
+			// Open streams are adjusted by the difference, which may leave their window negative
+			long long difference = (long long)value - initial_window;
+			for (auto& stream : streams) {
+				stream.second.send_window += difference;
+			}
+			initial_window = value;
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < DEFAULT_MAX_FRAME_SIZE || value > 0xffffff) {
+				fail(Http2Error::ProtocolError, "Invalid SETTINGS_MAX_FRAME_SIZE.");
+				return;
+			}
+			max_frame_size = value;
+			break;
+		default:
+			break;
+		}
+	}
+	queueFrameHeader(0, Http2FrameType::Settings, FLAG_ACK, 0);
+}
+
+void Http2Session::handleWindowUpdate(uint32_t stream_id, std::string_view payload) {
+	if (payload.length() != 4) {
+		fail(Http2Error::FrameSizeError, "Invalid WINDOW_UPDATE.");
+		return;
+	}
+	long long increment = readUint32(payload.data()) & 0x7fffffff;
+	if (stream_id == 0) {
+		send_window += increment;
+		if (increment == 0 || send_window > MAX_WINDOW_SIZE) {
+			fail(increment == 0 ? Http2Error::ProtocolError : Http2Error::FlowControlError, "Invalid connection WINDOW_UPDATE.");
+		}
+		return;
+	}
+
+	auto stream = streams.find(stream_id);
+	if (stream == streams.end())
+		return;
+	stream->second.send_window += increment;
+	if (increment == 0 || stream->second.send_window > MAX_WINDOW_SIZE) {
+		queueRstStream(stream_id, increment == 0 ? Http2Error::ProtocolError : Http2Error::FlowControlError);
+		streams.erase(stream);
+	}
+}
+
+void Http2Session::handleHeaderBlock(uint32_t stream_id, std::string_view block, bool end_stream) {
+	// Every block has to be decoded, even of a stream we ignore, as it may change the dynamic table
+	field_storage.clear();
+	fields.clear();
+	if (!decoder.decode(block, MAX_REQUEST_HEADERS_SIZE, field_storage, fields)) {
+		fail(Http2Error::CompressionError, "Invalid header block.");
+		return;
+	}
+	if (stream_id % 2 == 0) {
+		fail(Http2Error::ProtocolError, "Clients open odd-numbered streams.");
+		return;
+	}
+	if (stream_id <= last_stream_id) {
+		// Trailers of a request, which we don't need
+		auto stream = streams.find(stream_id);
+		if (end_stream && stream != streams.end()) {
+			stream->second.remote_open = false;
+		}
+		return;
+	}
+	if (going_away)
+		return;
+	last_stream_id = stream_id;
+	if (streams.size() >= HTTP2_MAX_CONCURRENT_STREAMS) {
+		queueRstStream(stream_id, Http2Error::RefusedStream);
+		return;
+	}
+
+	// The request is built like a parsed HTTP/1 request, the pseudo-headers as its request line and `Host`
+	HttpRequest request;
+	request.header_count = 0;
+	bool malformed = false;
+	bool too_many_headers = false;
+	bool has_scheme = false;
+	bool has_authority = false;
+	bool regular_seen = false;
+	for (const HpackField& field : fields) {
+		if (!field.name.empty() && field.name[0] == ':') {
+			// Pseudo-headers come first, and only once
+			malformed |= regular_seen;
+			if (field.name == ":method" && request.method.empty()) {
+				request.method = field.value;
+			} else if (field.name == ":path" && request.uri.empty()) {
+				request.uri = field.value;
+			} else if (field.name == ":scheme" && !has_scheme) {
+				has_scheme = true;
+			} else if (field.name == ":authority" && !has_authority && request.header_count < MAX_REQUEST_HEADERS) {
+				has_authority = true;
+				request.headers[request.header_count++] = HttpHeader{ HeaderId::Host, "host", field.value };
+			} else {
+				malformed = true;
+			}
+			continue;
+		}
+		regular_seen = true;
+
+		HeaderId id = field.static_index != 0 ? staticHeaderId(field.static_index) : lookupHeader(field.name);
+		// Connection-specific headers have no meaning in HTTP/2, and names have to be in lower case
+		bool connection_specific = id == HeaderId::Connection || id == HeaderId::TransferEncoding || field.name == "keep-alive"
+			|| field.name == "proxy-connection" || field.name == "upgrade" || (field.name == "te" && field.value != "trailers");
+		if (connection_specific || std::any_of(field.name.begin(), field.name.end(), [](char c) { return c >= 'A' && c <= 'Z'; })) {
+			malformed = true;
+		} else if (request.header_count == MAX_REQUEST_HEADERS) {
+			too_many_headers = true;
+		} else {
+			request.headers[request.header_count++] = HttpHeader{ id, field.name, field.value };
+		}
+	}
+	if (malformed || request.method.empty() || request.uri.empty() || !has_scheme) {
+		LOG(Info) << "Malformed HTTP/2 request.";
+		queueRstStream(stream_id, Http2Error::ProtocolError);
+		return;
+	}
+	request.version = "HTTP/2.0";
+
+	current_stream = stream_id;
+	current_remote_open = !end_stream;
+	if (too_many_headers) {
+		connection.queueBadRequest("Too many headers.");
+		connection.logAccess(nullptr);
+	} else {
+		connection.handleRequest(request);
+		if (!http1_required) {
+			connection.logAccess(&request);
+		}
+	}
+	connection.arena.release();
+	finishResponse();
+}
+
+void Http2Session::finishResponse() {
+	uint32_t stream_id = current_stream;
+	current_stream = 0;
+	if (http1_required) {
+		http1_required = false;
+		queueRstStream(stream_id, Http2Error::Http11Required);
+		return;
+	}
+	if (response_headers.empty()) {
+		queueRstStream(stream_id, Http2Error::InternalError);
+		return;
+	}
+
+	// The header block is sent in frames no larger than the client accepts
+	bool has_body = !response_body.empty();
+	std::string_view block = response_headers;
+	Http2FrameType type = Http2FrameType::Headers;
+	do {
+		std::string_view fragment = block.substr(0, max_frame_size);
+		block.remove_prefix(fragment.length());
+		uint8_t flags = (block.empty() ? FLAG_END_HEADERS : 0) | (type == Http2FrameType::Headers && !has_body ? FLAG_END_STREAM : 0);
+		queueFrameHeader(fragment.length(), type, flags, stream_id);
+		connection.queueOutput(fragment);
+		type = Http2FrameType::Continuation;
+	} while (!block.empty());
+	response_headers.clear();
+
+	if (has_body) {
+		Stream& stream = streams[stream_id];
+		stream.body = std::move(response_body);
+		stream.next_piece = 0;
+		stream.send_window = initial_window;
+		stream.remote_open = current_remote_open;
+		response_body.clear();
+	} else {
+		if (current_remote_open) {
+			// The request body is of no use to us
+			queueRstStream(stream_id, Http2Error::NoError);
+		}
+		idle_since = monotonicMilliseconds();
+	}
+}
+
+void Http2Session::encodeHead(std::string_view head) {
+	// Every head starts with `HTTP/1.1 XXX`
+	int status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+	response_headers.clear();
+	encoder.beginBlock(response_headers);
+	encoder.encodeStatus(status, response_headers);
+
+	size_t line_start = head.find("\r\n") + 2;
+	while (true) {
+		size_t line_end = head.find("\r\n", line_start);
+		if (line_end == std::string_view::npos || line_end == line_start)
+			break;
+		std::string_view line = head.substr(line_start, line_end - line_start);
+		line_start = line_end + 2;
+
+		// Every line was added as `Name: value`
+		size_t colon = line.find(':');
+		std::string_view value = line.substr(colon + 2);
+		lower_name.assign(line.substr(0, colon));
+		std::transform(lower_name.begin(), lower_name.end(), lower_name.begin(), [](char c) {
+			return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+		});
+		if (lower_name == "connection" || lower_name == "keep-alive" || lower_name == "transfer-encoding")
+			continue;
+		// The other headers mostly repeat from response to response
+		bool indexed = lower_name != "content-length" && lower_name != "content-range" && lower_name != "etag"
+			&& lower_name != "last-modified" && lower_name != "date";
+		encoder.encodeField(lower_name, value, indexed, response_headers);
+	}
+}
+
+void Http2Session::addBody(BodyPiece piece) {
+	if (piece.length > 0) {
+		response_body.push_back(std::move(piece));
+	}
+}
+
+long long Http2Session::queueResponse(const ResponseBuilder& response) {
+	SendBuffer buffers[RESPONSE_HEAD_BUFFERS];
+	size_t count = response.headBuffers(buffers);
+	std::pmr::string head(&connection.arena);
+	for (size_t i = 0; i < count; i++) {
+		head.append(buffers[i].data, buffers[i].length);
+	}
+	encodeHead(head);
+
+	std::shared_ptr<const string> body = response.memoryBody();
+	if (body) {
+		addBody(BodyPiece{ *body, body, nullptr, 0, (long long)body->length() });
+	}
+	const std::shared_ptr<OpenFile>& file = response.fileBody();
+	if (file) {
+		for (const ResponseBuilder::FilePart& part : response.bodyFileParts()) {
+			if (!part.prefix.empty()) {
+				// Multipart headers live in the builder, so they are copied
+				std::shared_ptr<const string> prefix = std::make_shared<const string>(part.prefix);
+				addBody(BodyPiece{ *prefix, prefix, nullptr, 0, (long long)prefix->length() });
+			}
+			queueFileBody(file, part.offset, part.length);
+		}
+	}
+
+	long long body_length = 0;
+	for (const BodyPiece& piece : response_body) {
+		body_length += piece.length;
+	}
+	return body_length;
+}
+
+void Http2Session::queueSerialized(std::string_view response, const std::shared_ptr<const void>& owner) {
+	size_t head_length = response.find("\r\n\r\n") + 4;
+	encodeHead(response.substr(0, head_length));
+	std::string_view body = response.substr(head_length);
+	addBody(BodyPiece{ body, owner, nullptr, 0, (long long)body.length() });
+}
+
+void Http2Session::queueFileBody(const std::shared_ptr<OpenFile>& file, long long offset, long long length) {
+	addBody(BodyPiece{ std::string_view(), nullptr, file, offset, length });
+}
+
+void Http2Session::schedule() {
+	// Only a little is queued ahead of the socket, so the streams opened meanwhile get their turn soon
+	auto next = streams.upper_bound(last_scheduled);
+	size_t blocked = 0; // Streams passed over in a row because their window is closed
+	while (!connection.closing && connection.output_length < HTTP2_MAX_QUEUED_DATA && send_window > 0
+		&& blocked < streams.size()) {
+		if (next == streams.end()) {
+			next = streams.begin();
+		}
+		uint32_t stream_id = next->first;
+		Stream& stream = next->second;
+		if (stream.send_window <= 0) {
+			++next;
+			blocked++;
+			continue;
+		}
+		blocked = 0;
+
+		BodyPiece& piece = stream.body[stream.next_piece];
+		long long length = std::min({ piece.length, stream.send_window, send_window, (long long)max_frame_size });
+		bool last = length == piece.length && stream.next_piece + 1 == stream.body.size();
+		queueFrameHeader((size_t)length, Http2FrameType::Data, last ? FLAG_END_STREAM : 0, stream_id);
+		if (piece.file) {
+			connection.queueFile(piece.file, piece.offset, length);
+		} else {
+			connection.queueShared(piece.data.substr((size_t)piece.offset, (size_t)length), piece.owner);
+		}
+		piece.offset += length;
+		piece.length -= length;
+		stream.send_window -= length;
+		send_window -= length;
+		last_scheduled = stream_id;
+		if (piece.length == 0) {
+			stream.next_piece++;
+		}
+
+		if (last) {
+			if (stream.remote_open) {
+				queueRstStream(stream_id, Http2Error::NoError);
+			}
+			next = streams.erase(next);
+			idle_since = monotonicMilliseconds();
+		} else {
+			++next;
+		}
+	}
+
+	// Without the client sending anymore, blocked streams can't get their windows back. After our GOAWAY, the
+	// client may still be sending streams it opened before it read it: they are read and dropped until it closes,
+	// as closing with unread input would reset the connection and lose the responses it did not read yet.
+	if (!connection.closing && !connection.hasPendingOutput()
+		&& (streams.empty() ? peer_going_away || connection.input_ended : connection.input_ended)) {
+		connection.closing = true;
+	}
+}
+
+void Http2Session::goAway() {
+	if (going_away)
+		return;
+	queueGoAway(Http2Error::NoError);
+	going_away = true;
+	idle_since = monotonicMilliseconds();
+	schedule();
+}
+
+long long Http2Session::deadline() const {
+	long long deadline;
+	if (connection.hasPendingOutput() || !streams.empty()) {
+		// The client has to read its responses, and to grant us windows to send them
+		deadline = connection.last_send + server_config.send_timeout * 1000LL;
+	} else {
+		// Only responses renew an idle connection, not PINGs. After a GOAWAY, the client gets a short while to
+		// close the connection itself.
+		int timeout = connection.requests_served == 0 ? server_config.header_timeout : server_config.keep_alive_timeout;
+		if (going_away) {
+			timeout = std::min(server_config.header_timeout, server_config.keep_alive_timeout);
+		}
+		deadline = idle_since + timeout * 1000LL;
+	}
+
+	// A frame which started to arrive, and a header block, have to be completed like the headers of a request
+	if (!connection.isIdle()) {
+		deadline = std::min(deadline, connection.request_start + server_config.header_timeout * 1000LL);
+	}
+	if (continuation_stream != 0) {
+		deadline = std::min(deadline, continuation_start + server_config.header_timeout * 1000LL);
+	}
+	return deadline;
+}
+
+void Http2Session::queueFrameHeader(size_t length, Http2FrameType type, uint8_t flags, uint32_t stream_id) {
+	char header[FRAME_HEADER_SIZE];
+	header[0] = (char)(length >> 16);
+	header[1] = (char)(length >> 8);
+	header[2] = (char)length;
+	header[3] = (char)type;
+	header[4] = (char)flags;
+	writeUint32(header + 5, stream_id);
+	connection.queueOutput(std::string_view(header, sizeof(header)));
+}
+
+void Http2Session::queueRstStream(uint32_t stream_id, Http2Error error) {
+	char payload[4];
+	writeUint32(payload, (uint32_t)error);
+	queueFrameHeader(sizeof(payload), Http2FrameType::RstStream, 0, stream_id);
+	connection.queueOutput(std::string_view(payload, sizeof(payload)));
+}
+
+void Http2Session::queueGoAway(Http2Error error) {
+	char payload[8];
+	writeUint32(payload, last_stream_id);
+	writeUint32(payload + 4, (uint32_t)error);
+	queueFrameHeader(sizeof(payload), Http2FrameType::GoAway, 0, 0);
+	connection.queueOutput(std::string_view(payload, sizeof(payload)));
+}
+
+void Http2Session::fail(Http2Error error, const char* reason) {
+	LOG(Info) << "HTTP/2 connection error: " << reason;
+	queueGoAway(error);
+	going_away = true;
+	connection.closing = true;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpack.h"
+
+class HttpConnection;
+class OpenFile;
+class ResponseBuilder;
+
+// What a client with prior knowledge of HTTP/2 sends first instead of a request (h2c)
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+enum class Http2FrameType : uint8_t {
+	Data = 0x0,
+	Headers = 0x1,
+	Priority = 0x2,
+	RstStream = 0x3,
+	Settings = 0x4,
+	PushPromise = 0x5,
+	Ping = 0x6,
+	GoAway = 0x7,
+	WindowUpdate = 0x8,
+	Continuation = 0x9
+};
+
+enum class Http2Error : uint32_t {
+	NoError = 0x0,
+	ProtocolError = 0x1,
+	InternalError = 0x2,
+	FlowControlError = 0x3,
+	FrameSizeError = 0x6,
+	RefusedStream = 0x7,
+	CompressionError = 0x9,
+	EnhanceYourCalm = 0xb,
+	Http11Required = 0xd
+};
+
+// HTTP/2 (RFC 9113) on a connection which started with the preface.
+// The session parses the connection's input as frames, hands every request to `HttpConnection::handleRequest` like
+// an HTTP/1 request, and sends the response it queues as frames of the request's stream. Bodies are not copied:
+// a DATA frame is queued as its 9 byte header followed by a view of the body in memory or a range of the file, so
+// files go out with sendfile as over HTTP/1. Streams with a body to send take turns, one frame each, within the
+// flow control windows the client grants and only as fast as the client reads, so a large file does not hold up
+// the small ones requested after it.
+class Http2Session {
+	// A part of a response body: bytes in memory kept alive by `owner`, or a range of `file`
+	struct BodyPiece {
+		std::string_view data;
+		std::shared_ptr<const void> owner;
+		std::shared_ptr<OpenFile> file;
+		long long offset; // Of the unsent part, into `data` or the file
+		long long length; // Unsent bytes
+	};
+	struct Stream {
+		std::pmr::vector<BodyPiece> body;
+		size_t next_piece;
+		long long send_window;
+		bool remote_open; // The client did not end its request, it is told to stop once the response was sent
+	};
+
+	HttpConnection& connection;
+	HpackDecoder decoder;
+	HpackEncoder encoder;
+	std::pmr::map<uint32_t, Stream> streams; // Streams with body left to send, by id
+	uint32_t last_stream_id; // The newest stream the client opened
+	uint32_t last_scheduled; // The stream which got the last DATA frame, the next one after it goes next
+	long long send_window; // The connection's flow control window
+	long long initial_window; // The client's SETTINGS_INITIAL_WINDOW_SIZE, which new streams start with
+	uint32_t max_frame_size; // The client's SETTINGS_MAX_FRAME_SIZE
+	long long unacknowledged_data; // DATA the client sent which we did not grant it again with a WINDOW_UPDATE
+	bool going_away; // We sent a GOAWAY, streams the client opens after it are ignored
+	bool peer_going_away; // The client sent a GOAWAY, it opens no more streams
+	long long idle_since; // The last response or our GOAWAY was sent, for the keep-alive timeout
+
+	// A header block which continues in CONTINUATION frames
+	uint32_t continuation_stream; // 0 if none
+	bool continuation_ends_stream;
+	long long continuation_start;
+	std::string header_block;
+
+	std::string field_storage; // Decoded header fields which are not in the static table
+	std::vector<HpackField> fields;
+	std::string lower_name; // Response header names are lower case in HTTP/2
+
+	// The response to the request being handled, until it is queued as frames
+	uint32_t current_stream;
+	bool current_remote_open;
+	bool http1_required; // The request has to be sent again over HTTP/1.1, the stream is reset
+	std::string response_headers; // The encoded header block
+	std::pmr::vector<BodyPiece> response_body;
+
+	void handleFrame(Http2FrameType type, uint8_t flags, uint32_t stream_id, std::string_view payload);
+	void handleSettings(uint8_t flags, uint32_t stream_id, std::string_view payload);
+	void handleWindowUpdate(uint32_t stream_id, std::string_view payload);
+	// Decodes a complete header block and handles the request it opens
+	void handleHeaderBlock(uint32_t stream_id, std::string_view block, bool end_stream);
+	// Queues the response of `current_stream` as HEADERS, its body is left to `schedule()`
+	void finishResponse();
+	// Encodes the status line and headers of a serialized HTTP/1 response into `response_headers`. The headers
+	// of the HTTP/1 connection are left out.
+	void encodeHead(std::string_view head);
+	void addBody(BodyPiece piece);
+
+	void queueFrameHeader(size_t length, Http2FrameType type, uint8_t flags, uint32_t stream_id);
+	void queueRstStream(uint32_t stream_id, Http2Error error);
+	void queueGoAway(Http2Error error);
+	// A connection error: the client is told why, and the connection is closed
+	void fail(Http2Error error, const char* reason);
+public:
+	// Queues our SETTINGS, which have to be the first frame we send
+	Http2Session(HttpConnection& connection, std::pmr::memory_resource* memory);
+	Http2Session(const Http2Session&) = delete;
+	Http2Session& operator=(const Http2Session&) = delete;
+
+	// Handles the complete frames in the connection's input
+	void processInput();
+	// The client stopped sending. A timed out connection is closed, otherwise the open streams are finished.
+	void onReceiveEnd(bool timed_out);
+
+	// The response primitives of `HttpConnection` hand the response of the request being handled to these.
+	// Returns the length of the body.
+	long long queueResponse(const ResponseBuilder& response);
+	// A serialized HTTP/1 response, `owner` keeps it alive
+	void queueSerialized(std::string_view response, const std::shared_ptr<const void>& owner);
+	void queueFileBody(const std::shared_ptr<OpenFile>& file, long long offset, long long length);
+
+	// Queues DATA frames of the streams with body left, as long as the windows allow and little output is waiting
+	void schedule();
+	// Resets the stream of the request being handled with HTTP_1_1_REQUIRED instead of answering it, so the client
+	// sends it again over an HTTP/1.1 connection (requests passed to an upstream)
+	void requireHttp1() { http1_required = true; }
+	// Tells the client that we take no more streams after the last one it opened and closes the connection once
+	// their responses were sent
+	void goAway();
+
+	// See `HttpConnection::deadline()`
+	long long deadline() const;
+};
@@ -0,0 +1,263 @@
+#include "http_parser.h"
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned lowestSetBit(uint32_t mask) {
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned)index;
+}
+#else
+static inline unsigned lowestSetBit(uint32_t mask) {
+	return (unsigned)__builtin_ctz(mask);
+}
+#endif
+
+struct KnownHeader {
+	std::string_view name; // Lower case
+	HeaderId id;
+};
+
+static constexpr KnownHeader known_headers[] = {
+	{ "content-length", HeaderId::ContentLength },
+	{ "transfer-encoding", HeaderId::TransferEncoding },
+	{ "connection", HeaderId::Connection },
+	{ "host", HeaderId::Host },
+	{ "accept-encoding", HeaderId::AcceptEncoding },
+	{ "range", HeaderId::Range },
+	{ "if-range", HeaderId::IfRange },
+	{ "if-none-match", HeaderId::IfNoneMatch },
+	{ "if-modified-since", HeaderId::IfModifiedSince },
+	{ "referer", HeaderId::Referer },
+	{ "user-agent", HeaderId::UserAgent },
+};
+
+#define HEADER_TABLE_SIZE 16
+
+static constexpr char toLower(char c) {
+	return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+// Length, first and last character tell the known names apart, the multiplier was searched for
+static constexpr unsigned headerHash(std::string_view name) {
+	return (unsigned)(name.length() + (unsigned char)toLower(name[0]) + (unsigned char)toLower(name[name.length() - 1]) * 7) % HEADER_TABLE_SIZE;
+}
+
+struct HeaderTable {
+	KnownHeader slots[HEADER_TABLE_SIZE];
+};
+
+static constexpr HeaderTable buildHeaderTable() {
+	HeaderTable table = {};
+	for (const KnownHeader& header : known_headers) {
+		table.slots[headerHash(header.name)] = header;
+	}
+	return table;
+}
+
+static constexpr HeaderTable header_table = buildHeaderTable();
+
+static constexpr bool isPerfectHash() {
+	for (const KnownHeader& header : known_headers) {
+		if (header_table.slots[headerHash(header.name)].id != header.id)
+			return false;
+	}
+	return true;
+}
+static_assert(isPerfectHash(), "Two known headers share a slot, the hash needs another multiplier");
+
+HeaderId lookupHeader(std::string_view name) {
+	if (name.empty())
+		return HeaderId::Other;
+
+	const KnownHeader& candidate = header_table.slots[headerHash(name)];
+	if (candidate.name.length() != name.length())
+		return HeaderId::Other;
+	for (size_t i = 0; i < name.length(); i++) {
+		if (toLower(name[i]) != candidate.name[i])
+			return HeaderId::Other;
+	}
+	return candidate.id;
+}
+
+// Applies the masks of LFs, colons and CRs found in a block at `position` to the state of `scanLine`.
+// Returns true if the block contains the end of the line, which is then stored in `line_feed`.
+static inline bool scanMasks(const char* position, uint32_t line_feeds, uint32_t colons, uint32_t carriage_returns,
+	const char*& colon, const char*& carriage_return, const char*& line_feed) {
+	if (line_feeds != 0) {
+		// Only what comes before the end of the line belongs to it
+		uint32_t before_line_feed = (line_feeds & (0u - line_feeds)) - 1;
+		colons &= before_line_feed;
+		carriage_returns &= before_line_feed;
+	}
+	if (colons != 0 && colon == nullptr) {
+		colon = position + lowestSetBit(colons);
+	}
+	if (carriage_returns != 0 && carriage_return == nullptr) {
+		carriage_return = position + lowestSetBit(carriage_returns);
+	}
+	if (line_feeds == 0)
+		return false;
+	line_feed = position + lowestSetBit(line_feeds);
+	return true;
+}
+
+// Scans `[position, end)` for the LF ending a line and returns it, or `end` if there is none yet.
+// The first colon and CR before the LF are stored in `colon` and `carriage_return`, unless they were found before.
+// Most header lines are short, so after the 32 byte blocks of AVX2 the rest is scanned in 16 byte blocks.
+static const char* scanLine(const char* position, const char* end, const char*& colon, const char*& carriage_return) {
+	const char* line_feed;
+#ifdef __AVX2__
+	for (; end - position >= 32; position += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)position);
+		if (scanMasks(position,
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'))),
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(':'))),
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r'))),
+			colon, carriage_return, line_feed))
+			return line_feed;
+	}
+#endif
+#ifdef SCAN_SSE2
+	for (; end - position >= 16; position += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)position);
+		if (scanMasks(position,
+			(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))),
+			(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(':'))),
+			(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r'))),
+			colon, carriage_return, line_feed))
+			return line_feed;
+	}
+#endif
+
+	for (; position < end; position++) {
+		if (*position == '\n')
+			return position;
+		if (*position == ':' && colon == nullptr) {
+			colon = position;
+		} else if (*position == '\r' && carriage_return == nullptr) {
+			carriage_return = position;
+		}
+	}
+	return end;
+}
+
+static inline bool isWhitespace(char c) {
+	return c == ' ' || c == '\t';
+}
+
+void HttpRequestParser::reset() {
+	line_start = 0;
+	scan_offset = 0;
+	colon_offset = -1;
+	carriage_return_offset = -1;
+	has_request_line = false;
+	header_count = 0;
+	error_reason = nullptr;
+}
+
+HttpRequestParser::Result HttpRequestParser::parse(const char* data, size_t length, HttpRequest& request) {
+	while (true) {
+		const char* colon = colon_offset == -1 ? nullptr : data + colon_offset;
+		const char* carriage_return = carriage_return_offset == -1 ? nullptr : data + carriage_return_offset;
+		const char* line_feed = scanLine(data + scan_offset, data + length, colon, carriage_return);
+		if (line_feed == data + length) {
+			// Resume after the bytes we have seen once more arrived
+			scan_offset = (uint32_t)length;
+			colon_offset = colon == nullptr ? -1 : (int32_t)(colon - data);
+			carriage_return_offset = carriage_return == nullptr ? -1 : (int32_t)(carriage_return - data);
+			return Result::Incomplete;
+		}
+
+		// Lines end with CRLF. A lone CR or LF could make a proxy in front of us see different requests.
+		if (line_feed == data + line_start || carriage_return != line_feed - 1) {
+			error_reason = "Line not terminated by CRLF";
+			return Result::Invalid;
+		}
+		uint32_t line_length = (uint32_t)(carriage_return - data) - line_start;
+
+		if (!has_request_line) {
+			if (!parseRequestLine(data, line_length))
+				return Result::Invalid;
+			has_request_line = true;
+		} else if (line_length == 0) {
+			// The empty line ends the headers
+			line_start = (uint32_t)(line_feed + 1 - data);
+			request.method = std::string_view(data + method.offset, method.length);
+			request.uri = std::string_view(data + uri.offset, uri.length);
+			request.version = std::string_view(data + version.offset, version.length);
+			for (uint32_t i = 0; i < header_count; i++) {
+				const HeaderSpan& header = headers[i];
+				request.headers[i] = HttpHeader{ header.id, std::string_view(data + header.name.offset, header.name.length),
+					std::string_view(data + header.value.offset, header.value.length) };
+			}
+			request.header_count = header_count;
+			return Result::Complete;
+		} else if (!parseHeaderLine(data, line_length, colon)) {
+			return Result::Invalid;
+		}
+
+		line_start = (uint32_t)(line_feed + 1 - data);
+		scan_offset = line_start;
+		colon_offset = -1;
+		carriage_return_offset = -1;
+	}
+}
+
+bool HttpRequestParser::parseRequestLine(const char* data, uint32_t length) {
+	// `METHOD Request-URI HTTP-Version`
+	const char* line = data + line_start;
+	const char* method_end = (const char*)memchr(line, ' ', length);
+	const char* uri_end = method_end == nullptr ? nullptr : (const char*)memchr(method_end + 1, ' ', line + length - method_end - 1);
+	if (uri_end == nullptr || method_end == line || uri_end == method_end + 1 || uri_end + 1 == line + length
+		|| memchr(uri_end + 1, ' ', line + length - uri_end - 1) != nullptr) {
+		error_reason = "Malformed request line";
+		return false;
+	}
+
+	method = Span{ line_start, (uint32_t)(method_end - line) };
+	uri = Span{ (uint32_t)(method_end + 1 - data), (uint32_t)(uri_end - method_end - 1) };
+	version = Span{ (uint32_t)(uri_end + 1 - data), (uint32_t)(line + length - uri_end - 1) };
+	return true;
+}
+
+bool HttpRequestParser::parseHeaderLine(const char* data, uint32_t length, const char* colon) {
+	// `Name: value`, possibly with whitespace around the value
+	const char* line = data + line_start;
+	if (colon == nullptr) {
+		error_reason = "Missing ':' seperator in header line";
+		return false;
+	}
+	// Continuation lines were deprecated, and whitespace before the colon must be rejected (RFC 7230, 3.2.4)
+	if (isWhitespace(line[0]) || colon == line || isWhitespace(colon[-1])) {
+		error_reason = "Malformed header line";
+		return false;
+	}
+	if (header_count == MAX_REQUEST_HEADERS) {
+		error_reason = "Too many headers";
+		return false;
+	}
+
+	const char* value = colon + 1;
+	const char* value_end = line + length;
+	while (value < value_end && isWhitespace(*value)) {
+		value++;
+	}
+	while (value_end > value && isWhitespace(value_end[-1])) {
+		value_end--;
+	}
+
+	std::string_view name(line, colon - line);
+	headers[header_count++] = HeaderSpan{ lookupHeader(name), Span{ line_start, (uint32_t)name.length() },
+		Span{ (uint32_t)(value - data), (uint32_t)(value_end - value) } };
+	return true;
+}
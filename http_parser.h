@@ -0,0 +1,95 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "server_settings.h"
+
+// The headers the server acts on. They are recognized while parsing, so the request handler can switch on them
+// instead of comparing every header name against every name it knows.
+enum class HeaderId : uint8_t {
+	Other,
+	ContentLength,
+	TransferEncoding,
+	Connection,
+	Host,
+	AcceptEncoding,
+	Range,
+	IfRange,
+	IfNoneMatch,
+	IfModifiedSince,
+	Referer,
+	UserAgent
+};
+
+// Identifies a header name case-insensitively, with a perfect hash over the known names
+HeaderId lookupHeader(std::string_view name);
+
+struct HttpHeader {
+	HeaderId id;
+	std::string_view name;
+	std::string_view value; // Without the surrounding whitespace
+};
+
+// A parsed request. The views point into the buffer given to `HttpRequestParser::parse`,
+// so they are only valid as long as that buffer is not modified. It is meant to live on the stack.
+struct HttpRequest {
+	std::string_view method;
+	std::string_view uri;
+	std::string_view version;
+	HttpHeader headers[MAX_REQUEST_HEADERS];
+	size_t header_count;
+};
+
+// Incremental parser for the request line and headers of an HTTP/1.x request, which never allocates.
+// It is fed the same, growing buffer after every receive and resumes where it stopped, so every byte is only scanned
+// once however the request is split up. Lines are scanned 16 or 32 bytes at a time with SSE2/AVX2 where available.
+class HttpRequestParser {
+public:
+	enum class Result {
+		Complete, // The request was filled in, `length()` tells where it ends
+		Incomplete, // The end of the headers was not received yet
+		Invalid // The request is malformed, `error()` says why
+	};
+private:
+	// Parts of the request are kept as offsets while parsing, the buffer may move between calls
+	struct Span {
+		uint32_t offset;
+		uint32_t length;
+	};
+	struct HeaderSpan {
+		HeaderId id;
+		Span name;
+		Span value;
+	};
+
+	uint32_t line_start; // Start of the line being parsed
+	uint32_t scan_offset; // Where to resume scanning for the end of the line
+	int32_t colon_offset; // The first colon in the line scanned so far, -1 if there is none
+	int32_t carriage_return_offset; // The first CR in the line scanned so far, -1 if there is none
+	bool has_request_line;
+	Span method;
+	Span uri;
+	Span version;
+	HeaderSpan headers[MAX_REQUEST_HEADERS];
+	uint32_t header_count;
+	const char* error_reason;
+
+	bool parseRequestLine(const char* data, uint32_t length);
+	bool parseHeaderLine(const char* data, uint32_t length, const char* colon);
+public:
+	HttpRequestParser() { reset(); }
+
+	// Parses the request starting at `data` and fills `request` once it is complete. Until then every call has to
+	// pass the same request with at least as many bytes as before, but the buffer holding it may have moved.
+	Result parse(const char* data, size_t length, HttpRequest& request);
+
+	// Bytes of the request line and headers after `Complete`, including the empty line ending them
+	size_t length() const { return line_start; }
+	const char* error() const { return error_reason; }
+	// True once part of a request was seen
+	bool started() const { return scan_offset > 0; }
+
+	// Prepares for parsing the next request
+	void reset();
+};
@@ -1,41 +1,172 @@
 #include "http_server.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <random>
+
+#include "server_config.h"
+#include "compression.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define closeFile _close
+#else
+#include <errno.h>
+#include <unistd.h>
+#define closeFile close
+#endif
+
+#ifdef _WIN32
+OpenFile::OpenFile(const char* path) : OpenFile(_open(path, _O_RDONLY | _O_BINARY)) {}
+#else
+OpenFile::OpenFile(const char* path) : OpenFile(open(path, O_RDONLY | O_CLOEXEC)) {}
+#endif
+
+OpenFile::OpenFile(int descriptor) : fd(descriptor), file_size(0) {
+#ifdef _WIN32
+	struct _stati64 file_status;
+	bool regular = fd != -1 && _fstati64(fd, &file_status) == 0 && (file_status.st_mode & _S_IFREG) != 0;
+#else
+	struct stat file_status;
+	bool regular = fd != -1 && fstat(fd, &file_status) == 0 && S_ISREG(file_status.st_mode);
+#endif
+	if (!regular) {
+		// Directories and the like can be opened too, but they are nothing we can serve
+		if (fd != -1) {
+			closeFile(fd);
+		}
+		fd = -1;
+		return;
+	}
+	file_size = (long long)file_status.st_size;
+}
+
+bool OpenFile::read(string& contents) const {
+	if (fd == -1)
+		return false;
+	contents.resize((size_t)file_size);
+	size_t done = 0;
+	char end;
+#ifdef _WIN32
+	if (_lseeki64(fd, 0, SEEK_SET) != 0)
+		return false;
+	while (done < contents.size()) {
+		int length = _read(fd, &contents[done], (unsigned)std::min(contents.size() - done, (size_t)INT_MAX));
+		if (length <= 0)
+			return false;
+		done += (size_t)length;
+	}
+	// A file which grew in the meantime is read again later
+	return _read(fd, &end, 1) == 0;
+#else
+	// The descriptor may be shared by responses sending it, so the file offset is left alone
+	while (done < contents.size()) {
+		ssize_t length = pread(fd, &contents[done], contents.size() - done, (off_t)done);
+		if (length == -1 && errno == EINTR)
+			continue;
+		if (length <= 0)
+			return false;
+		done += (size_t)length;
+	}
+	// A file which grew in the meantime is read again later
+	return pread(fd, &end, 1, (off_t)done) == 0;
+#endif
+}
+
+OpenFile::~OpenFile() {
+	if (fd != -1) {
+		closeFile(fd);
+	}
+}
+
+// Lines of the response head which don't depend on the response, so they are sent from static storage
+static const std::string_view SERVER_LINE = "Server: " SERVER_HEADER "\r\n";
+static const std::string_view EMPTY_BODY_LINE = "Content-Length: 0\r\n";
+static const std::string_view KEEP_ALIVE_END = "Connection: keep-alive\r\n\r\n";
+static const std::string_view CLOSE_END = "Connection: close\r\n\r\n";
 
 ResponseBuilder& ResponseBuilder::setStatusCode(StatusCode code) {
 	statusCode = code;
 	return *this;
 }
 
-ResponseBuilder& ResponseBuilder::addHeader(const string& name, const string& value) {
-	headers.push_back(make_pair(name, value));
+ResponseBuilder& ResponseBuilder::addHeader(std::string_view name, std::string_view value) {
+	headerLines.append(name).append(": ").append(value).append("\r\n");
+	return *this;
+}
+
+ResponseBuilder& ResponseBuilder::addHeader(std::string_view name, long long value) {
+	char digits[24];
+	std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+	return addHeader(name, std::string_view(digits, result.ptr - digits));
+}
+
+ResponseBuilder& ResponseBuilder::addHeaderLines(std::string_view lines) {
+	headerLines.append(lines);
 	return *this;
 }
 
-ResponseBuilder& ResponseBuilder::addBody(const string& contents) {
+bool ResponseBuilder::hasHeader(std::string_view name) const {
+	return getHeader(name).data() != nullptr;
+}
+
+std::string_view ResponseBuilder::getHeader(std::string_view name) const {
+	std::string_view lines = headerLines;
+	while (!lines.empty()) {
+		size_t line_end = lines.find("\r\n");
+		std::string_view line = lines.substr(0, line_end);
+		lines.remove_prefix(line_end + 2);
+
+		// Every line was added as `name: value`
+		size_t colon = line.find(':');
+		if (caseInsensitiveEquals(line.substr(0, colon), name))
+			return line.substr(colon + 2);
+	}
+	return std::string_view();
+}
+
+ResponseBuilder& ResponseBuilder::addBody(std::shared_ptr<const string> contents) {
 	if (hasBody) {
 		throw std::runtime_error("Response already has body");
 	}
 
 	hasBody = true;
-	body = contents;
-	addHeader("Content-Length", std::to_string(contents.length()));
+	hasContentLength = true;
+	addHeader("Content-Length", (long long)contents->length());
+	body = std::move(contents);
 	return *this;
 }
 
-ResponseBuilder& ResponseBuilder::addFileBody(const string& filepath, bool fail_with_404) {
-	std::ifstream served_file(filepath, std::ios::in | std::ios::binary);
-	if (served_file) {
-		// No need to actually read the file is this a head response
+ResponseBuilder& ResponseBuilder::addFileBody(const char* filepath, bool fail_with_404) {
+	if (hasBody) {
+		throw std::runtime_error("Response already has body");
+	}
+
+	std::shared_ptr<OpenFile> served_file = std::allocate_shared<OpenFile>(std::pmr::polymorphic_allocator<OpenFile>(fileMemory), filepath);
+	if (served_file->isOpen() && !hasHeader("Content-Type")) {
+		addHeader("Content-Type", getMimeType(getFileExtension(filepath)));
+	}
+	return addFileBody(served_file, fail_with_404);
+}
+
+ResponseBuilder& ResponseBuilder::addFileBody(const std::shared_ptr<OpenFile>& served_file, bool fail_with_404) {
+	if (hasBody) {
+		throw std::runtime_error("Response already has body");
+	}
+
+	if (served_file->isOpen()) {
+		// The contents are not read here, the connection sends them straight from the file.
+		// The length is also sent for head responses, so the client knows how large the resource is.
+		hasBody = true;
+		hasContentLength = true;
+		addHeader("Content-Length", served_file->size());
 		if (!isHead) {
-			// Read file contents
-			string file_contents;
-			served_file.seekg(0, std::ios::end);
-			file_contents.resize(served_file.tellg());
-			served_file.seekg(0, std::ios::beg);
-			served_file.read(&file_contents[0], file_contents.size());
-			served_file.close();
-			addBody(file_contents);
-		}
-		addHeader("Content-Type", getMimeType(getFileExtension(filepath).c_str()));
+			bodyFile = served_file;
+			fileParts.push_back(FilePart{ string(), 0, served_file->size() });
+		}
 	} else if (fail_with_404) {
 		// Could not read file
 		setStatusCode(StatusCode::NotFound);
@@ -49,197 +180,1272 @@ ResponseBuilder& ResponseBuilder::addFileBody(const string& filepath, bool fail_
 	return *this;
 }
 
+// Multipart boundaries must not occur in the parts, a random one makes that unlikely enough
+static string multipartBoundary() {
+	static thread_local std::mt19937_64 generator{ std::random_device()() };
+	char boundary[32];
+	snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)generator());
+	return boundary;
+}
+
+ResponseBuilder& ResponseBuilder::addFileRanges(const std::shared_ptr<OpenFile>& file, long long offset, long long size,
+	const std::pmr::vector<ByteRange>& ranges, std::string_view content_type) {
+	if (hasBody) {
+		throw std::runtime_error("Response already has body");
+	}
+
+	setStatusCode(StatusCode::PartialContent);
+	hasBody = true;
+	hasContentLength = true;
+	bodyFile = file;
+	auto contentRange = [&](const ByteRange& range, char (&value)[72]) {
+		int length = snprintf(value, sizeof(value), "bytes %lld-%lld/%lld", range.offset, range.offset + range.length - 1, size);
+		return std::string_view(value, (size_t)length);
+	};
+	char content_range[72];
+
+	if (ranges.size() == 1) {
+		const ByteRange& range = ranges[0];
+		addHeader("Content-Type", content_type);
+		addHeader("Content-Range", contentRange(range, content_range));
+		addHeader("Content-Length", range.length);
+		fileParts.push_back(FilePart{ string(), offset + range.offset, range.length });
+		return *this;
+	}
+
+	// Every part gets its own headers, and the body ends with the closing boundary
+	string boundary = multipartBoundary();
+	long long content_length = 0;
+	for (const ByteRange& range : ranges) {
+		string part_headers = "\r\n--" + boundary + "\r\n"
+			+ "Content-Type: " + string(content_type) + "\r\n"
+			+ "Content-Range: " + string(contentRange(range, content_range)) + "\r\n"
+			+ "\r\n";
+		content_length += part_headers.length() + range.length;
+		fileParts.push_back(FilePart{ part_headers, offset + range.offset, range.length });
+	}
+	string closing_boundary = "\r\n--" + boundary + "--\r\n";
+	content_length += closing_boundary.length();
+	fileParts.push_back(FilePart{ closing_boundary, 0, 0 });
+
+	addHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+	addHeader("Content-Length", content_length);
+	return *this;
+}
+
 ResponseBuilder& ResponseBuilder::setHead() {
 	isHead = true;
 	return *this;
 }
 
-string ResponseBuilder::build() const {
+ResponseBuilder ResponseBuilder::notModified() const {
+	ResponseBuilder response(headerLines.get_allocator().resource(), fileMemory);
+	response.setStatusCode(StatusCode::NotModified).setKeepAlive(keepAlive);
+	for (const char* name : { "ETag", "Last-Modified", "Cache-Control", "Expires", "Vary" }) {
+		if (hasHeader(name)) {
+			response.addHeader(name, getHeader(name));
+		}
+	}
+	return response;
+}
+
+ResponseBuilder& ResponseBuilder::setKeepAlive(bool keep_alive) {
+	keepAlive = keep_alive;
+	return *this;
+}
+
+size_t ResponseBuilder::headBuffers(SendBuffer (&buffers)[RESPONSE_HEAD_BUFFERS]) const {
 	if (statusCode == StatusCode::Missing) {
 		throw std::runtime_error("No status code set");
 	}
 
-	// Status line
-	string response;
-	response += "HTTP/";
-	response += HTTP_VERSION;
-	response += " ";
-	response += std::to_string((int)statusCode);
-	response += " ";
-	response += httpReasonForCode(statusCode);
-	response += "\r\n";
-
-	// Headers
-	for (auto header_pair : headers) {
-		response += header_pair.first;
-		response += ": ";
-		response += header_pair.second;
-		response += "\r\n";
+	size_t count = 0;
+	auto add = [&](std::string_view data) {
+		buffers[count++] = SendBuffer{ data.data(), data.length() };
+	};
+	add(httpStatusLine(statusCode));
+	add(SERVER_LINE);
+	if (!headerLines.empty()) {
+		add(headerLines);
+	}
+
+	// On a persistent connection the client relies on the length to find the end of the response
+	bool bodyless_status = statusCode == StatusCode::NoContent || statusCode == StatusCode::NotModified;
+	if (!hasContentLength && !bodyless_status) {
+		add(EMPTY_BODY_LINE);
 	}
 
 	// Headers end if marked with an empty line
-	response += "\r\n";
+	add(keepAlive ? KEEP_ALIVE_END : CLOSE_END);
+	return count;
+}
 
-	// Body
-	if (!isHead && hasBody) {
-		response += body;
-	}
+string ResponseBuilder::build() const {
+	SendBuffer buffers[RESPONSE_HEAD_BUFFERS];
+	size_t count = headBuffers(buffers);
+	std::shared_ptr<const string> body_contents = memoryBody();
 
+	size_t length = body_contents ? body_contents->length() : 0;
+	for (size_t i = 0; i < count; i++) {
+		length += buffers[i].length;
+	}
+	string response;
+	response.reserve(length);
+	for (size_t i = 0; i < count; i++) {
+		response.append(buffers[i].data, buffers[i].length);
+	}
+	if (body_contents) {
+		response += *body_contents;
+	}
 	return response;
 }
 
-string resolveRequestURI(const string& request_uri) {
-	// Parse request uri
-	if (request_uri[0] != '/')
-		throw std::runtime_error("Missing / in the beggining of abs_path");
+bool HttpConnection::wantsInput() const {
+	return !closing && !input_ended
+		&& output_length < MAX_PENDING_OUTPUT
+		&& input.length() - input_offset <= MAX_REQUEST_HEADERS_SIZE;
+}
+
+void HttpConnection::onReceive(const char* data, size_t length) {
+	if (closing)
+		return;
+
+	long long now = monotonicMilliseconds();
+	if (isIdle()) {
+		request_start = now;
+	}
+	last_receive = now;
+	bool had_output = hasPendingOutput();
+	input.append(data, length);
+	processInput();
+	// The client has to start reading the responses it caused from now on
+	if (!had_output && hasPendingOutput()) {
+		last_send = now;
+	}
+}
 
-	string filepath = SERVE_ROOT;
-	// We only need the path, we don't about the query parameters
-	int query_start = request_uri.find("?");
-	if (query_start != string::npos) {
-		filepath += decodeEscapeSequences(request_uri.substr(0, query_start));
+void HttpConnection::onReceiveEnd(bool timed_out) {
+	if (closing)
+		return;
+
+	// The client has to start reading what is queued now
+	if (!hasPendingOutput()) {
+		last_send = monotonicMilliseconds();
+	}
+	if (http2) {
+		http2->onReceiveEnd(timed_out);
+		return;
+	}
+
+	if (timed_out && proxying) {
+		if (monotonicMilliseconds() >= proxyDeadline()) {
+			LOG(Info) << "Upstream " << proxy->upstream()->name() << " timed out.";
+			failProxy(StatusCode::GatewayTimeout);
+		} else {
+			abortProxy();
+		}
+		return;
+	}
+	if (timed_out) {
+		// If we did not find the end-of-headers marker the request is either invalid or timed out.
+		// In either case, we respond with a 400 and close the connection. An idle connection is just closed,
+		// and so is one whose request was answered already while its body was still arriving.
+		if (!isIdle() && body_remaining == 0) {
+			queueBadRequest("Timeout: Did not find end of headers.");
+			logAccess(nullptr);
+		}
+		closing = true;
+		return;
+	}
+
+	// Requests the client sent before closing its half of the connection are still answered
+	input_ended = true;
+	processInput();
+}
+
+long long HttpConnection::deadline() const {
+	if (http2)
+		return http2->deadline();
+	if (proxying) {
+		long long deadline = proxyDeadline();
+		if (hasPendingOutput()) {
+			deadline = std::min(deadline, last_send + server_config.send_timeout * 1000LL);
+		}
+		if (!proxy->requestBodyComplete()) {
+			deadline = std::min({ deadline, last_receive + server_config.body_timeout * 1000LL,
+				request_start + server_config.request_timeout * 1000LL });
+		}
+		return deadline;
+	}
+
+	long long deadline;
+	if (hasPendingOutput()) {
+		// The client has to keep reading, but a request it is still sending has its own deadline too
+		deadline = last_send + server_config.send_timeout * 1000LL;
+		if (isIdle())
+			return deadline;
+	} else if (isIdle()) {
+		// Only sending a response renews an idle connection, so stray empty lines don't keep it open.
+		// A new connection has to send its first request as quickly as the headers of any other.
+		return last_send + (requests_served == 0 ? server_config.header_timeout : server_config.keep_alive_timeout) * 1000LL;
 	} else {
-		filepath += decodeEscapeSequences(request_uri);
+		deadline = LLONG_MAX;
 	}
 
-	// We resolve the relative path to an absolute path for two reasons:
-	// - We want to turn the linux-style path into a windows-style path
-	// - We need to make sure that the use of `..` path traversal did not cause the final path
-	//   the end up outside of the serve root, which is not allowed.
-	char resolved_path[256];
-	if (_fullpath(resolved_path, filepath.c_str(), sizeof(resolved_path)) == NULL) {
-		throw std::runtime_error("_fullpath() failed (File path too long?)");
+	// A slow client can't hold the connection by trickling the request, however steadily it sends
+	long long phase_deadline = body_remaining > 0 ? last_receive + server_config.body_timeout * 1000LL
+		: request_start + server_config.header_timeout * 1000LL;
+	return std::min({ deadline, phase_deadline, request_start + server_config.request_timeout * 1000LL });
+}
+
+// The bytes a chunk holds in memory
+static std::string_view chunkBytes(const HttpConnection::OutputChunk& chunk) {
+	return chunk.shared.empty() ? std::string_view(chunk.data) : chunk.shared;
+}
+
+size_t HttpConnection::pendingBuffers(SendBuffer* buffers, size_t max_count) {
+	size_t count = 0;
+	for (const OutputChunk& chunk : output) {
+		if (chunk.file || chunk.piped || count == max_count)
+			break;
+		std::string_view bytes = chunkBytes(chunk).substr(count == 0 ? output_offset : 0);
+		buffers[count++] = SendBuffer{ bytes.data(), bytes.length() };
 	}
-	char resolved_rootpath[256];
-	if (_fullpath(resolved_rootpath, SERVE_ROOT, sizeof(resolved_rootpath)) == NULL) {
-		throw std::runtime_error("_fullpath() failed (File path too long?)");
+	gathered_chunks = count;
+	return count;
+}
+
+size_t HttpConnection::pendingFileLength() const {
+	// Large files are sent in several steps anyway, we don't need to hand out more than fits a size_t
+	return (size_t)std::min(output.front().file_length, (long long)(1 << 30));
+}
+
+void HttpConnection::consumeOutput(size_t length) {
+	metrics.countSent(length);
+	last_send = monotonicMilliseconds();
+	output_length -= length;
+	gathered_chunks = 0;
+	// A gathered send may have completed several chunks
+	while (length > 0) {
+		OutputChunk& chunk = output.front();
+		bool chunk_sent;
+		if (chunk.file || chunk.piped) {
+			chunk.file_offset += length;
+			chunk.file_length -= length;
+			length = 0;
+			chunk_sent = chunk.file_length <= 0;
+		} else {
+			size_t consumed = std::min(length, chunkBytes(chunk).length() - output_offset);
+			output_offset += consumed;
+			length -= consumed;
+			chunk_sent = output_offset == chunkBytes(chunk).length();
+		}
+		if (chunk_sent) {
+			output.pop_front();
+			output_offset = 0;
+		}
 	}
-	if (string(resolved_path).find(resolved_rootpath) != 0) {
-		throw std::runtime_error("File path outside server root, possible path traversal");
+
+	// Pipelined requests may have been waiting for the client to read its responses, and HTTP/2 streams for room
+	// to queue their next frames
+	if (!closing && input_offset < input.length()) {
+		processInput();
+	} else if (http2) {
+		http2->schedule();
 	}
+}
 
-	// We initially assume that the final path is the resolved one, but it might be a directory
-	// and in that case we should try serving the directory's index if one exists.
-	string final_served_path = resolved_path;
+void HttpConnection::queueResponse(const ResponseBuilder& response) {
+	if (http2) {
+		response_status = response.getStatusCode();
+		metrics.countResponse(response_status);
+		response_body_length = http2->queueResponse(response);
+		return;
+	}
 
-	struct stat file_status;
-	int stat_result = stat(resolved_path, &file_status);
-	if (stat_result == 0 && (file_status.st_mode & S_IFDIR) != 0) {
-		// Path is a directory, try serving local index.html
-		if (final_served_path[final_served_path.length() - 1] != PATH_SEPERATOR) {
-			final_served_path += PATH_SEPERATOR;
+	// The head is small, it is copied behind the output of earlier responses. The body is sent from where it is.
+	long long queued_before = output_length;
+	SendBuffer buffers[RESPONSE_HEAD_BUFFERS];
+	size_t count = response.headBuffers(buffers);
+	size_t head_length = 0;
+	for (size_t i = 0; i < count; i++) {
+		head_length += buffers[i].length;
+	}
+	std::pmr::string& tail = outputTail(head_length);
+	for (size_t i = 0; i < count; i++) {
+		tail.append(buffers[i].data, buffers[i].length);
+	}
+	output_length += head_length;
+	response_status = response.getStatusCode();
+	metrics.countResponse(response_status);
+
+	std::shared_ptr<const string> body = response.memoryBody();
+	if (body) {
+		queueShared(*body, body);
+	}
+
+	const std::shared_ptr<OpenFile>& file = response.fileBody();
+	if (file) {
+		for (const ResponseBuilder::FilePart& part : response.bodyFileParts()) {
+			if (!part.prefix.empty()) {
+				queueOutput(part.prefix);
+			}
+			queueFile(file, part.offset, part.length);
 		}
-		final_served_path += "index.html";
 	}
+	response_body_length = output_length - queued_before - (long long)head_length;
+}
 
-	return final_served_path;
+std::pmr::string& HttpConnection::outputTail(size_t length) {
+	// Responses to pipelined requests are merged, so they need fewer buffers to send. Chunks which are
+	// in the middle of an asynchronous send must not be touched though.
+	if (output.size() <= gathered_chunks || output.back().file || output.back().piped || !output.back().shared.empty()) {
+		output.push_back(OutputChunk{ std::pmr::string(&memory), std::string_view(), nullptr, nullptr, 0, 0, false });
+		output.back().data.reserve(length);
+	}
+	return output.back().data;
 }
 
-void serveClient(SOCKET client_socket) {
-	string request;
+void HttpConnection::queueOutput(std::string_view data) {
+	outputTail(data.length()).append(data);
+	output_length += data.length();
+}
 
-	// Because of the format of HTTP requests, we can't know how long the request is (when including the body)
-	// because its length is specified in the 'Content-Length' header. As such, we `recv()` data until we find
-	// an empty new-line (CRLFCRLF) which marks the end of the headers. After we parse the headers, we may choose
-	// to `recv()` the rest of the body if one exists and it is relevant to the response.
+void HttpConnection::queueShared(std::string_view data, std::shared_ptr<const void> owner) {
+	if (data.empty())
+		return;
+	output.push_back(OutputChunk{ std::pmr::string(), data, std::move(owner), nullptr, 0, 0, false });
+	output_length += data.length();
+}
 
-	char recv_buffer[1024 * 4];
-	int end_of_headers = string::npos;
-	do {
-		int bytes = recv(client_socket, recv_buffer, sizeof(recv_buffer), 0);
-		if (bytes == SOCKET_ERROR) {
-			int err = WSAGetLastError();
+void HttpConnection::queueFile(const std::shared_ptr<OpenFile>& file, long long offset, long long length) {
+	if (length <= 0)
+		return;
+	output.push_back(OutputChunk{ std::pmr::string(), std::string_view(), nullptr, file, offset, length, false });
+	output_length += length;
+}
 
-			if (err == WSAETIMEDOUT) { // Timeout
-				break;
+void HttpConnection::queueCachedResponse(const std::shared_ptr<const CachedFile>& cached, bool is_head, bool keep_alive) {
+	std::string_view response(cached->response.data(), is_head ? cached->header_length : cached->response.length());
+	// Only the 304 response has no 304 of its own
+	response_status = cached->not_modified ? StatusCode::OK : StatusCode::NotModified;
+	response_body_length = (long long)(response.length() - cached->header_length);
+	metrics.countResponse(response_status);
+	queueSerialized(response, cached->connection_offset, cached, keep_alive);
+}
+
+void HttpConnection::queueSerialized(std::string_view response, size_t connection_offset, const std::shared_ptr<const void>& owner,
+	bool keep_alive) {
+	if (http2) {
+		http2->queueSerialized(response, owner);
+		return;
+	}
+	if (keep_alive) {
+		queueShared(response, owner);
+		return;
+	}
+
+	// The response is serialized for a persistent connection, so the last response swaps the header
+	static const std::string_view close_header = "Connection: close\r\n";
+	size_t header_end = connection_offset + strlen("Connection: keep-alive\r\n");
+	queueShared(response.substr(0, connection_offset), owner);
+	queueShared(close_header, nullptr);
+	queueShared(response.substr(header_end), owner);
+}
+
+void HttpConnection::queueBadRequest(const char* reason) {
+	queueResponse(ResponseBuilder(&arena, &memory).setStatusCode(StatusCode::BadRequest).addFileBody(RESPONSE_400, false));
+	LOG(Info) << "Bad request: " << reason;
+	// An HTTP/2 stream is answered on its own, the other streams go on
+	if (!http2) {
+		closing = true;
+	}
+}
+
+void HttpConnection::closeAfterResponse() {
+	if (http2) {
+		http2->goAway();
+	} else {
+		closing = true;
+	}
+}
+
+void HttpConnection::logAccess(const HttpRequest* request) {
+	if (!logger.accessLogEnabled())
+		return;
+
+	AccessEntry entry = {};
+	entry.client_address = client_address;
+	entry.status = (int)response_status;
+	entry.body_length = response_body_length;
+	if (request) {
+		entry.method = request->method;
+		entry.uri = request->uri;
+		entry.version = request->version;
+		for (size_t i = 0; i < request->header_count; i++) {
+			if (request->headers[i].id == HeaderId::Referer) {
+				entry.referer = request->headers[i].value;
+			} else if (request->headers[i].id == HeaderId::UserAgent) {
+				entry.user_agent = request->headers[i].value;
 			}
+		}
+	}
+	logger.access(entry);
+}
 
-			std::cout << "recv() failed: " << err << std::endl;
-			return;
+void HttpConnection::startProxy(ProxyRoute& route, const HttpRequest& request, bool keep_alive, long long content_length,
+	bool chunked) {
+	if (http2) {
+		// Upstreams are spoken to over HTTP/1.1 only, the client sends the request again on a connection of its own
+		http2->requireHttp1();
+		return;
+	}
+	if (draining || requests_served >= (unsigned)server_config.max_keep_alive_requests) {
+		keep_alive = false;
+	}
+
+	Upstream* upstream = proxy_routes.choose(route);
+	if (upstream == nullptr) {
+		// The body is skipped like that of any request we answer ourselves, a chunked one ends the connection
+		queueResponse(ResponseBuilder(&arena, &memory).setStatusCode(StatusCode::ServiceUnavailable)
+			.addFileBody(RESPONSE_503, false).setKeepAlive(keep_alive && !chunked));
+		body_remaining = (size_t)content_length;
+		if (!keep_alive || chunked) {
+			closing = true;
 		}
+		return;
+	}
 
-		request.append(recv_buffer, bytes);
-		end_of_headers = request.find("\r\n\r\n") + 2; // The first CRLF is the ending of the last header.
-	} while (end_of_headers == string::npos);
+	if (!proxy) {
+		proxy = std::make_unique<ProxyExchange>(&memory);
+	}
+	proxy->start(upstream, request, client_address, secure, keep_alive, content_length, chunked);
+	proxying = true;
+}
 
-	// If we did not find the end-of-headers marker the request is either invalid or timed out.
-	// In either case, we respond with a 400 and exit.
-	if (end_of_headers == string::npos) {
-		string resp = ResponseBuilder().setStatusCode(StatusCode::BadRequest).addFileBody(RESPONSE_400, false).build();
-		if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR) {
-			std::cout << "send() failed: " << WSAGetLastError() << std::endl;
-			return;
+void HttpConnection::feedProxyBody() {
+	input_offset += proxy->addRequestBody(input.data() + input_offset, input.length() - input_offset);
+	if (proxy->requestBodyInvalid()) {
+		LOG(Info) << "Bad request: Invalid chunked body.";
+		abortProxy();
+	} else if (input_ended && input_offset == input.length() && !proxy->requestBodyComplete()) {
+		// The upstream can't be sent a complete request anymore
+		abortProxy();
+	}
+}
+
+void HttpConnection::consumeUpstreamOutput(size_t length) {
+	proxy->consumeRequest(length);
+	if (input_offset < input.length()) {
+		feedProxyBody();
+		dropProcessedInput();
+	}
+}
+
+void HttpConnection::onUpstreamReceive(const char* data, size_t length) {
+	bool had_output = hasPendingOutput();
+	while (length > 0 && proxying) {
+		std::string_view forward;
+		size_t processed = proxy->receive(data, length, forward);
+		if (processed == 0) {
+			LOG(Warning) << "Malformed response from upstream " << proxy->upstream()->name() << ".";
+			failProxy(StatusCode::BadGateway);
+			break;
+		}
+		if (!forward.empty()) {
+			queueOutput(forward);
+		}
+		data += processed;
+		length -= processed;
+		if (proxy->responseComplete()) {
+			finishProxy();
+			// Bytes behind the response belong to no request, the connection can't be trusted anymore
+			upstream_reusable &= length == 0;
+		}
+	}
+	// The client has to start reading the response from now on
+	if (!had_output && hasPendingOutput()) {
+		last_send = monotonicMilliseconds();
+	}
+}
+
+void HttpConnection::onUpstreamSpliced(size_t length) {
+	if (!hasPendingOutput()) {
+		last_send = monotonicMilliseconds();
+	}
+	proxy->onRawBody(length);
+	queuePiped(length);
+	if (proxy->responseComplete()) {
+		finishProxy();
+	}
+}
+
+void HttpConnection::queuePiped(size_t length) {
+	// The pipe is read in order, so consecutive pieces are one chunk
+	if (!output.empty() && output.back().piped) {
+		output.back().file_length += (long long)length;
+	} else {
+		output.push_back(OutputChunk{ std::pmr::string(), std::string_view(), nullptr, nullptr, 0, (long long)length, true });
+	}
+	output_length += length;
+}
+
+void HttpConnection::onUpstreamEnd(bool failed) {
+	if (!proxying)
+		return;
+	// Without a length, the response ends with the connection
+	if (!failed && proxy->onEnd()) {
+		finishProxy();
+		return;
+	}
+	if (!failed) {
+		LOG(Info) << "Upstream " << proxy->upstream()->name() << " closed the connection before the end of the response.";
+	}
+	failProxy(StatusCode::BadGateway);
+}
+
+void HttpConnection::onUpstreamReleased() {
+	upstream_finished = false;
+	if (!closing) {
+		processInput();
+	}
+}
+
+void HttpConnection::finishProxy() {
+	proxy->upstream()->reportSuccess();
+	upstream_reusable = proxy->upstreamReusable();
+	response_status = (StatusCode)proxy->responseStatus();
+	response_body_length = proxy->forwardedBody();
+	metrics.countResponse(response_status);
+	endProxy();
+}
+
+void HttpConnection::failProxy(StatusCode status) {
+	proxy->upstream()->reportFailure();
+	upstream_reusable = false;
+	if (proxy->responseStarted()) {
+		// Only closing the connection tells the client that the rest of the response is missing
+		response_status = (StatusCode)proxy->responseStatus();
+		response_body_length = proxy->forwardedBody();
+		closing = true;
+		endProxy();
+		return;
+	}
+	queueResponse(ResponseBuilder(&arena, &memory).setStatusCode(status).setKeepAlive(proxy->clientKeepAlive()));
+	endProxy();
+}
+
+void HttpConnection::abortProxy() {
+	proxying = false;
+	upstream_finished = true;
+	upstream_reusable = false;
+	closing = true;
+}
+
+void HttpConnection::endProxy() {
+	proxying = false;
+	upstream_finished = true;
+	if (logger.accessLogEnabled()) {
+		AccessEntry entry = {};
+		entry.client_address = client_address;
+		entry.status = (int)response_status;
+		entry.body_length = response_body_length;
+		entry.method = proxy->log_method;
+		entry.uri = proxy->log_uri;
+		entry.version = proxy->log_version;
+		entry.referer = proxy->log_referer;
+		entry.user_agent = proxy->log_user_agent;
+		logger.access(entry);
+	}
+
+	if (!proxy->clientKeepAlive()) {
+		closing = true;
+	} else if (!proxy->requestBodyComplete()) {
+		// The upstream answered before it got the whole body, the rest is skipped like the body of any request we
+		// answer ourselves. A chunked one ends the connection.
+		body_remaining = (size_t)proxy->requestBodyRemaining();
+		closing |= body_remaining == 0;
+	}
+	// A pipelined request behind this one only starts to count now
+	request_start = std::max(last_receive, last_send);
+}
+
+long long HttpConnection::proxyDeadline() const {
+	// The upstream can't be blamed while it waits for the client to send more of the body or to read the response
+	if ((!proxy->requestBodyComplete() && proxy->pendingRequest().empty()) || output_length >= MAX_PENDING_OUTPUT)
+		return LLONG_MAX;
+	return proxy->deadline();
+}
+
+bool HttpConnection::startHttp2() {
+	static const std::string_view preface = HTTP2_PREFACE;
+	std::string_view received = std::string_view(input).substr(input_offset, preface.length());
+	if (received.empty() || received != preface.substr(0, received.length()))
+		return false;
+	if (received.length() < preface.length()) {
+		if (input_ended) {
+			closing = true;
 		}
+		return true;
+	}
 
-		std::cout << "\tTimeout: Did not find end of headers." << std::endl;
+	input_offset += preface.length();
+	http2 = std::make_unique<Http2Session>(*this, &memory);
+	http2->processInput();
+	return true;
+}
+
+void HttpConnection::dropProcessedInput() {
+	// A partially parsed request is kept as offsets from its start, so it is not affected
+	if (input_offset > 0 && input_offset * 2 >= input.length()) {
+		input.erase(0, input_offset);
+		input_offset = 0;
+	}
+}
+
+void HttpConnection::processInput() {
+	if (http2) {
+		http2->processInput();
+		return;
+	}
+	// Clients with prior knowledge start HTTP/2 right away instead of sending a request
+	if (requests_served == 0 && !parser.started() && server_config.h2c && startHttp2())
+		return;
+	// The next request waits until the proxied one was answered
+	if (proxying || upstream_finished) {
+		if (proxying) {
+			feedProxyBody();
+		}
+		dropProcessedInput();
 		return;
 	}
 
-	// Parse Request
+	// Too much output waiting means the client does not read its responses, so we stop answering requests
+	while (!closing && output_length < MAX_PENDING_OUTPUT) {
+		// Skip the body of the last request, we don't serve anything that needs it
+		if (body_remaining > 0) {
+			size_t skipped = std::min(body_remaining, input.length() - input_offset);
+			input_offset += skipped;
+			body_remaining -= skipped;
+			if (body_remaining > 0) {
+				if (input_ended) {
+					closing = true;
+				}
+				break;
+			}
+		}
+
+		// Clients may send empty lines between pipelined requests
+		while (!parser.started() && input.compare(input_offset, 2, "\r\n") == 0) {
+			input_offset += 2;
+		}
+
+		// Because of the format of HTTP requests, we can't know how long the request is (when including the body)
+		// because its length is specified in the 'Content-Length' header. As such, we accumulate data until the
+		// parser found the empty line which marks the end of the headers. It resumes where the last call stopped.
+		HttpRequest request;
+		long long parse_start = metrics.stageStart();
+		HttpRequestParser::Result result = parser.parse(input.data() + input_offset, input.length() - input_offset, request);
+		if (result == HttpRequestParser::Result::Complete) {
+			metrics.recordStage(Stage::Parse, parse_start);
+		}
+		if (result == HttpRequestParser::Result::Invalid) {
+			queueBadRequest(parser.error());
+			logAccess(nullptr);
+			break;
+		}
+		if (result == HttpRequestParser::Result::Incomplete) {
+			if (input.length() - input_offset > MAX_REQUEST_HEADERS_SIZE) {
+				queueBadRequest("Request headers too large.");
+				logAccess(nullptr);
+			} else if (input_ended) {
+				if (!isIdle()) {
+					queueBadRequest("Connection closed before the end of headers.");
+					logAccess(nullptr);
+				}
+				closing = true;
+			}
+			break;
+		}
+
+		// The request points into the input, so it is only consumed once it was handled
+		handleRequest(request);
+		input_offset += parser.length();
+		parser.reset();
+		if (proxying) {
+			// Logged once the response passed through
+			arena.release();
+			feedProxyBody();
+			break;
+		}
+		logAccess(&request);
+		arena.release();
+		// A pipelined request behind this one only starts to count now
+		request_start = std::max(last_receive, last_send);
+	}
+	// A bad request leaves the loop before the arena was released
+	arena.release();
+	dropProcessedInput();
+}
+
+// Parses the value of a `Range` header against a file of `file_size` bytes into the satisfiable ranges, which
+// are left empty if there are none. Returns false if the header should be ignored and the whole file be sent:
+// if it is invalid, uses a unit other than bytes, or asks for too many or overlapping ranges.
+static bool parseRanges(std::string_view value, long long file_size, std::pmr::vector<ByteRange>& ranges) {
+	const size_t unit_length = strlen("bytes=");
+	if (value.length() <= unit_length || !caseInsensitiveEquals(value.substr(0, unit_length), "bytes="))
+		return false;
+
+	unsigned range_count = 0;
+	bool invalid = forEachListElement(value.substr(unit_length), [&](std::string_view range) {
+		if (++range_count > MAX_BYTE_RANGES)
+			return true;
+
+		// `first-last`, `first-` or `-suffix_length`
+		size_t dash = range.find('-');
+		if (dash == std::string_view::npos || range.find_first_not_of("0123456789", dash + 1) != std::string_view::npos
+			|| range.find_first_not_of("0123456789") != dash || (dash == 0 && dash + 1 == range.length()))
+			return true;
+		// Positions beyond any file size saturate instead of overflowing
+		auto parsePosition = [](std::string_view digits) {
+			long long position = 0;
+			return digits.length() > 18 || std::from_chars(digits.data(), digits.data() + digits.length(), position).ec != std::errc()
+				? LLONG_MAX : position;
+		};
+
+		long long first;
+		long long last;
+		if (dash == 0) {
+			long long suffix_length = parsePosition(range.substr(1));
+			first = std::max(file_size - suffix_length, 0LL);
+			last = file_size - 1;
+			if (suffix_length == 0)
+				return false;
+		} else {
+			first = parsePosition(range.substr(0, dash));
+			last = dash + 1 == range.length() ? LLONG_MAX : parsePosition(range.substr(dash + 1));
+			if (last < first)
+				return true;
+		}
+		if (first < file_size) {
+			ranges.push_back(ByteRange{ first, std::min(last, file_size - 1) - first + 1 });
+		}
+		return false;
+	});
+	if (invalid)
+		return false;
+
+	// Overlapping ranges would let a small request make us send a file many times over
+	std::pmr::vector<ByteRange> sorted(ranges.begin(), ranges.end(), ranges.get_allocator());
+	std::sort(sorted.begin(), sorted.end(), [](const ByteRange& a, const ByteRange& b) { return a.offset < b.offset; });
+	for (size_t i = 1; i < sorted.size(); i++) {
+		if (sorted[i].offset < sorted[i - 1].offset + sorted[i - 1].length)
+			return false;
+	}
+	return true;
+}
+
+// A strong validator derived from the identity, size and modification time of the file the body comes from.
+// Every encoding of a file is a representation of its own, so it gets its own tag.
+static std::string_view entityTag(const struct stat& status, const char* encoding, char (&tag)[96]) {
+#ifdef __linux__
+	long long modified = (long long)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#else
+	long long modified = (long long)status.st_mtime;
+#endif
+	int length = snprintf(tag, sizeof(tag), "\"%llx-%llx-%llx%s%s\"", (unsigned long long)status.st_ino, (unsigned long long)status.st_size,
+		(unsigned long long)modified, encoding ? "-" : "", encoding ? encoding : "");
+	return std::string_view(tag, (size_t)length);
+}
+
+// True if the conditional headers of a GET or HEAD request show that the client's copy is still current,
+// so it gets a 304. `If-Modified-Since` is only considered without `If-None-Match`.
+static bool isNotModified(std::string_view if_none_match, std::string_view if_modified_since, std::string_view etag, time_t modified) {
+	if (!if_none_match.empty()) {
+		return forEachListElement(if_none_match, [etag](std::string_view tag) {
+			// The weak comparison ignores the `W/` prefix
+			if (tag.compare(0, 2, "W/") == 0) {
+				tag.remove_prefix(2);
+			}
+			return tag == "*" || tag == etag;
+		});
+	}
+
+	if (!if_modified_since.empty()) {
+		time_t since = parseHttpDate(if_modified_since);
+		return since != -1 && modified <= since;
+	}
+	return false;
+}
+
+// True if the `If-Range` validator still matches the representation, so the range can be sent.
+// Entity tags are compared strongly, dates have to match `Last-Modified` exactly.
+static bool ifRangeMatches(std::string_view if_range, std::string_view etag, std::string_view last_modified) {
+	if (if_range.empty())
+		return true;
+	if (if_range[0] == '"' || if_range.compare(0, 2, "W/") == 0)
+		return if_range == etag;
+	return if_range == last_modified;
+}
+
+void HttpConnection::handleRequest(const HttpRequest& request) {
+	StageTimer timer(Stage::Request);
+	requests_served++;
+
 	try {
-		StringParser parser(string(recv_buffer, end_of_headers));
+		if (request.version.compare(0, 5, "HTTP/") != 0) {
+			throw std::runtime_error("Invalid HTTP version");
+		}
+		bool is_http_1_1 = request.version != "HTTP/1.0";
 
-		// Request-Line: `METHOD Request-URI HTTP-Version CRLF`
-		string method = parser.next_by_delim(" ");
-		string request_uri = parser.next_by_delim(" ");
-		string http_version = parser.next_by_delim("\r\n");
-		std::cout << "Method: '" << method << "', Request URI: '" << request_uri << "', HTTP Version: '" << http_version << "'" << std::endl;
+		// HTTP/1.1 connections are persistent by default, HTTP/1.0 ones only if the client asks for it
+		bool keep_alive = is_http_1_1;
+		bool has_host = false;
+		bool has_chunked_body = false;
+		bool has_transfer_encoding = false;
+		bool has_unsupported_coding = false;
+		bool has_content_length = false;
+		size_t content_length = 0;
+		FileRequest file_request = {};
 
+		// Header names are case-insensitive, the parser already recognized the ones we care about
+		for (size_t i = 0; i < request.header_count; i++) {
+			const HttpHeader& header = request.headers[i];
+			switch (header.id) {
+			case HeaderId::ContentLength: {
+				// Differing lengths would let a proxy and its upstream disagree where the body ends (RFC 9112 6.3)
+				size_t length = 0;
+				const char* value_end = header.value.data() + header.value.length();
+				if (header.value.empty() || std::from_chars(header.value.data(), value_end, length).ptr != value_end) {
+					throw std::runtime_error("Invalid Content-Length");
+				}
+				if (has_content_length && length != content_length) {
+					throw std::runtime_error("Conflicting Content-Length headers");
+				}
+				content_length = length;
+				has_content_length = true;
+				break;
+			}
+			case HeaderId::TransferEncoding:
+				// The codings apply in the order they are listed, over all the headers, and chunked has to be the last
+				has_transfer_encoding = true;
+				forEachListElement(header.value, [&](std::string_view coding) {
+					if (has_chunked_body) {
+						throw std::runtime_error("Transfer coding after chunked");
+					}
+					if (caseInsensitiveEquals(coding, "chunked")) {
+						has_chunked_body = true;
+					} else {
+						has_unsupported_coding = true;
+					}
+					return false;
+				});
+				break;
+			case HeaderId::Connection:
+				if (caseInsensitiveEquals(header.value, "close")) {
+					keep_alive = false;
+				} else if (caseInsensitiveEquals(header.value, "keep-alive")) {
+					keep_alive = true;
+				}
+				break;
+			case HeaderId::Host:
+				has_host = true;
+				break;
+			case HeaderId::AcceptEncoding:
+				file_request.accepted_encodings = parseAcceptEncoding(header.value);
+				break;
+			case HeaderId::Range:
+				file_request.range = header.value;
+				break;
+			case HeaderId::IfRange:
+				file_request.if_range = header.value;
+				break;
+			case HeaderId::IfNoneMatch:
+				file_request.if_none_match = header.value;
+				break;
+			case HeaderId::IfModifiedSince:
+				file_request.if_modified_since = header.value;
+				break;
+			default:
+				break;
+			}
+		}
 
-		// Methods are case-sensitive
-		if (method != "GET" && method != "HEAD") {
-			// We currently do not support POST requests.
-			string resp = ResponseBuilder().setStatusCode(StatusCode::NotImplemented).build();
-			if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR) {
-				std::cout << "send() failed: " << WSAGetLastError() << std::endl;
-				return;
+		if (is_http_1_1 && !has_host) {
+			throw std::runtime_error("Missing Host header");
+		}
+		if (has_transfer_encoding && !has_chunked_body) {
+			throw std::runtime_error("Transfer-Encoding does not end with chunked");
+		}
+		if (has_transfer_encoding && has_content_length) {
+			throw std::runtime_error("Content-Length together with Transfer-Encoding");
+		}
+		if (has_unsupported_coding) {
+			// We can't decode the body, and can't find the end of the next request either
+			queueResponse(ResponseBuilder(&arena, &memory).setStatusCode(StatusCode::NotImplemented));
+			if (!http2) {
+				closing = true;
 			}
 			return;
 		}
 
-		// Parse headers
-		while (parser.has_data_left()) {
-			string headerline = parser.next_by_delim("\r\n");
-
-			int header_name_end = headerline.find(": ");
-			if (header_name_end == string::npos) {
-				throw std::runtime_error("Missing ': ' seperator in header line");
+		// Proxied requests may have any method and a body, which the upstream gets
+		if (proxy_routes.enabled()) {
+			std::string_view path = request.uri.substr(0, request.uri.find('?'));
+			ProxyRoute* route = path != server_config.metrics_path ? proxy_routes.match(path) : nullptr;
+			if (route) {
+				startProxy(*route, request, keep_alive, (long long)content_length, has_chunked_body);
+				return;
 			}
-			string header_name = headerline.substr(0, headerline.find(": "));
-			// Header names are case-insensitive
-			if (caseInsensitiveEquals(header_name, "Content-Length")) {
-				// TODO: Receive the rest of the body
-				// Is this relevant for GET?
-				std::cout << "\tHas content!" << std::endl;
+		}
+
+		// Methods are case-sensitive.
+		// Without a length we can't find where the body ends, so such requests end the connection too (HTTP/2 frames
+		// the body, its session drops it).
+		if ((request.method != "GET" && request.method != "HEAD") || has_chunked_body) {
+			// We currently do not support POST requests.
+			queueResponse(ResponseBuilder(&arena, &memory).setStatusCode(StatusCode::NotImplemented));
+			if (!http2) {
+				closing = true;
 			}
+			return;
 		}
 
-		// Parse request uri
-		string served_path = resolveRequestURI(request_uri);
+		if (!http2) {
+			body_remaining = content_length;
+		}
+		if (draining || requests_served >= (unsigned)server_config.max_keep_alive_requests) {
+			keep_alive = false;
+		}
+
+		file_request.path = request.uri.substr(0, request.uri.find('?'));
+		file_request.is_head = request.method == "HEAD";
+		file_request.keep_alive = keep_alive;
+		// Only GET requests can ask for parts of a file
+		if (request.method != "GET") {
+			file_request.range = std::string_view();
+		}
 
-		std::cout << "\tResolved path: " << served_path << std::endl;
+		if (!server_config.metrics_path.empty() && file_request.path == server_config.metrics_path) {
+			serveMetrics(file_request);
+			return;
+		}
+		if (bundle_store.enabled()) {
+			serveBundled(file_request);
+			return;
+		}
 
-		// Serve file
-		ResponseBuilder resp_builder = ResponseBuilder().setStatusCode(StatusCode::OK);
-		if (method == "HEAD")
-			resp_builder.setHead();
-		// TODO: This current response model assumes we can load the file contents into memory and then send them.
-		//       This means we cannot send very large files. A better approach could be to read the file in chunks
-		//       and send them down the wire.
-		string resp = resp_builder.addFileBody(served_path).build();
-		if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR) {
-			std::cout << "send() failed: " << WSAGetLastError() << std::endl;
+		// Small files are answered from memory, which also spares us resolving the path.
+		// Clients accepting different encodings may get different responses, so they are cached separately.
+		// The cache only holds complete responses, so range requests always go to the file.
+		char encodings[16];
+		std::to_chars_result encodings_end = std::to_chars(encodings, encodings + sizeof(encodings), file_request.accepted_encodings);
+		std::pmr::string cache_key(&arena);
+		cache_key.reserve(file_request.path.length() + 4);
+		cache_key.append(file_request.path).append("\n").append(encodings, encodings_end.ptr);
+		std::shared_ptr<const CachedFile> cached = file_request.range.empty() ? file_cache.find(cache_key) : nullptr;
+		if (cached) {
+			bool not_modified = isNotModified(file_request.if_none_match, file_request.if_modified_since, cached->etag, cached->modified);
+			queueCachedResponse(not_modified ? cached->not_modified : cached, file_request.is_head, keep_alive);
+			if (!keep_alive) {
+				closeAfterResponse();
+			}
 			return;
 		}
+
+		// Parse request uri. Changes after this are noticed when caching the response.
+		unsigned long long cache_generation = file_cache.generation();
+		std::shared_ptr<const ResolvedPath> resolved;
+		{
+			StageTimer resolve_timer(Stage::Resolve);
+			resolved = path_resolver.resolve(file_request.path, cache_generation);
+		}
+		LOG(Debug) << "Resolved path: " << resolved->path;
+		serveFile(file_request, cache_key, cache_generation, *resolved);
 	}
 	catch (const std::exception& e) {
-		string resp = ResponseBuilder().setStatusCode(StatusCode::BadRequest).addFileBody(RESPONSE_400, false).build();
-		if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR) {
-			std::cout << "send() failed: " << WSAGetLastError() << std::endl;
+		queueBadRequest(e.what());
+	}
+}
+
+void HttpConnection::serveFile(const FileRequest& request, std::string_view cache_key, unsigned long long cache_generation,
+	const ResolvedPath& resolved) {
+	StageTimer timer(Stage::File);
+	if (!request.keep_alive) {
+		closeAfterResponse();
+	}
+
+	const string& served_path = resolved.path;
+	const struct stat& file_status = resolved.status;
+	if ((file_status.st_mode & S_IFREG) == 0) {
+		queueNotFound(request);
+		return;
+	}
+
+	std::string_view content_type = getMimeType(getFileExtension(served_path));
+	ResponseBuilder response(&arena, &memory);
+	response.setKeepAlive(request.keep_alive);
+
+	// Compressed variants are preferred: a precompressed sibling (`app.js.gz`) if there is one, otherwise the file
+	// compressed by us. Until that is done the file is sent uncompressed, and we don't cache that response.
+	std::pmr::string body_path(served_path, &arena);
+	struct stat body_status = file_status;
+	const char* content_encoding = nullptr;
+	std::shared_ptr<const string> compressed_body;
+	bool cacheable = true;
+	if (isCompressible(content_type)) {
+		// Caches must not hand out a compressed response to clients which can't decode it
+		response.addHeader("Vary", "Accept-Encoding");
+
+		ContentEncoding encodings[COMPRESSED_ENCODINGS];
+		size_t encoding_count = preferredEncodings(request.accepted_encodings, encodings);
+		for (size_t i = 0; i < encoding_count; i++) {
+			ContentEncoding encoding = encodings[i];
+			const struct stat& sibling_status = resolved.variants[(int)encoding];
+			if ((sibling_status.st_mode & S_IFREG) != 0) {
+				body_path.append(encodingFileSuffix(encoding));
+				body_status = sibling_status;
+				content_encoding = encodingName(encoding);
+				break;
+			}
+		}
+
+		if (!content_encoding && encoding_count > 0) {
+			CompressionCache::State state = compression_cache.find(served_path, file_status, encodings[0], compressed_body);
+			if (state == CompressionCache::State::Ready) {
+				content_encoding = encodingName(encodings[0]);
+			} else if (state == CompressionCache::State::Pending) {
+				cacheable = false;
+			}
+		}
+	}
+	if (content_encoding) {
+		response.addHeader("Content-Encoding", content_encoding);
+	}
+
+	// Revalidating clients get a 304 without us opening the file
+	char etag_buffer[96];
+	char date_buffer[32];
+	std::string_view etag = entityTag(body_status, content_encoding, etag_buffer);
+	std::string_view last_modified = formatHttpDate(body_status.st_mtime, date_buffer);
+	response.addHeader("ETag", etag).addHeader("Last-Modified", last_modified);
+	const string& cache_control = cacheControlFor(request.path, served_path);
+	if (!cache_control.empty()) {
+		response.addHeader("Cache-Control", cache_control);
+	}
+	if (isNotModified(request.if_none_match, request.if_modified_since, etag, body_status.st_mtime)) {
+		queueResponse(response.notModified());
+		return;
+	}
+
+	// The file is opened below the root again, the path may have been resolved a while ago
+	std::shared_ptr<OpenFile> file;
+	if (!compressed_body) {
+		file = std::allocate_shared<OpenFile>(std::pmr::polymorphic_allocator<OpenFile>(&memory), path_resolver.openFile(body_path.c_str()));
+	}
+
+	// Only the requested parts of the file are read from disk. Our compressed copies are only sent whole.
+	if (!request.range.empty() && !compressed_body && ifRangeMatches(request.if_range, etag, last_modified)) {
+		std::pmr::vector<ByteRange> ranges(&arena);
+		if (file->isOpen() && parseRanges(request.range, file->size(), ranges)) {
+			if (ranges.empty()) {
+				char content_range[32];
+				int length = snprintf(content_range, sizeof(content_range), "bytes */%lld", file->size());
+				response.setStatusCode(StatusCode::RangeNotSatisfiable).addHeader("Content-Range", std::string_view(content_range, (size_t)length));
+			} else {
+				response.addHeader("Accept-Ranges", "bytes").addFileRanges(file, 0, file->size(), ranges, content_type);
+			}
+			queueResponse(response);
 			return;
 		}
+	}
+
+	response.setStatusCode(StatusCode::OK).addHeader("Content-Type", content_type);
+	if (!compressed_body) {
+		response.addHeader("Accept-Ranges", "bytes");
+	}
+
+	std::shared_ptr<const CachedFile> cached;
+	if (compressed_body) {
+		cached = file_cache.store(cache_key, served_path, response, compressed_body, cache_generation);
+	} else if (cacheable) {
+		cached = file_cache.load(cache_key, body_path, *file, response, cache_generation);
+	}
+	if (cached) {
+		queueCachedResponse(cached, request.is_head, request.keep_alive);
+		return;
+	}
+
+	if (request.is_head) {
+		response.setHead();
+	}
+	if (compressed_body) {
+		response.addBody(compressed_body);
+	} else {
+		response.addFileBody(file);
+	}
+	queueResponse(response);
+}
+
+void HttpConnection::serveBundled(const FileRequest& request) {
+	StageTimer timer(Stage::File);
+	if (!request.keep_alive) {
+		closeAfterResponse();
+	}
+
+	// The bundle's paths are decoded, most request paths have nothing to decode though
+	const std::shared_ptr<const Bundle>& bundle = bundle_store.current();
+	const BundleEntry* entry = request.path.find('%') == std::string_view::npos ? bundle->find(request.path)
+		: bundle->find(decodeEscapeSequences(string(request.path)));
+	if (!entry) {
+		queueNotFound(request);
+		return;
+	}
+
+	// The bundle holds the variants the packer found worth it, the best one the client accepts is sent
+	const BundleVariant* variant = &entry->variants[(int)ContentEncoding::Identity];
+	ContentEncoding encodings[COMPRESSED_ENCODINGS];
+	size_t encoding_count = preferredEncodings(request.accepted_encodings, encodings);
+	for (size_t i = 0; i < encoding_count; i++) {
+		if (entry->variants[(int)encodings[i]].response.length > 0) {
+			variant = &entry->variants[(int)encodings[i]];
+			break;
+		}
+	}
 
-		std::cout << "\tFailed to parse request. Exception msg: " << e.what() << std::endl;
+	const BundleResponse& stored = variant->response;
+	std::string_view head = bundle->bytes(stored.offset, stored.head_length);
+	std::string_view etag = head.substr(variant->etag_offset, variant->etag_length);
+	if (isNotModified(request.if_none_match, request.if_modified_since, etag, (time_t)entry->modified)) {
+		queueBundled(bundle, variant->not_modified, StatusCode::NotModified, true, request.keep_alive);
 		return;
 	}
+
+	// Ranges are sent from the bundle's file, with the representation's headers repeated from the stored response
+	long long body_length = (long long)(stored.length - stored.head_length);
+	char date_buffer[32];
+	if (!request.range.empty() && ifRangeMatches(request.if_range, etag, formatHttpDate((time_t)entry->modified, date_buffer))) {
+		std::pmr::vector<ByteRange> ranges(&arena);
+		if (parseRanges(request.range, body_length, ranges)) {
+			ResponseBuilder response(&arena, &memory);
+			response.setKeepAlive(request.keep_alive).addHeaderLines(head.substr(variant->fields_offset, variant->fields_length));
+			if (ranges.empty()) {
+				char content_range[32];
+				int length = snprintf(content_range, sizeof(content_range), "bytes */%lld", body_length);
+				response.setStatusCode(StatusCode::RangeNotSatisfiable).addHeader("Content-Range", std::string_view(content_range, (size_t)length));
+			} else {
+				response.addFileRanges(bundle->file(), (long long)(stored.offset + stored.head_length), body_length, ranges,
+					bundle->bytes(entry->content_type_offset, entry->content_type_length));
+			}
+			queueResponse(response);
+			return;
+		}
+	}
+
+	queueBundled(bundle, stored, StatusCode::OK, request.is_head, request.keep_alive);
+}
+
+void HttpConnection::queueBundled(const std::shared_ptr<const Bundle>& bundle, const BundleResponse& stored, StatusCode status,
+	bool is_head, bool keep_alive) {
+	std::string_view response = bundle->bytes(stored.offset, stored.length);
+	long long body_length = (long long)(stored.length - stored.head_length);
+	bool body_from_file = !is_head && body_length > BUNDLE_MEMORY_BODY_MAX_SIZE;
+	queueSerialized(is_head || body_from_file ? response.substr(0, stored.head_length) : response, stored.connection_offset,
+		bundle, keep_alive);
+	if (body_from_file && http2) {
+		http2->queueFileBody(bundle->file(), (long long)(stored.offset + stored.head_length), body_length);
+	} else if (body_from_file) {
+		queueFile(bundle->file(), (long long)(stored.offset + stored.head_length), body_length);
+	}
+	response_status = status;
+	response_body_length = is_head ? 0 : body_length;
+	metrics.countResponse(status);
+}
+
+void HttpConnection::queueNotFound(const FileRequest& request) {
+	ResponseBuilder response(&arena, &memory);
+	response.setStatusCode(StatusCode::NotFound).setKeepAlive(request.keep_alive);
+	if (request.is_head) {
+		response.setHead();
+	}
+	queueResponse(response.addFileBody(RESPONSE_404, false));
+}
+
+void HttpConnection::serveMetrics(const FileRequest& request) {
+	if (!request.keep_alive) {
+		closeAfterResponse();
+	}
+	ResponseBuilder response = ResponseBuilder().setStatusCode(StatusCode::OK).setKeepAlive(request.keep_alive)
+		.addHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+		.addHeader("Cache-Control", "no-store")
+		.addBody(std::make_shared<const string>(metrics.render()));
+	if (request.is_head) {
+		response.setHead();
+	}
+	queueResponse(response);
+}
+
+void serveClient(SOCKET client_socket) {
+	HttpConnection connection;
+	if (logger.accessLogEnabled()) {
+		connection.setClientAddress(peerAddress(client_socket));
+	}
+
+	// A client which does not read its response makes the blocking send fail
+	setSendTimeout(client_socket, server_config.send_timeout * 1000LL);
+
+	char recv_buffer[1024 * 4];
+	while (!connection.isFinished()) {
+		if (connection.wantsInput()) {
+			// Every receive only waits until the connection's deadline, so trickling a request does not extend it
+			long long remaining = connection.deadline() - monotonicMilliseconds();
+			if (remaining <= 0) {
+				connection.onReceiveEnd(true);
+				continue;
+			}
+			setReceiveTimeout(client_socket, remaining);
+
+			long long receive_start = metrics.stageStart();
+			int bytes = recv(client_socket, recv_buffer, sizeof(recv_buffer), 0);
+			if (bytes > 0) {
+				metrics.recordStage(Stage::Receive, receive_start);
+			}
+			if (bytes == SOCKET_ERROR) {
+				int err = WSAGetLastError();
+
+				if (err != WSAETIMEDOUT) {
+					LOG(Info) << "recv() failed: " << err;
+					return;
+				}
+
+				connection.onReceiveEnd(true);
+			} else if (bytes == 0) {
+				connection.onReceiveEnd(false);
+			} else {
+				connection.onReceive(recv_buffer, bytes);
+			}
+		}
+
+		while (connection.hasPendingOutput()) {
+			long long send_start = metrics.stageStart();
+			int sent;
+			if (connection.pendingOutputIsFile()) {
+				sent = sendFile(client_socket, connection.pendingFile(), connection.pendingFileOffset(), connection.pendingFileLength());
+				if (sent == 0) {
+					LOG(Warning) << "File ended before its announced length.";
+					return;
+				}
+			} else {
+				SendBuffer buffers[MAX_SEND_BUFFERS];
+				size_t count = connection.pendingBuffers(buffers, MAX_SEND_BUFFERS);
+				sent = sendBuffers(client_socket, buffers, count, connection.pendingOutputContinues());
+			}
+			if (sent == SOCKET_ERROR) {
+				LOG(Info) << "send() failed: " << WSAGetLastError();
+				return;
+			}
+			metrics.recordStage(Stage::Send, send_start);
+			connection.consumeOutput(sent);
+		}
+	}
 }
\ No newline at end of file
@@ -3,49 +3,385 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
 #include <vector>
+#include <sys/stat.h>
 
 #include "server_settings.h"
 #include "status_code.h"
 #include "mime_types.h"
 #include "string_utils.h"
 #include "sockets.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "path_resolver.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "bundle.h"
+#include "http2.h"
+#include "proxy.h"
 
 using std::string;
 
-// Builds an HTTP response
+// A file opened for reading. Response bodies keep the file open instead of holding its contents in memory,
+// and the file is closed when the last response referencing it was sent.
+class OpenFile {
+	int fd;
+	long long file_size;
+public:
+	// Check `isOpen()`, the file may be missing or not be a regular file
+	explicit OpenFile(const char* path);
+	// Takes over a descriptor opened for reading, -1 if opening failed
+	explicit OpenFile(int fd);
+	~OpenFile();
+	OpenFile(const OpenFile&) = delete;
+	OpenFile& operator=(const OpenFile&) = delete;
+
+	bool isOpen() const { return fd != -1; }
+	int descriptor() const { return fd; }
+	long long size() const { return file_size; }
+	// Reads the whole file into `contents`. Returns false if it can't be read or is not `size()` bytes long anymore.
+	bool read(string& contents) const;
+};
+
+// A range of bytes of a file, as requested with a `Range` header
+struct ByteRange {
+	long long offset;
+	long long length;
+};
+
+// The status line, `Server`, the other headers, `Content-Length: 0` and `Connection` with the empty line
+#define RESPONSE_HEAD_BUFFERS 5
+
+// Builds an HTTP response.
+// Headers are encoded as they are added, and the lines every response has come from static storage, so the
+// response is serialized as a list of buffers (`headBuffers`) without assembling it in one string first.
 class ResponseBuilder {
+public:
+	// A piece of a body sent from the file: `prefix` (e.g. the headers of a multipart part), followed by
+	// `length` bytes of the file starting at `offset`
+	struct FilePart {
+		string prefix;
+		long long offset;
+		long long length;
+	};
+private:
 	StatusCode statusCode;
-	std::vector<std::pair<string, string>> headers;
+	std::pmr::string headerLines; // `Name: value\r\n` for every header added
 	bool hasBody;
-	string body;
-	string bodyType;
+	std::shared_ptr<const string> body; // Shared with the output, it is not copied behind the headers
+	std::shared_ptr<OpenFile> bodyFile; // Sent after the headers instead of `body`, as `fileParts`
+	std::pmr::vector<FilePart> fileParts;
+	std::pmr::memory_resource* fileMemory; // Allocates `bodyFile`, which lives until the response was sent
 	bool isHead;
+	bool hasContentLength;
+	bool keepAlive;
 public:
-	ResponseBuilder() : statusCode(StatusCode::Missing), hasBody(false), isHead(false) {
-		addHeader("Server", SERVER_HEADER);
+	// Every response gets a `Server` header, which is not part of `headerLines`.
+	// The headers are kept in `memory`, which only has to live as long as the builder (a copy uses the default
+	// resource). An opened body file is allocated from `file_memory`, which has to outlive the sent response.
+	explicit ResponseBuilder(std::pmr::memory_resource* memory = std::pmr::get_default_resource(),
+		std::pmr::memory_resource* file_memory = std::pmr::get_default_resource())
+		: statusCode(StatusCode::Missing), headerLines(memory), hasBody(false), fileParts(memory), fileMemory(file_memory),
+		isHead(false), hasContentLength(false), keepAlive(false) {
+		headerLines.reserve(256);
 	}
 
 	ResponseBuilder& setStatusCode(StatusCode code);
+	StatusCode getStatusCode() const { return statusCode; }
+
+	ResponseBuilder& addHeader(std::string_view name, std::string_view value);
+	ResponseBuilder& addHeader(std::string_view name, long long value);
+	// Adds header lines which are serialized already, as `Name: value\r\n` each
+	ResponseBuilder& addHeaderLines(std::string_view lines);
 
-	ResponseBuilder& addHeader(const string& name, const string& value);
+	bool hasHeader(std::string_view name) const;
 
-	// Throws if the response already has a body
-	ResponseBuilder& addBody(const string& contents);
+	// The value of the first header named `name`, or an empty view. It is valid until the next header is added.
+	std::string_view getHeader(std::string_view name) const;
 
-	// Throws if the response already has a body.
+	// Throws if the response already has a body. The contents are shared, not copied.
+	ResponseBuilder& addBody(std::shared_ptr<const string> contents);
+
+	// Throws if the response already has a body. Adds a `Content-Type` header matching the file, unless there is one.
 	// By default sets status code and body to 404 response if file can not be read,
 	// else if fail_with_404 is false throws std::runtime_error.
-	ResponseBuilder& addFileBody(const string& filepath, bool fail_with_404 = true);
+	ResponseBuilder& addFileBody(const char* filepath, bool fail_with_404 = true);
+	// Like the above for a file opened by the caller, without adding a `Content-Type` header
+	ResponseBuilder& addFileBody(const std::shared_ptr<OpenFile>& file, bool fail_with_404 = true);
+
+	// Sets a `206 Partial Content` response with the `ranges` of a representation of `size` bytes, which are stored in
+	// `file` from `offset` on, as its body. A single range is sent as is, several ones as `multipart/byteranges` with
+	// `content_type` for every part. Throws if the response already has a body.
+	ResponseBuilder& addFileRanges(const std::shared_ptr<OpenFile>& file, long long offset, long long size,
+		const std::pmr::vector<ByteRange>& ranges, std::string_view content_type);
 
 	ResponseBuilder& setHead();
 
-	// Builds the response string. Throws if no status code was set.
+	// A `304 Not Modified` response for this one, with the headers a 304 has to repeat: the validators,
+	// the caching headers and `Vary`
+	ResponseBuilder notModified() const;
+
+	// Whether the connection stays open after this response. By default it is closed.
+	ResponseBuilder& setKeepAlive(bool keep_alive);
+
+	// Serializes the status line and headers into `buffers`, including the `Connection` header and a `Content-Length`
+	// header even if there is no body, so the client can find the end of the response on a persistent connection.
+	// Returns the number of buffers used. They point into static storage and into the builder, so they are only
+	// valid as long as it is not modified. The body follows as `memoryBody()`, or from `fileBody()`.
+	// Throws if no status code was set.
+	size_t headBuffers(SendBuffer (&buffers)[RESPONSE_HEAD_BUFFERS]) const;
+
+	// The body to send after the head if it is in memory, null if there is none or it is a HEAD response
+	std::shared_ptr<const string> memoryBody() const { return isHead || bodyFile ? nullptr : body; }
+
+	// The whole response as one string, which is what `headBuffers` and `memoryBody` describe.
+	// A body added with `addFileBody` or `addFileRanges` is not included.
 	string build() const;
+
+	// The file to send as the body after the head, null if there is none
+	const std::shared_ptr<OpenFile>& fileBody() const { return bodyFile; }
+	const std::pmr::vector<FilePart>& bodyFileParts() const { return fileParts; }
 };
 
-// Resolves a request uri to a local absolute path. Throws is the URI is invalid.
-string resolveRequestURI(const string& request_uri);
+// Per-connection HTTP state machine.
+// It does no I/O itself: received bytes are fed in as they arrive and the response bytes are queued,
+// so the same logic can be driven by a blocking thread (`serveClient`) or by a readiness-based event loop.
+// Persistent connections are supported, and pipelined requests are answered in order from the buffered input.
+// A connection starting with the HTTP/2 preface is handed to an `Http2Session`, which feeds the requests of its
+// streams through the same request handling.
+// Requests matching a proxy route are passed to an upstream (`ProxyExchange`). The driver holds the upstream
+// connection: it sends `pendingUpstreamOutput()` on it and feeds what it receives to `onUpstreamReceive()`, and the
+// response is queued as it arrives.
+class HttpConnection {
+	friend class Http2Session;
+public:
+	// A piece of the response output: either bytes in memory, a range of an open file, or bytes the driver moved
+	// from an upstream into its pipe
+	struct OutputChunk {
+		std::pmr::string data; // Bytes owned by the chunk
+		// Sent instead of `data` if not empty, without copying it: e.g. a cached response or a response body.
+		// `owner` keeps the memory alive, static memory has none.
+		std::string_view shared;
+		std::shared_ptr<const void> owner;
+		std::shared_ptr<OpenFile> file;
+		long long file_offset;
+		long long file_length; // Also the length of a piped chunk
+		bool piped;
+	};
+private:
+	// The parts of a request which decide how a file is served. The views point into the received input.
+	struct FileRequest {
+		std::string_view path; // Request path without the query
+		unsigned accepted_encodings; // Mask of `ContentEncoding`s
+		bool is_head;
+		bool keep_alive;
+		std::string_view range; // `Range`, only set for GET requests
+		std::string_view if_range;
+		std::string_view if_none_match;
+		std::string_view if_modified_since;
+	};
+
+	// The connection's own allocator, for the output and the files it sends. Memory freed by a sent response is
+	// reused by the next one, so a connection serving requests makes no calls to the shared heap.
+	std::pmr::unsynchronized_pool_resource memory;
+	// Data of the request being handled, which is all dropped at once when it was answered. Requests needing
+	// more than the inline buffer take it from `memory`.
+	alignas(std::max_align_t) char arena_buffer[REQUEST_ARENA_SIZE];
+	std::pmr::monotonic_buffer_resource arena;
+	string input; // Received bytes
+	size_t input_offset; // Start of the bytes in `input` which were not processed yet
+	HttpRequestParser parser; // Parses the request at `input_offset`, resuming as more input arrives
+	size_t body_remaining; // Bytes of the current request's body which still have to be skipped
+	// Response output waiting to be sent. Chunks are only ever appended behind the front one, so the front
+	// chunk stays valid while a driver sends it asynchronously.
+	std::pmr::deque<OutputChunk> output;
+	size_t output_offset; // Bytes of the front chunk's `data` which were already sent
+	long long output_length; // Unsent bytes in all chunks
+	size_t gathered_chunks; // Chunks handed out by the last `pendingBuffers()`, they must not change until sent
+	unsigned requests_served;
+	string client_address; // For the access log
+	StatusCode response_status; // Status and body length of the last queued response, for the access log
+	long long response_body_length;
+	bool input_ended; // The client closed its sending half of the connection
+	bool closing; // No further requests are processed, the connection is closed once the output is sent
+	bool draining; // The server is being replaced, the connection is not kept alive after the next response
+	std::unique_ptr<Http2Session> http2; // Set once the client sent the HTTP/2 preface
+	std::unique_ptr<ProxyExchange> proxy; // Created for the first proxied request, and reused by the next ones
+	bool proxying; // `proxy` holds the request being handled
+	// The proxied request ended, the driver has to release the upstream connection before the next request
+	bool upstream_finished;
+	bool upstream_reusable; // The released upstream connection can be used for another request
+	bool secure; // The client connected over TLS, which the upstream is told
+	// Monotonic times the deadlines are measured from
+	long long request_start; // The first bytes of the request being received arrived
+	long long last_receive;
+	long long last_send; // The output last made progress or started to be pending, or the connection was opened
+
+	// Handles all complete requests in the input, unless too much output is already waiting to be sent
+	void processInput();
+	// Returns true if the input is the HTTP/2 preface, or may still turn out to be, and starts the session once it is
+	bool startHttp2();
+	// Drops the processed input once it makes up most of the buffer
+	void dropProcessedInput();
+	// Interprets the headers of a parsed request and queues the matching response
+	void handleRequest(const HttpRequest& request);
+	// Queues the response for a file which is not cached yet, or a 404 if it does not exist.
+	// Picks the best encoding the client accepts, answers conditional requests with a 304 and range requests
+	// with a 206, and caches the full response under `cache_key` if possible.
+	// `cache_generation` is the file cache generation from before the path was resolved.
+	void serveFile(const FileRequest& request, std::string_view cache_key, unsigned long long cache_generation,
+		const ResolvedPath& resolved);
+	void queueResponse(const ResponseBuilder& response);
+	// The chunk to append `length` more bytes of output to
+	std::pmr::string& outputTail(size_t length);
+	// Copies `data` behind the output, where it is merged with the output of earlier responses if possible
+	void queueOutput(std::string_view data);
+	// Queues `data` without copying it, `owner` keeps it alive until it was sent
+	void queueShared(std::string_view data, std::shared_ptr<const void> owner);
+	// Queues `length` bytes of `file` from `offset` on, which are sent without copying them to user space
+	void queueFile(const std::shared_ptr<OpenFile>& file, long long offset, long long length);
+	void queueCachedResponse(const std::shared_ptr<const CachedFile>& cached, bool is_head, bool keep_alive);
+	// Queues a response serialized for a persistent connection without copying it, `owner` keeps it alive until it
+	// was sent. On the last response the `Connection` header at `connection_offset` is swapped.
+	void queueSerialized(std::string_view response, size_t connection_offset, const std::shared_ptr<const void>& owner,
+		bool keep_alive);
+	// Queues the response for a request path from the current bundle, or a 404 if the bundle does not have it.
+	// Ranges and conditional requests are answered like in `serveFile`.
+	void serveBundled(const FileRequest& request);
+	// Queues a response stored in `bundle`. Small bodies are sent from the mapping together with the head, larger
+	// ones from the bundle's file, which the kernel sends without copying them.
+	void queueBundled(const std::shared_ptr<const Bundle>& bundle, const BundleResponse& stored, StatusCode status,
+		bool is_head, bool keep_alive);
+	void queueNotFound(const FileRequest& request);
+	// Queues the metrics in the Prometheus text format
+	void serveMetrics(const FileRequest& request);
+	// Queues a 400 response and closes the connection after it (HTTP/1)
+	void queueBadRequest(const char* reason);
+	// Closes the connection once the response to the current request was sent. Over HTTP/2 the client is sent a
+	// GOAWAY instead, so it can finish its other streams.
+	void closeAfterResponse();
+	// Writes the access log entry for the last queued response, `request` is null if it could not be parsed
+	void logAccess(const HttpRequest* request);
+
+	// Passes the request to an upstream of `route`. A request over HTTP/2 is refused, as upstreams speak HTTP/1.1,
+	// and without a healthy upstream it is answered with a 503.
+	void startProxy(ProxyRoute& route, const HttpRequest& request, bool keep_alive, long long content_length, bool chunked);
+	// Moves received request body bytes to the exchange, as far as its buffer allows
+	void feedProxyBody();
+	// The response passed through completely
+	void finishProxy();
+	// The upstream failed: the client gets `status` if no response was passed on yet, otherwise the connection is closed
+	void failProxy(StatusCode status);
+	// The client broke off the proxied request, the connection is closed
+	void abortProxy();
+	// Logs the proxied request and lets the connection go on with the next request
+	void endProxy();
+	// When the upstream has to have made progress, LLONG_MAX while it waits for the client
+	long long proxyDeadline() const;
+	void queuePiped(size_t length);
+public:
+	HttpConnection() : arena(arena_buffer, sizeof(arena_buffer), &memory), input_offset(0), body_remaining(0), output(&memory),
+		output_offset(0), output_length(0), gathered_chunks(0), requests_served(0), response_status(StatusCode::Missing), response_body_length(0), input_ended(false), closing(false), draining(false),
+		proxying(false), upstream_finished(false), upstream_reusable(false), secure(false) {
+		request_start = last_receive = last_send = monotonicMilliseconds();
+		metrics.countConnection(true);
+	}
+	~HttpConnection() { metrics.countConnection(false); }
+	HttpConnection(const HttpConnection&) = delete;
+	HttpConnection& operator=(const HttpConnection&) = delete;
+
+	// The client's address as it is written to the access log
+	void setClientAddress(string address) { client_address = std::move(address); }
+	// The client connected over TLS
+	void setSecure() { secure = true; }
+
+	// Consumes received bytes and queues the responses for all complete requests.
+	void onReceive(const char* data, size_t length);
+
+	// Called when the client stopped sending, either because the connection timed out or because the client
+	// closed its half of the connection. A partially received request is answered with a 400.
+	void onReceiveEnd(bool timed_out);
+
+	// False once the connection is closing, or while the client has to read its responses before we accept more requests
+	bool wantsInput() const;
+	// True if no partially received request is buffered, i.e. the connection waits for a new request
+	bool isIdle() const { return input_offset == input.length() && body_remaining == 0 && !proxying; }
+
+	// The pending output is either bytes in memory, which are gathered from the chunks up to the next file into
+	// `pendingBuffers()` to send them with a single `writev`, or a range of a file (`pendingFile()`), which should
+	// be sent without copying it to user space.
+	bool hasPendingOutput() const { return !output.empty(); }
+	bool pendingOutputIsFile() const { return output.front().file != nullptr; }
+	// The pending output is `pendingFileLength()` bytes at the front of the driver's pipe
+	bool pendingOutputIsPipe() const { return output.front().piped; }
+	// Fills `buffers` with up to `max_count` pieces of the pending memory output and returns how many.
+	// They stay valid until `consumeOutput()`, even if more output is queued in the meantime.
+	size_t pendingBuffers(SendBuffer* buffers, size_t max_count);
+	int pendingFile() const { return output.front().file->descriptor(); }
+	long long pendingFileOffset() const { return output.front().file_offset; }
+	// Unsent bytes of the pending file range or pipe
+	size_t pendingFileLength() const;
+	// True if more output follows what is being sent, so the kernel may wait for it before sending a packet
+	bool pendingOutputContinues() const { return output.size() > std::max<size_t>(gathered_chunks, 1); }
+	// Marks `length` bytes of the pending output as sent, which may allow processing more pipelined requests
+	void consumeOutput(size_t length);
+
+	// True when the last response was fully sent and the connection should be closed
+	bool isFinished() const { return closing && !hasPendingOutput(); }
+
+	// Answers the next request with `Connection: close`. Closing an idle connection right away would race with
+	// the client sending its next request on it, so that is left to the keep-alive timeout. An HTTP/2 client is sent
+	// a GOAWAY, which tells it which streams were taken. They are answered, and the client gets a short while to
+	// close the connection itself.
+	void drain() {
+		draining = true;
+		if (http2) {
+			http2->goAway();
+		}
+	}
+
+	// The upstream a proxied request waits to be sent to, null if there is none. The driver takes an idle connection
+	// to it from its pool or opens one, and calls `onUpstreamConnected()` once it is established.
+	Upstream* wantedUpstream() const { return proxying ? proxy->upstream() : nullptr; }
+	void onUpstreamConnected() { proxy->onConnected(); }
+	// The request bytes to send to the upstream, which stay valid until `consumeUpstreamOutput()`
+	std::string_view pendingUpstreamOutput() const { return proxying ? proxy->pendingRequest() : std::string_view(); }
+	// Marks `length` bytes as sent to the upstream, which makes room for more of the request body
+	void consumeUpstreamOutput(size_t length);
+	// False while the client has to read the response before more of it is received
+	bool wantsUpstreamInput() const { return proxying && output_length < MAX_PENDING_OUTPUT; }
+	// Queues the response bytes received from the upstream
+	void onUpstreamReceive(const char* data, size_t length);
+	// Response body bytes which the driver may move from the upstream socket into its pipe without looking at them
+	// (splice), 0 if it has to receive them with `onUpstreamReceive()`
+	long long upstreamSpliceLength() const { return proxying ? proxy->rawBodyRemaining() : 0; }
+	// Queues `length` bytes the driver moved into its pipe, to be moved to the client behind the output before them
+	void onUpstreamSpliced(size_t length);
+	// A reused upstream connection was closed before the response started, which happens when the upstream closed
+	// it while idle. Returns true if the request can be sent again on a new connection.
+	bool retryUpstream() { return proxying && proxy->restart(); }
+	// The upstream closed the connection (`failed` if it reset it or the connect failed)
+	void onUpstreamEnd(bool failed);
+	// The proxied request ended. The driver puts the upstream connection back into its pool if it is `reusable`,
+	// otherwise closes it, and calls `onUpstreamReleased()`.
+	bool upstreamFinished() const { return upstream_finished; }
+	bool upstreamReusable() const { return upstream_reusable; }
+	// Goes on with the requests pipelined behind the proxied one
+	void onUpstreamReleased();
+
+	// The monotonic time (`monotonicMilliseconds()`) at which the connection times out: when the headers, the body or
+	// the whole request take too long to arrive, the client does not read its pending output or an idle persistent
+	// connection is not used. It changes as bytes are received and sent, the driver has to check it after each.
+	// Once it passed, a connection with pending output should be closed, otherwise call `onReceiveEnd(true)`. While a
+	// request is proxied, it is also when the upstream times out, which is answered with a 504.
+	long long deadline() const;
+};
 
-// Serve an HTTP client
+// Serve an HTTP client using blocking socket calls
 void serveClient(SOCKET client_socket);
\ No newline at end of file
@@ -0,0 +1,724 @@
+#ifdef __linux__
+#include "io_uring_engine.h"
+
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+#include "server_settings.h"
+#include "http_server.h"
+#include "server_config.h"
+#include "timer_wheel.h"
+
+#define RING_ENTRIES 1024
+#define RECV_BUFFER_COUNT 512 // Must be a power of two
+#define RECV_BUFFER_SIZE (1024 * 4)
+#define RECV_BUFFER_GROUP 0
+#define SPLICE_PIPE_SIZE (1024 * 256) // File bodies are spliced through a pipe of this size per connection
+
+// Minimal io_uring wrapper over the raw syscalls, so we do not depend on liburing.
+class Ring {
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned sq_local_tail; // Tail including the entries we did not publish yet
+	unsigned sq_published; // Tail of the entries the kernel already consumed
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct io_uring_buf_ring* buffer_ring;
+	char* buffers;
+	unsigned short buffer_ring_tail;
+	bool legacy_buffers; // Buffers are handed over with IORING_OP_PROVIDE_BUFFERS instead of the buffer ring
+
+	bool bufferRingWorks();
+public:
+	Ring();
+
+	// Returns a zeroed submission queue entry. Submits the queued entries first if the queue is full.
+	struct io_uring_sqe* getSqe();
+	// Makes room for `count` entries, so linked entries are not split between two submissions
+	void reserveSqes(unsigned count);
+	// Submits all queued entries and waits until at least `wait_for` completions are available.
+	void submit(unsigned wait_for);
+
+	// Calls `handler` with a copy of every available completion.
+	template <typename Handler>
+	void forEachCompletion(Handler handler) {
+		unsigned head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe cqe = cqes[head & *cq_mask];
+			head++;
+			// We release the entry before handling it, since the handler may queue more operations
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			handler(cqe);
+		}
+	}
+
+	// Registers the receive buffers the kernel picks from for operations with IOSQE_BUFFER_SELECT
+	void setupBufferRing();
+	char* buffer(unsigned short buffer_id) { return buffers + (size_t)buffer_id * RECV_BUFFER_SIZE; }
+	// Hands a receive buffer back to the kernel
+	void recycleBuffer(unsigned short buffer_id);
+};
+
+Ring::Ring() : sq_local_tail(0), sq_published(0), buffer_ring(nullptr), buffers(nullptr), buffer_ring_tail(0), legacy_buffers(false) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	// We only ever touch a ring from the thread which owns it, which allows the kernel to skip some work
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = RING_ENTRIES * 8;
+	ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring_fd < 0 && errno == EINVAL) {
+		// Older kernels do not know the optimization flags
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = RING_ENTRIES * 8;
+		ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	}
+	if (ring_fd < 0) {
+		std::cerr << "io_uring_setup() failed: " << errno << std::endl;
+		exit(1);
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap && cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+
+	char* sq_ptr = (char*)mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	char* cq_ptr = sq_ptr;
+	if (!single_mmap && sq_ptr != MAP_FAILED) {
+		cq_ptr = (char*)mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	}
+	sqes = (struct io_uring_sqe*)mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+		std::cerr << "mmap() of the io_uring queues failed: " << errno << std::endl;
+		exit(1);
+	}
+
+	sq_entries = params.sq_entries;
+	sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+	sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+	sq_mask = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+	cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+	cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+	cq_mask = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+	sq_local_tail = sq_published = *sq_tail;
+}
+
+struct io_uring_sqe* Ring::getSqe() {
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+		submit(0);
+	}
+
+	unsigned index = sq_local_tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	sq_local_tail++;
+	return sqe;
+}
+
+void Ring::reserveSqes(unsigned count) {
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count > sq_entries) {
+		submit(0);
+	}
+}
+
+void Ring::submit(unsigned wait_for) {
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	while (true) {
+		unsigned to_submit = sq_local_tail - sq_published;
+		int result = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (result >= 0) {
+			sq_published += result;
+			return;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			std::cerr << "io_uring_enter() failed: " << errno << std::endl;
+			exit(1);
+		}
+		if (errno != EINTR) {
+			// The completion queue is full, the caller has to drain it before we can submit more
+			return;
+		}
+	}
+}
+
+void Ring::setupBufferRing() {
+	size_t ring_size = RECV_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	buffer_ring = (struct io_uring_buf_ring*)mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buffers = (char*)mmap(0, (size_t)RECV_BUFFER_COUNT * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer_ring == MAP_FAILED || buffers == MAP_FAILED) {
+		std::cerr << "mmap() of the receive buffers failed: " << errno << std::endl;
+		exit(1);
+	}
+
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (uint64_t)buffer_ring;
+	registration.ring_entries = RECV_BUFFER_COUNT;
+	registration.bgid = RECV_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) == 0) {
+		for (unsigned i = 0; i < RECV_BUFFER_COUNT; i++) {
+			recycleBuffer((unsigned short)i);
+		}
+		if (bufferRingWorks())
+			return;
+
+		syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+	}
+
+	// Buffer rings need Linux 5.19, and some kernels accept the registration but never select buffers
+	// from the ring. Providing the buffers with an operation works everywhere, at the cost of an extra
+	// submission queue entry per recycled buffer.
+	legacy_buffers = true;
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = RECV_BUFFER_COUNT;
+	sqe->addr = (uint64_t)buffers;
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->off = 0;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	submit(0);
+}
+
+bool Ring::bufferRingWorks() {
+	// Receive a single byte from a socket pair into a buffer from the ring
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+		return false;
+	bool works = false;
+	if (write(pair[1], "x", 1) == 1) {
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = pair[0];
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		submit(1);
+
+		forEachCompletion([this, &works](const struct io_uring_cqe& cqe) {
+			if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+				works = true;
+				recycleBuffer((unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			}
+		});
+	}
+	close(pair[0]);
+	close(pair[1]);
+	return works;
+}
+
+void Ring::recycleBuffer(unsigned short buffer_id) {
+	if (legacy_buffers) {
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = 1;
+		sqe->addr = (uint64_t)buffer(buffer_id);
+		sqe->len = RECV_BUFFER_SIZE;
+		sqe->off = buffer_id;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		return;
+	}
+
+	struct io_uring_buf* entry = &buffer_ring->bufs[buffer_ring_tail & (RECV_BUFFER_COUNT - 1)];
+	entry->addr = (uint64_t)buffer(buffer_id);
+	entry->len = RECV_BUFFER_SIZE;
+	entry->bid = buffer_id;
+	buffer_ring_tail++;
+	__atomic_store_n(&buffer_ring->tail, buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+// The operation kind is stored in the low bits of the completion's user data, the rest is the connection pointer
+enum UringOp : uint64_t {
+	OpIgnore = 0,
+	OpAccept = 1,
+	OpRecv = 2,
+	OpSend = 3,
+	OpTimer = 4,
+	OpSplice = 5,
+	OpWake = 6,
+	OpMask = 7
+};
+
+// The timer runs at the connection's `http.deadline()`, it is cancelled once the connection is closing
+struct alignas(8) UringConnection : TimerWheel::Timer {
+	SOCKET socket;
+	HttpConnection http;
+	bool receiving; // A multishot receive is armed
+	bool pausing; // The armed receive is being cancelled until the client reads its responses
+	bool sending; // A send is in flight
+	bool closing;
+	// io_uring has no sendfile, so file bodies are spliced into a pipe and from there into the socket
+	int pipe_read;
+	int pipe_write;
+	size_t pipe_capacity;
+	size_t piped; // Bytes of the pending file chunk which are in the pipe
+	// The kernel reads these while a gathered send is in flight
+	struct msghdr message;
+	struct iovec send_buffers[MAX_SEND_BUFFERS];
+};
+
+class UringLoop {
+	Shard& shard;
+	Ring ring;
+	std::unordered_set<UringConnection*> connections;
+	TimerWheel deadlines;
+	struct __kernel_timespec timer_interval; // Read by the kernel while the timer is armed
+	uint64_t wake_signals; // Written by the kernel when the shard's eventfd is read
+	bool draining; // The listening socket was handed over, the loop ends once the connections are closed
+
+	void armAccept();
+	void armTimer();
+	void armWake();
+	void armRecv(UringConnection* connection);
+	void cancelRecv(UringConnection* connection);
+	// Cancels the send in flight, and the splice linked to it
+	void cancelSend(UringConnection* connection);
+	// Queues sending the pending file chunk. Returns false if no pipe could be created.
+	bool spliceFile(UringConnection* connection);
+	// Sends pending output, or starts closing the connection once everything was sent
+	void continueSending(UringConnection* connection);
+	void beginClose(UringConnection* connection);
+	// Closes the socket and frees the connection once no operation references it anymore
+	void releaseIfIdle(UringConnection* connection);
+
+	void onAccept(const struct io_uring_cqe& cqe);
+	void onRecv(UringConnection* connection, const struct io_uring_cqe& cqe);
+	void onSend(UringConnection* connection, const struct io_uring_cqe& cqe);
+	void onSplice(UringConnection* connection, const struct io_uring_cqe& cqe);
+	// Called when the connection's deadline timer ran
+	void expire(UringConnection* connection);
+	// The connection's deadline, which is brought forward to the end of the drain
+	long long deadlineOf(UringConnection* connection) const;
+	// Stops accepting and lets every connection finish its request
+	void startDraining();
+public:
+	explicit UringLoop(Shard& shard);
+	void run();
+};
+
+UringLoop::UringLoop(Shard& shard) : shard(shard), deadlines(monotonicMilliseconds()), draining(false) {
+	ring.setupBufferRing();
+}
+
+void UringLoop::run() {
+	armAccept();
+	armTimer();
+	armWake();
+
+	while (!draining || !connections.empty()) {
+		ring.submit(1);
+		ring.forEachCompletion([this](const struct io_uring_cqe& cqe) {
+			UringConnection* connection = (UringConnection*)(cqe.user_data & ~(uint64_t)OpMask);
+			switch (cqe.user_data & OpMask) {
+			case OpAccept:
+				onAccept(cqe);
+				break;
+			case OpRecv:
+				onRecv(connection, cqe);
+				break;
+			case OpSend:
+				onSend(connection, cqe);
+				break;
+			case OpSplice:
+				onSplice(connection, cqe);
+				break;
+			case OpTimer:
+				deadlines.advance(monotonicMilliseconds(), [this](TimerWheel::Timer* timer) {
+					expire(static_cast<UringConnection*>(timer));
+				});
+				armTimer();
+				break;
+			case OpWake:
+				startDraining();
+				break;
+			default:
+				break;
+			}
+		});
+	}
+	// Submits the closes of the last connections
+	ring.submit(0);
+}
+
+void UringLoop::armAccept() {
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard.server_socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = OpAccept;
+}
+
+void UringLoop::armTimer() {
+	// Wakes up when the next deadline is due, and at least once a second. A deadline which was set in the meantime
+	// may be earlier, but then it runs less than a second late.
+	long long timeout = deadlines.timeUntilNext(monotonicMilliseconds());
+	if (timeout < 0 || timeout > 1000) {
+		timeout = 1000;
+	}
+	timer_interval.tv_sec = timeout / 1000;
+	timer_interval.tv_nsec = (timeout % 1000) * 1000000;
+
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)&timer_interval;
+	sqe->len = 1;
+	sqe->user_data = OpTimer;
+}
+
+void UringLoop::armWake() {
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = shard.wake_fd;
+	sqe->addr = (uint64_t)&wake_signals;
+	sqe->len = sizeof(wake_signals);
+	sqe->user_data = OpWake;
+}
+
+void UringLoop::armRecv(UringConnection* connection) {
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = (uint64_t)connection | OpRecv;
+	connection->receiving = true;
+	connection->pausing = false;
+}
+
+void UringLoop::cancelRecv(UringConnection* connection) {
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)connection | OpRecv;
+	sqe->user_data = OpIgnore;
+}
+
+void UringLoop::cancelSend(UringConnection* connection) {
+	ring.reserveSqes(2);
+	for (uint64_t op : { OpSplice, OpSend }) {
+		struct io_uring_sqe* sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)connection | op;
+		sqe->user_data = OpIgnore;
+	}
+}
+
+bool UringLoop::spliceFile(UringConnection* connection) {
+	if (connection->pipe_read == -1) {
+		int pipe_fds[2];
+		if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+			LOG(Warning) << "pipe2() failed: " << errno;
+			return false;
+		}
+		connection->pipe_read = pipe_fds[0];
+		connection->pipe_write = pipe_fds[1];
+		// A larger pipe means fewer round trips, but the kernel may limit its size
+		int capacity = fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+		connection->pipe_capacity = capacity > 0 ? capacity : fcntl(pipe_fds[1], F_GETPIPE_SZ);
+	}
+
+	ring.reserveSqes(2);
+	if (connection->piped == 0) {
+		// Move the next part of the file into the pipe. Only page references are moved, not the data.
+		// The splice into the socket is linked, so both run with a single submission.
+		struct io_uring_sqe* sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->splice_fd_in = connection->http.pendingFile();
+		sqe->splice_off_in = (uint64_t)connection->http.pendingFileOffset();
+		sqe->fd = connection->pipe_write;
+		sqe->off = (uint64_t)-1;
+		sqe->len = (unsigned)std::min(connection->http.pendingFileLength(), connection->pipe_capacity);
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uint64_t)connection | OpSplice;
+	}
+
+	// If the splice into the pipe comes up short, this one is cancelled and we retry with what arrived
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->splice_fd_in = connection->pipe_read;
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->fd = connection->socket;
+	sqe->off = (uint64_t)-1;
+	sqe->len = (unsigned)(connection->piped > 0 ? connection->piped : std::min(connection->http.pendingFileLength(), connection->pipe_capacity));
+	sqe->user_data = (uint64_t)connection | OpSend;
+	return true;
+}
+
+void UringLoop::continueSending(UringConnection* connection) {
+	if (connection->sending || connection->closing)
+		return;
+
+	if (connection->http.hasPendingOutput()) {
+		if (connection->http.pendingOutputIsFile()) {
+			if (!spliceFile(connection)) {
+				beginClose(connection);
+				return;
+			}
+		} else {
+			// The pending output stays untouched until the send completes. Everything in memory up to the next file
+			// goes out with one send, headers followed by a file body should share a packet with the start of the body.
+			SendBuffer buffers[MAX_SEND_BUFFERS];
+			size_t count = connection->http.pendingBuffers(buffers, MAX_SEND_BUFFERS);
+			struct io_uring_sqe* sqe = ring.getSqe();
+			sqe->fd = connection->socket;
+			sqe->msg_flags = MSG_NOSIGNAL | (connection->http.pendingOutputContinues() ? MSG_MORE : 0);
+			sqe->user_data = (uint64_t)connection | OpSend;
+			if (count == 1) {
+				sqe->opcode = IORING_OP_SEND;
+				sqe->addr = (uint64_t)buffers[0].data;
+				sqe->len = (unsigned)buffers[0].length;
+			} else {
+				for (size_t i = 0; i < count; i++) {
+					connection->send_buffers[i].iov_base = (void*)buffers[i].data;
+					connection->send_buffers[i].iov_len = buffers[i].length;
+				}
+				memset(&connection->message, 0, sizeof(connection->message));
+				connection->message.msg_iov = connection->send_buffers;
+				connection->message.msg_iovlen = count;
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->addr = (uint64_t)&connection->message;
+				sqe->len = 1;
+			}
+		}
+		connection->sending = true;
+	} else if (connection->http.isFinished()) {
+		beginClose(connection);
+	}
+}
+
+void UringLoop::beginClose(UringConnection* connection) {
+	if (connection->closing)
+		return;
+	connection->closing = true;
+	deadlines.cancel(*connection);
+
+	// Shutdown local send half of the connection. This is done right away rather than with IORING_OP_SHUTDOWN:
+	// the kernel may only look up the descriptor once it runs the operation on a worker thread, and by then the
+	// socket may already be closed and its number reused by a newly accepted client.
+	shutdown(connection->socket, SHUT_WR);
+
+	if (connection->receiving) {
+		// The armed receive references the connection, so it has to finish before we can free it
+		cancelRecv(connection);
+	}
+
+	releaseIfIdle(connection);
+}
+
+void UringLoop::releaseIfIdle(UringConnection* connection) {
+	if (!connection->closing || connection->receiving || connection->sending)
+		return;
+
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = connection->socket;
+	sqe->user_data = OpIgnore;
+	if (connection->pipe_read != -1) {
+		close(connection->pipe_read);
+		close(connection->pipe_write);
+	}
+
+	LOG(Debug) << "Client disconnected.";
+	connections.erase(connection);
+	delete connection;
+	shard.active.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void UringLoop::onAccept(const struct io_uring_cqe& cqe) {
+	if (!(cqe.flags & IORING_CQE_F_MORE) && !draining) {
+		// The kernel stopped the multishot accept (e.g. on an error), we have to re-arm it
+		armAccept();
+	}
+
+	if (cqe.res < 0) {
+		// A cancelled accept means we are draining
+		if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -ECANCELED) {
+			LOG(Warning) << "accept() failed: " << -cqe.res;
+		}
+		return;
+	}
+
+	UringConnection* connection = new UringConnection;
+	connection->socket = cqe.res;
+	setNoDelay(connection->socket);
+	connection->receiving = false;
+	connection->pausing = false;
+	connection->sending = false;
+	connection->closing = false;
+	connection->pipe_read = -1;
+	connection->pipe_write = -1;
+	connection->pipe_capacity = 0;
+	connection->piped = 0;
+	if (logger.accessLogEnabled()) {
+		connection->http.setClientAddress(peerAddress(connection->socket));
+	}
+	if (draining) {
+		// Accepted before the accept was cancelled
+		connection->http.drain();
+	}
+	connections.insert(connection);
+	shard.accepted.fetch_add(1, std::memory_order_relaxed);
+	shard.active.fetch_add(1, std::memory_order_relaxed);
+	deadlines.schedule(*connection, deadlineOf(connection));
+	armRecv(connection);
+}
+
+void UringLoop::onRecv(UringConnection* connection, const struct io_uring_cqe& cqe) {
+	if (!(cqe.flags & IORING_CQE_F_MORE)) {
+		connection->receiving = false;
+	}
+
+	if (cqe.flags & IORING_CQE_F_BUFFER) {
+		unsigned short buffer_id = (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		if (cqe.res > 0) {
+			connection->http.onReceive(ring.buffer(buffer_id), cqe.res);
+		}
+		ring.recycleBuffer(buffer_id);
+	}
+
+	if (connection->closing) {
+		releaseIfIdle(connection);
+		return;
+	}
+
+	if (cqe.res == 0) {
+		connection->http.onReceiveEnd(false);
+	} else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+		// The connection broke, there is nobody left to respond to
+		beginClose(connection);
+		return;
+	} else if (!connection->receiving && connection->http.wantsInput()) {
+		// We ran out of receive buffers, the kernel ended the multishot receive or we paused it, so we re-arm it
+		armRecv(connection);
+	} else if (connection->receiving && !connection->pausing && !connection->http.wantsInput()) {
+		// The client has to read its responses before we accept more pipelined requests
+		connection->pausing = true;
+		cancelRecv(connection);
+	}
+
+	// Sending may close and free the connection, while the deadline only depends on the pending output
+	deadlines.schedule(*connection, deadlineOf(connection));
+	continueSending(connection);
+}
+
+void UringLoop::onSend(UringConnection* connection, const struct io_uring_cqe& cqe) {
+	connection->sending = false;
+
+	if (connection->closing) {
+		releaseIfIdle(connection);
+		return;
+	}
+
+	if (cqe.res == -ECANCELED && connection->piped > 0) {
+		// The splice into the pipe came up short, we send what made it into the pipe
+		continueSending(connection);
+		return;
+	}
+	if (cqe.res <= 0) {
+		beginClose(connection);
+		return;
+	}
+
+	if (connection->http.pendingOutputIsFile()) {
+		connection->piped -= cqe.res;
+	}
+	connection->http.consumeOutput(cqe.res);
+	if (!connection->receiving && connection->http.wantsInput()) {
+		// Resume receiving after we paused it to let the client catch up
+		armRecv(connection);
+	}
+	deadlines.schedule(*connection, deadlineOf(connection));
+	continueSending(connection);
+}
+
+void UringLoop::onSplice(UringConnection* connection, const struct io_uring_cqe& cqe) {
+	// The linked splice into the socket is still to complete, so the connection stays alive
+	if (cqe.res > 0) {
+		connection->piped += cqe.res;
+	} else if (!connection->closing) {
+		// A truncated file can't deliver the announced length anymore, or splicing failed
+		beginClose(connection);
+	}
+}
+
+void UringLoop::expire(UringConnection* connection) {
+	bool drained = draining && monotonicMilliseconds() >= shard.drain_deadline;
+	if (drained || connection->http.hasPendingOutput()) {
+		// The client stopped reading, or the drain ended. A send waiting for the client is cancelled, so the
+		// connection can be freed.
+		LOG(Debug) << (drained ? "Connection closed at the end of the drain." : "Client did not read its response in time.");
+		if (connection->sending) {
+			cancelSend(connection);
+		}
+		beginClose(connection);
+		return;
+	}
+
+	// A started request is answered with a 400, an idle connection is just closed
+	connection->http.onReceiveEnd(true);
+	deadlines.schedule(*connection, deadlineOf(connection));
+	continueSending(connection);
+}
+
+long long UringLoop::deadlineOf(UringConnection* connection) const {
+	long long deadline = connection->http.deadline();
+	return draining ? std::min(deadline, shard.drain_deadline) : deadline;
+}
+
+void UringLoop::startDraining() {
+	if (draining || !shard.draining.load(std::memory_order_acquire)) {
+		armWake();
+		return;
+	}
+	draining = true;
+
+	// The successor accepts from the same listening socket now
+	struct io_uring_sqe* sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = OpAccept;
+	sqe->user_data = OpIgnore;
+
+	std::vector<UringConnection*> open(connections.begin(), connections.end());
+	for (UringConnection* connection : open) {
+		if (connection->closing)
+			continue;
+		connection->http.drain();
+		deadlines.schedule(*connection, deadlineOf(connection));
+		continueSending(connection);
+	}
+}
+
+void runIoUringEngine(Shard& shard) {
+	UringLoop loop(shard);
+	loop.run();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+#ifdef __linux__
+
+#include "shards.h"
+
+// Serves a shard's connections with io_uring on the calling thread and never returns. Requires Linux 6.0 or newer.
+// Every shard owns a ring with a multishot accept on the listening socket, multishot receives
+// into a provided buffer ring and sends. All operations queued while handling a batch of completions
+// are submitted together with the wait for the next batch, so a busy loop costs a single
+// `io_uring_enter` per batch instead of a syscall per operation.
+void runIoUringEngine(Shard& shard);
+
+#endif
\ No newline at end of file
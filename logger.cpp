@@ -0,0 +1,455 @@
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+Logger logger;
+
+thread_local Logger::RingHandle Logger::thread_ring;
+
+// Records in the rings start at multiples of this, so their headers can be read in place
+#define LOG_RECORD_ALIGNMENT 16
+// Longer strings in access log entries are truncated
+#define LOG_MAX_FIELD_LENGTH 1024
+// The writer hands formatted entries to stdout in pieces of about this size
+#define LOG_WRITE_BATCH_SIZE (64 * 1024)
+
+enum class RecordType : uint8_t {
+	Padding, // Fills the end of the ring when a record did not fit there
+	Message,
+	Access
+};
+
+struct RecordHeader {
+	uint32_t length; // Of the whole record, a multiple of LOG_RECORD_ALIGNMENT
+	RecordType type;
+	LogLevel level;
+	uint16_t detail; // The status code of an access record, the text length of a message
+	long long time; // Microseconds since the epoch
+};
+static_assert(sizeof(RecordHeader) == LOG_RECORD_ALIGNMENT, "Padding records must fit in any gap");
+
+// The fixed part of an access record, followed by the strings in the order of `lengths`:
+// client address, method, URI, version, referer and user agent
+struct AccessFields {
+	long long body_length;
+	uint16_t lengths[6];
+};
+
+// A single-producer single-consumer ring of records. The thread owning it appends records and the writer thread
+// removes them, each side only waits for the other's position.
+struct Logger::Ring {
+	std::unique_ptr<char[]> buffer;
+	size_t capacity; // A power of two
+	alignas(64) std::atomic<unsigned long long> head; // Bytes ever appended, advanced by the owning thread
+	unsigned long long reserved_end; // Where `head` moves on `commit()`
+	unsigned long long sampled; // Access entries of successful responses seen by the owning thread
+	alignas(64) std::atomic<unsigned long long> tail; // Bytes ever removed, advanced by the writer thread
+	std::atomic<bool> retired;
+
+	explicit Ring(size_t capacity) : buffer(new char[capacity]), capacity(capacity), head(0), reserved_end(0), sampled(0),
+		tail(0), retired(false) {}
+
+	// Space for a record of `length` bytes, which is contiguous, or null if the ring is too full
+	char* reserve(size_t length) {
+		unsigned long long start = head.load(std::memory_order_relaxed);
+		size_t position = (size_t)(start & (capacity - 1));
+		size_t padding = capacity - position < length ? capacity - position : 0;
+		if (start + padding + length - tail.load(std::memory_order_acquire) > capacity)
+			return nullptr;
+
+		if (padding > 0) {
+			RecordHeader header = {};
+			header.length = (uint32_t)padding;
+			header.type = RecordType::Padding;
+			memcpy(buffer.get() + position, &header, sizeof(header));
+			position = 0;
+		}
+		reserved_end = start + padding + length;
+		return buffer.get() + position;
+	}
+
+	// Publishes the reserved record to the writer. Returns the bytes now waiting in the ring.
+	size_t commit() {
+		head.store(reserved_end, std::memory_order_release);
+		return (size_t)(reserved_end - tail.load(std::memory_order_relaxed));
+	}
+};
+
+Logger::RingHandle::~RingHandle() {
+	// The writer drains what is left and then forgets the ring
+	if (ring) {
+		ring->retired.store(true, std::memory_order_release);
+	}
+}
+
+Logger::~Logger() {
+	// The writer waits for entries for the lifetime of the process
+	if (writer.joinable()) {
+		writer.detach();
+	}
+}
+
+void Logger::start(LogFormat format, LogLevel level, unsigned sample_rate) {
+	this->format = format;
+	this->level = level;
+	this->sample_rate = sample_rate > 0 ? sample_rate : 1;
+	started = true;
+	writer = std::thread(&Logger::writeEntries, this);
+}
+
+void Logger::stop() {
+	if (!writer.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping.store(true, std::memory_order_relaxed);
+		wake_requested.store(true, std::memory_order_relaxed);
+	}
+	wake_up.notify_one();
+	writer.join();
+	started = false;
+}
+
+Logger::Ring* Logger::ownRing() {
+	if (!started)
+		return nullptr;
+	if (!thread_ring.ring) {
+		// The ring is allocated by the thread using it, so it is local to its core
+		size_t capacity = LOG_RECORD_ALIGNMENT;
+		while (capacity < (size_t)LOG_BUFFER_SIZE_KB * 1024) {
+			capacity *= 2;
+		}
+		thread_ring.ring = std::make_shared<Ring>(capacity);
+		std::lock_guard<std::mutex> lock(mutex);
+		rings.push_back(thread_ring.ring);
+	}
+	return thread_ring.ring.get();
+}
+
+void Logger::wakeWriter() {
+	if (!wake_requested.exchange(true, std::memory_order_relaxed)) {
+		wake_up.notify_one();
+	}
+}
+
+static long long currentTime() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static size_t alignRecord(size_t length) {
+	return (length + LOG_RECORD_ALIGNMENT - 1) & ~(size_t)(LOG_RECORD_ALIGNMENT - 1);
+}
+
+void Logger::message(LogLevel level, std::string_view text) {
+	Ring* ring = ownRing();
+	if (!ring) {
+		std::cout << text << std::endl;
+		return;
+	}
+
+	size_t length = alignRecord(sizeof(RecordHeader) + text.length());
+	char* record = ring->reserve(length);
+	if (!record) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	RecordHeader header = { (uint32_t)length, RecordType::Message, level, (uint16_t)text.length(), currentTime() };
+	memcpy(record, &header, sizeof(header));
+	memcpy(record + sizeof(header), text.data(), text.length());
+	if (ring->commit() > ring->capacity / 2) {
+		wakeWriter();
+	}
+}
+
+void Logger::access(const AccessEntry& entry) {
+	Ring* ring = ownRing();
+	if (!ring || format == LogFormat::Off)
+		return;
+	// Errors are rare and the interesting part, so they are never sampled away
+	if (entry.status < 400 && sample_rate > 1 && ring->sampled++ % sample_rate != 0)
+		return;
+
+	std::string_view strings[] = { entry.client_address, entry.method, entry.uri, entry.version, entry.referer, entry.user_agent };
+	AccessFields fields = {};
+	fields.body_length = entry.body_length;
+	size_t length = sizeof(RecordHeader) + sizeof(AccessFields);
+	for (size_t i = 0; i < 6; i++) {
+		strings[i] = strings[i].substr(0, LOG_MAX_FIELD_LENGTH);
+		fields.lengths[i] = (uint16_t)strings[i].length();
+		length += strings[i].length();
+	}
+	length = alignRecord(length);
+
+	char* record = ring->reserve(length);
+	if (!record) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	RecordHeader header = { (uint32_t)length, RecordType::Access, LogLevel::Info, (uint16_t)entry.status, currentTime() };
+	memcpy(record, &header, sizeof(header));
+	memcpy(record + sizeof(header), &fields, sizeof(fields));
+	char* position = record + sizeof(header) + sizeof(fields);
+	for (std::string_view string : strings) {
+		memcpy(position, string.data(), string.length());
+		position += string.length();
+	}
+	if (ring->commit() > ring->capacity / 2) {
+		wakeWriter();
+	}
+}
+
+static const char* levelName(LogLevel level) {
+	switch (level) {
+	case LogLevel::Debug: return "debug";
+	case LogLevel::Info: return "info";
+	case LogLevel::Warning: return "warning";
+	default: return "error";
+	}
+}
+
+// Appends `value` with quotes, backslashes and control characters escaped as `\xhh` (as Apache does)
+static void appendEscaped(std::string& output, std::string_view value) {
+	static const char hex[] = "0123456789abcdef";
+	for (char c : value) {
+		unsigned char byte = (unsigned char)c;
+		if (c == '"' || c == '\\' || byte < 0x20 || byte == 0x7f) {
+			char escaped[] = { '\\', 'x', hex[byte >> 4], hex[byte & 15] };
+			output.append(escaped, sizeof(escaped));
+		} else {
+			output += c;
+		}
+	}
+}
+
+// Appends `value` as a JSON string including the quotes
+static void appendJsonString(std::string& output, std::string_view value) {
+	static const char hex[] = "0123456789abcdef";
+	output += '"';
+	for (char c : value) {
+		unsigned char byte = (unsigned char)c;
+		if (c == '"' || c == '\\') {
+			output += '\\';
+			output += c;
+		} else if (byte < 0x20) {
+			char escaped[] = { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 15] };
+			output.append(escaped, sizeof(escaped));
+		} else {
+			output += c;
+		}
+	}
+	output += '"';
+}
+
+static void appendNumber(std::string& output, long long value) {
+	char digits[24];
+	std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+	output.append(digits, result.ptr - digits);
+}
+
+// Formats the time of entries. Many entries share a second, so its text is only built once per second.
+class TimeFormatter {
+	long long second;
+	char common[32]; // `[18/Oct/2026:07:42:48 +0000]`
+	char iso[32]; // `2026-10-18T07:42:48`
+public:
+	TimeFormatter() : second(-1) {}
+
+	void update(long long time) {
+		if (time / 1000000 == second)
+			return;
+		second = time / 1000000;
+		time_t seconds = (time_t)second;
+		struct tm utc;
+#ifdef _WIN32
+		gmtime_s(&utc, &seconds);
+#else
+		gmtime_r(&seconds, &utc);
+#endif
+		strftime(common, sizeof(common), "[%d/%b/%Y:%H:%M:%S +0000]", &utc);
+		strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%S", &utc);
+	}
+
+	const char* commonLogTime() const { return common; }
+
+	// `"2026-10-18T07:42:48.123Z"` for `time`, which was passed to `update()`
+	void appendJson(std::string& output, long long time) const {
+		char text[48];
+		snprintf(text, sizeof(text), "\"%s.%03dZ\"", iso, (int)(time / 1000 % 1000));
+		output += text;
+	}
+};
+
+// Only used by the writer thread
+static TimeFormatter time_formatter;
+
+void Logger::appendMessage(std::string& output, long long time, LogLevel level, std::string_view text) {
+	time_formatter.update(time);
+	if (format == LogFormat::Json) {
+		output += "{\"time\":";
+		time_formatter.appendJson(output, time);
+		output += ",\"level\":\"";
+		output += levelName(level);
+		output += "\",\"message\":";
+		appendJsonString(output, text);
+		output += "}\n";
+	} else {
+		output += time_formatter.commonLogTime();
+		output += ' ';
+		output += levelName(level);
+		output += ": ";
+		output += text;
+		output += '\n';
+	}
+}
+
+bool Logger::drain(Ring& ring, std::string& output) {
+	unsigned long long tail = ring.tail.load(std::memory_order_relaxed);
+	unsigned long long head = ring.head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+
+	while (tail != head) {
+		const char* record = ring.buffer.get() + (tail & (ring.capacity - 1));
+		RecordHeader header;
+		memcpy(&header, record, sizeof(header));
+		tail += header.length;
+		if (header.type == RecordType::Padding)
+			continue;
+
+		time_formatter.update(header.time);
+		const char* data = record + sizeof(header);
+		if (header.type == RecordType::Message) {
+			appendMessage(output, header.time, header.level, std::string_view(data, header.detail));
+			continue;
+		}
+
+		AccessFields fields;
+		memcpy(&fields, data, sizeof(fields));
+		std::string_view strings[6];
+		const char* position = data + sizeof(fields);
+		for (size_t i = 0; i < 6; i++) {
+			strings[i] = std::string_view(position, fields.lengths[i]);
+			position += fields.lengths[i];
+		}
+		std::string_view client = strings[0], method = strings[1], uri = strings[2], version = strings[3];
+		std::string_view referer = strings[4], user_agent = strings[5];
+
+		if (format == LogFormat::Json) {
+			output += "{\"time\":";
+			time_formatter.appendJson(output, header.time);
+			output += ",\"client\":";
+			appendJsonString(output, client);
+			output += ",\"method\":";
+			appendJsonString(output, method);
+			output += ",\"uri\":";
+			appendJsonString(output, uri);
+			output += ",\"version\":";
+			appendJsonString(output, version);
+			output += ",\"status\":";
+			appendNumber(output, header.detail);
+			output += ",\"bytes\":";
+			appendNumber(output, fields.body_length);
+			output += ",\"referer\":";
+			appendJsonString(output, referer);
+			output += ",\"user_agent\":";
+			appendJsonString(output, user_agent);
+			output += "}\n";
+			continue;
+		}
+
+		// `client - - [time] "request" status bytes`, with `-` for what is unknown
+		output += client.empty() ? "-" : client;
+		output += " - - ";
+		output += time_formatter.commonLogTime();
+		output += " \"";
+		if (method.empty()) {
+			output += '-';
+		} else {
+			appendEscaped(output, method);
+			output += ' ';
+			appendEscaped(output, uri);
+			output += ' ';
+			appendEscaped(output, version);
+		}
+		output += "\" ";
+		appendNumber(output, header.detail);
+		output += ' ';
+		if (fields.body_length > 0) {
+			appendNumber(output, fields.body_length);
+		} else {
+			output += '-';
+		}
+		if (format == LogFormat::Combined) {
+			output += " \"";
+			appendEscaped(output, referer.empty() ? "-" : referer);
+			output += "\" \"";
+			appendEscaped(output, user_agent.empty() ? "-" : user_agent);
+			output += '"';
+		}
+		output += '\n';
+	}
+
+	ring.tail.store(tail, std::memory_order_release);
+	return true;
+}
+
+void Logger::writeEntries() {
+	std::string output;
+	std::vector<std::shared_ptr<Ring>> drained;
+	unsigned long long reported_drops = 0;
+	bool stopped = false;
+	while (!stopped) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			// Everything logged before `stop()` is drained in this last round
+			stopped = stopping.load(std::memory_order_relaxed);
+			if (!wake_requested.load(std::memory_order_relaxed) && !stopped) {
+				wake_up.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+			}
+			wake_requested.store(false, std::memory_order_relaxed);
+
+			// Rings of threads which ended are dropped once they are empty
+			rings.erase(std::remove_if(rings.begin(), rings.end(), [](const std::shared_ptr<Ring>& ring) {
+				return ring->retired.load(std::memory_order_acquire)
+					&& ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire);
+			}), rings.end());
+			drained = rings;
+		}
+
+		// Keep draining while the threads produce entries, and write them in batches of a few pages
+		bool any = true;
+		while (any) {
+			any = false;
+			for (const std::shared_ptr<Ring>& ring : drained) {
+				any |= drain(*ring, output);
+				if (output.length() >= LOG_WRITE_BATCH_SIZE) {
+					fwrite(output.data(), 1, output.length(), stdout);
+					output.clear();
+				}
+			}
+		}
+
+		unsigned long long drops = dropped.load(std::memory_order_relaxed);
+		if (drops != reported_drops) {
+			appendMessage(output, currentTime(), LogLevel::Warning,
+				"Log buffers full, dropped " + std::to_string(drops - reported_drops) + " entries");
+			reported_drops = drops;
+		}
+		if (!output.empty()) {
+			fwrite(output.data(), 1, output.length(), stdout);
+			output.clear();
+			fflush(stdout);
+		}
+	}
+}
+
+LogMessage& LogMessage::operator<<(std::string_view value) {
+	size_t count = std::min(value.length(), sizeof(text) - length);
+	memcpy(text + length, value.data(), count);
+	length += count;
+	return *this;
+}
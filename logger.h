@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "server_settings.h"
+
+#define LOG_MAX_MESSAGE_LENGTH 512 // Longer messages are truncated
+
+enum class LogLevel : uint8_t {
+	Debug, // Connections opening and closing, resolved paths
+	Info, // Bad requests and failed sends, mostly caused by clients
+	Warning, // Problems of the server which don't stop it from serving
+	Error,
+	Off
+};
+
+enum class LogFormat {
+	Off, // No access log, messages are still written
+	Common, // Common Log Format: `client - - [time] "request" status bytes`
+	Combined, // Common Log Format followed by `"referer" "user-agent"`
+	Json // One JSON object per line, messages too
+};
+
+// The fields of an access log entry. The views only have to stay valid during `Logger::access()`.
+struct AccessEntry {
+	std::string_view client_address;
+	std::string_view method; // Empty if the request could not be parsed
+	std::string_view uri;
+	std::string_view version;
+	int status;
+	long long body_length; // Bytes of the response body
+	std::string_view referer;
+	std::string_view user_agent;
+};
+
+// Asynchronous log of messages and accessed files.
+// Every thread writes its entries into a ring buffer of its own, without locks or system calls, and a background
+// thread drains the buffers and formats the entries into batched writes to stdout. A thread whose buffer is full
+// drops its entries (they are counted) rather than waiting for the writer, so logging never blocks a request.
+class Logger {
+	struct Ring;
+	// Keeps the calling thread's ring alive and marks it as retired when the thread ends
+	struct RingHandle {
+		std::shared_ptr<Ring> ring;
+		~RingHandle();
+	};
+	static thread_local RingHandle thread_ring;
+
+	LogFormat format;
+	LogLevel level;
+	unsigned sample_rate;
+	bool started;
+
+	std::mutex mutex; // Protects `rings`, the writer waits on `wake_up` with it
+	std::condition_variable wake_up;
+	std::vector<std::shared_ptr<Ring>> rings;
+	std::atomic<bool> wake_requested;
+	std::atomic<bool> stopping;
+	std::atomic<unsigned long long> dropped;
+	std::thread writer;
+
+	// The calling thread's ring, which is created on first use. Null if the logger is not started.
+	Ring* ownRing();
+	// Wakes the writer before the flush interval ran out, because a ring is filling up
+	void wakeWriter();
+	void writeEntries();
+	void appendMessage(std::string& output, long long time, LogLevel level, std::string_view text);
+	// Formats the entries of `ring` behind `output`. Returns true if there were any.
+	bool drain(Ring& ring, std::string& output);
+public:
+	Logger() : format(LogFormat::Off), level(LogLevel::Info), sample_rate(1), started(false), wake_requested(false), stopping(false), dropped(0) {}
+	~Logger();
+
+	// Starts the writer thread. Until then, messages are written to stdout directly and there is no access log.
+	// Of the access log entries for successful responses only one in `sample_rate` is written, errors always are.
+	void start(LogFormat format, LogLevel level, unsigned sample_rate);
+	// Writes the entries logged so far and ends the writer thread, e.g. before the process exits. Later entries are lost.
+	void stop();
+
+	bool enabled(LogLevel level) const { return level >= this->level && this->level != LogLevel::Off; }
+	bool accessLogEnabled() const { return started && format != LogFormat::Off; }
+
+	void message(LogLevel level, std::string_view text);
+	void access(const AccessEntry& entry);
+
+	// Entries which were dropped because their thread's buffer was full
+	unsigned long long droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+};
+
+extern Logger logger;
+
+// A log message assembled with `<<` into a fixed buffer on the stack and handed to the logger when it goes out of scope.
+// Longer messages are truncated. Use it through the `LOG` macro, which skips formatting disabled levels.
+class LogMessage {
+	LogLevel level;
+	size_t length;
+	char text[LOG_MAX_MESSAGE_LENGTH];
+public:
+	explicit LogMessage(LogLevel level) : level(level), length(0) {}
+	~LogMessage() { logger.message(level, std::string_view(text, length)); }
+	LogMessage(const LogMessage&) = delete;
+	LogMessage& operator=(const LogMessage&) = delete;
+
+	LogMessage& operator<<(std::string_view value);
+	LogMessage& operator<<(const char* value) { return *this << std::string_view(value ? value : "(null)"); }
+	LogMessage& operator<<(char value) { return *this << std::string_view(&value, 1); }
+
+	template <typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+	LogMessage& operator<<(Integer value) {
+		char digits[24];
+		std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+		return *this << std::string_view(digits, result.ptr - digits);
+	}
+};
+
+// Turns the message expression into `void`, so `LOG` can be the branch of a conditional expression
+struct LogVoidify {
+	void operator&(const LogMessage&) {}
+};
+
+// `LOG(Warning) << "recv() failed: " << error;` logs a message, the operands are only evaluated if the level is enabled
+#define LOG(level) !logger.enabled(LogLevel::level) ? (void)0 : LogVoidify() & LogMessage(LogLevel::level)
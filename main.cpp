@@ -13,91 +13,107 @@
 #include "sockets.h"
 #include "string_utils.h"
 #include "http_server.h"
+#include "server_config.h"
+#include "file_cache.h"
+#include "compression.h"
+#include "path_resolver.h"
+#include "logger.h"
+#include "metrics.h"
+#include "bundle.h"
+
+// Maps the bundle, or prepares serving the files below the serve root
+static void startContent() {
+	if (!server_config.bundle_path.empty()) {
+		// A bundle is served as it is, there is nothing to cache, compress or resolve
+		bundle_store.start(server_config.bundle_path);
+		metrics.addGauge("webserver_bundle_entries", "Request paths in the bundle being served.",
+			[]() { return (double)bundle_store.current()->entryCount(); });
+		metrics.addGauge("webserver_bundle_reloads", "New bundles swapped in since the start.",
+			[]() { return (double)bundle_store.reloadCount(); });
+		return;
+	}
+	// Without a way to watch the files for changes the cache stays disabled
+	file_cache.start((size_t)server_config.file_cache_size_mb * 1024 * 1024, FILE_CACHE_MAX_FILE_SIZE, SERVE_ROOT);
+	path_resolver.start(SERVE_ROOT, RESOLVE_CACHE_ENTRIES);
+	compression_cache.start((size_t)server_config.compression_cache_size_mb * 1024 * 1024, COMPRESSION_THREADS);
+}
 
-struct thread_data {
-	HANDLE work_event;
-	SOCKET client_socket;
-};
+#ifdef _WIN32
+#include "thread_pool.h"
 
-// Thread entry
-DWORD WINAPI winThreadProc(_In_ LPVOID lpParameter) {
-	volatile thread_data* data = (volatile thread_data*)lpParameter;
+// Serves a client on a pool worker. The worker is responsible for closing the client socket when finished.
+static void serveAndClose(SOCKET client_socket) {
+	serveClient(client_socket);
 
-	while (true) {
-		// Wait for work to be assigned to this thread.
-		WaitForSingleObject(data->work_event, INFINITE);
-		
-		SOCKET client_socket = data->client_socket;
-		serveClient(client_socket);
+	endClient(client_socket);
+	LOG(Debug) << "Client disconnected.";
+}
 
-		endClient(client_socket);
-		std::cout << "Client disconnected." << std::endl;
+// Responds with a 503 error code, used when the pending connections queue overflows or a client waited for too long
+static void rejectOverloaded(SOCKET client_socket) {
+	ResponseBuilder response = ResponseBuilder().setStatusCode(StatusCode::ServiceUnavailable).addFileBody(RESPONSE_503, false);
+	string resp = response.build();
+	const std::shared_ptr<OpenFile>& body = response.fileBody();
+	if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR
+		|| (body && sendFile(client_socket, body->descriptor(), 0, (size_t)body->size()) == SOCKET_ERROR)) {
+		LOG(Info) << "send() failed: " << WSAGetLastError();
+	}
 
-		// We reset the event to signal that we finished our work.
-		ResetEvent(data->work_event);
+	LOG(Warning) << "Failed to respond to request, server overloaded.";
+	metrics.countOverload();
+	metrics.countResponse(StatusCode::ServiceUnavailable);
+	if (logger.accessLogEnabled()) {
+		std::string client_address = peerAddress(client_socket);
+		AccessEntry entry = {};
+		entry.client_address = client_address;
+		entry.status = (int)StatusCode::ServiceUnavailable;
+		entry.body_length = body ? body->size() : 0;
+		logger.access(entry);
 	}
-	return 0;
+
+	endClient(client_socket);
+	LOG(Debug) << "Client disconnected.";
 }
 
-int main() {
-	HANDLE thread_pool[MAX_SIMULTANEOUS_CONNECTIONS];
-	volatile thread_data* thread_data[MAX_SIMULTANEOUS_CONNECTIONS];
-
-	// Setup the thread pool
-	for (int i = 0; i < MAX_SIMULTANEOUS_CONNECTIONS; i++) {
-		thread_data[i] = new struct thread_data;
-		// The event will be used to alert the thread about new work.
-		// We setup the event as manual reset: The thread will reset it to signal that it finished its work.
-		thread_data[i]->work_event = CreateEvent(0, TRUE, FALSE, 0);
-		if (!thread_data[i]->work_event) {
-			std::cerr << "CreatEvent() failed: " << GetLastError() << std::endl;
-			return 1;
-		}
-		thread_pool[i] = CreateThread(0, 0, winThreadProc, (LPVOID) thread_data[i], 0, 0);
+int main(int argc, char* argv[]) {
+	parseCommandLine(argc, argv);
+	logger.start(server_config.log_format, server_config.log_level, (unsigned)server_config.log_sample_rate);
+	if (!server_config.metrics_path.empty()) {
+		metrics.start();
+	}
+
+	startContent();
+	if (!server_config.tls_certificate.empty()) {
+		std::cerr << "HTTPS is only supported on Linux" << std::endl;
+		exit(1);
+	}
+	if (!server_config.proxy_rules.empty()) {
+		std::cerr << "Proxying is only supported on Linux" << std::endl;
+		exit(1);
 	}
 
+	// Accepted clients wait in a bounded queue until a worker is free, so a short burst of connections
+	// is absorbed instead of immediately turning into 503 responses.
+	ThreadPool pool(server_config.worker_threads, server_config.pending_queue_depth,
+		std::chrono::milliseconds(server_config.max_queue_delay_ms));
+	metrics.addGauge("webserver_thread_pool_queue_depth", "Clients waiting for a free worker.",
+		[&pool]() { return (double)pool.queueDepth(); });
+
 	SOCKET server_socket = createServer();
 
 	try {
 		while (true) {
 
 			SOCKET client_socket = acceptClient(server_socket);
-			std::cout << "Client connected." << std::endl;
-
-			int available_thread = -1;
-			// Check if any of the threads are available
-			for (int i = 0; i < MAX_SIMULTANEOUS_CONNECTIONS; i++) {
-				// A wait with a timeout of 0 is used to check the signal state of an event.
-				// If the event is not signaled, the thread is not working.
-				if (WaitForSingleObject(thread_data[i]->work_event, 0) == WAIT_TIMEOUT) {
-					available_thread = i;
-					break;
-				}
+			LOG(Debug) << "Client connected.";
+
+			bool queued = pool.submit(
+				[client_socket]() { serveAndClose(client_socket); },
+				[client_socket]() { rejectOverloaded(client_socket); });
+			if (!queued) {
+				// We have too many pending connections
+				rejectOverloaded(client_socket);
 			}
-
-			if (available_thread == -1) {
-				// We have too many simulatenuous connections, we respond with a 503 error code
-				string resp = ResponseBuilder().setStatusCode(StatusCode::ServiceUnavailable).addFileBody(RESPONSE_503, false).build();
-				if (send(client_socket, resp.c_str(), resp.length(), 0) == SOCKET_ERROR) {
-					std::cout << "send() failed: " << WSAGetLastError() << std::endl;
-				}
-
-				std::cout << "\tFailed to respond to request, server overloaded. (Reached max thread count)" << std::endl;
-
-				endClient(client_socket);
-				std::cout << "Client disconnected." << std::endl;
-			} else {
-				// Pass the client socket to the thread
-				thread_data[available_thread]->client_socket = client_socket;
-				
-				// According to MSDN, functions that signal sync object use appropriate memory barriers,
-				// so no extra works needs to done to ensure client_socket is written before the thread
-				// will be alerted.
-				
-				// Alert the thread about new work
-				SetEvent(thread_data[available_thread]->work_event); 
-				// The thread is responisble for closing the client socket when finished.
-			}	
 		}
 	}
 	catch (...) {
@@ -107,4 +123,80 @@ int main() {
 	endServer(server_socket);
 
 	return 0;
-}
\ No newline at end of file
+}
+#else
+#include <signal.h>
+#include "event_loop.h"
+#include "io_uring_engine.h"
+#include "upgrade.h"
+#include "tls.h"
+
+// Loads the certificate if the server speaks HTTPS
+static void startTls() {
+	if (server_config.tls_certificate.empty())
+		return;
+#if ENABLE_TLS
+	if (server_config.io_engine == "uring") {
+		// Its sends are submitted as they are, there is no place for encrypting them in between
+		std::cerr << "HTTPS is only supported by the epoll engine" << std::endl;
+		exit(1);
+	}
+	tls_context.start(server_config.tls_certificate, server_config.tls_private_key, server_config.tls_ticket_keys,
+		server_config.kernel_tls);
+#else
+	std::cerr << "HTTPS is not supported, the server was built without ENABLE_TLS" << std::endl;
+	exit(1);
+#endif
+}
+
+// Resolves the upstreams of the proxy routes
+static void startProxy() {
+	if (server_config.proxy_rules.empty())
+		return;
+	if (server_config.io_engine == "uring") {
+		// The upstream connections are driven by the event loop, next to the client connections
+		std::cerr << "Proxying is only supported by the epoll engine" << std::endl;
+		exit(1);
+	}
+	proxy_routes.start(server_config.proxy_rules);
+}
+
+int main(int argc, char* argv[]) {
+	parseCommandLine(argc, argv);
+	logger.start(server_config.log_format, server_config.log_level, (unsigned)server_config.log_sample_rate);
+	if (!server_config.metrics_path.empty()) {
+		metrics.start();
+	}
+
+	// A client closing its connection while we write to it must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	startContent();
+	startTls();
+	startProxy();
+
+	// A server running an older build hands over its listening sockets, so not a single connection is refused
+	std::vector<SOCKET> inherited;
+	if (!server_config.upgrade_socket.empty()) {
+		inherited = inheritListeners(server_config.upgrade_socket);
+	}
+
+	// Connections are multiplexed over one event loop per core instead of a thread per connection,
+	// so there is no hard connection limit and no need to reject clients with a 503.
+	// The loops only return once a successor took over and the open connections were drained.
+	std::vector<std::unique_ptr<Shard>> shards = createShards(server_config.event_loop_threads, inherited);
+	std::function<void()> started;
+	if (!server_config.upgrade_socket.empty()) {
+		started = [&shards]() { serveUpgrades(server_config.upgrade_socket, shards, server_config.drain_timeout); };
+	}
+	runShards(shards, server_config.io_engine == "uring" ? runIoUringEngine : runEventLoop, server_config.shard_stats_interval, started);
+
+	LOG(Info) << "All connections were drained, exiting.";
+	logger.stop();
+	for (auto& shard : shards) {
+		endServer(shard->server_socket);
+	}
+
+	return 0;
+}
+#endif
\ No newline at end of file
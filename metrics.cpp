@@ -0,0 +1,314 @@
+#include "metrics.h"
+#include <stdio.h>
+
+#include "file_cache.h"
+#include "path_resolver.h"
+#include "logger.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned highestSetBit(unsigned long long value) {
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (unsigned)index;
+}
+#else
+static inline unsigned highestSetBit(unsigned long long value) {
+	return 63 - (unsigned)__builtin_clzll(value);
+}
+#endif
+
+Metrics metrics;
+
+thread_local std::shared_ptr<Metrics::ThreadMetrics> Metrics::thread_metrics;
+
+// The exported histogram has a bucket per power of two between these (in nanoseconds, about 1us to 17s)
+#define EXPORTED_MIN_EXPONENT 10
+#define EXPORTED_MAX_EXPONENT 34
+
+// Status codes from 100 to 599 are counted
+#define STATUS_CODE_SLOTS 500
+
+static const char* const stage_names[] = { "receive", "parse", "request", "resolve", "file", "send" };
+static_assert(sizeof(stage_names) / sizeof(stage_names[0]) == (size_t)Stage::Count, "Every stage needs a name");
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// The counters of one thread. It is value-initialized, which zeroes the atomics.
+struct Metrics::ThreadMetrics {
+	std::atomic<unsigned long long> stage_buckets[(size_t)Stage::Count][HISTOGRAM_BUCKETS];
+	std::atomic<unsigned long long> stage_nanoseconds[(size_t)Stage::Count];
+	std::atomic<unsigned long long> responses[STATUS_CODE_SLOTS];
+	std::atomic<unsigned long long> sent_bytes;
+	std::atomic<unsigned long long> connections_opened;
+	std::atomic<unsigned long long> connections_closed;
+	std::atomic<unsigned long long> overloads;
+	std::atomic<unsigned long long> tls_handshakes[2]; // Full ones, and resumed sessions
+	std::atomic<unsigned long long> tls_kernel_sends;
+	std::atomic<unsigned long long> upstream_connections[2]; // New ones, and reused idle ones
+	std::atomic<unsigned long long> upstream_failures;
+	std::atomic<unsigned long long> upstream_ejections;
+};
+
+// Only the owning thread writes a counter, so a plain load and store suffice where `fetch_add` would lock the bus
+static inline void add(std::atomic<unsigned long long>& counter, unsigned long long value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Values below `2 << HISTOGRAM_SUB_BUCKET_BITS` get a bucket each, above that every power of two is split
+// into `1 << HISTOGRAM_SUB_BUCKET_BITS` buckets
+static size_t bucketIndex(unsigned long long value) {
+	if (value < (2ull << HISTOGRAM_SUB_BUCKET_BITS))
+		return (size_t)value;
+	unsigned exponent = highestSetBit(value);
+	if (exponent > HISTOGRAM_MAX_EXPONENT)
+		return HISTOGRAM_BUCKETS - 1;
+	size_t sub_bucket = (size_t)(value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1);
+	return ((size_t)(exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+// The smallest value above the bucket
+static unsigned long long bucketEnd(size_t index) {
+	if (index < (2u << HISTOGRAM_SUB_BUCKET_BITS))
+		return index + 1;
+	unsigned exponent = (unsigned)(index >> HISTOGRAM_SUB_BUCKET_BITS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+	unsigned long long sub_bucket = index & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1);
+	return ((1ull << HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket + 1) << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+Metrics::ThreadMetrics& Metrics::own() {
+	if (!thread_metrics) {
+		thread_metrics = std::make_shared<ThreadMetrics>();
+		std::lock_guard<std::mutex> lock(mutex);
+		threads.push_back(thread_metrics);
+	}
+	return *thread_metrics;
+}
+
+void Metrics::addGauge(const std::string& name, const std::string& help, std::function<double()> value) {
+	std::lock_guard<std::mutex> lock(mutex);
+	gauges.push_back(Gauge{ name, help, std::move(value) });
+}
+
+void Metrics::recordStage(Stage stage, long long start) {
+	if (!started || start == 0)
+		return;
+	long long elapsed = stageStart() - start;
+	unsigned long long nanoseconds = elapsed > 0 ? (unsigned long long)elapsed : 0;
+	ThreadMetrics& counters = own();
+	add(counters.stage_buckets[(size_t)stage][bucketIndex(nanoseconds)], 1);
+	add(counters.stage_nanoseconds[(size_t)stage], nanoseconds);
+}
+
+void Metrics::countResponse(StatusCode status) {
+	int slot = (int)status - 100;
+	if (started && slot >= 0 && slot < STATUS_CODE_SLOTS) {
+		add(own().responses[slot], 1);
+	}
+}
+
+void Metrics::countSent(size_t bytes) {
+	if (started) {
+		add(own().sent_bytes, bytes);
+	}
+}
+
+void Metrics::countConnection(bool opened) {
+	if (started) {
+		add(opened ? own().connections_opened : own().connections_closed, 1);
+	}
+}
+
+void Metrics::countOverload() {
+	if (started) {
+		add(own().overloads, 1);
+	}
+}
+
+void Metrics::countTlsHandshake(bool resumed, bool kernel_sends) {
+	if (started) {
+		add(own().tls_handshakes[resumed ? 1 : 0], 1);
+		if (kernel_sends) {
+			add(own().tls_kernel_sends, 1);
+		}
+	}
+}
+
+void Metrics::countUpstreamConnection(bool reused) {
+	if (started) {
+		add(own().upstream_connections[reused ? 1 : 0], 1);
+	}
+}
+
+void Metrics::countUpstreamFailure() {
+	if (started) {
+		add(own().upstream_failures, 1);
+	}
+}
+
+void Metrics::countUpstreamEjection() {
+	if (started) {
+		add(own().upstream_ejections, 1);
+	}
+}
+
+static void appendHeader(std::string& output, const char* name, const char* type, const char* help) {
+	output.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	output.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+static void appendValue(std::string& output, const char* name, const std::string& labels, double value) {
+	char text[64];
+	snprintf(text, sizeof(text), "%.17g", value);
+	output.append(name);
+	if (!labels.empty()) {
+		output.append("{").append(labels).append("}");
+	}
+	output.append(" ").append(text).append("\n");
+}
+
+static std::string secondsLabel(double nanoseconds) {
+	char text[32];
+	snprintf(text, sizeof(text), "%.9g", nanoseconds / 1e9);
+	return text;
+}
+
+std::string Metrics::render() const {
+	// Sum up the blocks of all threads. They keep counting meanwhile, so the sum is a snapshot of some moment
+	// of every thread, which is all Prometheus needs.
+	std::vector<unsigned long long> buckets((size_t)Stage::Count * HISTOGRAM_BUCKETS, 0);
+	unsigned long long stage_nanoseconds[(size_t)Stage::Count] = {};
+	unsigned long long responses[STATUS_CODE_SLOTS] = {};
+	unsigned long long sent_bytes = 0, connections_opened = 0, connections_closed = 0, overloads = 0;
+	unsigned long long tls_handshakes[2] = {}, tls_kernel_sends = 0;
+	unsigned long long upstream_connections[2] = {}, upstream_failures = 0, upstream_ejections = 0;
+	std::vector<Gauge> gauges;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const std::shared_ptr<ThreadMetrics>& thread : threads) {
+			for (size_t stage = 0; stage < (size_t)Stage::Count; stage++) {
+				for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+					buckets[stage * HISTOGRAM_BUCKETS + i] += thread->stage_buckets[stage][i].load(std::memory_order_relaxed);
+				}
+				stage_nanoseconds[stage] += thread->stage_nanoseconds[stage].load(std::memory_order_relaxed);
+			}
+			for (size_t i = 0; i < STATUS_CODE_SLOTS; i++) {
+				responses[i] += thread->responses[i].load(std::memory_order_relaxed);
+			}
+			sent_bytes += thread->sent_bytes.load(std::memory_order_relaxed);
+			connections_opened += thread->connections_opened.load(std::memory_order_relaxed);
+			connections_closed += thread->connections_closed.load(std::memory_order_relaxed);
+			overloads += thread->overloads.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < 2; i++) {
+				tls_handshakes[i] += thread->tls_handshakes[i].load(std::memory_order_relaxed);
+			}
+			tls_kernel_sends += thread->tls_kernel_sends.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < 2; i++) {
+				upstream_connections[i] += thread->upstream_connections[i].load(std::memory_order_relaxed);
+			}
+			upstream_failures += thread->upstream_failures.load(std::memory_order_relaxed);
+			upstream_ejections += thread->upstream_ejections.load(std::memory_order_relaxed);
+		}
+		gauges = this->gauges;
+	}
+
+	std::string output;
+	output.reserve(16 * 1024);
+
+	appendHeader(output, "webserver_responses_total", "counter", "Responses queued, by status code.");
+	for (size_t i = 0; i < STATUS_CODE_SLOTS; i++) {
+		if (responses[i] > 0) {
+			appendValue(output, "webserver_responses_total", "code=\"" + std::to_string(i + 100) + "\"", (double)responses[i]);
+		}
+	}
+	appendHeader(output, "webserver_sent_bytes_total", "counter", "Bytes sent to clients, including headers.");
+	appendValue(output, "webserver_sent_bytes_total", "", (double)sent_bytes);
+	appendHeader(output, "webserver_connections_total", "counter", "HTTP connections opened.");
+	appendValue(output, "webserver_connections_total", "", (double)connections_opened);
+	appendHeader(output, "webserver_connections_active", "gauge", "HTTP connections currently open.");
+	appendValue(output, "webserver_connections_active", "", (double)(connections_opened - connections_closed));
+	appendHeader(output, "webserver_overload_rejections_total", "counter", "Clients answered with a 503 because no worker was free.");
+	appendValue(output, "webserver_overload_rejections_total", "", (double)overloads);
+	appendHeader(output, "webserver_tls_handshakes_total", "counter", "TLS handshakes completed, by whether a session was resumed.");
+	appendValue(output, "webserver_tls_handshakes_total", "resumed=\"false\"", (double)tls_handshakes[0]);
+	appendValue(output, "webserver_tls_handshakes_total", "resumed=\"true\"", (double)tls_handshakes[1]);
+	appendHeader(output, "webserver_tls_kernel_connections_total", "counter", "TLS connections whose records the kernel encrypts (kTLS).");
+	appendValue(output, "webserver_tls_kernel_connections_total", "", (double)tls_kernel_sends);
+	appendHeader(output, "webserver_proxy_upstream_connections_total", "counter", "Upstream connections proxied requests were sent on, by whether an idle one was reused.");
+	appendValue(output, "webserver_proxy_upstream_connections_total", "reused=\"false\"", (double)upstream_connections[0]);
+	appendValue(output, "webserver_proxy_upstream_connections_total", "reused=\"true\"", (double)upstream_connections[1]);
+	appendHeader(output, "webserver_proxy_upstream_failures_total", "counter", "Proxied requests an upstream failed to answer.");
+	appendValue(output, "webserver_proxy_upstream_failures_total", "", (double)upstream_failures);
+	appendHeader(output, "webserver_proxy_upstream_ejections_total", "counter", "Times an upstream was ejected after failing repeatedly.");
+	appendValue(output, "webserver_proxy_upstream_ejections_total", "", (double)upstream_ejections);
+
+	appendHeader(output, "webserver_stage_duration_seconds", "histogram", "Time spent in the stages of serving requests.");
+	for (size_t stage = 0; stage < (size_t)Stage::Count; stage++) {
+		const unsigned long long* stage_buckets = &buckets[stage * HISTOGRAM_BUCKETS];
+		std::string stage_label = std::string("stage=\"") + stage_names[stage] + "\"";
+		unsigned long long cumulative = 0;
+		size_t i = 0;
+		for (unsigned exponent = EXPORTED_MIN_EXPONENT; exponent <= EXPORTED_MAX_EXPONENT; exponent++) {
+			// Powers of two are bucket boundaries, so the exported buckets are exact
+			for (; i < HISTOGRAM_BUCKETS && bucketEnd(i) <= (1ull << exponent); i++) {
+				cumulative += stage_buckets[i];
+			}
+			appendValue(output, "webserver_stage_duration_seconds_bucket",
+				stage_label + ",le=\"" + secondsLabel((double)(1ull << exponent)) + "\"", (double)cumulative);
+		}
+		for (; i < HISTOGRAM_BUCKETS; i++) {
+			cumulative += stage_buckets[i];
+		}
+		appendValue(output, "webserver_stage_duration_seconds_bucket", stage_label + ",le=\"+Inf\"", (double)cumulative);
+		appendValue(output, "webserver_stage_duration_seconds_sum", stage_label, stage_nanoseconds[stage] / 1e9);
+		appendValue(output, "webserver_stage_duration_seconds_count", stage_label, (double)cumulative);
+	}
+
+	appendHeader(output, "webserver_stage_duration_quantile_seconds", "gauge",
+		"Quantiles of the stage durations since startup, as upper bounds within 25%.");
+	for (size_t stage = 0; stage < (size_t)Stage::Count; stage++) {
+		const unsigned long long* stage_buckets = &buckets[stage * HISTOGRAM_BUCKETS];
+		unsigned long long count = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			count += stage_buckets[i];
+		}
+		if (count == 0)
+			continue;
+		for (double quantile : quantiles) {
+			unsigned long long rank = (unsigned long long)(quantile * (double)count + 0.5);
+			unsigned long long cumulative = 0;
+			size_t i = 0;
+			for (; i < HISTOGRAM_BUCKETS - 1; i++) {
+				cumulative += stage_buckets[i];
+				if (cumulative >= rank && cumulative > 0)
+					break;
+			}
+			char quantile_text[16];
+			snprintf(quantile_text, sizeof(quantile_text), "%g", quantile);
+			appendValue(output, "webserver_stage_duration_quantile_seconds",
+				std::string("stage=\"") + stage_names[stage] + "\",quantile=\"" + quantile_text + "\"", bucketEnd(i) / 1e9);
+		}
+	}
+
+	appendHeader(output, "webserver_file_cache_hits_total", "counter", "Requests answered from the file cache.");
+	appendValue(output, "webserver_file_cache_hits_total", "", (double)file_cache.hitCount());
+	appendHeader(output, "webserver_file_cache_misses_total", "counter", "Requests the file cache could not answer.");
+	appendValue(output, "webserver_file_cache_misses_total", "", (double)file_cache.missCount());
+	appendHeader(output, "webserver_file_cache_evictions_total", "counter", "Files evicted from the file cache to stay within its budget.");
+	appendValue(output, "webserver_file_cache_evictions_total", "", (double)file_cache.evictionCount());
+	appendHeader(output, "webserver_file_cache_entries", "gauge", "Responses held by the file cache.");
+	appendValue(output, "webserver_file_cache_entries", "", (double)file_cache.entryCount());
+	appendHeader(output, "webserver_file_cache_bytes", "gauge", "Memory used by the file cache.");
+	appendValue(output, "webserver_file_cache_bytes", "", (double)file_cache.bytesUsed());
+	appendHeader(output, "webserver_path_resolutions_total", "counter", "Request paths mapped to files, by whether the result was cached.");
+	appendValue(output, "webserver_path_resolutions_total", "cached=\"true\"", (double)path_resolver.hitCount());
+	appendValue(output, "webserver_path_resolutions_total", "cached=\"false\"", (double)path_resolver.missCount());
+	appendHeader(output, "webserver_log_dropped_entries_total", "counter", "Log entries dropped because a log buffer was full.");
+	appendValue(output, "webserver_log_dropped_entries_total", "", (double)logger.droppedCount());
+
+	for (const Gauge& gauge : gauges) {
+		appendHeader(output, gauge.name.c_str(), "gauge", gauge.help.c_str());
+		appendValue(output, gauge.name.c_str(), "", gauge.value());
+	}
+	return output;
+}
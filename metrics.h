@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "status_code.h"
+
+// Steps of serving a request whose durations are recorded
+enum class Stage {
+	Receive, // A `recv()` call which returned data (not measured with io_uring, which receives asynchronously)
+	Parse, // Parsing the request headers
+	Request, // Handling a parsed request until its response is queued, including the stages below
+	Resolve, // Mapping the request path to a file
+	File, // Opening or loading the file and building the response
+	Send, // A send call which sent data (not measured with io_uring)
+	Count
+};
+
+// Durations are counted in buckets which are a quarter of a power of two wide (in nanoseconds), so any value
+// is known within 25% while the buckets cover nanoseconds up to minutes.
+#define HISTOGRAM_SUB_BUCKET_BITS 2
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) << HISTOGRAM_SUB_BUCKET_BITS)
+
+// Counters and latency histograms of the server, rendered in the Prometheus text format.
+// Every thread counts into a block of its own which only it writes, so recording needs neither locks nor atomic
+// read-modify-write instructions. The blocks are only summed up when the metrics are requested.
+class Metrics {
+	struct ThreadMetrics;
+	static thread_local std::shared_ptr<ThreadMetrics> thread_metrics;
+
+	struct Gauge {
+		std::string name;
+		std::string help;
+		std::function<double()> value;
+	};
+
+	bool started;
+	mutable std::mutex mutex; // Protects `threads` and `gauges`
+	std::vector<std::shared_ptr<ThreadMetrics>> threads; // Blocks of ended threads are kept, counters must not go down
+	std::vector<Gauge> gauges;
+
+	// The calling thread's block, which is created on first use
+	ThreadMetrics& own();
+public:
+	Metrics() : started(false) {}
+
+	// Enables recording. Until then (or if it is never called) nothing is recorded.
+	void start() { started = true; }
+	bool enabled() const { return started; }
+
+	// Adds a gauge which is read when the metrics are rendered, e.g. the length of a queue
+	void addGauge(const std::string& name, const std::string& help, std::function<double()> value);
+
+	// The start of a timed stage, 0 if recording is disabled
+	long long stageStart() const {
+		return started ? std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+	}
+	// Records the duration of a stage which began at `start`
+	void recordStage(Stage stage, long long start);
+
+	void countResponse(StatusCode status);
+	void countSent(size_t bytes);
+	// Called when an HTTP connection is opened or closed
+	void countConnection(bool opened);
+	// Called when a client is rejected with a 503 because the server is overloaded
+	void countOverload();
+	// Called when a TLS handshake completed. `kernel_sends` tells if the kernel encrypts the records (kTLS).
+	void countTlsHandshake(bool resumed, bool kernel_sends);
+	// Called when a proxied request gets an upstream connection, a new one or one `reused` from the idle pool
+	void countUpstreamConnection(bool reused);
+	// Called when an upstream failed a request, and when it is ejected after failing too often
+	void countUpstreamFailure();
+	void countUpstreamEjection();
+
+	// All metrics in the Prometheus text exposition format (version 0.0.4)
+	std::string render() const;
+};
+
+extern Metrics metrics;
+
+// Records the duration of a stage from its construction until it goes out of scope
+class StageTimer {
+	Stage stage;
+	long long start;
+public:
+	explicit StageTimer(Stage stage) : stage(stage), start(metrics.stageStart()) {}
+	~StageTimer() { metrics.recordStage(stage, start); }
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+};
@@ -1,91 +1,244 @@
 #include "mime_types.h"
-#include <string.h>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+struct MimeType {
+	std::string_view extension; // Including the dot, lower case
+	std::string_view type;
+};
 
 // Taken from MDN's Common MIME types (https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types)
-static const char* mime_types[] = {
-	".aac", "audio/aac",
-	".abw", "application/x-abiword",
-	".arc", "application/x-freearc",
-	".avi", "video/x-msvideo",
-	".azw", "application/vnd.amazon.ebook",
-	".bin", "application/octet-stream",
-	".bmp", "image/bmp",
-	".bz", "application/x-bzip",
-	".bz2", "application/x-bzip2",
-	".csh", "application/x-csh",
-	".css", "text/css",
-	".csv", "text/csv",
-	".doc", "application/msword",
-	".docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
-	".eot", "application/vnd.ms-fontobject",
-	".epub", "application/epub+zip",
-	".gz", "application/gzip",
-	".gif", "image/gif",
-	".htm", "text/html",
-	".html", "text/html",
-	".ico", "image/vnd.microsoft.icon",
-	".ics", "text/calendar",
-	".jar", "application/java-archive",
-	".jpeg", "image/jpeg",
-	".jpg", "image/jpeg",
-	".js", "text/javascript",
-	".json", "application/json",
-	".jsonld", "application/ld+json",
-	".mid", "audio/midi audio/x-midi",
-	".midi", "audio/midi audio/x-midi",
-	".mjs", "text/javascript",
-	".mp3", "audio/mpeg",
-	".mpeg", "video/mpeg",
-	".mpkg", "application/vnd.apple.installer+xml",
-	".odp", "application/vnd.oasis.opendocument.presentation",
-	".ods", "application/vnd.oasis.opendocument.spreadsheet",
-	".odt", "application/vnd.oasis.opendocument.text",
-	".oga", "audio/ogg",
-	".ogv", "video/ogg",
-	".ogx", "application/ogg",
-	".opus", "audio/opus",
-	".otf", "font/otf",
-	".png", "image/png",
-	".pdf", "application/pdf",
-	".php", "application/x-httpd-php",
-	".ppt", "application/vnd.ms-powerpoint",
-	".pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation",
-	".rar", "application/vnd.rar",
-	".rtf", "application/rtf",
-	".sh", "application/x-sh",
-	".svg", "image/svg+xml",
-	".swf", "application/x-shockwave-flash",
-	".tar", "application/x-tar",
-	".tif", "image/tiff",
-	".tiff", "image/tiff",
-	".ts", "video/mp2t",
-	".ttf", "font/ttf",
-	".txt", "text/plain",
-	".vsd", "application/vnd.visio",
-	".wav", "audio/wav",
-	".weba", "audio/webm",
-	".webm", "video/webm",
-	".webp", "image/webp",
-	".woff", "font/woff",
-	".woff2", "font/woff2",
-	".xhtml", "application/xhtml+xml",
-	".xls", "application/vnd.ms-excel",
-	".xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
-	".xml", "text/xml",
-	".xul", "application/vnd.mozilla.xul+xml",
-	".zip", "application/zip",
-	".3gp", "video/3gpp",
-	".3g2", "video/3gpp2",
-	".7z", "application/x-7z-compressed"
+static constexpr MimeType mime_types[] = {
+	{ ".aac", "audio/aac" },
+	{ ".abw", "application/x-abiword" },
+	{ ".arc", "application/x-freearc" },
+	{ ".avi", "video/x-msvideo" },
+	{ ".azw", "application/vnd.amazon.ebook" },
+	{ ".bin", "application/octet-stream" },
+	{ ".bmp", "image/bmp" },
+	{ ".bz", "application/x-bzip" },
+	{ ".bz2", "application/x-bzip2" },
+	{ ".csh", "application/x-csh" },
+	{ ".css", "text/css" },
+	{ ".csv", "text/csv" },
+	{ ".doc", "application/msword" },
+	{ ".docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+	{ ".eot", "application/vnd.ms-fontobject" },
+	{ ".epub", "application/epub+zip" },
+	{ ".gz", "application/gzip" },
+	{ ".gif", "image/gif" },
+	{ ".htm", "text/html" },
+	{ ".html", "text/html" },
+	{ ".ico", "image/vnd.microsoft.icon" },
+	{ ".ics", "text/calendar" },
+	{ ".jar", "application/java-archive" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".jpg", "image/jpeg" },
+	{ ".js", "text/javascript" },
+	{ ".json", "application/json" },
+	{ ".jsonld", "application/ld+json" },
+	{ ".mid", "audio/midi" },
+	{ ".midi", "audio/midi" },
+	{ ".mjs", "text/javascript" },
+	{ ".mp3", "audio/mpeg" },
+	{ ".mp4", "video/mp4" },
+	{ ".mpeg", "video/mpeg" },
+	{ ".mpkg", "application/vnd.apple.installer+xml" },
+	{ ".odp", "application/vnd.oasis.opendocument.presentation" },
+	{ ".ods", "application/vnd.oasis.opendocument.spreadsheet" },
+	{ ".odt", "application/vnd.oasis.opendocument.text" },
+	{ ".oga", "audio/ogg" },
+	{ ".ogv", "video/ogg" },
+	{ ".ogx", "application/ogg" },
+	{ ".opus", "audio/opus" },
+	{ ".otf", "font/otf" },
+	{ ".png", "image/png" },
+	{ ".pdf", "application/pdf" },
+	{ ".php", "application/x-httpd-php" },
+	{ ".ppt", "application/vnd.ms-powerpoint" },
+	{ ".pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+	{ ".rar", "application/vnd.rar" },
+	{ ".rtf", "application/rtf" },
+	{ ".sh", "application/x-sh" },
+	{ ".svg", "image/svg+xml" },
+	{ ".swf", "application/x-shockwave-flash" },
+	{ ".tar", "application/x-tar" },
+	{ ".tif", "image/tiff" },
+	{ ".tiff", "image/tiff" },
+	{ ".ts", "video/mp2t" },
+	{ ".ttf", "font/ttf" },
+	{ ".txt", "text/plain" },
+	{ ".vsd", "application/vnd.visio" },
+	{ ".wav", "audio/wav" },
+	{ ".weba", "audio/webm" },
+	{ ".webm", "video/webm" },
+	{ ".webp", "image/webp" },
+	{ ".woff", "font/woff" },
+	{ ".woff2", "font/woff2" },
+	{ ".xhtml", "application/xhtml+xml" },
+	{ ".xls", "application/vnd.ms-excel" },
+	{ ".xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+	{ ".xml", "text/xml" },
+	{ ".xul", "application/vnd.mozilla.xul+xml" },
+	{ ".zip", "application/zip" },
+	{ ".3gp", "video/3gpp" },
+	{ ".3g2", "video/3gpp2" },
+	{ ".7z", "application/x-7z-compressed" }
+};
+
+static constexpr std::string_view default_mime_type = "application/octet-stream";
+
+// Extensions are looked up in an open addressing table. The seed was searched for so that every built-in
+// extension gets a slot of its own, so a lookup is one hash and one string comparison.
+#define MIME_HASH_SEED 686768u
+#define MIME_TABLE_BITS 8
+
+static constexpr char toLower(char c) {
+	return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+// Case-insensitive FNV-1a, the highest `bits` bits select the slot
+static constexpr uint32_t mimeHash(std::string_view extension, unsigned bits) {
+	uint32_t hash = MIME_HASH_SEED;
+	for (char c : extension) {
+		hash = (hash ^ (unsigned char)toLower(c)) * 16777619u;
+	}
+	return hash >> (32 - bits);
+}
+
+struct BuiltinTable {
+	uint8_t slots[1 << MIME_TABLE_BITS]; // Index into `mime_types` plus one, 0 for an empty slot
 };
 
-const char* getMimeType(const char* extension) {
-	for (int i = 0; i < sizeof(mime_types) / 2; i++) {
-		if (!strcmp(extension, mime_types[2 * i])) {
-			return mime_types[2 * i + 1];
+static constexpr BuiltinTable buildBuiltinTable() {
+	BuiltinTable table = {};
+	for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+		table.slots[mimeHash(mime_types[i].extension, MIME_TABLE_BITS)] = (uint8_t)(i + 1);
+	}
+	return table;
+}
+
+static constexpr BuiltinTable builtin_table = buildBuiltinTable();
+
+static constexpr bool isPerfectHash() {
+	for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+		if (builtin_table.slots[mimeHash(mime_types[i].extension, MIME_TABLE_BITS)] != i + 1)
+			return false;
+	}
+	return true;
+}
+static_assert(sizeof(mime_types) / sizeof(mime_types[0]) < 256, "A slot can't refer to more than 255 types");
+static_assert(isPerfectHash(), "Two extensions share a slot, MIME_HASH_SEED has to be searched for again");
+
+static bool extensionEquals(std::string_view extension, std::string_view lower_case) {
+	if (extension.length() != lower_case.length())
+		return false;
+	for (size_t i = 0; i < extension.length(); i++) {
+		if (toLower(extension[i]) != lower_case[i])
+			return false;
+	}
+	return true;
+}
+
+// The types of a mime.types file together with the built-in ones, hashed the same way.
+// Extensions may collide here, so a lookup probes the following slots until it hits an empty one.
+struct LoadedTable {
+	std::vector<std::string> strings; // Storage of the loaded extensions and types
+	std::vector<MimeType> types;
+	std::vector<uint32_t> slots; // Index into `types` plus one, 0 for an empty slot
+	unsigned bits;
+
+	// Inserts `types[index]`, replacing an entry with the same extension if `replace` is set
+	void insert(size_t index, bool replace) {
+		size_t mask = slots.size() - 1;
+		size_t slot = mimeHash(types[index].extension, bits);
+		while (slots[slot] != 0 && types[slots[slot] - 1].extension != types[index].extension) {
+			slot = (slot + 1) & mask;
+		}
+		if (slots[slot] == 0 || replace) {
+			slots[slot] = (uint32_t)(index + 1);
+		}
+	}
+
+	std::string_view find(std::string_view extension) const {
+		size_t mask = slots.size() - 1;
+		for (size_t slot = mimeHash(extension, bits); slots[slot] != 0; slot = (slot + 1) & mask) {
+			const MimeType& candidate = types[slots[slot] - 1];
+			if (extensionEquals(extension, candidate.extension))
+				return candidate.type;
 		}
+		return default_mime_type;
 	}
+};
+
+// Only set before the server starts, so lookups need no synchronization
+static std::unique_ptr<const LoadedTable> loaded_table;
+
+std::string_view getMimeType(std::string_view extension) {
+	if (extension.empty())
+		return default_mime_type;
+	if (loaded_table)
+		return loaded_table->find(extension);
+
+	uint8_t index = builtin_table.slots[mimeHash(extension, MIME_TABLE_BITS)];
+	if (index != 0 && extensionEquals(extension, mime_types[index - 1].extension))
+		return mime_types[index - 1].type;
 
 	// Default mime-type for unknown file types.
-	return "application/octet-stream";
-}
\ No newline at end of file
+	return default_mime_type;
+}
+
+void loadMimeTypes(const std::string& path) {
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Can't open " + path);
+
+	// `type extension...` lines as in /etc/mime.types, `#` starts a comment
+	std::unique_ptr<LoadedTable> table = std::make_unique<LoadedTable>();
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string type;
+		std::string extension;
+		if (!(words >> type))
+			continue;
+		if (type.find('/') == std::string::npos)
+			throw std::runtime_error("Invalid mime type '" + type + "' in " + path);
+		while (words >> extension) {
+			std::string key = "." + extension;
+			for (char& c : key) {
+				c = toLower(c);
+			}
+			table->strings.push_back(key);
+			table->strings.push_back(type);
+		}
+	}
+	size_t loaded_count = table->strings.size() / 2;
+
+	// The views into `strings` are taken once it stopped growing
+	for (size_t i = 0; i < loaded_count; i++) {
+		table->types.push_back(MimeType{ table->strings[2 * i], table->strings[2 * i + 1] });
+	}
+	for (const MimeType& builtin : mime_types) {
+		table->types.push_back(builtin);
+	}
+
+	// At most half of the slots are used, so probe sequences stay short
+	table->bits = MIME_TABLE_BITS;
+	while (((size_t)1 << table->bits) < table->types.size() * 2) {
+		table->bits++;
+	}
+	table->slots.assign((size_t)1 << table->bits, 0);
+	// Later lines of the file override earlier ones, and the file overrides the built-in types
+	for (size_t i = 0; i < table->types.size(); i++) {
+		table->insert(i, i < loaded_count);
+	}
+
+	std::cout << "Loaded " << loaded_count << " mime types from " << path << std::endl;
+	loaded_table = std::move(table);
+}
@@ -1,4 +1,11 @@
 #pragma once
+#include <string>
+#include <string_view>
 
-// Returns the mime type for a given extension including the dot
-const char* getMimeType(const char* extension);
\ No newline at end of file
+// Returns the mime type for a given extension including the dot, ignoring its case.
+// Unknown extensions get `application/octet-stream`. The returned view stays valid while the server runs.
+std::string_view getMimeType(std::string_view extension);
+
+// Adds the types of a mime.types file (`type extension...` lines) to the built-in ones, taking precedence over them.
+// Must be called before the server starts serving. Throws std::runtime_error if the file can't be read or is invalid.
+void loadMimeTypes(const std::string& path);
@@ -0,0 +1,265 @@
+#include "path_resolver.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "compression.h"
+#include "file_cache.h"
+#include "string_utils.h"
+
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define fullPath _fullpath
+#define PATH_BUFFER_SIZE _MAX_PATH
+#else
+#include <limits.h>
+#define PATH_BUFFER_SIZE PATH_MAX
+
+// POSIX counterpart of `_fullpath`. `realpath` only works for existing paths, so if the file itself
+// does not exist we resolve its parent directory instead and append the last component, which lets
+// the caller still answer with a 404 rather than failing the resolution.
+static char* fullPath(char* resolved, const char* path, size_t size) {
+	char full[PATH_MAX];
+	if (realpath(path, full) == NULL) {
+		std::string parent = path;
+		size_t last_seperator = parent.find_last_of(PATH_SEPERATOR);
+		std::string name = last_seperator == std::string::npos ? parent : parent.substr(last_seperator + 1);
+		parent = last_seperator == std::string::npos ? "." : parent.substr(0, last_seperator + 1);
+		if (errno != ENOENT || name == ".." || realpath(parent.c_str(), full) == NULL) {
+			return NULL;
+		}
+		strncat(full, "/", sizeof(full) - strlen(full) - 1);
+		strncat(full, name.c_str(), sizeof(full) - strlen(full) - 1);
+	}
+	if (strlen(full) >= size) {
+		return NULL;
+	}
+	strcpy(resolved, full);
+	return resolved;
+}
+#endif
+
+PathResolver path_resolver;
+
+static const ContentEncoding variant_encodings[] = { ContentEncoding::Gzip, ContentEncoding::Brotli };
+
+void PathResolver::start(const std::string& root, size_t cache_entries) {
+	char resolved_root[PATH_BUFFER_SIZE];
+	if (fullPath(resolved_root, root.c_str(), sizeof(resolved_root)) == NULL) {
+		std::cerr << "Failed to resolve the serve root " << root << ": " << errno << std::endl;
+		exit(1);
+	}
+	this->root = resolved_root;
+	if (this->root.length() > 1 && this->root.back() == PATH_SEPERATOR) {
+		this->root.pop_back();
+	}
+	shard_capacity = cache_entries / RESOLVE_CACHE_SHARDS;
+
+#ifdef __linux__
+	root_fd = open(this->root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd == -1) {
+		std::cerr << "Failed to open the serve root " << this->root << ": " << errno << std::endl;
+		exit(1);
+	}
+	// Kernels before 5.6 don't have openat2, paths are then compared with the root after canonicalizing them
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = O_PATH | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH;
+	int probe = (int)syscall(SYS_openat2, root_fd, ".", &how, sizeof(how));
+	if (probe == -1) {
+		std::cerr << "openat2() is not available, resolving paths with realpath(): " << errno << std::endl;
+		close(root_fd);
+		root_fd = -1;
+	} else {
+		close(probe);
+	}
+#endif
+}
+
+std::shared_ptr<const ResolvedPath> PathResolver::resolve(std::string_view request_path, unsigned long long generation) {
+	if (request_path.empty() || request_path[0] != '/')
+		throw std::runtime_error("Missing / in the beggining of abs_path");
+
+	// Results are only reused while the file cache's watcher tells us about changes
+	bool cacheable = shard_capacity > 0 && file_cache.watching();
+	Shard& shard = shards[std::hash<std::string_view>()(request_path) % RESOLVE_CACHE_SHARDS];
+	if (cacheable) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto entry = shard.entries.find(request_path);
+		if (entry != shard.entries.end() && entry->second->generation == generation) {
+			hits.fetch_add(1, std::memory_order_relaxed);
+			return entry->second;
+		}
+	}
+	misses.fetch_add(1, std::memory_order_relaxed);
+
+	std::string relative_path = decodeEscapeSequences(std::string(request_path.substr(1)));
+
+	std::shared_ptr<ResolvedPath> resolved = root_fd != -1 ? resolveBeneath(relative_path) : resolveCanonical(relative_path);
+	resolved->generation = generation;
+	resolved->request_path = request_path;
+
+	if (cacheable) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		// Crawlers requesting many different paths must not grow the cache without bounds
+		if (shard.entries.size() >= shard_capacity) {
+			shard.entries.clear();
+		}
+		// The replaced entry's key views its own path, so it has to go before the new one is inserted
+		shard.entries.erase(request_path);
+		shard.entries.emplace(resolved->request_path, resolved);
+	}
+	return resolved;
+}
+
+int PathResolver::openFile(const char* path) const {
+#ifdef __linux__
+	if (root_fd != -1) {
+		// Paths outside the root are never served
+		if (strncmp(path, root.c_str(), root.length()) != 0 || path[root.length()] != '/')
+			return -1;
+		struct open_how how;
+		memset(&how, 0, sizeof(how));
+		how.flags = O_RDONLY | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		int fd;
+		do {
+			fd = (int)syscall(SYS_openat2, root_fd, path + root.length() + 1, &how, sizeof(how));
+		} while (fd == -1 && (errno == EINTR || errno == EAGAIN));
+		return fd;
+	}
+#endif
+#ifdef _WIN32
+	return _open(path, _O_RDONLY | _O_BINARY);
+#else
+	return open(path, O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+#ifdef __linux__
+// Opens `relative_path` below the directory `directory_fd` for `fstat` only. Returns -1 if there is no such file,
+// throws if the path leads outside the directory.
+static int openBeneath(int directory_fd, const std::string& relative_path) {
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = O_PATH | O_CLOEXEC;
+	// Absolute symbolic links and `..` may not leave the root, and /proc links may not jump anywhere
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	int fd;
+	do {
+		fd = (int)syscall(SYS_openat2, directory_fd, relative_path.empty() ? "." : relative_path.c_str(), &how, sizeof(how));
+	} while (fd == -1 && (errno == EINTR || errno == EAGAIN));
+	if (fd == -1 && errno == EXDEV)
+		throw std::runtime_error("File path outside server root, possible path traversal");
+	return fd;
+}
+
+// Stats `relative_path` below the directory `directory_fd`, setting `st_mode` to 0 if there is no such file
+static void statBeneath(int directory_fd, const std::string& relative_path, struct stat& status) {
+	int fd = openBeneath(directory_fd, relative_path);
+	if (fd == -1 || fstat(fd, &status) != 0) {
+		status.st_mode = 0;
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+std::shared_ptr<ResolvedPath> PathResolver::resolveBeneath(const std::string& relative_path) {
+	std::shared_ptr<ResolvedPath> resolved = std::make_shared<ResolvedPath>();
+	int fd = openBeneath(root_fd, relative_path);
+	if (fd != -1 && fstat(fd, &resolved->status) == 0 && S_ISDIR(resolved->status.st_mode)) {
+		// Path is a directory, try serving local index.html
+		int index_fd = openBeneath(fd, "index.html");
+		close(fd);
+		fd = index_fd;
+		if (fd == -1 || fstat(fd, &resolved->status) != 0) {
+			resolved->status.st_mode = 0;
+		}
+	} else if (fd == -1) {
+		resolved->status.st_mode = 0;
+	}
+
+	// The canonical path is what the file cache's watcher reports changes for
+	if (fd != -1) {
+		char link[64];
+		char target[PATH_MAX];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		ssize_t length = readlink(link, target, sizeof(target));
+		close(fd);
+		if (length > 0 && (size_t)length < sizeof(target)) {
+			resolved->path.assign(target, (size_t)length);
+		}
+	}
+	if (resolved->path.empty()) {
+		resolved->path = root + "/" + relative_path;
+	}
+
+	// The precompressed siblings have to be below the root as well
+	for (ContentEncoding encoding : variant_encodings) {
+		struct stat& variant = resolved->variants[(int)encoding];
+		variant.st_mode = 0;
+		if (S_ISREG(resolved->status.st_mode) && resolved->path.compare(0, root.length() + 1, root + "/") == 0) {
+			statBeneath(root_fd, resolved->path.substr(root.length() + 1) + encodingFileSuffix(encoding), variant);
+		}
+	}
+	return resolved;
+}
+#else
+std::shared_ptr<ResolvedPath> PathResolver::resolveBeneath(const std::string& relative_path) {
+	return resolveCanonical(relative_path);
+}
+#endif
+
+std::shared_ptr<ResolvedPath> PathResolver::resolveCanonical(const std::string& relative_path) {
+	// We resolve the relative path to an absolute path for two reasons:
+	// - We want to turn the linux-style path into a windows-style path
+	// - We need to make sure that the use of `..` path traversal did not cause the final path
+	//   the end up outside of the serve root, which is not allowed.
+	std::string filepath = root + "/" + relative_path;
+	char resolved_path[PATH_BUFFER_SIZE];
+	if (fullPath(resolved_path, filepath.c_str(), sizeof(resolved_path)) == NULL) {
+		throw std::runtime_error("_fullpath() failed (File path too long?)");
+	}
+	// `/srv/root2` is not below `/srv/root`
+	size_t root_length = root.length();
+	if (strncmp(resolved_path, root.c_str(), root_length) != 0
+		|| (resolved_path[root_length] != '\0' && resolved_path[root_length] != PATH_SEPERATOR)) {
+		throw std::runtime_error("File path outside server root, possible path traversal");
+	}
+
+	std::shared_ptr<ResolvedPath> resolved = std::make_shared<ResolvedPath>();
+	resolved->path = resolved_path;
+	int stat_result = stat(resolved_path, &resolved->status);
+	if (stat_result == 0 && (resolved->status.st_mode & S_IFDIR) != 0) {
+		// Path is a directory, try serving local index.html
+		if (resolved->path.back() != PATH_SEPERATOR) {
+			resolved->path += PATH_SEPERATOR;
+		}
+		resolved->path += "index.html";
+		stat_result = stat(resolved->path.c_str(), &resolved->status);
+	}
+	// The caller answers conditional requests with this, without opening the file
+	if (stat_result != 0) {
+		resolved->status.st_mode = 0;
+	}
+
+	for (ContentEncoding encoding : variant_encodings) {
+		struct stat& variant = resolved->variants[(int)encoding];
+		if (stat_result != 0 || stat((resolved->path + encodingFileSuffix(encoding)).c_str(), &variant) != 0) {
+			variant.st_mode = 0;
+		}
+	}
+	return resolved;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#define RESOLVE_CACHE_SHARDS 16 // Entries are spread over independently locked shards to reduce contention
+
+// What a request path resolved to
+struct ResolvedPath {
+	std::string request_path; // The request path this was resolved for, which it is cached under
+	// Canonical local path of the file to serve, the `index.html` for a directory. It keys the caches and their
+	// invalidation, the file itself is opened with `PathResolver::openFile`.
+	std::string path;
+	struct stat status; // Status of `path`, with `st_mode` 0 if it does not exist
+	// Status of the precompressed siblings (`path.gz`, `path.br`) indexed by `ContentEncoding`, `st_mode` 0 if missing
+	struct stat variants[3];
+	unsigned long long generation; // File cache generation from before the path was resolved
+};
+
+// Maps request paths to the files below the serve root.
+// The root is held open as a directory, and paths are resolved relative to it with `openat2(RESOLVE_BENEATH)`,
+// so neither `..` nor symbolic links can lead out of it (Linux 5.6+). Elsewhere the canonical path is compared
+// with the root's. Results are cached while the file cache watches for changes, which invalidate them, so a
+// repeated request needs no system calls to find its file.
+class PathResolver {
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		// Keyed by views of the entries' `request_path`, so lookups need no copy of the path
+		std::unordered_map<std::string_view, std::shared_ptr<const ResolvedPath>> entries;
+	};
+
+	Shard shards[RESOLVE_CACHE_SHARDS];
+	std::string root; // Canonical path of the serve root, without a trailing separator
+	int root_fd; // -1 if `openat2` is not available
+	size_t shard_capacity; // 0 disables the cache
+
+	std::atomic<unsigned long long> hits;
+	std::atomic<unsigned long long> misses;
+
+	// Resolves a decoded path relative to the root
+	std::shared_ptr<ResolvedPath> resolveBeneath(const std::string& relative_path);
+	std::shared_ptr<ResolvedPath> resolveCanonical(const std::string& relative_path);
+public:
+	PathResolver() : root_fd(-1), shard_capacity(0), hits(0), misses(0) {}
+
+	// Opens the serve root and caches up to `cache_entries` resolved paths (0 disables the cache).
+	// Exits if the root can't be opened.
+	void start(const std::string& root, size_t cache_entries);
+
+	// Resolves the path of a request URI (without the query, still percent-encoded). `generation` is the file cache
+	// generation from before the call, cached results from before a later change are not used.
+	// Throws std::runtime_error if the path is invalid or leads outside the root.
+	std::shared_ptr<const ResolvedPath> resolve(std::string_view request_path, unsigned long long generation);
+
+	// Opens a file for reading by the canonical path `resolve` found for it (or a sibling of it). Below the root it is
+	// opened relative to the root with `openat2(RESOLVE_BENEATH)` again, so a directory replaced by a symbolic link
+	// since the path was resolved or cached can't lead out of it. Returns the descriptor, or -1 if it can't be opened.
+	int openFile(const char* path) const;
+
+	unsigned long long hitCount() const { return hits.load(std::memory_order_relaxed); }
+	unsigned long long missCount() const { return misses.load(std::memory_order_relaxed); }
+};
+
+extern PathResolver path_resolver;
@@ -0,0 +1,598 @@
+#include "proxy.h"
+
+#include <string.h>
+#include <charconv>
+#include <iostream>
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+
+#include "server_settings.h"
+#include "server_config.h"
+#include "string_utils.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+ProxyRoutes proxy_routes;
+
+Upstream::Upstream(std::string name, const sockaddr* address, socklen_t length)
+	: upstream_name(std::move(name)), address_length(length), failures(0), ejected_until(0) {
+	memcpy(&socket_address, address, length);
+}
+
+void Upstream::reportSuccess() {
+	if (failures.load(std::memory_order_relaxed) != 0) {
+		failures.store(0, std::memory_order_relaxed);
+	}
+}
+
+void Upstream::reportFailure() {
+	metrics.countUpstreamFailure();
+	if (failures.fetch_add(1, std::memory_order_relaxed) + 1 < PROXY_MAX_FAILS)
+		return;
+	// Requests in flight may fail as well, the upstream is only ejected once
+	failures.store(0, std::memory_order_relaxed);
+	ejected_until.store(monotonicMilliseconds() + PROXY_FAIL_TIMEOUT_SECONDS * 1000LL, std::memory_order_relaxed);
+	metrics.countUpstreamEjection();
+	LOG(Warning) << "Upstream " << upstream_name << " failed " << PROXY_MAX_FAILS << " times in a row, it gets no requests for "
+		<< PROXY_FAIL_TIMEOUT_SECONDS << " seconds.";
+}
+
+// Resolves `host:port`, `[ipv6]:port` or `unix:PATH`. Exits if that fails.
+static std::unique_ptr<Upstream> resolveUpstream(const std::string& name) {
+	if (name.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+		std::cerr << "Unix socket upstreams are not supported: " << name << std::endl;
+		exit(1);
+#else
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		std::string path = name.substr(5);
+		if (path.empty() || path.length() >= sizeof(address.sun_path)) {
+			std::cerr << "Invalid Unix socket path for an upstream: " << name << std::endl;
+			exit(1);
+		}
+		memcpy(address.sun_path, path.c_str(), path.length() + 1);
+		return std::make_unique<Upstream>(name, (const sockaddr*)&address, (socklen_t)sizeof(address));
+#endif
+	}
+
+	size_t colon = name.rfind(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == name.length()) {
+		std::cerr << "An upstream has to be host:port or unix:PATH: " << name << std::endl;
+		exit(1);
+	}
+	std::string host = name.substr(0, colon);
+	if (host.length() > 2 && host.front() == '[' && host.back() == ']') {
+		host = host.substr(1, host.length() - 2);
+	}
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	int error = getaddrinfo(host.c_str(), name.c_str() + colon + 1, &hints, &result);
+	if (error != 0 || result == nullptr) {
+		std::cerr << "Failed to resolve the upstream " << name << ": " << gai_strerror(error) << std::endl;
+		exit(1);
+	}
+	std::unique_ptr<Upstream> upstream = std::make_unique<Upstream>(name, result->ai_addr, (socklen_t)result->ai_addrlen);
+	freeaddrinfo(result);
+	return upstream;
+}
+
+void ProxyRoutes::start(const std::vector<std::pair<std::string, std::string>>& rules) {
+	for (const auto& rule : rules) {
+		std::unique_ptr<ProxyRoute> route = std::make_unique<ProxyRoute>();
+		route->prefix = rule.first;
+		route->next = 0;
+		size_t start = 0;
+		while (start <= rule.second.length()) {
+			size_t comma = std::min(rule.second.find(',', start), rule.second.length());
+			route->upstreams.push_back(resolveUpstream(rule.second.substr(start, comma - start)));
+			start = comma + 1;
+		}
+		routes.push_back(std::move(route));
+	}
+}
+
+ProxyRoute* ProxyRoutes::match(std::string_view path) const {
+	for (const auto& route : routes) {
+		if (path.compare(0, route->prefix.length(), route->prefix) == 0)
+			return route.get();
+	}
+	return nullptr;
+}
+
+Upstream* ProxyRoutes::choose(ProxyRoute& route) const {
+	long long now = monotonicMilliseconds();
+	size_t count = route.upstreams.size();
+	unsigned start = route.next.fetch_add(1, std::memory_order_relaxed);
+	for (size_t i = 0; i < count; i++) {
+		Upstream* upstream = route.upstreams[(start + i) % count].get();
+		if (upstream->isAvailable(now))
+			return upstream;
+	}
+	return nullptr;
+}
+
+void ChunkedScanner::reset() {
+	state = State::Size;
+	chunk_remaining = 0;
+	has_digits = false;
+}
+
+size_t ChunkedScanner::scan(const char* data, size_t length, std::string_view& chunk_data) {
+	chunk_data = std::string_view();
+	size_t i = 0;
+	while (i < length && state != State::Done && state != State::Invalid) {
+		char c = data[i];
+		switch (state) {
+		case State::Size: {
+			int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+			if (digit >= 0) {
+				if (chunk_remaining >> 56 != 0) {
+					state = State::Invalid;
+					break;
+				}
+				chunk_remaining = chunk_remaining * 16 + (unsigned)digit;
+				has_digits = true;
+			} else if (!has_digits) {
+				state = State::Invalid;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				state = State::Extension;
+			} else if (c == '\r') {
+				state = State::SizeLineEnd;
+			} else {
+				state = State::Invalid;
+			}
+			i++;
+			break;
+		}
+		case State::Extension:
+			if (c == '\r') {
+				state = State::SizeLineEnd;
+			}
+			i++;
+			break;
+		case State::SizeLineEnd:
+			if (c != '\n') {
+				state = State::Invalid;
+				break;
+			}
+			i++;
+			has_digits = false;
+			state = chunk_remaining == 0 ? State::TrailerLineStart : State::Data;
+			break;
+		case State::Data: {
+			size_t piece = (size_t)std::min<unsigned long long>(chunk_remaining, length - i);
+			chunk_data = std::string_view(data + i, piece);
+			chunk_remaining -= piece;
+			i += piece;
+			if (chunk_remaining == 0) {
+				state = State::DataCarriageReturn;
+			}
+			// The caller gets one piece of data at a time
+			return i;
+		}
+		case State::DataCarriageReturn:
+			state = c == '\r' ? State::DataLineEnd : State::Invalid;
+			i++;
+			break;
+		case State::DataLineEnd:
+			state = c == '\n' ? State::Size : State::Invalid;
+			i++;
+			break;
+		case State::TrailerLineStart:
+			state = c == '\r' ? State::TrailerEnd : State::TrailerLine;
+			i++;
+			break;
+		case State::TrailerLine:
+			if (c == '\n') {
+				state = State::TrailerLineStart;
+			}
+			i++;
+			break;
+		case State::TrailerEnd:
+			state = c == '\n' ? State::Done : State::Invalid;
+			i++;
+			break;
+		default:
+			break;
+		}
+	}
+	return i;
+}
+
+ProxyExchange::ProxyExchange(std::pmr::memory_resource* memory)
+	: target(nullptr), request(memory), request_sent(0), replayable(false), idempotent(false), sent_any(false), request_framing(Framing::None), request_body_remaining(0),
+	response_head(memory), head_complete(false), interim(false), received_any(false), closed(false), status(0),
+	response_framing(Framing::None), response_body_remaining(0), decode_chunks(false), upstream_keep_alive(false),
+	forwarded_body(0), client_http_1_1(true), client_keep_alive(false), is_head(false), connected(false), last_activity(0),
+	log_method(memory), log_uri(memory), log_version(memory), log_referer(memory), log_user_agent(memory) {
+}
+
+// Splits the value of a `Connection` header into its options, which name further hop-by-hop headers
+static size_t connectionOptions(std::string_view value, std::string_view (&options)[8], size_t count) {
+	while (!value.empty() && count < 8) {
+		size_t comma = value.find(',');
+		std::string_view option = trimWhitespace(value.substr(0, comma));
+		if (!option.empty()) {
+			options[count++] = option;
+		}
+		value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+	}
+	return count;
+}
+
+// Headers which only concern one connection and are not passed on (RFC 9110 7.6.1), together with the ones named by
+// its `Connection` header
+static bool isHopByHop(std::string_view name, const std::string_view (&options)[8], size_t option_count) {
+	static const std::string_view hop_by_hop[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade" };
+	for (std::string_view header : hop_by_hop) {
+		if (caseInsensitiveEquals(name, header))
+			return true;
+	}
+	for (size_t i = 0; i < option_count; i++) {
+		if (caseInsensitiveEquals(name, options[i]))
+			return true;
+	}
+	return false;
+}
+
+void ProxyExchange::start(Upstream* upstream, const HttpRequest& http_request, std::string_view client_address, bool secure,
+	bool keep_alive, long long content_length, bool chunked) {
+	target = upstream;
+	request.clear();
+	request_sent = 0;
+	replayable = true;
+	idempotent = false;
+	for (std::string_view method : { "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE" }) {
+		idempotent |= http_request.method == method;
+	}
+	sent_any = false;
+	request_framing = chunked ? Framing::Chunked : content_length > 0 ? Framing::Length : Framing::None;
+	request_body_remaining = content_length;
+	request_chunks.reset();
+	response_head.clear();
+	head_complete = false;
+	interim = false;
+	received_any = false;
+	closed = false;
+	status = 0;
+	response_framing = Framing::None;
+	response_body_remaining = 0;
+	response_chunks.reset();
+	decode_chunks = false;
+	upstream_keep_alive = false;
+	forwarded_body = 0;
+	client_http_1_1 = http_request.version != "HTTP/1.0";
+	client_keep_alive = keep_alive;
+	is_head = http_request.method == "HEAD";
+	connected = false;
+	last_activity = monotonicMilliseconds();
+
+	log_method.assign(http_request.method);
+	log_uri.assign(http_request.uri);
+	log_version.assign(http_request.version);
+	log_referer.clear();
+	log_user_agent.clear();
+
+	std::string_view options[8];
+	size_t option_count = 0;
+	for (size_t i = 0; i < http_request.header_count; i++) {
+		if (http_request.headers[i].id == HeaderId::Connection) {
+			option_count = connectionOptions(http_request.headers[i].value, options, option_count);
+		}
+	}
+
+	request.reserve(512);
+	request.append(http_request.method).append(" ").append(http_request.uri).append(" HTTP/1.1\r\n");
+	bool has_host = false;
+	bool has_length = false;
+	std::string_view forwarded_for;
+	for (size_t i = 0; i < http_request.header_count; i++) {
+		const HttpHeader& header = http_request.headers[i];
+		if (header.id == HeaderId::Referer) {
+			log_referer.assign(header.value);
+		} else if (header.id == HeaderId::UserAgent) {
+			log_user_agent.assign(header.value);
+		}
+		if (isHopByHop(header.name, options, option_count) || caseInsensitiveEquals(header.name, "X-Forwarded-Proto"))
+			continue;
+		// The body is framed the way we forward it, not copied from the client's headers
+		if (header.id == HeaderId::ContentLength || header.id == HeaderId::TransferEncoding) {
+			has_length |= header.id == HeaderId::ContentLength;
+			continue;
+		}
+		if (caseInsensitiveEquals(header.name, "X-Forwarded-For")) {
+			// Proxies in front of us are kept in the list
+			forwarded_for = header.value;
+			continue;
+		}
+		has_host |= header.id == HeaderId::Host;
+		request.append(header.name).append(": ").append(header.value).append("\r\n");
+	}
+	if (!has_host) {
+		// An HTTP/1.0 client may not have sent one, HTTP/1.1 requires it
+		request.append("Host: ").append(upstream->name().compare(0, 5, "unix:") == 0 ? "localhost" : upstream->name()).append("\r\n");
+	}
+	if (chunked) {
+		request.append("Transfer-Encoding: chunked\r\n");
+	} else if (has_length) {
+		char length[24];
+		request.append("Content-Length: ").append(length, std::to_chars(length, length + sizeof(length), content_length).ptr - length).append("\r\n");
+	}
+	request.append("X-Forwarded-For: ");
+	if (!forwarded_for.empty()) {
+		request.append(forwarded_for).append(", ");
+	}
+	request.append(client_address).append("\r\n");
+	request.append("X-Forwarded-Proto: ").append(secure ? "https" : "http").append("\r\n\r\n");
+}
+
+void ProxyExchange::onConnected() {
+	connected = true;
+	last_activity = monotonicMilliseconds();
+}
+
+size_t ProxyExchange::addRequestBody(const char* data, size_t length) {
+	size_t unsent = request.length() - request_sent;
+	if (requestBodyComplete() || unsent >= PROXY_BUFFER_SIZE)
+		return 0;
+	size_t take = std::min(length, PROXY_BUFFER_SIZE - unsent);
+	if (request_framing == Framing::Length) {
+		take = (size_t)std::min<long long>((long long)take, request_body_remaining);
+		request_body_remaining -= take;
+	} else {
+		// The body is passed on as it is, the chunks only tell where it ends
+		size_t scanned = 0;
+		std::string_view chunk_data;
+		while (scanned < take && !request_chunks.done() && !request_chunks.invalid()) {
+			scanned += request_chunks.scan(data + scanned, take - scanned, chunk_data);
+		}
+		take = scanned;
+	}
+
+	// Sent bytes are kept for a retry as long as the whole request fits into the buffer
+	if (request.length() + take > PROXY_BUFFER_SIZE && request_sent > 0) {
+		request.erase(0, request_sent);
+		request_sent = 0;
+		replayable = false;
+	}
+	request.append(data, take);
+	if (unsent == 0 && take > 0) {
+		// The upstream waited for the client so far, it gets the full timeout for the new bytes
+		last_activity = monotonicMilliseconds();
+	}
+	return take;
+}
+
+bool ProxyExchange::requestBodyComplete() const {
+	switch (request_framing) {
+	case Framing::Length:
+		return request_body_remaining == 0;
+	case Framing::Chunked:
+		return request_chunks.done();
+	default:
+		return true;
+	}
+}
+
+void ProxyExchange::consumeRequest(size_t length) {
+	request_sent += length;
+	sent_any |= length > 0;
+	last_activity = monotonicMilliseconds();
+	if (!replayable && request_sent == request.length()) {
+		request.clear();
+		request_sent = 0;
+	}
+}
+
+bool ProxyExchange::restart() {
+	if (!replayable || received_any || (sent_any && !idempotent))
+		return false;
+	request_sent = 0;
+	sent_any = false;
+	connected = false;
+	last_activity = monotonicMilliseconds();
+	return true;
+}
+
+bool ProxyExchange::parseResponseHead() {
+	std::string_view head = response_head;
+	size_t line_end = head.find("\r\n");
+	std::string_view status_line = head.substr(0, line_end);
+	if (status_line.length() < 12 || status_line.compare(0, 7, "HTTP/1.") != 0 || status_line[8] != ' '
+		|| std::from_chars(status_line.data() + 9, status_line.data() + 12, status).ptr != status_line.data() + 12
+		|| status < 100 || status > 599 || status == 101)
+		return false;
+	bool http_1_1 = status_line[7] != '0';
+
+	// The options of `Connection` may name other headers, which have to be known before they are copied
+	std::string_view options[8];
+	size_t option_count = 0;
+	std::string_view lines = head.substr(line_end + 2, head.length() - line_end - 4);
+	for (size_t start = 0; start < lines.length();) {
+		size_t end = std::min(lines.find("\r\n", start), lines.length());
+		std::string_view line = lines.substr(start, end - start);
+		size_t colon = line.find(':');
+		if (colon == std::string_view::npos || colon == 0)
+			return false;
+		if (caseInsensitiveEquals(line.substr(0, colon), "Connection")) {
+			option_count = connectionOptions(line.substr(colon + 1), options, option_count);
+		}
+		start = end + 2;
+	}
+
+	std::pmr::string rewritten(response_head.get_allocator());
+	rewritten.reserve(head.length() + 32);
+	rewritten.append("HTTP/1.1 ").append(status_line.substr(9)).append("\r\n");
+	long long content_length = -1;
+	bool chunked = false;
+	bool other_encoding = false;
+	upstream_keep_alive = http_1_1;
+	for (size_t start = 0; start < lines.length();) {
+		size_t end = std::min(lines.find("\r\n", start), lines.length());
+		std::string_view line = lines.substr(start, end - start);
+		start = end + 2;
+		size_t colon = line.find(':');
+		std::string_view name = line.substr(0, colon);
+		std::string_view value = trimWhitespace(line.substr(colon + 1));
+		if (caseInsensitiveEquals(name, "Connection")) {
+			for (size_t i = 0; i < option_count; i++) {
+				if (caseInsensitiveEquals(options[i], "close")) {
+					upstream_keep_alive = false;
+				} else if (caseInsensitiveEquals(options[i], "keep-alive")) {
+					upstream_keep_alive = true;
+				}
+			}
+			continue;
+		}
+		if (isHopByHop(name, options, option_count))
+			continue;
+		if (caseInsensitiveEquals(name, "Content-Length")) {
+			long long length = -1;
+			if (value.empty() || std::from_chars(value.data(), value.data() + value.length(), length).ptr != value.data() + value.length()
+				|| length < 0 || (content_length >= 0 && length != content_length))
+				return false;
+			content_length = length;
+		} else if (caseInsensitiveEquals(name, "Transfer-Encoding")) {
+			// Chunked has to be the last coding, otherwise the body ends with the connection
+			std::string_view last = trimWhitespace(value.substr(value.rfind(',') == std::string_view::npos ? 0 : value.rfind(',') + 1));
+			chunked = caseInsensitiveEquals(last, "chunked");
+			other_encoding = !chunked;
+			if (!client_http_1_1)
+				continue; // An HTTP/1.0 client gets the body decoded
+		}
+		rewritten.append(line).append("\r\n");
+	}
+	if (chunked && content_length >= 0)
+		return false; // Ambiguous, the way responses are smuggled
+
+	if (status < 200) {
+		// An interim response (`100 Continue`) is passed on to clients which know them, the final one follows
+		interim = true;
+		if (client_http_1_1) {
+			rewritten.append("\r\n");
+			response_head.swap(rewritten);
+		} else {
+			response_head.clear();
+		}
+		return true;
+	}
+
+	if (is_head || status == 204 || status == 304) {
+		response_framing = Framing::None;
+	} else if (chunked) {
+		response_framing = Framing::Chunked;
+		decode_chunks = !client_http_1_1;
+	} else if (content_length >= 0 && !other_encoding) {
+		response_framing = content_length > 0 ? Framing::Length : Framing::None;
+		response_body_remaining = content_length;
+	} else {
+		response_framing = Framing::UntilClose;
+		upstream_keep_alive = false;
+	}
+	// Without a length the client has to see the connection close to find the end
+	if (response_framing == Framing::UntilClose || decode_chunks) {
+		client_keep_alive = false;
+	}
+	rewritten.append(client_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+	response_head.swap(rewritten);
+	head_complete = true;
+	return true;
+}
+
+size_t ProxyExchange::receive(const char* data, size_t length, std::string_view& forward) {
+	forward = std::string_view();
+	last_activity = monotonicMilliseconds();
+	received_any = true;
+	replayable = false;
+
+	if (!head_complete) {
+		if (interim) {
+			response_head.clear();
+			interim = false;
+		}
+		// Only the new bytes and the three before them can contain the end of the head
+		size_t search_start = response_head.length() >= 3 ? response_head.length() - 3 : 0;
+		size_t previous_length = response_head.length();
+		response_head.append(data, std::min(length, (size_t)MAX_REQUEST_HEADERS_SIZE));
+		size_t end = response_head.find("\r\n\r\n", search_start);
+		if (end == std::string::npos) {
+			if (response_head.length() >= MAX_REQUEST_HEADERS_SIZE)
+				return 0;
+			return length;
+		}
+		response_head.resize(end + 4);
+		if (!parseResponseHead())
+			return 0;
+		forward = response_head;
+		return end + 4 - previous_length;
+	}
+
+	size_t processed = 0;
+	switch (response_framing) {
+	case Framing::Length:
+		processed = (size_t)std::min<long long>((long long)length, response_body_remaining);
+		response_body_remaining -= processed;
+		forward = std::string_view(data, processed);
+		break;
+	case Framing::Chunked: {
+		std::string_view chunk_data;
+		processed = response_chunks.scan(data, length, chunk_data);
+		if (response_chunks.invalid())
+			return 0;
+		forward = decode_chunks ? chunk_data : std::string_view(data, processed);
+		break;
+	}
+	case Framing::UntilClose:
+		processed = length;
+		forward = std::string_view(data, length);
+		break;
+	default:
+		break;
+	}
+	forwarded_body += (long long)forward.length();
+	return processed;
+}
+
+bool ProxyExchange::onEnd() {
+	closed = true;
+	return responseComplete();
+}
+
+bool ProxyExchange::responseComplete() const {
+	if (!head_complete)
+		return false;
+	switch (response_framing) {
+	case Framing::Length:
+		return response_body_remaining == 0;
+	case Framing::Chunked:
+		return response_chunks.done();
+	case Framing::UntilClose:
+		return closed;
+	default:
+		return true;
+	}
+}
+
+long long ProxyExchange::rawBodyRemaining() const {
+	return head_complete && response_framing == Framing::Length ? response_body_remaining : 0;
+}
+
+void ProxyExchange::onRawBody(size_t length) {
+	response_body_remaining -= (long long)length;
+	forwarded_body += (long long)length;
+	last_activity = monotonicMilliseconds();
+}
+
+bool ProxyExchange::upstreamReusable() const {
+	return upstream_keep_alive && !closed && responseComplete() && response_framing != Framing::UntilClose
+		&& requestBodyComplete() && request_sent == request.length();
+}
+
+long long ProxyExchange::deadline() const {
+	return last_activity + (connected ? server_config.proxy_timeout : PROXY_CONNECT_TIMEOUT_SECONDS) * 1000LL;
+}
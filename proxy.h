@@ -0,0 +1,179 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "sockets.h"
+#include "http_parser.h"
+
+// A server requests are passed to. Its health is shared by all threads: after PROXY_MAX_FAILS failures in a row
+// (refused or reset connections, timeouts, malformed responses) it is ejected and gets no requests for
+// PROXY_FAIL_TIMEOUT_SECONDS, after which it is tried again.
+class Upstream {
+	std::string upstream_name; // As given on the command line, e.g. `127.0.0.1:9000` or `unix:/run/app.sock`
+	sockaddr_storage socket_address;
+	socklen_t address_length;
+	std::atomic<int> failures; // In a row
+	std::atomic<long long> ejected_until; // Monotonic milliseconds
+public:
+	Upstream(std::string name, const sockaddr* address, socklen_t length);
+	Upstream(const Upstream&) = delete;
+	Upstream& operator=(const Upstream&) = delete;
+
+	const std::string& name() const { return upstream_name; }
+	const sockaddr* address() const { return (const sockaddr*)&socket_address; }
+	socklen_t addressLength() const { return address_length; }
+
+	bool isAvailable(long long now) const { return ejected_until.load(std::memory_order_relaxed) <= now; }
+	void reportSuccess();
+	void reportFailure();
+};
+
+// Requests whose path starts with `prefix` are passed to one of the upstreams, which take turns
+struct ProxyRoute {
+	std::string prefix;
+	std::vector<std::unique_ptr<Upstream>> upstreams;
+	std::atomic<unsigned> next;
+};
+
+// The proxy routes of the `--proxy` options
+class ProxyRoutes {
+	std::vector<std::unique_ptr<ProxyRoute>> routes;
+public:
+	// Resolves the upstreams of every rule (path prefix, comma-separated `host:port` or `unix:PATH`).
+	// Exits if one can't be resolved.
+	void start(const std::vector<std::pair<std::string, std::string>>& rules);
+	bool enabled() const { return !routes.empty(); }
+	// The first route whose prefix the request path starts with, null if none does
+	ProxyRoute* match(std::string_view path) const;
+	// The next upstream of the route which is not ejected, null if all of them are
+	Upstream* choose(ProxyRoute& route) const;
+};
+
+extern ProxyRoutes proxy_routes;
+
+// Finds the end of a chunked body (RFC 9112 7.1) as it passes through, without buffering it
+class ChunkedScanner {
+	enum class State { Size, Extension, SizeLineEnd, Data, DataCarriageReturn, DataLineEnd, TrailerLineStart, TrailerLine,
+		TrailerEnd, Done, Invalid };
+	State state;
+	unsigned long long chunk_remaining;
+	bool has_digits;
+public:
+	ChunkedScanner() { reset(); }
+	void reset();
+
+	// Scans `data` up to the end of the body. Stops behind the next piece of chunk data, which `chunk_data` is set to
+	// (empty if there was none). Returns the number of bytes scanned.
+	size_t scan(const char* data, size_t length, std::string_view& chunk_data);
+	bool done() const { return state == State::Done; }
+	bool invalid() const { return state == State::Invalid; }
+};
+
+// A request passed to an upstream over HTTP/1.1 and its response on the way back. Like `HttpConnection`, which owns
+// it, it does no I/O itself.
+// The request head is rewritten for the upstream, its body is passed on as it arrives. The upstream connection stays
+// reusable as long as both messages are delimited and the upstream does not close it.
+class ProxyExchange {
+public:
+	enum class Framing {
+		None, // No body
+		Length, // `Content-Length` bytes
+		Chunked,
+		UntilClose // The response ends when the upstream closes the connection
+	};
+private:
+	Upstream* target;
+	std::pmr::string request; // The request head and body waiting to be sent, sent bytes are kept for a retry
+	size_t request_sent;
+	bool replayable; // `request` still holds everything sent, so it can be sent again on a new connection
+	bool idempotent; // The method may be sent twice (RFC 9110 9.2.2), others are not retried once some of it was sent
+	bool sent_any; // Some of the request reached the current upstream connection
+	Framing request_framing;
+	long long request_body_remaining; // For `Framing::Length`
+	ChunkedScanner request_chunks;
+
+	std::pmr::string response_head; // Received until it is complete, then the head rewritten for the client
+	bool head_complete; // The final (not 1xx) head was received and queued
+	bool interim; // `response_head` holds an interim (1xx) head which was passed on
+	bool received_any;
+	bool closed; // The upstream closed the connection
+	int status;
+	Framing response_framing;
+	long long response_body_remaining; // For `Framing::Length`
+	ChunkedScanner response_chunks;
+	bool decode_chunks; // An HTTP/1.0 client gets the chunk data only
+	bool upstream_keep_alive;
+	long long forwarded_body; // Body bytes passed to the client
+
+	bool client_http_1_1;
+	bool client_keep_alive;
+	bool is_head;
+	bool connected;
+	long long last_activity; // Monotonic milliseconds
+
+	// Checks and rewrites the complete response head. Returns false if it is malformed.
+	bool parseResponseHead();
+public:
+	// Saved from the request for the access log, which is written once the response passed through
+	std::pmr::string log_method;
+	std::pmr::string log_uri;
+	std::pmr::string log_version;
+	std::pmr::string log_referer;
+	std::pmr::string log_user_agent;
+
+	explicit ProxyExchange(std::pmr::memory_resource* memory);
+	ProxyExchange(const ProxyExchange&) = delete;
+	ProxyExchange& operator=(const ProxyExchange&) = delete;
+
+	// Serializes the request head for `upstream`. Hop-by-hop headers are dropped, `X-Forwarded-For` and
+	// `X-Forwarded-Proto` are added. Request bodies are delimited by `content_length` or are chunked, the client's
+	// `Content-Length` and `Transfer-Encoding` headers are replaced by the framing we send.
+	void start(Upstream* upstream, const HttpRequest& http_request, std::string_view client_address, bool secure,
+		bool keep_alive, long long content_length, bool chunked);
+	Upstream* upstream() const { return target; }
+	bool isConnected() const { return connected; }
+	void onConnected();
+
+	// Takes as much of the request body from `data` as fits into the buffer. Returns the number of bytes taken.
+	size_t addRequestBody(const char* data, size_t length);
+	bool requestBodyComplete() const;
+	// The request body is chunked and malformed
+	bool requestBodyInvalid() const { return request_chunks.invalid(); }
+	// Content-Length bytes of the request body which did not arrive yet
+	long long requestBodyRemaining() const { return request_framing == Framing::Length ? request_body_remaining : 0; }
+	std::string_view pendingRequest() const { return std::string_view(request).substr(request_sent); }
+	void consumeRequest(size_t length);
+	// Sends the request again on a new connection after a reused one was closed before it answered. False if that
+	// is not possible anymore, or if the method is not idempotent and the upstream may already have processed it.
+	bool restart();
+
+	// Processes response bytes from `data` and sets `forward` to the bytes to pass to the client, which point into
+	// `data` or into the exchange. Returns the number of bytes processed, the rest needs another call. Once the
+	// response is complete, the rest does not belong to it. Returns 0 if the response is malformed.
+	size_t receive(const char* data, size_t length, std::string_view& forward);
+	// The upstream closed the connection. Returns true if this completed the response.
+	bool onEnd();
+	bool responseStarted() const { return head_complete; }
+	bool responseComplete() const;
+	bool receivedAny() const { return received_any; }
+	int responseStatus() const { return status; }
+	long long forwardedBody() const { return forwarded_body; }
+	// The body bytes which follow raw from the upstream, which may be moved to the client without passing through
+	// the exchange (splice), 0 if there are none or the body has to be looked at
+	long long rawBodyRemaining() const;
+	// Body bytes moved to the client without `receive`
+	void onRawBody(size_t length);
+
+	// Whether the client connection can be kept alive after this response
+	bool clientKeepAlive() const { return client_keep_alive; }
+	// Whether the upstream connection can be used for the next request once the response is complete
+	bool upstreamReusable() const;
+	// When the upstream has to have made progress
+	long long deadline() const;
+};
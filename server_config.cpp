@@ -0,0 +1,219 @@
+#include "server_config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+#include "server_settings.h"
+#include "string_utils.h"
+#include "mime_types.h"
+
+ServerConfig server_config = {
+	"epoll",
+	EVENT_LOOP_THREADS,
+	0,
+	UPGRADE_SOCKET,
+	DRAIN_TIMEOUT_SECONDS,
+	WORKER_THREADS,
+	PENDING_CONNECTIONS_QUEUE_DEPTH,
+	MAX_QUEUE_DELAY_MS,
+	HEADER_TIMEOUT_SECONDS,
+	BODY_TIMEOUT_SECONDS,
+	REQUEST_TIMEOUT_SECONDS,
+	SEND_TIMEOUT_SECONDS,
+	KEEP_ALIVE_TIMEOUT_SECONDS,
+	MAX_KEEP_ALIVE_REQUESTS,
+	HTTP2_CLEARTEXT != 0,
+	FILE_CACHE_SIZE_MB,
+	COMPRESSION_CACHE_SIZE_MB,
+	STATIC_BUNDLE,
+	TLS_CERTIFICATE,
+	TLS_PRIVATE_KEY,
+	TLS_TICKET_KEYS,
+	KERNEL_TLS != 0,
+	{},
+	{},
+	PROXY_TIMEOUT_SECONDS,
+	METRICS_PATH,
+	LogFormat::Combined,
+	LogLevel::Info,
+	1
+};
+
+static void printUsage(const char* program) {
+	std::cerr << "Usage: " << program << " [options]" << std::endl
+		<< "  --io-engine=epoll|uring   I/O engine used to serve connections (Linux only, default: epoll)" << std::endl
+		<< "  --loop-threads=N          Number of event loop threads, each pinned to a CPU with its own listening socket" << std::endl
+		<< "                            (Linux only, default: one per CPU)" << std::endl
+		<< "  --shard-stats=SECONDS     Print the per-thread connection and file cache counters every SECONDS seconds (Linux only)" << std::endl
+		<< "  --upgrade-socket=PATH     Unix socket over which a newly started server with the same option takes over the" << std::endl
+		<< "                            listening sockets, while this one finishes its open requests (Linux only)" << std::endl
+		<< "  --drain-timeout=S         Seconds a replaced server may finish its open requests (Linux only, default: " << DRAIN_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --threads=N               Number of worker threads (Windows only, default: " << WORKER_THREADS << ")" << std::endl
+		<< "  --queue-depth=N           Clients which may wait for a free worker (Windows only, default: " << PENDING_CONNECTIONS_QUEUE_DEPTH << ")" << std::endl
+		<< "  --queue-delay-ms=N        How long a client may wait for a free worker before getting a 503" << std::endl
+		<< "                            (Windows only, default: " << MAX_QUEUE_DELAY_MS << ")" << std::endl
+		<< "  --header-timeout=S        Seconds a client may take to send the request headers (default: " << HEADER_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --body-timeout=S          Seconds a client may pause while sending a request body (default: " << BODY_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --request-timeout=S       Seconds a client may take to send a whole request (default: " << REQUEST_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --send-timeout=S          Seconds a client may take to read some of its pending response before the" << std::endl
+		<< "                            connection is dropped (default: " << SEND_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --keep-alive-timeout=S    Seconds a persistent connection may wait for its next request (default: " << KEEP_ALIVE_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --max-keep-alive-requests=N  Requests served on a persistent connection before it is closed (default: " << MAX_KEEP_ALIVE_REQUESTS << ")" << std::endl
+		<< "  --h2c=on|off              Serve HTTP/2 to clients which start with its preface (prior knowledge)" << std::endl
+		<< "                            (default: " << (HTTP2_CLEARTEXT ? "on" : "off") << ")" << std::endl
+		<< "  --cache-size-mb=N         Memory budget for caching small files, 0 disables the cache" << std::endl
+		<< "                            (Linux only, default: " << FILE_CACHE_SIZE_MB << ")" << std::endl
+		<< "  --compression-cache-mb=N  Memory budget for files compressed on the fly, 0 only serves precompressed" << std::endl
+		<< "                            .gz/.br files (default: " << COMPRESSION_CACHE_SIZE_MB << ")" << std::endl
+		<< "  --bundle=FILE             Serve the files packed into FILE by tools/pack_bundle.cpp instead of the serve root." << std::endl
+		<< "                            A new bundle renamed over FILE replaces it while running (Linux only)" << std::endl
+		<< "  --tls-cert=FILE           Serve HTTPS with the PEM certificate chain in FILE (Linux only, epoll engine)" << std::endl
+		<< "  --tls-key=FILE            PEM private key of the certificate (default: read from the certificate file)" << std::endl
+		<< "  --tls-ticket-keys=FILE    80 random bytes encrypting session tickets, so servers sharing the file resume" << std::endl
+		<< "                            each other's sessions (default: random keys)" << std::endl
+		<< "  --ktls=on|off             Let the kernel encrypt the records after the handshake if it can (default: " << (KERNEL_TLS ? "on" : "off") << ")" << std::endl
+		<< "  --cache-control=MATCH:VALUE  Send `Cache-Control: VALUE` for files matching a path prefix (/static/), an" << std::endl
+		<< "                            extension (.css) or * for all, can be repeated, the first match wins" << std::endl
+		<< "  --proxy=PREFIX=UPSTREAMS  Pass requests whose path starts with PREFIX to the comma-separated upstreams," << std::endl
+		<< "                            host:port or unix:PATH, which take turns. Can be repeated, the first match wins" << std::endl
+		<< "                            (Linux only, epoll engine)" << std::endl
+		<< "  --proxy-timeout=S         Seconds an upstream may take to accept a request or to send more of its response" << std::endl
+		<< "                            (default: " << PROXY_TIMEOUT_SECONDS << ")" << std::endl
+		<< "  --mime-types=FILE         Load content types from a mime.types file (`type ext...` lines), which take" << std::endl
+		<< "                            precedence over the built-in ones" << std::endl
+		<< "  --metrics-path=PATH       Request path answered with metrics in the Prometheus text format, empty disables" << std::endl
+		<< "                            recording them (default: " << METRICS_PATH << ")" << std::endl
+		<< "  --log-format=FORMAT       Access log format: common, combined, json or off (default: combined)" << std::endl
+		<< "  --log-level=LEVEL         Least severe messages logged: debug, info, warning, error or off (default: info)" << std::endl
+		<< "  --log-sample=N            Log only one in N successful requests, errors are always logged (default: 1)" << std::endl;
+}
+
+// Parses an integer option value of at least `minimum`. Exits on invalid values.
+static int parseNumber(const char* program, const char* name, const std::string& value, long minimum) {
+	char* end;
+	long parsed = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || parsed < minimum || parsed > 1000000) {
+		std::cerr << "Invalid value for " << name << ": '" << value << "'" << std::endl;
+		printUsage(program);
+		exit(1);
+	}
+	return (int)parsed;
+}
+
+// Parses a strictly positive integer option value. Exits on invalid values.
+static int parsePositive(const char* program, const char* name, const std::string& value) {
+	return parseNumber(program, name, value, 1);
+}
+
+void parseCommandLine(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		size_t equals = option.find('=');
+		std::string name = option.substr(0, equals);
+		std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+		if (name == "--io-engine" && (value == "epoll" || value == "uring")) {
+			server_config.io_engine = value;
+		} else if (name == "--loop-threads") {
+			server_config.event_loop_threads = parsePositive(argv[0], "--loop-threads", value);
+		} else if (name == "--shard-stats") {
+			server_config.shard_stats_interval = parsePositive(argv[0], "--shard-stats", value);
+		} else if (name == "--upgrade-socket" && equals != std::string::npos) {
+			server_config.upgrade_socket = value;
+		} else if (name == "--drain-timeout") {
+			server_config.drain_timeout = parsePositive(argv[0], "--drain-timeout", value);
+		} else if (name == "--threads") {
+			server_config.worker_threads = parsePositive(argv[0], "--threads", value);
+		} else if (name == "--queue-depth") {
+			server_config.pending_queue_depth = parsePositive(argv[0], "--queue-depth", value);
+		} else if (name == "--queue-delay-ms") {
+			server_config.max_queue_delay_ms = parsePositive(argv[0], "--queue-delay-ms", value);
+		} else if (name == "--header-timeout") {
+			server_config.header_timeout = parsePositive(argv[0], "--header-timeout", value);
+		} else if (name == "--body-timeout") {
+			server_config.body_timeout = parsePositive(argv[0], "--body-timeout", value);
+		} else if (name == "--request-timeout") {
+			server_config.request_timeout = parsePositive(argv[0], "--request-timeout", value);
+		} else if (name == "--send-timeout") {
+			server_config.send_timeout = parsePositive(argv[0], "--send-timeout", value);
+		} else if (name == "--keep-alive-timeout") {
+			server_config.keep_alive_timeout = parsePositive(argv[0], "--keep-alive-timeout", value);
+		} else if (name == "--max-keep-alive-requests") {
+			server_config.max_keep_alive_requests = parsePositive(argv[0], "--max-keep-alive-requests", value);
+		} else if (name == "--h2c" && (value == "on" || value == "off")) {
+			server_config.h2c = value == "on";
+		} else if (name == "--cache-size-mb") {
+			server_config.file_cache_size_mb = parseNumber(argv[0], "--cache-size-mb", value, 0);
+		} else if (name == "--compression-cache-mb") {
+			server_config.compression_cache_size_mb = parseNumber(argv[0], "--compression-cache-mb", value, 0);
+		} else if (name == "--bundle" && equals != std::string::npos) {
+			server_config.bundle_path = value;
+		} else if (name == "--tls-cert" && !value.empty()) {
+			server_config.tls_certificate = value;
+		} else if (name == "--tls-key" && !value.empty()) {
+			server_config.tls_private_key = value;
+		} else if (name == "--tls-ticket-keys" && !value.empty()) {
+			server_config.tls_ticket_keys = value;
+		} else if (name == "--ktls" && (value == "on" || value == "off")) {
+			server_config.kernel_tls = value == "on";
+		} else if (name == "--cache-control") {
+			size_t colon = value.find(':');
+			std::string match = value.substr(0, colon);
+			if (colon == std::string::npos || colon + 1 == value.length() || (match != "*" && match[0] != '/' && match[0] != '.')) {
+				std::cerr << "Invalid value for --cache-control: '" << value << "'" << std::endl;
+				printUsage(argv[0]);
+				exit(1);
+			}
+			server_config.cache_control_rules.push_back(std::make_pair(match, value.substr(colon + 1)));
+		} else if (name == "--proxy") {
+			size_t separator = value.find('=');
+			std::string prefix = value.substr(0, separator);
+			if (separator == std::string::npos || separator + 1 == value.length() || prefix.empty() || prefix[0] != '/') {
+				std::cerr << "Invalid value for --proxy: '" << value << "'" << std::endl;
+				printUsage(argv[0]);
+				exit(1);
+			}
+			server_config.proxy_rules.push_back(std::make_pair(prefix, value.substr(separator + 1)));
+		} else if (name == "--proxy-timeout") {
+			server_config.proxy_timeout = parsePositive(argv[0], "--proxy-timeout", value);
+		} else if (name == "--metrics-path" && equals != std::string::npos && (value.empty() || value[0] == '/')) {
+			server_config.metrics_path = value;
+		} else if (name == "--log-format" && (value == "common" || value == "combined" || value == "json" || value == "off")) {
+			server_config.log_format = value == "common" ? LogFormat::Common : value == "combined" ? LogFormat::Combined
+				: value == "json" ? LogFormat::Json : LogFormat::Off;
+		} else if (name == "--log-level" && (value == "debug" || value == "info" || value == "warning" || value == "error" || value == "off")) {
+			server_config.log_level = value == "debug" ? LogLevel::Debug : value == "info" ? LogLevel::Info
+				: value == "warning" ? LogLevel::Warning : value == "error" ? LogLevel::Error : LogLevel::Off;
+		} else if (name == "--log-sample") {
+			server_config.log_sample_rate = parsePositive(argv[0], "--log-sample", value);
+		} else if (name == "--mime-types" && !value.empty()) {
+			try {
+				loadMimeTypes(value);
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Failed to load --mime-types: " << e.what() << std::endl;
+				exit(1);
+			}
+		} else {
+			if (name != "--help") {
+				std::cerr << "Unknown option: '" << option << "'" << std::endl;
+			}
+			printUsage(argv[0]);
+			exit(1);
+		}
+	}
+}
+
+const std::string& cacheControlFor(std::string_view request_path, const std::string& served_path) {
+	static const std::string default_cache_control = DEFAULT_CACHE_CONTROL;
+	std::string_view extension = getFileExtension(served_path);
+	for (const auto& rule : server_config.cache_control_rules) {
+		const std::string& match = rule.first;
+		bool matches = match == "*"
+			|| (match[0] == '/' && request_path.compare(0, match.length(), match) == 0)
+			|| (match[0] == '.' && caseInsensitiveEquals(match, extension));
+		if (matches)
+			return rule.second;
+	}
+	return default_cache_control;
+}
\ No newline at end of file
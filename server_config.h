@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "logger.h"
+
+// Settings which can be chosen when starting the server.
+// The defaults come from the compile-time settings in server_settings.h.
+struct ServerConfig {
+	std::string io_engine; // `epoll` or `uring` (Linux only)
+	int event_loop_threads; // Number of shards (Linux), 0 means one per CPU
+	int shard_stats_interval; // Seconds between printing the per-shard counters, 0 disables it
+	std::string upgrade_socket; // Path of the Unix socket for handing over the listening sockets, empty disables it (Linux)
+	int drain_timeout; // Seconds a replaced server may finish its open requests (Linux)
+	int worker_threads; // Threads in the pool serving clients (Windows)
+	int pending_queue_depth; // Accepted clients which may wait for a free worker (Windows)
+	int max_queue_delay_ms; // How long a client may wait for a free worker (Windows)
+	int header_timeout; // Seconds a client may take to send the request headers
+	int body_timeout; // Seconds a client may pause while sending a request body
+	int request_timeout; // Seconds a client may take to send a whole request
+	int send_timeout; // Seconds a client may take to read some of its pending response
+	int keep_alive_timeout; // Seconds a persistent connection may wait for its next request
+	int max_keep_alive_requests; // Requests served on a persistent connection before it is closed
+	bool h2c; // Connections starting with the HTTP/2 preface speak HTTP/2
+	int file_cache_size_mb; // Memory budget of the file cache, 0 disables it
+	int compression_cache_size_mb; // Memory budget for files compressed on the fly, 0 disables compressing
+	std::string bundle_path; // Bundle served instead of the serve root, empty serves the directory (Linux)
+	std::string tls_certificate; // PEM certificate chain, HTTPS is served if set (Linux)
+	std::string tls_private_key; // PEM private key, empty if it is in the certificate file
+	std::string tls_ticket_keys; // File with the session ticket keys, empty uses random keys
+	bool kernel_tls; // Records are encrypted by the kernel after the handshake, if it supports it
+	// `Cache-Control` values by request path prefix (`/static/`), extension (`.css`) or `*` for all files, first match wins
+	std::vector<std::pair<std::string, std::string>> cache_control_rules;
+	// Request path prefixes passed to upstreams, with their comma-separated `host:port` or `unix:PATH` (Linux)
+	std::vector<std::pair<std::string, std::string>> proxy_rules;
+	int proxy_timeout; // Seconds an upstream may take to make progress on a proxied request
+	std::string metrics_path; // Request path of the metrics, empty disables recording them
+	LogFormat log_format; // Format of the access log
+	LogLevel log_level; // Less severe messages are not logged
+	int log_sample_rate; // Only one in this many successful requests is written to the access log
+};
+
+extern ServerConfig server_config;
+
+// Parses `--name=value` command line options into `server_config`, and loads the `--mime-types` file.
+// Prints the usage and exits on unknown or invalid options.
+void parseCommandLine(int argc, char* argv[]);
+
+// The `Cache-Control` value for a request path served from `served_path`, empty if none should be sent
+const std::string& cacheControlFor(std::string_view request_path, const std::string& served_path);
\ No newline at end of file
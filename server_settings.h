@@ -2,10 +2,58 @@
 
 #define LISTEN_PORT "8080"
 #define SERVE_ROOT "./server_root/"
-#define MAX_SIMULTANEOUS_CONNECTIONS 3 // This is essentially the number of threads in the pool
+#define WORKER_THREADS 3 // Number of threads in the pool serving clients (Windows)
+#define PENDING_CONNECTIONS_QUEUE_DEPTH 128 // Accepted clients waiting for a free worker before we respond with a 503 (Windows)
+#define MAX_QUEUE_DELAY_MS 2000 // Clients which waited longer than this for a worker get a 503 (Windows)
+#define EVENT_LOOP_THREADS 0 // Number of event loop threads, each can hold many connections. 0 means one per CPU (Linux)
+#define HEADER_TIMEOUT_SECONDS 3 // How long a client may take to send the request headers
+#define BODY_TIMEOUT_SECONDS 10 // How long a client may pause while sending a request body
+#define REQUEST_TIMEOUT_SECONDS 30 // How long a client may take to send a whole request, however steadily it sends
+#define SEND_TIMEOUT_SECONDS 30 // How long a client may take to read some of its pending response before it is dropped
+#define MAX_REQUEST_HEADERS_SIZE (64 * 1024) // Requests with larger headers are rejected with a 400
+#define MAX_REQUEST_HEADERS 64 // Requests with more header lines are rejected with a 400
+#define KEEP_ALIVE_TIMEOUT_SECONDS 5 // How long a persistent connection may wait for its next request
+#define MAX_KEEP_ALIVE_REQUESTS 100 // Requests served on a persistent connection before it is closed
+#define TIMER_WHEEL_TICK_MS 100 // Precision of the connection deadlines (Linux)
+#define UPGRADE_SOCKET "" // Unix socket over which a new server takes over the listening sockets, empty disables upgrades (Linux)
+#define DRAIN_TIMEOUT_SECONDS 30 // How long a replaced server may finish its open requests before it closes them (Linux)
+#define MAX_PENDING_OUTPUT (1024 * 1024) // Pipelined requests wait while more response bytes than this are unsent
+#define HTTP2_CLEARTEXT 1 // Connections starting with the HTTP/2 preface speak HTTP/2 (h2c with prior knowledge)
+#define HTTP2_MAX_CONCURRENT_STREAMS 100 // Streams an HTTP/2 client may have responses pending on, more are refused
+#define HTTP2_MAX_QUEUED_DATA (64 * 1024) // DATA frames are queued for sending up to this, the streams take turns filling it
+#define REQUEST_ARENA_SIZE 2048 // Bytes kept in every connection for the data of the request being handled, more comes from its pool
+#define MAX_SEND_BUFFERS 16 // Pieces of pending output gathered into a single send (writev)
+#define MAX_BYTE_RANGES 16 // Range requests asking for more ranges than this get the whole file
+#define DEFAULT_CACHE_CONTROL "" // `Cache-Control` for files matching no --cache-control rule, empty sends none
+#define FILE_CACHE_SIZE_MB 64 // Memory budget for caching small files with their headers, 0 disables the cache (Linux)
+#define FILE_CACHE_MAX_FILE_SIZE (256 * 1024) // Larger files are always sent from disk
+#define STATIC_BUNDLE "" // Bundle (tools/pack_bundle.cpp) served instead of SERVE_ROOT, empty serves the directory (Linux)
+#define BUNDLE_MEMORY_BODY_MAX_SIZE (256 * 1024) // Larger bundled bodies are sent with sendfile from the bundle instead of from its mapping
+#define RESOLVE_CACHE_ENTRIES 16384 // Request paths whose resolution is cached while the file cache watches for changes
+#define ENABLE_GZIP 1 // gzip content encoding, needs zlib
+#define ENABLE_BROTLI 1 // br content encoding, needs the brotli encoder library
+#define ENABLE_TLS 1 // HTTPS, needs OpenSSL (Linux)
+#define TLS_CERTIFICATE "" // PEM certificate chain, the server speaks HTTPS instead of HTTP if set (Linux)
+#define TLS_PRIVATE_KEY "" // PEM private key, empty if it is in the certificate file
+#define TLS_TICKET_KEYS "" // File with 80 random bytes encrypting session tickets, empty uses random keys per process
+#define TLS_SESSION_CACHE_ENTRIES 20480 // Sessions kept for clients resuming with a session ID instead of a ticket
+#define KERNEL_TLS 1 // Hand the record encryption to the kernel after the handshake (kTLS), so files are still sent with sendfile
+#define COMPRESSION_CACHE_SIZE_MB 32 // Memory budget for files compressed on the fly, 0 only serves precompressed siblings
+#define COMPRESSION_THREADS 1 // Background threads compressing files
+#define COMPRESSION_MIN_FILE_SIZE 256 // Smaller files are not worth compressing
+#define COMPRESSION_MAX_FILE_SIZE (16 * 1024 * 1024) // Larger files are only sent compressed if there is a precompressed sibling
+#define PROXY_TIMEOUT_SECONDS 60 // How long an upstream may take to accept a proxied request or to send more of its response
+#define PROXY_CONNECT_TIMEOUT_SECONDS 5 // How long connecting to an upstream may take
+#define PROXY_MAX_IDLE_CONNECTIONS 32 // Idle connections every event loop keeps open to each upstream for the next requests
+#define PROXY_MAX_FAILS 3 // Failed requests in a row after which an upstream is ejected
+#define PROXY_FAIL_TIMEOUT_SECONDS 10 // How long an ejected upstream gets no requests
+#define PROXY_BUFFER_SIZE (64 * 1024) // Request body bytes buffered for an upstream, and response body bytes in a connection's pipe
+#define METRICS_PATH "/_stats" // Request path answered with the metrics in the Prometheus text format, empty disables them
+#define LOG_BUFFER_SIZE_KB 256 // Per-thread buffer of log entries waiting to be written, entries are dropped while it is full
+#define LOG_FLUSH_INTERVAL_MS 20 // How often the log writer drains the buffers which are not filling up
 
-#define HTTP_VERSION "1.0"
+#define HTTP_VERSION "1.1"
 #define SERVER_HEADER "SimpleWebserver/1.0"
 #define RESPONSE_400 "./default_responses/400.html"
 #define RESPONSE_404 "./default_responses/404.html"
-#define RESPONSE_503 "./default_responses/503.html"
+#define RESPONSE_503 "./default_responses/503.html"
\ No newline at end of file
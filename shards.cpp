@@ -0,0 +1,144 @@
+#ifdef __linux__
+#include "shards.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "file_cache.h"
+#include "path_resolver.h"
+#include "logger.h"
+
+// Returns the CPUs this process may run on, in ascending order
+static std::vector<int> usableCpus() {
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+	if (cpus.empty()) {
+		cpus.push_back(0);
+	}
+	return cpus;
+}
+
+std::vector<std::unique_ptr<Shard>> createShards(int count, const std::vector<SOCKET>& inherited) {
+	std::vector<int> cpus = usableCpus();
+	if (count <= 0) {
+		count = (int)cpus.size();
+	}
+	count = std::max(count, (int)inherited.size());
+
+	std::vector<std::unique_ptr<Shard>> shards;
+	for (int i = 0; i < count; i++) {
+		std::unique_ptr<Shard> shard(new Shard);
+		shard->index = i;
+		shard->cpu = cpus[i % cpus.size()];
+		shard->server_socket = i < (int)inherited.size() ? inherited[i] : createReusePortServer();
+		shard->accepted = 0;
+		shard->active = 0;
+		shard->draining = false;
+		shard->drain_deadline = 0;
+		shard->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (shard->wake_fd == -1) {
+			std::cerr << "eventfd() failed: " << errno << std::endl;
+			exit(1);
+		}
+
+		// A hint for the kernel to pick this listener for connections whose packets are processed on our CPU
+		setsockopt(shard->server_socket, SOL_SOCKET, SO_INCOMING_CPU, &shard->cpu, sizeof(shard->cpu));
+		shards.push_back(std::move(shard));
+	}
+	return shards;
+}
+
+static void printShardStats(const std::vector<std::unique_ptr<Shard>>& shards) {
+	unsigned long long total = 0;
+	for (const auto& shard : shards) {
+		total += shard->accepted.load(std::memory_order_relaxed);
+	}
+
+	for (const auto& shard : shards) {
+		unsigned long long accepted = shard->accepted.load(std::memory_order_relaxed);
+		std::cout << "Shard " << shard->index << " (cpu " << shard->cpu << "): accepted " << accepted
+			<< " (" << (total ? accepted * 100 / total : 0) << "%), active " << shard->active.load(std::memory_order_relaxed) << std::endl;
+	}
+
+	std::cout << "File cache: " << file_cache.hitCount() << " hits, " << file_cache.missCount() << " misses, "
+		<< file_cache.evictionCount() << " evictions, " << file_cache.entryCount() << " entries using "
+		<< file_cache.bytesUsed() / 1024 << " KB" << std::endl;
+	std::cout << "Path resolution: " << path_resolver.hitCount() << " cached, " << path_resolver.missCount() << " resolved" << std::endl;
+	std::cout << "Log: " << logger.droppedCount() << " entries dropped" << std::endl;
+}
+
+void runShards(std::vector<std::unique_ptr<Shard>>& shards, const std::function<void(Shard&)>& shard_main, int stats_interval,
+	const std::function<void()>& started) {
+	std::vector<std::thread> threads;
+	for (auto& shard : shards) {
+		Shard* shard_ptr = shard.get();
+		threads.emplace_back([shard_ptr, &shard_main]() {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(shard_ptr->cpu, &set);
+			int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (err != 0) {
+				std::cerr << "Failed to pin shard " << shard_ptr->index << " to cpu " << shard_ptr->cpu << ": " << err << std::endl;
+			}
+
+			// Anything the shard allocates from here on is first touched by the pinned thread, so it is local to its core
+			shard_main(*shard_ptr);
+		});
+	}
+
+	if (started) {
+		started();
+	}
+
+	std::mutex mutex;
+	std::condition_variable stopped_changed;
+	bool stopped = false;
+	std::thread stats_printer;
+	if (stats_interval > 0) {
+		stats_printer = std::thread([&]() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopped_changed.wait_for(lock, std::chrono::seconds(stats_interval), [&stopped]() { return stopped; })) {
+				printShardStats(shards);
+			}
+		});
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	if (stats_printer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopped = true;
+		}
+		stopped_changed.notify_one();
+		stats_printer.join();
+	}
+}
+
+void drainShards(std::vector<std::unique_ptr<Shard>>& shards, long long deadline) {
+	for (auto& shard : shards) {
+		shard->drain_deadline = deadline;
+		shard->draining.store(true, std::memory_order_release);
+		uint64_t signal = 1;
+		if (write(shard->wake_fd, &signal, sizeof(signal)) != sizeof(signal)) {
+			LOG(Error) << "Failed to wake shard " << shard->index << ": " << errno;
+		}
+	}
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+#ifdef __linux__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "sockets.h"
+
+// A shard is a worker thread pinned to one CPU which owns its own SO_REUSEPORT listening socket,
+// so a connection stays on the same core from accept to close.
+// The counters are only written by the shard's thread; relaxed atomics let other threads read them.
+struct alignas(64) Shard {
+	int index;
+	int cpu; // The CPU the shard's thread is pinned to
+	SOCKET server_socket;
+	std::atomic<unsigned long long> accepted; // Connections accepted since startup
+	std::atomic<unsigned long long> active; // Connections currently open
+	// Set by `drainShards`: the shard stops accepting, finishes its connections until `drain_deadline`
+	// (monotonic milliseconds) and then returns from its main function
+	std::atomic<bool> draining;
+	long long drain_deadline;
+	int wake_fd; // eventfd signalled when `draining` was set
+};
+
+// Creates `count` shards, each with its own listening socket. A count of 0 means one shard per usable CPU.
+// The `inherited` listening sockets (taken over from a replaced server) are used first, and every one of them
+// gets a shard, since the connections queued on it would never be accepted otherwise.
+std::vector<std::unique_ptr<Shard>> createShards(int count, const std::vector<SOCKET>& inherited);
+
+// Runs `shard_main` on one pinned thread per shard and returns once all of them returned, i.e. never unless the
+// shards were drained. `started` is called once the threads run.
+// If `stats_interval` is positive, the per-shard counters are printed every `stats_interval` seconds.
+void runShards(std::vector<std::unique_ptr<Shard>>& shards, const std::function<void(Shard&)>& shard_main, int stats_interval,
+	const std::function<void()>& started);
+
+// Makes every shard stop accepting and close its connections once their requests are answered, or at `deadline`
+// (monotonic milliseconds) at the latest. Thread safe.
+void drainShards(std::vector<std::unique_ptr<Shard>>& shards, long long deadline);
+
+#endif
\ No newline at end of file
@@ -1,32 +1,54 @@
 #include "sockets.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "server_settings.h"
+#include "logger.h"
 
-// Simple Windows TCP socket server written according to the MSDN docs
+// Simple TCP socket server written according to the MSDN docs.
+// On POSIX systems the Winsock names are mapped to their BSD socket equivalents in sockets.h.
 
-SOCKET createServer() {
+#ifdef _WIN32
+#define SOCKETS_CLEANUP() WSACleanup()
+#else
+#define SOCKETS_CLEANUP()
+#endif
+
+static SOCKET openListeningSocket(bool reuse_port) {
+#ifdef _WIN32
 	WSADATA wsaData;
 	int startupResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
 	if (startupResult != 0) {
 		printf("WSAStartup() failed: %d\n", startupResult);
 		exit(1);
 	}
+#endif
 
-	ADDRINFO* addrResult = NULL;
-	ADDRINFO hints;
+	struct addrinfo* addrResult = NULL;
+	struct addrinfo hints;
 
-	ZeroMemory(&hints, sizeof(hints));
+	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO::IPPROTO_TCP;
+	hints.ai_protocol = IPPROTO_TCP;
 	hints.ai_flags = AI_PASSIVE;
 
 	int addrinfoResult = getaddrinfo(NULL, LISTEN_PORT, &hints, &addrResult);
 	if (addrinfoResult != 0) {
 		printf("getaddrinfo() failed: %d\n", addrinfoResult);
-		WSACleanup();
+		SOCKETS_CLEANUP();
 		exit(1);
 	}
 
@@ -34,18 +56,30 @@ SOCKET createServer() {
 	if (listenSocket == INVALID_SOCKET) {
 		printf("socket() failed: %d\n", WSAGetLastError());
 		freeaddrinfo(addrResult);
-		WSACleanup();
+		SOCKETS_CLEANUP();
 		exit(1);
 	}
 
-	DWORD timeout = 3 * 1000; // 3 seconds in ms
-	setsockopt(listenSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#ifndef _WIN32
+	// Allow restarting the server while old connections are still in TIME_WAIT
+	int reuse = 1;
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+#ifdef __linux__
+	// Several sockets bound to the same port, the kernel load balances incoming connections between them
+	if (reuse_port && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) == SOCKET_ERROR) {
+		printf("setsockopt(SO_REUSEPORT) failed: %d\n", WSAGetLastError());
+		freeaddrinfo(addrResult);
+		closesocket(listenSocket);
+		exit(1);
+	}
+#endif
+#endif
 
 	if (bind(listenSocket, addrResult->ai_addr, (int)addrResult->ai_addrlen) == SOCKET_ERROR) {
 		printf("bind() failed: %d\n", WSAGetLastError());
 		freeaddrinfo(addrResult);
 		closesocket(listenSocket);
-		WSACleanup();
+		SOCKETS_CLEANUP();
 		exit(1);
 	}
 
@@ -54,36 +88,181 @@ SOCKET createServer() {
 	if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
 		printf("listen() failed: %d\n", WSAGetLastError());
 		closesocket(listenSocket);
-		WSACleanup();
+		SOCKETS_CLEANUP();
 		exit(1);
 	}
 
 	return listenSocket;
 }
 
+SOCKET createServer() {
+	return openListeningSocket(false);
+}
+
 SOCKET acceptClient(SOCKET serverSocket) {
 	SOCKET clientSocket = accept(serverSocket, NULL, NULL);
 	if (clientSocket == INVALID_SOCKET) {
 		printf("accept() failed: %d\n", WSAGetLastError());
 		closesocket(serverSocket);
-		WSACleanup();
+		SOCKETS_CLEANUP();
 		return 1;
 	}
+	setNoDelay(clientSocket);
 	return clientSocket;
 }
 
 void endClient(SOCKET clientSocket) {
-	// Shutdown local send half of the connection
+	// Shutdown local send half of the connection.
+	// This fails if the client already reset the connection, which is not a reason to take the server down.
 	if (shutdown(clientSocket, SD_SEND) == SOCKET_ERROR) {
-		printf("shutdown() failed: %d\n", WSAGetLastError());
-		closesocket(clientSocket);
-		WSACleanup();
-		exit(1);
+		LOG(Info) << "shutdown() failed: " << WSAGetLastError();
 	}
 	closesocket(clientSocket);
 }
 
+std::string peerAddress(SOCKET socket) {
+	struct sockaddr_storage address;
+	socklen_t address_length = sizeof(address);
+	char host[NI_MAXHOST];
+	if (getpeername(socket, (struct sockaddr*)&address, &address_length) == SOCKET_ERROR
+		|| getnameinfo((struct sockaddr*)&address, address_length, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+		return std::string();
+	return host;
+}
+
+// Sets SO_RCVTIMEO or SO_SNDTIMEO, a timeout of 0 would wait forever
+static void setTimeout(SOCKET socket, int option, long long milliseconds) {
+#ifdef _WIN32
+	DWORD timeout = milliseconds > 0 ? (DWORD)milliseconds : 1; // in ms
+#else
+	if (milliseconds <= 0) {
+		milliseconds = 1;
+	}
+	struct timeval timeout = { (time_t)(milliseconds / 1000), (suseconds_t)(milliseconds % 1000 * 1000) };
+#endif
+	setsockopt(socket, SOL_SOCKET, option, (const char*)&timeout, sizeof(timeout));
+}
+
+void setNoDelay(SOCKET socket) {
+	int one = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+
+void setReceiveTimeout(SOCKET socket, long long milliseconds) {
+	setTimeout(socket, SO_RCVTIMEO, milliseconds);
+}
+
+void setSendTimeout(SOCKET socket, long long milliseconds) {
+	setTimeout(socket, SO_SNDTIMEO, milliseconds);
+}
+
+int sendFile(SOCKET socket, int file, long long offset, size_t length) {
+#ifdef __linux__
+	// sendfile() moves at most about 2GB per call anyway
+	off_t file_offset = (off_t)offset;
+	ssize_t sent = sendfile(socket, file, &file_offset, length < (1u << 30) ? length : (1u << 30));
+	return sent == -1 ? SOCKET_ERROR : (int)sent;
+#else
+	char buffer[1024 * 64];
+	int chunk = length < sizeof(buffer) ? (int)length : (int)sizeof(buffer);
+#ifdef _WIN32
+	int bytes_read = _lseeki64(file, offset, SEEK_SET) == -1 ? -1 : _read(file, buffer, chunk);
+#else
+	int bytes_read = (int)pread(file, buffer, chunk, (off_t)offset);
+#endif
+	if (bytes_read <= 0) {
+		return bytes_read == 0 ? 0 : SOCKET_ERROR;
+	}
+
+	// The caller expects that the returned bytes were sent, so we don't return before they are
+	int total = 0;
+	while (total < bytes_read) {
+		int sent = send(socket, buffer + total, bytes_read - total, 0);
+		if (sent == SOCKET_ERROR) {
+			return total > 0 ? total : SOCKET_ERROR;
+		}
+		total += sent;
+	}
+	return total;
+#endif
+}
+
+int sendBuffers(SOCKET socket, const SendBuffer* buffers, size_t count, bool more) {
+	if (count > MAX_SEND_BUFFERS) {
+		count = MAX_SEND_BUFFERS;
+	}
+#ifdef _WIN32
+	WSABUF pieces[MAX_SEND_BUFFERS];
+	for (size_t i = 0; i < count; i++) {
+		pieces[i].buf = (CHAR*)buffers[i].data;
+		pieces[i].len = (ULONG)buffers[i].length;
+	}
+	DWORD sent;
+	return WSASend(socket, pieces, (DWORD)count, &sent, 0, NULL, NULL) == SOCKET_ERROR ? SOCKET_ERROR : (int)sent;
+#else
+	struct iovec pieces[MAX_SEND_BUFFERS];
+	for (size_t i = 0; i < count; i++) {
+		pieces[i].iov_base = (void*)buffers[i].data;
+		pieces[i].iov_len = buffers[i].length;
+	}
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = pieces;
+	message.msg_iovlen = count;
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_MORE
+	flags |= more ? MSG_MORE : 0;
+#endif
+	ssize_t sent = sendmsg(socket, &message, flags);
+	return sent == -1 ? SOCKET_ERROR : (int)sent;
+#endif
+}
+
 void endServer(SOCKET serverSocket) {
 	closesocket(serverSocket);
-	WSACleanup();
+	SOCKETS_CLEANUP();
+}
+
+#ifdef __linux__
+SOCKET createReusePortServer() {
+	return openListeningSocket(true);
+}
+
+bool setNonBlocking(SOCKET socket) {
+	int flags = fcntl(socket, F_GETFL, 0);
+	if (flags == -1) {
+		return false;
+	}
+	return fcntl(socket, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+SOCKET acceptClientNonBlocking(SOCKET serverSocket) {
+	SOCKET clientSocket = accept4(serverSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (clientSocket == INVALID_SOCKET && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		LOG(Warning) << "accept4() failed: " << errno;
+	} else if (clientSocket != INVALID_SOCKET) {
+		setNoDelay(clientSocket);
+	}
+	return clientSocket;
+}
+
+SOCKET connectNonBlocking(const sockaddr* address, socklen_t length) {
+	SOCKET socket = ::socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socket == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if (address->sa_family == AF_INET || address->sa_family == AF_INET6) {
+		// Requests are sent as soon as they are complete, small ones must not wait for an acknowledgement
+		setNoDelay(socket);
+	}
+	if (connect(socket, address, length) == -1 && errno != EINPROGRESS) {
+		int error = errno;
+		close(socket);
+		errno = error;
+		return INVALID_SOCKET;
+	}
+	return socket;
 }
+#endif
\ No newline at end of file
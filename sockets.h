@@ -1,10 +1,78 @@
 #pragma once
+#include <string>
 
+
+#ifdef _WIN32
 #pragma comment(lib, "Ws2_32.lib")
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+// Minimal Winsock compatibility names, so the rest of the server can stay platform agnostic.
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_SEND SHUT_WR
+#define WSAETIMEDOUT EAGAIN
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define closesocket close
+#define WSAGetLastError() errno
+#endif
 
 SOCKET createServer();
 SOCKET acceptClient(SOCKET server_socket);
 void endClient(SOCKET client_socket);
-void endServer(SOCKET server_socket);
\ No newline at end of file
+void endServer(SOCKET server_socket);
+
+// The peer's IP address as text, empty if it is unknown
+std::string peerAddress(SOCKET socket);
+
+// Disables Nagle's algorithm, so small writes (HTTP/2 frames, TLS records, response heads) go out without waiting
+// for the acknowledgement of the previous ones. Bigger responses are still coalesced with MSG_MORE.
+// Accepted clients get this already.
+void setNoDelay(SOCKET socket);
+
+// Sets how long a blocking `recv()` on the socket waits before failing with WSAETIMEDOUT, at least a millisecond
+void setReceiveTimeout(SOCKET socket, long long milliseconds);
+// Sets how long a blocking `send()` on the socket waits for the client to read before failing
+void setSendTimeout(SOCKET socket, long long milliseconds);
+
+// Sends up to `length` bytes of the file starting at `offset`. On Linux the data goes straight from the
+// page cache to the socket (`sendfile`), elsewhere it is read into a small buffer first.
+// Returns the number of bytes sent, 0 if the file ended before `offset`, or SOCKET_ERROR.
+int sendFile(SOCKET socket, int file, long long offset, size_t length);
+
+// A span of memory to send, one of the pieces given to `sendBuffers`
+struct SendBuffer {
+	const char* data;
+	size_t length;
+};
+
+// Sends the buffers in order with a single gather write (`sendmsg`, `WSASend`), so a response made of several
+// pieces does not have to be copied together first. `more` tells the kernel that more output follows right away,
+// so it may hold back a partial packet (Linux).
+// Returns the number of bytes sent, which may end in the middle of any buffer, or SOCKET_ERROR.
+int sendBuffers(SOCKET socket, const SendBuffer* buffers, size_t count, bool more);
+
+#ifdef __linux__
+// Like `createServer`, but with SO_REUSEPORT set, so every call creates another listening socket on the same port
+SOCKET createReusePortServer();
+
+// Switches the socket to non-blocking mode. Returns false on failure.
+bool setNonBlocking(SOCKET socket);
+
+// Accepts a pending client as a non-blocking socket.
+// Returns INVALID_SOCKET if there is no pending client (or accept failed).
+SOCKET acceptClientNonBlocking(SOCKET server_socket);
+
+// Starts connecting a non-blocking socket to `address`, the connection is established once the socket is writable.
+// Returns INVALID_SOCKET with `errno` set if that fails right away.
+SOCKET connectNonBlocking(const sockaddr* address, socklen_t length);
+#endif
\ No newline at end of file
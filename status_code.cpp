@@ -1,38 +1,43 @@
 #include "status_code.h"
+#include "server_settings.h"
 
-std::string httpReasonForCode(StatusCode statusCode) {
+// Code, reason phrase and the enum name of every status code we send
+#define STATUS_CODES(STATUS) \
+	STATUS(OK, "200", "OK") \
+	STATUS(Created, "201", "Created") \
+	STATUS(Accepted, "202", "Accepted") \
+	STATUS(NoContent, "204", "No Content") \
+	STATUS(PartialContent, "206", "Partial Content") \
+	STATUS(MovedPermanently, "301", "Moved Permanently") \
+	STATUS(MovedTemporarily, "302", "Moved Temporarily") \
+	STATUS(NotModified, "304", "Not Modified") \
+	STATUS(BadRequest, "400", "Bad Request") \
+	STATUS(Unauthorized, "401", "Unauthorized") \
+	STATUS(Forbidden, "403", "Forbidden") \
+	STATUS(NotFound, "404", "Not Found") \
+	STATUS(RangeNotSatisfiable, "416", "Range Not Satisfiable") \
+	STATUS(InternalServerError, "500", "Internal Server Error") \
+	STATUS(NotImplemented, "501", "Not Implemented") \
+	STATUS(BadGateway, "502", "Bad Gateway") \
+	STATUS(ServiceUnavailable, "503", "Service Unavailable") \
+	STATUS(GatewayTimeout, "504", "Gateway Timeout")
+
+const char* httpReasonForCode(StatusCode statusCode) {
+	switch (statusCode) {
+#define REASON_CASE(name, code, reason) case StatusCode::name: return reason;
+	STATUS_CODES(REASON_CASE)
+#undef REASON_CASE
+	default:
+		throw std::invalid_argument("Unknown status code");
+	}
+}
+
+std::string_view httpStatusLine(StatusCode statusCode) {
 	switch (statusCode) {
-	case StatusCode::OK:
-		return "OK";
-	case StatusCode::Created:
-		return "Created";
-	case StatusCode::Accepted:
-		return "Accepted";
-	case StatusCode::NoContent:
-		return "No Content";
-	case StatusCode::MovedPermanently:
-		return "Moved Permanently";
-	case StatusCode::MovedTemporarily:
-		return "Moved Temporarily";
-	case StatusCode::NotModified:
-		return "Not Modified";
-	case StatusCode::BadRequest:
-		return "Bad Request";
-	case StatusCode::Unauthorized:
-		return "Unauthorized";
-	case StatusCode::Forbidden:
-		return "Forbidden";
-	case StatusCode::NotFound:
-		return "Not Found";
-	case StatusCode::InternalServerError:
-		return "Internal Server Error";
-	case StatusCode::NotImplemented:
-		return "Not Implemented";
-	case StatusCode::BadGateway:
-		return "Bad Gateway";
-	case StatusCode::ServiceUnavailable:
-		return "Service Unavailable";
+#define STATUS_LINE_CASE(name, code, reason) case StatusCode::name: return "HTTP/" HTTP_VERSION " " code " " reason "\r\n";
+	STATUS_CODES(STATUS_LINE_CASE)
+#undef STATUS_LINE_CASE
 	default:
 		throw std::invalid_argument("Unknown status code");
 	}
-}
\ No newline at end of file
+}
@@ -1,14 +1,16 @@
 #pragma once
 #include <string>
 #include <stdexcept>
+#include <string_view>
 
-// HTTP/1.0 status codes
+// HTTP status codes
 enum class StatusCode {
 	Missing = -1,
 	OK = 200,
 	Created = 201,
 	Accepted = 202,
 	NoContent = 204,
+	PartialContent = 206,
 	MovedPermanently = 301,
 	MovedTemporarily = 302,
 	NotModified = 304,
@@ -16,10 +18,17 @@ enum class StatusCode {
 	Unauthorized = 401,
 	Forbidden = 403,
 	NotFound = 404,
+	RangeNotSatisfiable = 416,
 	InternalServerError = 500,
 	NotImplemented = 501,
 	BadGateway = 502,
-	ServiceUnavailable = 503
+	ServiceUnavailable = 503,
+	GatewayTimeout = 504
 };
 
-std::string httpReasonForCode(StatusCode statusCode);
\ No newline at end of file
+// The reason phrase, e.g. `Not Found`. Throws std::invalid_argument for codes we don't know.
+const char* httpReasonForCode(StatusCode statusCode);
+
+// The complete status line in static storage, e.g. `HTTP/1.1 404 Not Found\r\n`.
+// Throws std::invalid_argument for codes we don't know.
+std::string_view httpStatusLine(StatusCode statusCode);
\ No newline at end of file
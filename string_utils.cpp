@@ -1,41 +1,30 @@
 #include <stdexcept>
+#include <stdio.h>
+#include <string.h>
 
 #include "string_utils.h"
 
 using std::string;
 
-// Returns a substring starting at the end of the last part, ending at the first occurrence of the specified delimiter.
-// Throws std::runtime_error if the delimiter cannot be found.
-string StringParser::next_by_delim(const string& delim) {
-
-	int part_end = data.find(delim, cur_offset);
-	if (part_end == string::npos) {
-		throw std::runtime_error("Failed to find next part by delimiter.");
-	}
-
-	string part = data.substr(cur_offset, part_end - cur_offset);
-
-	cur_offset = part_end + delim.length();
-
-	return part;
-}
-
-bool StringParser::has_data_left() const {
-	return cur_offset < data.length();
-}
-
-bool caseInsensitiveEquals(const string& a, const string& b) {
+bool caseInsensitiveEquals(std::string_view a, std::string_view b) {
 	if (a.length() != b.length())
 		return false;
 
 	for (size_t i = 0; i < a.length(); i++) {
-		if (tolower(a[i]) != tolower(b[i]))
+		if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
 			return false;
 	}
 
 	return true;
 }
 
+std::string_view trimWhitespace(std::string_view str) {
+	size_t start = str.find_first_not_of(" \t");
+	if (start == std::string_view::npos)
+		return std::string_view();
+	return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+}
+
 // Hex char to int value. Throws if illegal char.
 int hexNibble(char c) {
 	if ('0' <= c && c <= '9') {
@@ -80,14 +69,62 @@ string decodeEscapeSequences(const string& str) {
 }
 
 // Returns the file extension of the path, including the dot. e.g. `.txt`
-// Returns an empty string if no extension was found.
-string getFileExtension(const string& filepath) {
-	int last_dot = filepath.find_last_of('.');
-	if (last_dot == string::npos) {
-		return "";
+// Returns an empty view if no extension was found.
+std::string_view getFileExtension(std::string_view filepath) {
+	size_t last_dot = filepath.find_last_of('.');
+	if (last_dot == std::string_view::npos) {
+		return std::string_view();
 	} else {
 		// TODO: Do we need to handle folders with dots in their name?
 		// i.e. Should `some_dir/another.dir/file_with_no_ext` resolve to no extenstion
 		return filepath.substr(last_dot);
 	}
-}
\ No newline at end of file
+}
+
+std::string_view formatHttpDate(time_t time, char (&buffer)[32]) {
+	struct tm parts;
+#ifdef _WIN32
+	gmtime_s(&parts, &time);
+#else
+	gmtime_r(&time, &parts);
+#endif
+	// strftime() would use the locale's day and month names
+	static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	int length = snprintf(buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[parts.tm_wday], parts.tm_mday,
+		months[parts.tm_mon], parts.tm_year + 1900, parts.tm_hour, parts.tm_min, parts.tm_sec);
+	return std::string_view(buffer, (size_t)length);
+}
+
+time_t parseHttpDate(std::string_view date) {
+	static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	// sscanf() needs a terminated string
+	char terminated[64];
+	if (date.length() >= sizeof(terminated))
+		return -1;
+	memcpy(terminated, date.data(), date.length());
+	terminated[date.length()] = '\0';
+
+	char weekday[4];
+	char month[4];
+	struct tm parts = {};
+	int consumed = 0;
+	if (sscanf(terminated, "%3[A-Za-z], %2d %3[A-Za-z] %4d %2d:%2d:%2d GMT%n", weekday, &parts.tm_mday, month,
+		&parts.tm_year, &parts.tm_hour, &parts.tm_min, &parts.tm_sec, &consumed) != 7 || consumed != (int)date.length())
+		return -1;
+
+	parts.tm_mon = -1;
+	for (int i = 0; i < 12; i++) {
+		if (strcmp(month, months[i]) == 0) {
+			parts.tm_mon = i;
+		}
+	}
+	if (parts.tm_mon == -1)
+		return -1;
+	parts.tm_year -= 1900;
+#ifdef _WIN32
+	return _mkgmtime(&parts);
+#else
+	return timegm(&parts);
+#endif
+}
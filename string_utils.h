@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <time.h>
 
 #ifdef _WIN32
 #define PATH_SEPERATOR '\\'
@@ -8,20 +10,26 @@
 #define PATH_SEPERATOR '/'
 #endif
 
-class StringParser {
-	std::string data;
-	size_t cur_offset;
-public:
-	StringParser(std::string data) : data(data), cur_offset(0) {}
-
-	// Returns a substring starting at the end of the last part, ending at the first occurrence of the specified delimiter.
-	// Throws std::runtime_error if the delimiter cannot be found.
-	std::string next_by_delim(const std::string& delim);
-
-	bool has_data_left() const;
-};
-
-bool caseInsensitiveEquals(const std::string& a, const std::string& b);
+bool caseInsensitiveEquals(std::string_view a, std::string_view b);
+
+// Returns `str` without leading and trailing spaces and tabs
+std::string_view trimWhitespace(std::string_view str);
+
+// Calls `visit` with every element of a comma-separated header value (e.g. `gzip, br;q=0.5`), without the surrounding
+// whitespace. Empty elements are skipped. Stops and returns true as soon as `visit` returns true.
+template <typename Visitor>
+bool forEachListElement(std::string_view list, Visitor visit) {
+	while (!list.empty()) {
+		size_t comma = list.find(',');
+		std::string_view element = trimWhitespace(list.substr(0, comma));
+		if (!element.empty() && visit(element))
+			return true;
+		if (comma == std::string_view::npos)
+			break;
+		list.remove_prefix(comma + 1);
+	}
+	return false;
+}
 
 // Hex char to int value. Throws if illegal char.
 int hexNibble(char c);
@@ -30,5 +38,12 @@ int hexNibble(char c);
 std::string decodeEscapeSequences(const std::string& str);
 
 // Returns the file extension of the path, including the dot. e.g. `.txt`
-// Returns an empty string if no extension was found.
-std::string getFileExtension(const std::string& filepath);
\ No newline at end of file
+// Returns an empty view if no extension was found.
+std::string_view getFileExtension(std::string_view filepath);
+
+// Formats a time as an HTTP-date in the preferred IMF-fixdate format, e.g. `Sun, 06 Nov 1994 08:49:37 GMT`,
+// into `buffer` and returns it
+std::string_view formatHttpDate(time_t time, char (&buffer)[32]);
+
+// Parses an HTTP-date in the IMF-fixdate format. The obsolete formats are not supported. Returns -1 if the date is invalid.
+time_t parseHttpDate(std::string_view date);
\ No newline at end of file
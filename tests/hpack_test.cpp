@@ -0,0 +1,67 @@
+// Round trip of the HPACK Huffman code over all 257 symbols: every byte value is encoded alone and within a string
+// of all of them, and decoded again. The end of string code must be rejected, and so must padding which is longer
+// than seven bits or not all ones.
+//
+// Build from the repository root and run:
+//   g++ -std=c++17 -O2 -I. -o hpack_test tests/hpack_test.cpp hpack.cpp && ./hpack_test
+// The exit status is 1 if a check failed.
+#include <stdio.h>
+#include <string>
+
+#include "hpack.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, int symbol) {
+	if (!condition) {
+		fprintf(stderr, "FAILED: %s (symbol %d)\n", what, symbol);
+		failures++;
+	}
+}
+
+static bool decode(const std::string& encoded, std::string& decoded) {
+	decoded.clear();
+	return hpackHuffmanDecode((const uint8_t*)encoded.data(), encoded.length(), decoded);
+}
+
+int main() {
+	std::string all;
+	std::string encoded;
+	std::string decoded;
+	for (int symbol = 0; symbol < 256; symbol++) {
+		std::string value(1, (char)symbol);
+		all += value;
+		// Repeated, so the codes also start in the middle of a byte
+		for (const std::string& input : { value, value + value + value }) {
+			encoded.clear();
+			hpackHuffmanEncode(input, encoded);
+			check(decode(encoded, decoded), "decodes", symbol);
+			check(decoded == input, "round trip", symbol);
+		}
+	}
+
+	encoded.clear();
+	hpackHuffmanEncode(all, encoded);
+	check(decode(encoded, decoded) && decoded == all, "round trip of all symbols", -1);
+	std::string reversed(all.rbegin(), all.rend());
+	encoded.clear();
+	hpackHuffmanEncode(reversed, encoded);
+	check(decode(encoded, decoded) && decoded == reversed, "round trip of all symbols reversed", -1);
+
+	// Symbol 256, the end of string code, is 30 ones
+	check(!decode(std::string(4, '\xff'), decoded), "end of string code is rejected", 256);
+	encoded.clear();
+	hpackHuffmanEncode("a", encoded);
+	check(!decode(encoded + std::string(4, '\xff'), decoded), "end of string code after a symbol is rejected", 256);
+	// A whole byte of padding
+	check(!decode(encoded + "\xff", decoded), "eight bits of padding are rejected", 'a');
+	// '0' is 00000, the padding has to be ones
+	check(!decode(std::string(1, '\x00'), decoded), "padding of zeros is rejected", '0');
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All Huffman checks passed\n");
+	return 0;
+}
@@ -0,0 +1,120 @@
+#include "thread_pool.h"
+
+// The index of the pool worker running on this thread, or -1 on threads outside of the pool
+static thread_local long long current_worker = -1;
+static thread_local const ThreadPool* current_pool = nullptr;
+
+static size_t roundUpToPowerOfTwo(size_t value) {
+	size_t result = 1;
+	while (result < value) {
+		result <<= 1;
+	}
+	return result;
+}
+
+ThreadPool::ThreadPool(int thread_count, size_t queue_depth, std::chrono::milliseconds max_queue_delay)
+	: pending(roundUpToPowerOfTwo(queue_depth)), max_queue_delay(max_queue_delay), sleeping(0), queued(0), stopping(false) {
+	for (int i = 0; i < thread_count; i++) {
+		workers.emplace_back(new Worker);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		threads.emplace_back(&ThreadPool::workerMain, this, (size_t)i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+		wake_up.notify_all();
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+bool ThreadPool::submit(std::function<void()> run, std::function<void()> expire) {
+	Task* task = new Task{ std::move(run), std::move(expire), std::chrono::steady_clock::now() };
+
+	// Workers push to their own deque, where idle workers can steal the task from.
+	// If the deque is full (or we are not a worker) the task goes to the bounded queue.
+	// Counted before it is visible, a worker taking it right away must not decrement the count below zero
+	queued.fetch_add(1, std::memory_order_relaxed);
+	bool queued_task = false;
+	if (current_pool == this) {
+		queued_task = workers[current_worker]->deque.push(task);
+	}
+	if (!queued_task && !pending.push(task)) {
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		delete task;
+		return false;
+	}
+
+	// The seq_cst ordering pairs with the sleeper's re-check, so a worker can't miss the new task
+	if (sleeping.load(std::memory_order_seq_cst) > 0) {
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		wake_up.notify_one();
+	}
+	return true;
+}
+
+ThreadPool::Task* ThreadPool::findTask(size_t index) {
+	Task* task = workers[index]->deque.pop();
+	if (task)
+		return task;
+
+	task = pending.pop();
+	if (task)
+		return task;
+
+	// Steal from the others, starting with our neighbour so the thieves spread out
+	for (size_t i = 1; i < workers.size(); i++) {
+		task = workers[(index + i) % workers.size()]->deque.steal();
+		if (task)
+			return task;
+	}
+	return nullptr;
+}
+
+void ThreadPool::runTask(Task* task) {
+	queued.fetch_sub(1, std::memory_order_relaxed);
+
+	// A task which waited for too long is answered as overloaded, the client most likely gave up on us anyway
+	if (task->expire && std::chrono::steady_clock::now() - task->enqueued > max_queue_delay) {
+		task->expire();
+	} else {
+		task->run();
+	}
+	delete task;
+}
+
+void ThreadPool::workerMain(size_t index) {
+	current_worker = (long long)index;
+	current_pool = this;
+
+	while (true) {
+		Task* task = findTask(index);
+		if (task) {
+			runTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleeping.fetch_add(1, std::memory_order_seq_cst);
+		// Re-check after announcing that we sleep, a submitter might have raced with us
+		task = findTask(index);
+		if (!task && stopping) {
+			sleeping.fetch_sub(1, std::memory_order_seq_cst);
+			return;
+		}
+		if (!task) {
+			wake_up.wait_for(lock, std::chrono::milliseconds(100));
+		}
+		sleeping.fetch_sub(1, std::memory_order_seq_cst);
+		lock.unlock();
+
+		if (task) {
+			runTask(task);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,194 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed capacity work-stealing deque (Chase-Lev). Only the owning worker pushes and pops at the bottom,
+// any other thread may steal from the top. All operations are lock-free.
+template <typename T>
+class WorkStealingDeque {
+	std::atomic<long long> top;
+	std::atomic<long long> bottom;
+	std::unique_ptr<std::atomic<T*>[]> buffer;
+	long long mask;
+public:
+	// `capacity` must be a power of two
+	explicit WorkStealingDeque(size_t capacity) : top(0), bottom(0), buffer(new std::atomic<T*>[capacity]), mask((long long)capacity - 1) {}
+
+	// Owner only. Returns false if the deque is full.
+	bool push(T* item);
+	// Owner only. Returns nullptr if the deque is empty.
+	T* pop();
+	// Any thread. Returns nullptr if the deque is empty or another thread won the race for the item.
+	T* steal();
+};
+
+// Bounded multi-producer multi-consumer queue (Vyukov). All operations are lock-free.
+template <typename T>
+class BoundedQueue {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T* item;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> enqueue_position;
+	alignas(64) std::atomic<size_t> dequeue_position;
+public:
+	// `capacity` must be a power of two
+	explicit BoundedQueue(size_t capacity);
+
+	// Returns false if the queue is full
+	bool push(T* item);
+	// Returns nullptr if the queue is empty
+	T* pop();
+};
+
+// Thread pool with a bounded queue for work submitted from outside the pool, and a work-stealing deque
+// per worker for work submitted by the workers themselves. Idle workers steal from busy ones.
+class ThreadPool {
+	struct Task {
+		std::function<void()> run;
+		std::function<void()> expire;
+		std::chrono::steady_clock::time_point enqueued;
+	};
+
+	struct Worker {
+		WorkStealingDeque<Task> deque;
+		Worker() : deque(256) {}
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	BoundedQueue<Task> pending;
+	std::chrono::milliseconds max_queue_delay;
+
+	// Idle workers sleep on the condition variable, submitters only take the lock if someone sleeps
+	std::mutex sleep_mutex;
+	std::condition_variable wake_up;
+	std::atomic<int> sleeping;
+	std::atomic<size_t> queued; // Number of tasks in the pending queue and the deques
+	std::atomic<bool> stopping;
+
+	void workerMain(size_t index);
+	Task* findTask(size_t index);
+	void runTask(Task* task);
+public:
+	// `queue_depth` is rounded up to a power of two
+	ThreadPool(int thread_count, size_t queue_depth, std::chrono::milliseconds max_queue_delay);
+	// Runs the remaining tasks and joins the workers
+	~ThreadPool();
+
+	// Queues `run` to be executed on one of the workers. If the task waits in the queue for longer than the
+	// maximum queueing delay, `expire` is called instead (on a worker). Returns false without queueing
+	// anything if the queue is full.
+	bool submit(std::function<void()> run, std::function<void()> expire = nullptr);
+
+	// Number of tasks waiting to be executed
+	size_t queueDepth() const { return queued.load(std::memory_order_relaxed); }
+};
+
+template <typename T>
+bool WorkStealingDeque<T>::push(T* item) {
+	long long b = bottom.load(std::memory_order_relaxed);
+	long long t = top.load(std::memory_order_acquire);
+	if (b - t > mask)
+		return false;
+
+	buffer[b & mask].store(item, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+template <typename T>
+T* WorkStealingDeque<T>::pop() {
+	long long b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long t = top.load(std::memory_order_relaxed);
+
+	if (t > b) {
+		// Empty
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	T* item = buffer[b & mask].load(std::memory_order_relaxed);
+	if (t == b) {
+		// Last item, we race with the thieves for it
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			item = nullptr;
+		}
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+	return item;
+}
+
+template <typename T>
+T* WorkStealingDeque<T>::steal() {
+	long long t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return nullptr;
+
+	T* item = buffer[t & mask].load(std::memory_order_relaxed);
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return nullptr;
+	return item;
+}
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), enqueue_position(0), dequeue_position(0) {
+	for (size_t i = 0; i < capacity; i++) {
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+template <typename T>
+bool BoundedQueue<T>::push(T* item) {
+	size_t position = enqueue_position.load(std::memory_order_relaxed);
+	while (true) {
+		Cell& cell = cells[position & mask];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		long long difference = (long long)sequence - (long long)position;
+		if (difference == 0) {
+			if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				cell.item = item;
+				cell.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (difference < 0) {
+			return false; // Full
+		} else {
+			position = enqueue_position.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+template <typename T>
+T* BoundedQueue<T>::pop() {
+	size_t position = dequeue_position.load(std::memory_order_relaxed);
+	while (true) {
+		Cell& cell = cells[position & mask];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		long long difference = (long long)sequence - (long long)(position + 1);
+		if (difference == 0) {
+			if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				T* item = cell.item;
+				cell.sequence.store(position + mask + 1, std::memory_order_release);
+				return item;
+			}
+		} else if (difference < 0) {
+			return nullptr; // Empty
+		} else {
+			position = dequeue_position.load(std::memory_order_relaxed);
+		}
+	}
+}
\ No newline at end of file
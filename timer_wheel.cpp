@@ -0,0 +1,88 @@
+#include "timer_wheel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned lowestSetBit(uint64_t mask) {
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (unsigned)index;
+}
+#else
+static inline unsigned lowestSetBit(uint64_t mask) {
+	return (unsigned)__builtin_ctzll(mask);
+}
+#endif
+
+// Ticks ahead of the current one a timer can be scheduled for, later deadlines are run early and rescheduled
+static const uint64_t MAX_DELAY = ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+TimerWheel::TimerWheel(long long now_ms) : occupied(0), count(0), current(0), start_ms(now_ms) {
+	for (auto& level : slots) {
+		for (Timer& head : level) {
+			head.previous = head.next = &head;
+		}
+	}
+}
+
+void TimerWheel::unlink(Timer& timer) {
+	if (!timer.scheduled())
+		return;
+	timer.previous->next = timer.next;
+	timer.next->previous = timer.previous;
+	timer.previous = timer.next = nullptr;
+	count--;
+}
+
+void TimerWheel::insert(Timer& timer) {
+	// The level is the first one whose slots are fine enough to tell the expiry from the current tick
+	uint64_t delay = timer.expiry - current;
+	int level = 0;
+	while (level + 1 < TIMER_WHEEL_LEVELS && delay >= ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+		level++;
+	}
+	unsigned slot = (unsigned)((timer.expiry >> (TIMER_WHEEL_SLOT_BITS * level)) & (SLOTS - 1));
+	if (level == 0) {
+		occupied |= (uint64_t)1 << slot;
+	}
+
+	Timer& head = slots[level][slot];
+	timer.previous = head.previous;
+	timer.next = &head;
+	head.previous->next = &timer;
+	head.previous = &timer;
+	count++;
+}
+
+void TimerWheel::cascade() {
+	// A level went around when all the tick bits below it are zero, and then the levels below it did as well
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		if ((current & (((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0)
+			return;
+		Timer& head = slots[level][(current >> (TIMER_WHEEL_SLOT_BITS * level)) & (SLOTS - 1)];
+		while (head.next != &head) {
+			Timer* timer = head.next;
+			unlink(*timer);
+			insert(*timer);
+		}
+	}
+}
+
+void TimerWheel::schedule(Timer& timer, long long deadline_ms) {
+	unlink(timer);
+	// Rounded up, so a timer never runs before its deadline
+	long long ticks = (std::max(deadline_ms - start_ms, 0LL) + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+	timer.expiry = std::min(std::max((uint64_t)ticks, current + 1), current + MAX_DELAY);
+	insert(timer);
+}
+
+long long TimerWheel::timeUntilNext(long long now_ms) const {
+	if (count == 0)
+		return -1;
+
+	// The next occupied level 0 slot within the coming round, or else the end of the round, where the next
+	// level cascades down
+	unsigned first = (unsigned)((current + 1) & (SLOTS - 1));
+	uint64_t rotated = first == 0 ? occupied : (occupied >> first) | (occupied << (SLOTS - first));
+	uint64_t next_tick = rotated != 0 ? current + 1 + lowestSetBit(rotated) : (current | (SLOTS - 1)) + 1;
+	return std::max(start_ms + (long long)next_tick * TIMER_WHEEL_TICK_MS - now_ms, 0LL);
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <chrono>
+
+#include "server_settings.h"
+
+// Milliseconds on a monotonic clock, which connection deadlines are measured in
+inline long long monotonicMilliseconds() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6 // 64 slots per level
+
+// Hierarchical timer wheel, which runs timers with a precision of `TIMER_WHEEL_TICK_MS`.
+// Level 0 has a slot for each of the next 64 ticks, the slots of every further level span 64 times as long, and
+// the timers of a slot move down a level when the level below went around once. Scheduling, moving and cancelling
+// a timer only link or unlink a list node, so the cost does not depend on how many connections are waiting.
+// It is not thread safe, every event loop has its own.
+class TimerWheel {
+public:
+	// A timer embedded in the object it belongs to (e.g. as a base class). It has to be cancelled before it is destroyed.
+	struct Timer {
+		Timer* previous;
+		Timer* next; // Null while the timer is not scheduled
+		uint64_t expiry; // Tick at which the timer runs
+
+		Timer() : previous(nullptr), next(nullptr), expiry(0) {}
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+		bool scheduled() const { return next != nullptr; }
+	};
+private:
+	static const unsigned SLOTS = 1u << TIMER_WHEEL_SLOT_BITS;
+
+	Timer slots[TIMER_WHEEL_LEVELS][SLOTS]; // Heads of circular lists
+	uint64_t occupied; // A bit for every level 0 slot which may hold timers, it is cleared when the slot runs
+	size_t count; // Scheduled timers
+	uint64_t current; // The last tick which ran
+	long long start_ms; // Time of tick 0
+
+	void unlink(Timer& timer);
+	void insert(Timer& timer);
+	// Moves the timers of the higher level slots which end with the `current` tick down
+	void cascade();
+public:
+	explicit TimerWheel(long long now_ms);
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	// Runs `timer` at `deadline_ms`, or on the next tick if that has passed. A scheduled timer is moved.
+	// Deadlines are never run early, but up to a tick late.
+	void schedule(Timer& timer, long long deadline_ms);
+	// Does nothing if the timer is not scheduled
+	void cancel(Timer& timer) { unlink(timer); }
+
+	// Milliseconds from `now_ms` until `advance` has something to do, -1 if no timer is scheduled
+	long long timeUntilNext(long long now_ms) const;
+
+	// Runs the ticks up to `now_ms` and calls `expired(timer)` for every timer which is due, after unscheduling it.
+	// The callback may schedule and cancel any timers.
+	template <typename Callback>
+	void advance(long long now_ms, Callback expired) {
+		uint64_t target = (uint64_t)std::max(now_ms - start_ms, 0LL) / TIMER_WHEEL_TICK_MS;
+		if (count == 0 && current < target) {
+			current = target;
+		}
+		while (current < target) {
+			current++;
+			cascade();
+
+			unsigned slot = (unsigned)(current & (SLOTS - 1));
+			Timer& head = slots[0][slot];
+			while (head.next != &head) {
+				Timer* timer = head.next;
+				unlink(*timer);
+				expired(timer);
+			}
+			occupied &= ~((uint64_t)1 << slot);
+		}
+	}
+};
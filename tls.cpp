@@ -0,0 +1,227 @@
+#ifdef __linux__
+#include "tls.h"
+
+#if ENABLE_TLS
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "server_config.h"
+
+// The most plaintext a record holds. Encrypting in user space, this is what is handed to OpenSSL at once.
+#define TLS_RECORD_SIZE 16384
+// Name, HMAC secret and AES key of the session ticket keys
+#define TLS_TICKET_KEYS_SIZE 80
+
+TlsContext tls_context;
+
+// Takes the oldest error off OpenSSL's queue of the calling thread and clears the rest
+static std::string takeError() {
+	unsigned long error = ERR_get_error();
+	ERR_clear_error();
+	if (error == 0)
+		return "unknown error";
+	char text[256];
+	ERR_error_string_n(error, text, sizeof(text));
+	return text;
+}
+
+// ALPN: a client speaking HTTP/2 sends its preface right after the handshake, which the connection recognizes like
+// one without TLS
+static int selectProtocol(SSL*, const unsigned char** out, unsigned char* out_length, const unsigned char* in,
+	unsigned int in_length, void*) {
+	static const unsigned char with_http2[] = "\x02h2\x08http/1.1";
+	static const unsigned char http1[] = "\x08http/1.1";
+	const unsigned char* supported = server_config.h2c ? with_http2 : http1;
+	unsigned int supported_length = server_config.h2c ? sizeof(with_http2) - 1 : sizeof(http1) - 1;
+	if (SSL_select_next_proto((unsigned char**)out, out_length, supported, supported_length, in, in_length) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK; // Without an agreement the client may still speak HTTP/1.1
+	return SSL_TLSEXT_ERR_OK;
+}
+
+void TlsContext::start(const std::string& certificate, const std::string& private_key, const std::string& ticket_keys, bool kernel_tls) {
+	context = SSL_CTX_new(TLS_server_method());
+	if (context == nullptr) {
+		std::cerr << "SSL_CTX_new() failed: " << takeError() << std::endl;
+		exit(1);
+	}
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	// Clients closing without close_notify are common and harmless for HTTP, which delimits its messages itself
+	uint64_t options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+	if (kernel_tls) {
+		options |= SSL_OP_ENABLE_KTLS;
+	}
+	SSL_CTX_set_options(context, options);
+
+	const std::string& key = private_key.empty() ? certificate : private_key;
+	if (SSL_CTX_use_certificate_chain_file(context, certificate.c_str()) != 1) {
+		std::cerr << "Failed to load the TLS certificate " << certificate << ": " << takeError() << std::endl;
+		exit(1);
+	}
+	if (SSL_CTX_use_PrivateKey_file(context, key.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context) != 1) {
+		std::cerr << "Failed to load the TLS private key " << key << ": " << takeError() << std::endl;
+		exit(1);
+	}
+
+	// Tickets carry the session to the client, so all shards resume them without sharing state. Clients which don't
+	// take tickets resume by session ID from the cache, which is shared by all shards.
+	static const unsigned char session_id_context[] = "webserver";
+	SSL_CTX_set_session_id_context(context, session_id_context, sizeof(session_id_context) - 1);
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(context, TLS_SESSION_CACHE_ENTRIES);
+	if (!ticket_keys.empty()) {
+		// Servers sharing the keys (a successor taking over, the other nodes of a cluster) resume each other's sessions
+		std::ifstream file(ticket_keys, std::ios::binary);
+		char keys[TLS_TICKET_KEYS_SIZE + 1];
+		file.read(keys, sizeof(keys));
+		if (file.gcount() != TLS_TICKET_KEYS_SIZE) {
+			std::cerr << "The TLS ticket keys " << ticket_keys << " have to be exactly " << TLS_TICKET_KEYS_SIZE << " bytes" << std::endl;
+			exit(1);
+		}
+		if (SSL_CTX_set_tlsext_ticket_keys(context, keys, TLS_TICKET_KEYS_SIZE) != 1) {
+			std::cerr << "Failed to set the TLS ticket keys: " << takeError() << std::endl;
+			exit(1);
+		}
+		OPENSSL_cleanse(keys, sizeof(keys));
+	}
+
+	SSL_CTX_set_alpn_select_cb(context, selectProtocol, nullptr);
+}
+
+TlsConnection::TlsConnection(SOCKET socket) : socket(socket), established(false), kernel_sends(false), failed(false),
+	unsent_data(nullptr), unsent_length(0) {
+	ssl = SSL_new(tls_context.get());
+	if (ssl == nullptr || SSL_set_fd(ssl, socket) != 1) {
+		LOG(Error) << "Failed to set up TLS for a connection: " << takeError();
+		failed = true;
+		return;
+	}
+	SSL_set_accept_state(ssl);
+}
+
+TlsConnection::~TlsConnection() {
+	SSL_free(ssl);
+}
+
+int TlsConnection::handshake() {
+	if (failed)
+		return -1;
+	int result = SSL_do_handshake(ssl);
+	if (result != 1) {
+		int error = SSL_get_error(ssl, result);
+		if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+			return 0;
+		LOG(Debug) << "TLS handshake failed: " << (error == SSL_ERROR_SSL ? takeError() : "connection closed");
+		ERR_clear_error();
+		failed = true;
+		return -1;
+	}
+
+	established = true;
+	// OpenSSL switched the socket to kTLS for sending if the kernel and the cipher allow it. Receiving stays with
+	// OpenSSL either way: requests are small, and it handles the records which are not application data.
+	kernel_sends = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+	metrics.countTlsHandshake(SSL_session_reused(ssl) == 1, kernel_sends);
+	return 1;
+}
+
+int TlsConnection::failure(int result) {
+	int error = SSL_get_error(ssl, result);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		errno = EAGAIN;
+		return SOCKET_ERROR;
+	}
+	if (error == SSL_ERROR_SSL) {
+		LOG(Debug) << "TLS error: " << takeError();
+	}
+	ERR_clear_error();
+	failed = true;
+	if (error != SSL_ERROR_SYSCALL || errno == 0 || errno == EAGAIN) {
+		errno = ECONNRESET;
+	}
+	return SOCKET_ERROR;
+}
+
+int TlsConnection::receive(char* buffer, size_t length) {
+	int result = SSL_read(ssl, buffer, (int)std::min(length, (size_t)INT_MAX));
+	if (result > 0)
+		return result;
+	if (SSL_get_error(ssl, result) == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	return failure(result);
+}
+
+char* TlsConnection::stagingBuffer() {
+	if (!staging) {
+		staging.reset(new char[TLS_RECORD_SIZE]);
+	}
+	return staging.get();
+}
+
+int TlsConnection::write() {
+	// Without SSL_MODE_ENABLE_PARTIAL_WRITE, a successful write took all of it
+	int result = SSL_write(ssl, unsent_data, (int)unsent_length);
+	if (result <= 0)
+		return failure(result);
+	unsent_length = 0;
+	return result;
+}
+
+int TlsConnection::sendBuffers(const SendBuffer* buffers, size_t count, bool more) {
+	if (kernel_sends)
+		return ::sendBuffers(socket, buffers, count, more);
+
+	// A write which has to be repeated gets the same bytes, which are still at the front of the pending output
+	if (unsent_length == 0) {
+		if (buffers[0].length >= TLS_RECORD_SIZE) {
+			unsent_data = buffers[0].data;
+			unsent_length = TLS_RECORD_SIZE;
+		} else {
+			// Small pieces share a record instead of getting one each
+			char* buffer = stagingBuffer();
+			size_t length = 0;
+			for (size_t i = 0; i < count && length < TLS_RECORD_SIZE; i++) {
+				size_t piece = std::min(buffers[i].length, (size_t)TLS_RECORD_SIZE - length);
+				memcpy(buffer + length, buffers[i].data, piece);
+				length += piece;
+			}
+			unsent_data = buffer;
+			unsent_length = length;
+		}
+	}
+	return write();
+}
+
+int TlsConnection::sendFile(int file, long long offset, size_t length) {
+	if (kernel_sends)
+		return ::sendFile(socket, file, offset, length);
+
+	if (unsent_length == 0) {
+		char* buffer = stagingBuffer();
+		ssize_t bytes_read = pread(file, buffer, std::min(length, (size_t)TLS_RECORD_SIZE), (off_t)offset);
+		if (bytes_read <= 0)
+			return bytes_read == 0 ? 0 : SOCKET_ERROR;
+		unsent_data = buffer;
+		unsent_length = (size_t)bytes_read;
+	}
+	return write();
+}
+
+void TlsConnection::shutdown() {
+	// A record which was only partially sent can't be followed by an alert
+	if (!established || failed || unsent_length > 0)
+		return;
+	SSL_shutdown(ssl);
+	ERR_clear_error();
+}
+#endif
+#endif
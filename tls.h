@@ -0,0 +1,73 @@
+#pragma once
+#ifdef __linux__
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+#include "server_settings.h"
+#include "sockets.h"
+
+#if ENABLE_TLS
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+// HTTPS: OpenSSL performs the handshakes, and afterwards the kernel encrypts the records (kTLS) if it can, so the
+// connection sends with `sendmsg` and `sendfile` as over plain TCP and file bodies still never pass through our
+// memory. Without kTLS (a kernel without the `tls` module, or a cipher it does not support), records are encrypted
+// in user space and files are read into a buffer for it.
+// Sessions are resumed with tickets, or with a session ID from a cache for clients which don't take tickets, so a
+// client reconnecting skips the full handshake.
+class TlsContext {
+	SSL_CTX* context;
+public:
+	TlsContext() : context(nullptr) {}
+	TlsContext(const TlsContext&) = delete;
+	TlsContext& operator=(const TlsContext&) = delete;
+
+	// Loads the certificate chain and key and the ticket keys, if a file is given. Exits if they can't be loaded.
+	void start(const std::string& certificate, const std::string& private_key, const std::string& ticket_keys, bool kernel_tls);
+	bool enabled() const { return context != nullptr; }
+	SSL_CTX* get() const { return context; }
+};
+
+extern TlsContext tls_context;
+
+// The TLS side of a connection on a non-blocking socket. Its receive and send functions work like `recv()` and the
+// ones in sockets.h, and fail with `errno` set to EAGAIN when they have to wait for the socket.
+class TlsConnection {
+	SSL* ssl;
+	SOCKET socket;
+	bool established;
+	bool kernel_sends; // The kernel encrypts what we send on the socket
+	bool failed; // A fatal error occurred, the connection must not be shut down cleanly
+	// Plaintext handed to `SSL_write` which has to be passed again once the socket is writable. It points into the
+	// pending output or into `staging`.
+	const char* unsent_data;
+	size_t unsent_length;
+	std::unique_ptr<char[]> staging; // Small pieces of output copied together and file contents, a record's worth
+
+	char* stagingBuffer();
+	int write();
+	// Maps the result of a failed SSL call to SOCKET_ERROR and `errno`
+	int failure(int result);
+public:
+	explicit TlsConnection(SOCKET socket);
+	~TlsConnection();
+	TlsConnection(const TlsConnection&) = delete;
+	TlsConnection& operator=(const TlsConnection&) = delete;
+
+	// Continues the handshake. Returns 1 once it completed, 0 while it waits for the socket and -1 if it failed.
+	int handshake();
+	bool isEstablished() const { return established; }
+	// The kernel encrypts what is sent on the socket, so it can be written to directly (sendfile, splice)
+	bool kernelSends() const { return kernel_sends; }
+
+	// Returns the number of decrypted bytes received, 0 at the end of the connection, or SOCKET_ERROR
+	int receive(char* buffer, size_t length);
+	int sendBuffers(const SendBuffer* buffers, size_t count, bool more);
+	int sendFile(int file, long long offset, size_t length);
+	// Tells the client that we close the connection (close_notify), if the socket takes it right away
+	void shutdown();
+};
+#endif
+#endif
@@ -0,0 +1,291 @@
+// Packs a directory into a static content bundle (see bundle.h), which the server maps and serves with
+// `--bundle=FILE`. Every file is stored with its complete responses: the `200 OK` with content type, length, entity
+// tag, `Last-Modified` and `Cache-Control`, the `304 Not Modified`, and the same for its gzip and brotli variants if
+// the file is compressible. A precompressed sibling (`app.js.gz`) is taken as the variant, otherwise the file is
+// compressed here if that makes it smaller. Directories with an `index.html` are reachable as `/dir/` and `/dir`.
+// Entity tags are derived from the contents, so every node serving the same bundle sends the same ones.
+//
+// Build from the repository root (the responses are made with the server's own code):
+//   g++ -std=c++17 -O2 -I. -pthread -o pack_bundle tools/pack_bundle.cpp $(ls *.cpp | grep -v main.cpp) -lz -lbrotlienc -lssl -lcrypto
+// Usage: pack_bundle --root=DIR --out=FILE [--cache-control=MATCH:VALUE]... [--mime-types=FILE]
+// `--cache-control` and `--mime-types` work like the server's options, their values are baked into the responses.
+// The bundle is written next to FILE and renamed over it, so a server serving FILE swaps it in atomically.
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+#include "compression.h"
+#include "http_server.h"
+#include "mime_types.h"
+#include "server_config.h"
+#include "string_utils.h"
+
+static void fail(const std::string& message) {
+	std::cerr << message << std::endl;
+	exit(1);
+}
+
+static std::string readFile(const std::string& path) {
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file)
+		fail("Failed to open " + path);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Collects the regular files below `directory` as paths relative to the root, and the directories holding an
+// `index.html`. Symbolic links to files are followed, to directories not, so a link can't make us loop.
+static void collectFiles(const std::string& root, const std::string& relative, std::vector<std::string>& files,
+	std::vector<std::string>& index_directories) {
+	std::string directory = relative.empty() ? root : root + "/" + relative;
+	DIR* dir = opendir(directory.c_str());
+	if (dir == NULL)
+		fail("Failed to read the directory " + directory);
+	std::vector<std::string> names;
+	while (struct dirent* entry = readdir(dir)) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	for (const std::string& name : names) {
+		std::string path = relative.empty() ? name : relative + "/" + name;
+		struct stat link_status;
+		struct stat status;
+		if (lstat((root + "/" + path).c_str(), &link_status) != 0 || stat((root + "/" + path).c_str(), &status) != 0)
+			continue;
+		if (S_ISDIR(status.st_mode) && !S_ISLNK(link_status.st_mode)) {
+			collectFiles(root, path, files, index_directories);
+		} else if (S_ISREG(status.st_mode)) {
+			files.push_back(path);
+			if (name == "index.html") {
+				index_directories.push_back(relative);
+			}
+		}
+	}
+}
+
+class BundleWriter {
+	std::ofstream out;
+	uint64_t position; // Where the next data goes
+
+	// Finds `text` in a response head, which has to contain it
+	static size_t find(std::string_view head, const char* text, size_t from = 0) {
+		size_t found = head.find(text, from);
+		if (found == std::string::npos)
+			fail(std::string("Missing ") + text + " in a response");
+		return found;
+	}
+public:
+	BundleWriter(const std::string& path, uint64_t data_offset) : out(path, std::ios::out | std::ios::binary | std::ios::trunc),
+		position(data_offset) {
+		if (!out)
+			fail("Failed to create " + path);
+		out.seekp((std::streamoff)data_offset);
+	}
+
+	uint64_t write(std::string_view data) {
+		uint64_t offset = position;
+		out.write(data.data(), (std::streamsize)data.length());
+		position += data.length();
+		return offset;
+	}
+
+	BundleResponse writeResponse(const std::string& serialized, size_t body_length) {
+		BundleResponse stored = {};
+		stored.length = serialized.length();
+		stored.head_length = (uint32_t)(serialized.length() - body_length);
+		stored.connection_offset = (uint32_t)find(std::string_view(serialized).substr(0, stored.head_length), "Connection: keep-alive\r\n");
+		stored.offset = write(serialized);
+		return stored;
+	}
+
+	// Writes the responses for one encoding of a file. `response` has the representation's headers, which are
+	// followed by the content type and the body.
+	BundleVariant writeVariant(ResponseBuilder response, std::string_view content_type, std::shared_ptr<const std::string> body) {
+		BundleVariant variant = {};
+		variant.not_modified = writeResponse(response.notModified().build(), 0);
+
+		size_t body_length = body->length();
+		std::string serialized = response.addHeader("Content-Type", content_type).addBody(std::move(body)).build();
+		std::string_view head = std::string_view(serialized).substr(0, serialized.length() - body_length);
+		// The representation's header lines are those after `Server` and before `Content-Type`
+		size_t fields_start = find(head, "\r\n", find(head, "\r\nServer: ") + 2) + 2;
+		size_t etag_start = find(head, "\r\nETag: ") + strlen("\r\nETag: ");
+		variant.fields_offset = (uint32_t)fields_start;
+		variant.fields_length = (uint32_t)(find(head, "\r\nContent-Type: ") + 2 - fields_start);
+		variant.etag_offset = (uint32_t)etag_start;
+		variant.etag_length = (uint32_t)(find(head, "\r\n", etag_start) - etag_start);
+		variant.response = writeResponse(serialized, body_length);
+		return variant;
+	}
+
+	void finish(const BundleHeader& header, const std::vector<BundleEntry>& entries, const std::vector<uint32_t>& slots) {
+		out.seekp(0);
+		out.write((const char*)&header, sizeof(header));
+		out.seekp((std::streamoff)header.entries_offset);
+		out.write((const char*)entries.data(), (std::streamsize)(entries.size() * sizeof(BundleEntry)));
+		out.seekp((std::streamoff)header.slots_offset);
+		out.write((const char*)slots.data(), (std::streamsize)(slots.size() * sizeof(uint32_t)));
+		out.close();
+		if (!out)
+			fail("Failed to write the bundle");
+	}
+
+	uint64_t size() const { return position; }
+};
+
+int main(int argc, char* argv[]) {
+	std::string root;
+	std::string out_path;
+	// The options shared with the server are parsed by its own code
+	std::vector<char*> server_options = { argv[0] };
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		if (option.compare(0, 7, "--root=") == 0) root = option.substr(7);
+		else if (option.compare(0, 6, "--out=") == 0) out_path = option.substr(6);
+		else if (option.compare(0, 16, "--cache-control=") == 0 || option.compare(0, 13, "--mime-types=") == 0) server_options.push_back(argv[i]);
+		else fail("Unknown option: " + option + " (see the top of tools/pack_bundle.cpp for the usage)");
+	}
+	if (root.empty() || out_path.empty())
+		fail("--root and --out are required (see the top of tools/pack_bundle.cpp for the usage)");
+	parseCommandLine((int)server_options.size(), server_options.data());
+	while (root.length() > 1 && root.back() == '/') {
+		root.pop_back();
+	}
+
+	std::vector<std::string> files;
+	std::vector<std::string> index_directories;
+	collectFiles(root, "", files, index_directories);
+
+	// The paths of a directory share the entry of its `index.html`, the root only has `/`
+	size_t entry_count = files.size();
+	for (const std::string& directory : index_directories) {
+		entry_count += directory.empty() ? 1 : 2;
+	}
+	uint32_t slot_count = 1;
+	while (slot_count < entry_count * 2) {
+		slot_count *= 2;
+	}
+
+	BundleHeader header = {};
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = BUNDLE_VERSION;
+	header.byte_order = BUNDLE_BYTE_ORDER;
+	header.slot_count = slot_count;
+	header.entries_offset = sizeof(BundleHeader);
+	header.slots_offset = header.entries_offset + entry_count * sizeof(BundleEntry);
+	uint64_t data_offset = header.slots_offset + (uint64_t)slot_count * sizeof(uint32_t);
+
+	std::string temporary_path = out_path + ".tmp";
+	BundleWriter writer(temporary_path, data_offset);
+	std::vector<BundleEntry> entries;
+	std::vector<std::string> paths;
+	unsigned encodings_built = parseAcceptEncoding("gzip, br");
+
+	for (const std::string& relative : files) {
+		std::string local_path = root + "/" + relative;
+		std::string request_path = "/" + relative;
+		struct stat status;
+		if (stat(local_path.c_str(), &status) != 0)
+			fail("Failed to stat " + local_path);
+		std::shared_ptr<const std::string> contents = std::make_shared<const std::string>(readFile(local_path));
+		std::string_view content_type = getMimeType(getFileExtension(relative));
+
+		BundleEntry entry = {};
+		entry.modified = (int64_t)status.st_mtime;
+		entry.content_type_offset = writer.write(content_type);
+		entry.content_type_length = (uint32_t)content_type.length();
+
+		char tag_hash[24];
+		snprintf(tag_hash, sizeof(tag_hash), "%016llx", (unsigned long long)bundleHash(*contents));
+		char date_buffer[32];
+		std::string_view last_modified = formatHttpDate(status.st_mtime, date_buffer);
+		const std::string& cache_control = cacheControlFor(request_path, local_path);
+		bool compressible = isCompressible(content_type);
+
+		for (ContentEncoding encoding : { ContentEncoding::Identity, ContentEncoding::Gzip, ContentEncoding::Brotli }) {
+			std::shared_ptr<const std::string> body = contents;
+			if (encoding != ContentEncoding::Identity) {
+				if (!compressible || (encodings_built & (1u << (int)encoding)) == 0)
+					continue;
+				struct stat sibling_status;
+				std::string sibling = local_path + encodingFileSuffix(encoding);
+				if (stat(sibling.c_str(), &sibling_status) == 0 && S_ISREG(sibling_status.st_mode)) {
+					body = std::make_shared<const std::string>(readFile(sibling));
+				} else if (contents->length() >= COMPRESSION_MIN_FILE_SIZE) {
+					std::string compressed = compress(*contents, encoding);
+					if (compressed.length() >= contents->length())
+						continue;
+					body = std::make_shared<const std::string>(std::move(compressed));
+				} else {
+					continue;
+				}
+			}
+
+			// The same headers as `HttpConnection::serveFile` sends, in the order range responses need them
+			std::string etag = std::string("\"") + tag_hash + (encoding == ContentEncoding::Identity ? "" : "-")
+				+ (encoding == ContentEncoding::Identity ? "" : encodingName(encoding)) + "\"";
+			ResponseBuilder response;
+			response.setStatusCode(StatusCode::OK).setKeepAlive(true);
+			if (compressible) {
+				response.addHeader("Vary", "Accept-Encoding");
+			}
+			if (encoding != ContentEncoding::Identity) {
+				response.addHeader("Content-Encoding", encodingName(encoding));
+			}
+			response.addHeader("ETag", etag).addHeader("Last-Modified", last_modified);
+			if (!cache_control.empty()) {
+				response.addHeader("Cache-Control", cache_control);
+			}
+			response.addHeader("Accept-Ranges", "bytes");
+			entry.variants[(int)encoding] = writer.writeVariant(response, content_type, body);
+		}
+
+		entries.push_back(entry);
+		paths.push_back(request_path);
+		size_t slash = relative.find_last_of('/');
+		if (relative.substr(slash == std::string::npos ? 0 : slash + 1) == "index.html") {
+			std::string directory = slash == std::string::npos ? "" : relative.substr(0, slash);
+			entries.push_back(entry);
+			paths.push_back("/" + directory + (directory.empty() ? "" : "/"));
+			if (!directory.empty()) {
+				entries.push_back(entry);
+				paths.push_back("/" + directory);
+			}
+		}
+	}
+
+	std::vector<uint32_t> slots(slot_count, 0);
+	for (size_t i = 0; i < entries.size(); i++) {
+		BundleEntry& entry = entries[i];
+		entry.path_offset = writer.write(paths[i]);
+		entry.path_length = (uint32_t)paths[i].length();
+		entry.path_hash = bundleHash(paths[i]);
+		uint32_t slot = (uint32_t)entry.path_hash & (slot_count - 1);
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & (slot_count - 1);
+		}
+		slots[slot] = (uint32_t)(i + 1);
+	}
+
+	// The tables were laid out for the entries counted before
+	if (entries.size() != entry_count)
+		fail("The directory changed while it was packed");
+	header.entry_count = (uint32_t)entries.size();
+	header.file_size = writer.size();
+	writer.finish(header, entries, slots);
+	if (rename(temporary_path.c_str(), out_path.c_str()) != 0)
+		fail("Failed to rename the bundle to " + out_path);
+	std::cout << "Packed " << files.size() << " files as " << entries.size() << " paths into " << out_path << " ("
+		<< header.file_size / 1024 << " KB)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,177 @@
+#ifdef __linux__
+#include "upgrade.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <thread>
+
+#include "logger.h"
+#include "timer_wheel.h"
+
+#define MAX_HANDOFF_SOCKETS 253 // SCM_MAX_FD, the most descriptors a single message can carry
+#define SUCCESSOR_START_TIMEOUT_SECONDS 60 // How long a new server may take to start before the old one gives up on it
+
+// The connection to the replaced server, which we keep until it stopped accepting
+static int predecessor = -1;
+
+static bool unixAddress(const std::string& path, struct sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.length() >= sizeof(address.sun_path))
+		return false;
+	memcpy(address.sun_path, path.data(), path.length());
+	return true;
+}
+
+std::vector<SOCKET> inheritListeners(const std::string& path) {
+	std::vector<SOCKET> sockets;
+	struct sockaddr_un address;
+	if (!unixAddress(path, address)) {
+		std::cerr << "Invalid upgrade socket path: '" << path << "'" << std::endl;
+		exit(1);
+	}
+
+	int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connection == -1 || connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		// No server is running, we start afresh
+		if (connection != -1) {
+			close(connection);
+		}
+		return sockets;
+	}
+
+	// The count travels as the message's data, the sockets as its ancillary data
+	uint32_t count = 0;
+	struct iovec data = { &count, sizeof(count) };
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_SOCKETS)];
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+
+	struct cmsghdr* header = received == sizeof(count) ? CMSG_FIRSTHDR(&message) : nullptr;
+	if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+		size_t descriptors = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < descriptors; i++) {
+			int descriptor;
+			memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+			sockets.push_back(descriptor);
+		}
+	}
+	if (sockets.empty() || sockets.size() != count || (message.msg_flags & MSG_CTRUNC)) {
+		std::cerr << "Failed to take over the listening sockets of the server running at " << path << std::endl;
+		exit(1);
+	}
+
+	predecessor = connection;
+	LOG(Info) << "Took over " << sockets.size() << " listening sockets from the running server.";
+	return sockets;
+}
+
+// Sends the listening sockets to `successor` and waits until it accepts connections.
+// Returns false if it can't be trusted with them or gave up.
+static bool handOff(int successor, const std::vector<std::unique_ptr<Shard>>& shards) {
+	// Anyone could connect to the path, but only the same user may take over the server
+	struct ucred credentials;
+	socklen_t credentials_length = sizeof(credentials);
+	if (getsockopt(successor, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) != 0 || credentials.uid != geteuid()) {
+		LOG(Warning) << "Refused to hand the listening sockets to a process of another user.";
+		return false;
+	}
+	if (shards.size() > MAX_HANDOFF_SOCKETS) {
+		LOG(Error) << "Too many listening sockets to hand over: " << shards.size();
+		return false;
+	}
+
+	uint32_t count = (uint32_t)shards.size();
+	struct iovec data = { &count, sizeof(count) };
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_SOCKETS)];
+	memset(control, 0, sizeof(control));
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	for (uint32_t i = 0; i < count; i++) {
+		int descriptor = shards[i]->server_socket;
+		memcpy(CMSG_DATA(header) + i * sizeof(int), &descriptor, sizeof(int));
+	}
+	if (sendmsg(successor, &message, MSG_NOSIGNAL) != sizeof(count)) {
+		LOG(Warning) << "Failed to hand over the listening sockets: " << errno;
+		return false;
+	}
+
+	// We keep serving while the new server starts
+	setReceiveTimeout(successor, SUCCESSOR_START_TIMEOUT_SECONDS * 1000LL);
+	char ready;
+	if (recv(successor, &ready, 1, 0) != 1) {
+		LOG(Warning) << "The new server did not start, we keep serving.";
+		return false;
+	}
+	return true;
+}
+
+static void serveSuccessors(int listener, std::string path, std::vector<std::unique_ptr<Shard>>* shards, int drain_timeout) {
+	while (true) {
+		int successor = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (successor == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			LOG(Error) << "accept4() on the upgrade socket failed: " << errno;
+			return;
+		}
+
+		if (handOff(successor, *shards)) {
+			LOG(Info) << "The new server took over, finishing the open connections.";
+			drainShards(*shards, monotonicMilliseconds() + drain_timeout * 1000LL);
+			// Closing the connection tells the successor that it can listen at the path itself
+			close(listener);
+			unlink(path.c_str());
+			close(successor);
+			return;
+		}
+		close(successor);
+	}
+}
+
+void serveUpgrades(const std::string& path, std::vector<std::unique_ptr<Shard>>& shards, int drain_timeout) {
+	if (predecessor != -1) {
+		char ready = 1;
+		char released;
+		if (send(predecessor, &ready, 1, MSG_NOSIGNAL) != 1 || recv(predecessor, &released, 1, 0) != 0) {
+			LOG(Warning) << "Lost the connection to the replaced server.";
+		}
+		close(predecessor);
+		predecessor = -1;
+	}
+
+	struct sockaddr_un address;
+	unixAddress(path, address);
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	// Nobody answered at the path, so whatever is left there is stale
+	unlink(path.c_str());
+	if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+		LOG(Error) << "Failed to listen for upgrades at " << path << ": " << errno;
+		if (listener != -1) {
+			close(listener);
+		}
+		return;
+	}
+	chmod(path.c_str(), S_IRUSR | S_IWUSR);
+
+	std::thread(serveSuccessors, listener, path, &shards, drain_timeout).detach();
+}
+#endif
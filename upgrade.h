@@ -0,0 +1,23 @@
+#pragma once
+#ifdef __linux__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "shards.h"
+
+// Zero-downtime upgrades: a running server listens on a Unix domain socket, and a new server started with the same
+// path connects to it and receives the listening sockets (SCM_RIGHTS). Both accept from the same sockets until the
+// new one runs, then the old one stops accepting and drains its connections, so no connection is refused and the
+// kernel's accept queues are never empty of a listener.
+
+// Connects to the server listening at `path` and takes over its listening sockets.
+// Returns none if no server is running there, exits if the handoff failed.
+std::vector<SOCKET> inheritListeners(const std::string& path);
+
+// Tells the replaced server, if any, that the `shards` accept connections now, and waits until it let go of `path`.
+// Then listens at `path` for a successor on a background thread, which drains the shards once it took over.
+void serveUpgrades(const std::string& path, std::vector<std::unique_ptr<Shard>>& shards, int drain_timeout);
+
+#endif